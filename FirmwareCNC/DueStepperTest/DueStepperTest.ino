@@ -0,0 +1,94 @@
+#include "StepperControl.h"
+
+// Runs a cruise of all axes through the plan queue and the segment scheduler with the SAM3X8E step timer (TC1 channel 0)
+// and the refill interrupt (TC1 channel 1) - reports its duration and the timing telemetry of the step interrupt.
+
+// steps of each axis (the slower axes make a part of them)
+#define CRUISE_STEPS 4000
+// deltaT of the fastest axis (ticks)
+#define CRUISE_DELTA_T 400
+
+PlanQueue<1024, 4> PLAN_QUEUE;
+SegmentScheduler<Slot1Axis, Slot0Axis, Slot3Axis, Slot2Axis> SEGMENT_SCHEDULER;
+
+//schedule refill interrupt - the loop only arms the plans
+SCHEDULE_REFILL_ISR {
+	SEGMENT_SCHEDULER.refillSchedule();
+}
+
+// the setup function runs once when you press reset or power the board
+void setup() {
+	Serial.begin(128000);
+
+	pinMode(SLOT0_CLK_PIN, OUTPUT);
+	pinMode(SLOT0_DIR_PIN, OUTPUT);
+
+	pinMode(SLOT1_CLK_PIN, OUTPUT);
+	pinMode(SLOT1_DIR_PIN, OUTPUT);
+
+	pinMode(SLOT2_CLK_PIN, OUTPUT);
+	pinMode(SLOT2_DIR_PIN, OUTPUT);
+
+	pinMode(SLOT3_CLK_PIN, OUTPUT);
+	pinMode(SLOT3_DIR_PIN, OUTPUT);
+
+	digitalWrite(SLOT0_CLK_PIN, HIGH);
+	digitalWrite(SLOT1_CLK_PIN, HIGH);
+	digitalWrite(SLOT2_CLK_PIN, HIGH);
+	digitalWrite(SLOT3_CLK_PIN, HIGH);
+
+	Steppers::initialize();
+	enableScheduleRefill();
+}
+
+void printTime(String message, unsigned long duration) {
+	Serial.print(message);
+	Serial.print(1.0*(duration));
+	Serial.println("us");
+}
+
+// queues constant plan where the axis i steps CRUISE_STEPS >> i times with the period which keeps them together
+void pushCruise() {
+	byte data[4 * ConstantPlan::dataSize] = { 0 };
+	for (byte i = 0; i < 4; ++i) {
+		int16_t stepCount = CRUISE_STEPS >> i;
+		int32_t deltaT = (int32_t)CRUISE_DELTA_T << i;
+		uint16_t periodNumerator = 0;
+		int32_t offset = INT32_MIN;
+		byte axis[] = { INT16_TO_BYTES(stepCount), INT32_TO_BYTES(deltaT), INT16_TO_BYTES(periodNumerator), INT32_TO_BYTES(offset) };
+		memcpy(data + i * ConstantPlan::dataSize, axis, sizeof(axis));
+	}
+	PLAN_QUEUE.push('C', data);
+}
+
+void testCruise() {
+	unsigned long expectedMicroseconds = (unsigned long)CRUISE_STEPS * CRUISE_DELTA_T / (TIMER_FREQUENCY / 1000000);
+
+	TimingTelemetry telemetry;
+	Steppers::takeTimingTelemetry(telemetry);
+	pushCruise();
+	unsigned long startTime = micros();
+	while (PLAN_QUEUE.front() != NULL || !SEGMENT_SCHEDULER.isIdle() || Steppers::isSchedulerRunning()) {
+		if (PLAN_QUEUE.front() != NULL && SEGMENT_SCHEDULER.canArm()) {
+			SEGMENT_SCHEDULER.arm(PLAN_QUEUE.front());
+			PLAN_QUEUE.pop();
+		}
+		SEGMENT_SCHEDULER.takeFinishedInstructions();
+	}
+	unsigned long duration = micros() - startTime;
+	Steppers::takeTimingTelemetry(telemetry);
+
+	printTime("Expected duration: ", expectedMicroseconds);
+	printTime("Measured duration: ", duration);
+	Serial.print("Underrun stops: ");
+	Serial.println(telemetry.underrunStops);
+	Serial.print("Lowest occupancy: ");
+	Serial.println(telemetry.minOccupancy);
+}
+
+void loop() {
+	testCruise();
+
+	Serial.println();
+	delay(1000);
+}
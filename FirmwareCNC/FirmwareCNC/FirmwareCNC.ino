@@ -1,43 +1,161 @@
 #include "StepperControl.h"
+#ifndef HOST_SIMULATOR
+// constructor of HardwareSerial is defined by the private header of the core (the sketch defines its own Serial)
+#include <HardwareSerial_private.h>
+#endif
 
 // how many bytes contains instruction from controller
 
 #define INSTRUCTION_SIZE 59
-#define BUFFERED_INSTRUCTION_COUNT 6
-#define STEPPER_COUNT 2
-
-//Buffer used in form of INSTRUCTION_SIZE segments which are filled with Serial data.
-byte INSTRUCTION_BUFFER[INSTRUCTION_SIZE*BUFFERED_INSTRUCTION_COUNT] = { 0 };
+// frame slots of the receive interrupt (plans leave them as soon as they are decoded)
+#define BUFFERED_INSTRUCTION_COUNT 3
+#define STEPPER_COUNT 4
+
+// SRAM of the ATmega328P (Arduino Uno)
+#define SRAM_SIZE 2048
+// SRAM kept for the stack (the deepest main loop call with the nested refill, step and receive interrupts)
+#define SRAM_STACK_RESERVE 320
+// static SRAM besides the budgeted buffers (Serial with its 64 byte rings, the core, small globals of the sketch and StepperControl)
+#define SRAM_GLOBALS_RESERVE 352
+// SRAM of the buffers which are budgeted (see SEGMENT_SCHEDULER_SRAM)
+#define BUFFERS_SRAM_BUDGET (SRAM_SIZE - SRAM_STACK_RESERVE - SRAM_GLOBALS_RESERVE)
+// SRAM of the plan queue - whatever the schedule ring, the segment scheduler and the frame slots leave
+#define PLAN_QUEUE_SRAM_BUDGET (BUFFERS_SRAM_BUDGET - SCHEDULE_SRAM_SIZE - SEGMENT_SCHEDULER_SRAM(STEPPER_COUNT) - FRAME_RECEIVER_SRAM(INSTRUCTION_SIZE, BUFFERED_INSTRUCTION_COUNT))
+// bytes of decoded plans
+#define PLAN_QUEUE_SIZE (PLAN_QUEUE_SRAM_BUDGET - PLAN_QUEUE_SRAM(0, STEPPER_COUNT))
+
+// shortest time between two credit reports in ms (reports are batched for this time)
+#define CREDIT_REPORT_PERIOD 2
+
+// how long a move starting from the standstill waits for the next move in ms (a frame takes ~5ms at 128000 baud)
+#define MOVE_START_DELAY 10
+
+// homing phases (homing segments are scheduled while the main loop keeps serving the controller)
+#define HOMING_IDLE 0
+// fast approach to the switches (pressed switches block steps of their axes)
+#define HOMING_APPROACH 1
+// quick back-off from the pressed switches
+#define HOMING_BACK_OFF 2
+// slow approach which finds the switches precisely
+#define HOMING_SLOW_APPROACH 3
+// releasing the switches step by step (home is where they are released)
+#define HOMING_RELEASE 4
+
+// steps of a single approach segment (switches are checked between the segments)
+#define HOMING_SEGMENT_STEPS 100
+// steps of the back-off from the pressed switches
+#define HOMING_BACK_OFF_STEPS 400
+// default deltaT of the slow approach and of the release
+#define HOMING_SLOW_DELTA_T 2000
+// the fastest homing (ticks)
+#define HOMING_MIN_DELTA_T (MIN_DELTA_T * (TIMER_FREQUENCY / TIMESCALE))
+// the fastest back-off (it starts from the standstill without a ramp)
+#define HOMING_BACK_OFF_MIN_DELTA_T (START_DELTA_T * (TIMER_FREQUENCY / TIMESCALE))
+
+// axes in the order of plan instruction data (only first STEPPER_COUNT axes are scheduled)
+#if STEPPER_COUNT == 1
+#define STEPPER_AXES Slot1Axis
+#elif STEPPER_COUNT == 2
+#define STEPPER_AXES Slot1Axis, Slot0Axis
+#elif STEPPER_COUNT == 3
+#define STEPPER_AXES Slot1Axis, Slot0Axis, Slot3Axis
+#else
+#define STEPPER_AXES Slot1Axis, Slot0Axis, Slot3Axis, Slot2Axis
+#endif
+
+//Instruction slots which are filled with Serial data by the receive interrupt.
+FrameReceiver<INSTRUCTION_SIZE, BUFFERED_INSTRUCTION_COUNT> FRAME_RECEIVER;
+//Plans decoded from the received frames.
+PlanQueue<PLAN_QUEUE_SIZE, STEPPER_COUNT> PLAN_QUEUE;
+
+//build fails when the schedule ring leaves no space for plans or the buffers take more SRAM than they are budgeted
+static_assert(PLAN_QUEUE_SIZE >= 2 * PlanQueue<1, STEPPER_COUNT>::maxRecordSize, "schedule ring leaves no SRAM for the plan queue");
+#ifndef HOST_SIMULATOR
+//(host pointers are wider - the session replay of the simulator checks the budget only)
+static_assert(sizeof(FRAME_RECEIVER) <= FRAME_RECEIVER_SRAM(INSTRUCTION_SIZE, BUFFERED_INSTRUCTION_COUNT) && sizeof(PLAN_QUEUE) <= PLAN_QUEUE_SRAM_BUDGET, "instruction buffering exceeds its SRAM budget");
+#endif
+
+//Byte received before the authentication (-1 when there is none).
+volatile int16_t AUTHENTICATION_BYTE = -1;
+//Determine whether controller authenticated - received bytes are frames afterwards.
+volatile bool IS_AUTHENTICATED = false;
 
 // determine whether home position was calibrated already
 bool IS_HOME_CALIBRATED = false;
+//Phase of the running homing (HOMING_IDLE when it does not run).
+byte HOMING_PHASE = HOMING_IDLE;
+//Clock masks of the axes in the order of plan data.
+const byte AXIS_CLK_MASKS[] = { SLOT1_CLK_MASK, SLOT0_CLK_MASK, SLOT3_CLK_MASK, SLOT2_CLK_MASK };
+//deltaT of the fast homing approach of each axis (in the order of plan data).
+uint16_t HOMING_FAST_DELTA_TS[STEPPER_COUNT];
+//deltaT of the slow homing approach and release of each axis (in the order of plan data).
+uint16_t HOMING_SLOW_DELTA_TS[STEPPER_COUNT];
+//Steps which released the home switches (in the order of plan data).
+uint16_t HOMING_RELEASE_STEPS[STEPPER_COUNT];
+
+//Determine whether plans are acknowledged by credit reports instead of 'Y' and 'F' for each plan.
+bool IS_CREDIT_MODE = false;
+//Determine whether plans are dropped until controller resynchronizes by 'W' (some plan was lost in credit mode).
+bool IS_RESYNC_REQUIRED = false;
+//Count of accepted plans (cumulative sequence number, it overflows).
+byte ACCEPTED_PLAN_SEQUENCE = 0;
+//Sequence number which was reported last time.
+byte REPORTED_PLAN_SEQUENCE = 0;
+//Free plan credits which were reported last time.
+byte REPORTED_FREE_CREDITS = 0;
+//Count of instruction ends which were not reported yet.
+byte UNREPORTED_FINISHED_COUNT = 0;
+//Time of the last credit report.
+unsigned long LAST_REPORT_TIME = 0;
+
+//Count of finished instructions (cumulative, positions are committed with them).
+uint32_t EXECUTED_INSTRUCTION_COUNT = 0;
+//Shortest time between two pushed state reports in ms (0 when the state is not pushed periodically).
+uint16_t STATE_REPORT_PERIOD = 0;
+//Count of finished instructions which pushes the state report (0 when the state is not pushed by instructions).
+byte STATE_REPORT_INSTRUCTIONS = 0;
+//Count of instructions finished from the last state report.
+byte UNREPORTED_STATE_INSTRUCTIONS = 0;
+//Time of the last state report.
+unsigned long LAST_STATE_REPORT_TIME = 0;
+//Time of the last decoded move.
+unsigned long LAST_MOVE_DECODE_TIME = 0;
+
+SegmentScheduler<STEPPER_AXES> SEGMENT_SCHEDULER;
+#ifndef HOST_SIMULATOR
+static_assert(sizeof(SEGMENT_SCHEDULER) <= SEGMENT_SCHEDULER_SRAM(STEPPER_COUNT), "segment scheduler exceeds its SRAM budget");
+#endif
+
+//Serial port is defined here so the core one (with its receive interrupt buffering into 64 bytes) is not linked.
+HardwareSerial Serial(&UBRR0H, &UBRR0L, &UCSR0A, &UCSR0B, &UCSR0C, &UDR0);
+
+//receive interrupt - bytes go directly to the instruction slots
+ISR(USART_RX_vect) {
+	byte data = UDR0;
+	if (IS_AUTHENTICATED)
+		FRAME_RECEIVER.receive(data);
+	else
+		AUTHENTICATION_BYTE = data;
+}
 
-//Index where next instruction segment will contain plan instruction.
-uint16_t INSTRUCTION_BUFFER_LAST_INDEX = 0;
-//Index to a segment where data are actually written.
-uint16_t INSTRUCTION_BUFFER_ARRIVAL_INDEX = 0;
-//Absolute offset to actually written segment.
-uint16_t INSTRUCTION_BUFFER_ARRIVAL_OFFSET = 0;
-//Offset within actually written instruction segment.
-uint16_t SEGMENT_ARRIVAL_OFFSET = 0;
-
-//Time where last byte has arrived (is used for incomplete message recoveries).
-unsigned long LAST_BYTE_ARRIVAL_TIME = 0;
-
-ActivationSlack4D lastSlack = { 0 };
-
-bool enableConstantSchedule = false;
-PlanScheduler4D<ConstantPlan> CONSTANT_SCHEDULER(SLOT1_CLK_MASK, SLOT1_DIR_MASK, SLOT0_CLK_MASK, SLOT0_DIR_MASK, SLOT3_CLK_MASK, SLOT3_DIR_MASK, SLOT2_CLK_MASK, SLOT2_DIR_MASK);
-
-bool enableAccelerationSchedule = false;
-PlanScheduler4D<AccelerationPlan> ACCELERATION_SCHEDULER(SLOT1_CLK_MASK, SLOT1_DIR_MASK, SLOT0_CLK_MASK, SLOT0_DIR_MASK, SLOT3_CLK_MASK, SLOT3_DIR_MASK, SLOT2_CLK_MASK, SLOT2_DIR_MASK);
+//transmit interrupt is served by the core implementation
+ISR(USART_UDRE_vect) {
+	Serial._tx_udr_empty_irq();
+}
 
 //homing interrupt
 volatile byte HOME_MASK = 0;
+//Determine whether pressed home switches block steps of their axes (the homing turns it off to leave the switches).
+volatile bool IS_HOME_MASK_BLOCKING = true;
 ISR(PCINT1_vect) {
 	setHomeMask();
 }
 
+//schedule refill interrupt - the main loop is left to the protocol
+SCHEDULE_REFILL_ISR {
+	SEGMENT_SCHEDULER.refillSchedule();
+}
+
 void setup() {
 	Serial.begin(128000);
 
@@ -78,8 +196,14 @@ void setup() {
 	pciSetup(A3);
 	pciSetup(A4);
 
+	for (byte i = 0; i < STEPPER_COUNT; ++i) {
+		HOMING_FAST_DELTA_TS[i] = HOMING_DELTA_T;
+		HOMING_SLOW_DELTA_TS[i] = HOMING_SLOW_DELTA_T;
+	}
+
 	//initialize libraries
 	Steppers::initialize();
+	enableScheduleRefill();
 	setHomeMask();
 	delay(1000);
 	melodyStart();
@@ -92,90 +216,138 @@ void loop() {
 	waitForAuthentication();
 
 	for (;;) {
-		if (!enableAccelerationSchedule && !enableConstantSchedule)
-			tryToFetchNextPlans();
-
-		bool isPlanFinished = false;
-		if (enableConstantSchedule)
-			isPlanFinished = !CONSTANT_SCHEDULER.fillSchedule();
-		else if (enableAccelerationSchedule)
-			isPlanFinished = !ACCELERATION_SCHEDULER.fillSchedule();
-
-		if (isPlanFinished) {
-			// executed plans were finished
-			if (enableConstantSchedule) {
-				lastSlack = CONSTANT_SCHEDULER.slack;
-				enableConstantSchedule = false;
-			}
+		if (HOMING_PHASE != HOMING_IDLE)
+			continueHoming();
 
-			if (enableAccelerationSchedule) {
-				lastSlack = ACCELERATION_SCHEDULER.slack;
-				enableAccelerationSchedule = false;
-			}
+		//next instruction is armed while the current one is scheduled
+		tryToFetchNextPlans();
 
-			//Serial.print('F');  //report instruction steps are all scheduled
-			continue;
-		}
+		//scheduler reports raised by the refill interrupt
+		Steppers::sendDeferredReports();
 
-		//serial communication handling
-		if (SEGMENT_ARRIVAL_OFFSET == INSTRUCTION_SIZE) {
+		decodeReceivedPlans();
+
+		reportFinishedInstructions();
+
+		if (IS_CREDIT_MODE)
+			trySendCreditReport();
+
+		trySendStateReport();
+
+		//serial communication handling (frames are received by the interrupt)
+		reportReceiveErrors();
+
+		const byte* frame = FRAME_RECEIVER.receivedFrame();
+		if (frame != NULL) {
 			//we received an instrution - do processing
-			processControllerInstruction();
-		}
-		else if (Serial.available()) {
-			//new data byte arrived
-			INSTRUCTION_BUFFER[INSTRUCTION_BUFFER_ARRIVAL_OFFSET + SEGMENT_ARRIVAL_OFFSET] = (byte)Serial.read();
-			SEGMENT_ARRIVAL_OFFSET = boundedIncrement(SEGMENT_ARRIVAL_OFFSET, INSTRUCTION_SIZE + 1);
-			LAST_BYTE_ARRIVAL_TIME = millis();
-		}
-		else if (SEGMENT_ARRIVAL_OFFSET > 0 && (millis() - LAST_BYTE_ARRIVAL_TIME) > 2) {
-			//there may be some incomplete message - we cant wait more
-			SEGMENT_ARRIVAL_OFFSET = 0;
-			Serial.print('E'); //incomplete message erased			
+			bool isPlanKept = processControllerInstruction(frame, FRAME_RECEIVER.receivedFrameSize());
+			FRAME_RECEIVER.processFrame(isPlanKept);
 		}
 	}
 }
 
-// Processes buffer with instruction from controller - return false on invalid instruction
-inline bool processControllerInstruction() {
-	const byte* buffer = INSTRUCTION_BUFFER + INSTRUCTION_BUFFER_ARRIVAL_OFFSET;
-	SEGMENT_ARRIVAL_OFFSET = 0;
+// Commits positions of the instructions finished by the step interrupt and reports them ('F' or credit report).
+void reportFinishedInstructions() {
+	byte count = SEGMENT_SCHEDULER.takeFinishedInstructions();
+	if (HOMING_PHASE != HOMING_IDLE)
+		//homing segments are not reported (positions are reset by the homing)
+		return;
 
-	uint16_t checksum = 0;
-	for (int i = 0; i < INSTRUCTION_SIZE - 2; ++i) {
-		checksum += buffer[i];
+	EXECUTED_INSTRUCTION_COUNT += count;
+	UNREPORTED_STATE_INSTRUCTIONS += count;
+	if (IS_CREDIT_MODE) {
+		UNREPORTED_FINISHED_COUNT += count;
+		return;
 	}
 
-	uint16_t receivedChecksum = READ_UINT16(buffer, INSTRUCTION_SIZE - 2);
-	if (receivedChecksum != checksum) {
+	for (; count > 0; --count)
+		Serial.print('F');
+}
+
+// Reports frames which were lost by the receive interrupt.
+void reportReceiveErrors() {
+	if (FRAME_RECEIVER.checkIncompleteFrame(millis(), 2)) {
+		//there was some incomplete message - we cant wait more
+		IS_RESYNC_REQUIRED = IS_CREDIT_MODE;
+		Serial.print('E'); //incomplete message erased
+	}
+
+	for (byte count = FRAME_RECEIVER.takeInvalidFrameCount(); count > 0; --count) {
 		//we received invalid instruction
+		IS_RESYNC_REQUIRED = IS_CREDIT_MODE;
 		Serial.print('C'); //invalid checksum
-		return false;
 	}
 
+	for (byte count = FRAME_RECEIVER.takeOverflowFrameCount(); count > 0; --count) {
+		//there was no more space for keeping the plan
+		IS_RESYNC_REQUIRED = IS_CREDIT_MODE;
+		sendPlanOverflow();
+	}
+}
+
+// Processes valid frame with instruction from controller - returns true when the frame is a plan which has to be kept
+inline bool processControllerInstruction(const byte* buffer, byte frameSize) {
 	//parse the instruction
-	byte command = buffer[0];
+	bool isCompact = buffer[0] & COMPACT_FRAME_FLAG;
+	byte command = isCompact ? buffer[1] : buffer[0];
+	if (isCompact && !PLAN_QUEUE.isValidCompact(buffer + 1, buffer + frameSize - 2)) {
+		//compact frames carry plans only and their axis data has to fit into the payload
+		IS_RESYNC_REQUIRED = IS_CREDIT_MODE;
+		Serial.print('C'); //invalid frame
+		return false;
+	}
+
+	if (!isCompact && !PLAN_QUEUE.isValidPlanData(command, buffer + 1)) {
+		//arcs have to stay in their quadrant and in the range of the arc timing, splines in the direction of their axes
+		IS_RESYNC_REQUIRED = IS_CREDIT_MODE;
+		Serial.print('C'); //invalid frame
+		return false;
+	}
+
 	switch (command)
 	{
 	case 'A': //acceleration plan arrived
 	case 'C': //constant plan arrived		
-		if (!canAddPlan()) {
-			//there is no more space for keeping the plan
-			sendPlanOverflow();
+	case MOVE_KIND: //move arrived (ramps are planned by the device)
+	case ARC_KIND: //arc arrived
+	case SPLINE_KIND: //spline arrived
+		if (IS_RESYNC_REQUIRED)
+			//plans following a lost one cannot be executed
 			return false;
-		}
 
-		sendPlanAccepted();
-		//shift the arrival index to the next one		
-		INSTRUCTION_BUFFER_ARRIVAL_INDEX = boundedIncrement(INSTRUCTION_BUFFER_ARRIVAL_INDEX, BUFFERED_INSTRUCTION_COUNT);
-		INSTRUCTION_BUFFER_ARRIVAL_OFFSET = INSTRUCTION_BUFFER_ARRIVAL_INDEX * INSTRUCTION_SIZE;
+		if (IS_CREDIT_MODE)
+			//acceptance is reported by the next credit report
+			++ACCEPTED_PLAN_SEQUENCE;
+		else
+			sendPlanAccepted();
+		//the plan stays in its slot until it is fetched
 		return true;
 	case 'H':
-		//homing procedure
-		homing();
-		return true;
+		//homing procedure (it runs in the main loop)
+		startHoming();
+		return false;
+	case 'G':
+		//homing speeds - uint16 fast and slow deltaT of each axis (in the order of plan data)
+		for (byte i = 0; i < STEPPER_COUNT; ++i) {
+			HOMING_FAST_DELTA_TS[i] = max(READ_UINT16(buffer, 1 + i * 4), (uint16_t)HOMING_MIN_DELTA_T);
+			HOMING_SLOW_DELTA_TS[i] = max(READ_UINT16(buffer, 1 + i * 4 + 2), (uint16_t)HOMING_MIN_DELTA_T);
+		}
+		return false;
+	case 'V':
+		//feed override in percents (it applies to the steps which were not scheduled yet, moving axes ramp to it)
+		SEGMENT_SCHEDULER.setFeedOverride(buffer[1]);
+		return false;
+	case '!':
+		//feed hold (axes decelerate along their path and the plans wait)
+		SEGMENT_SCHEDULER.holdFeed();
+		return false;
+	case '~':
+		//resume after feed hold
+		SEGMENT_SCHEDULER.resumeFeed();
+		return false;
 	case 'D': {
-		//state data request
+		//state data request (positions of the finished instructions are committed first)
+		reportFinishedInstructions();
 		byte data[] = {
 			'D', IS_HOME_CALIBRATED,
 			INT32_TO_BYTES(SLOT1_STEPS),
@@ -185,108 +357,178 @@ inline bool processControllerInstruction() {
 		};
 
 		Serial.write(data, sizeof(data));
-		return true;
+		return false;
 	}
+	case 'P':
+		//state push subscription - period in ms and count of instructions (zeros stop the pushing)
+		STATE_REPORT_PERIOD = READ_UINT16(buffer, 1);
+		STATE_REPORT_INSTRUCTIONS = buffer[3];
+		reportFinishedInstructions();
+		sendStateReport();
+		return false;
+	case 'T':
+		//timing telemetry request
+		sendTelemetry();
+		return false;
+	case 'W':
+		//credit mode (also resynchronizes plan sequence after a lost plan)
+		reportFinishedInstructions(); //instructions finished before are reported the old way
+		IS_CREDIT_MODE = true;
+		IS_RESYNC_REQUIRED = false;
+		sendCreditReport();
+		return false;
 	case 'I':
 		//welcome message
+		PLAN_QUEUE.resetCompactReferences(); //controller starts delta encoding from zero
+		reportFinishedInstructions(); //positions of the finished instructions are kept
+		IS_CREDIT_MODE = false;
+		IS_RESYNC_REQUIRED = false;
 		melody();
 		Serial.print('I');
-		return true;
+		return false;
 	}
 
 	//unknown command
 	return false;
 }
 
-void homing() {
-	if (enableAccelerationSchedule || enableAccelerationSchedule || Steppers::isSchedulerRunning()) {
+void startHoming() {
+	if (HOMING_PHASE != HOMING_IDLE || !SEGMENT_SCHEDULER.isIdle() || Steppers::isSchedulerRunning() || PLAN_QUEUE.count() > 0 || SEGMENT_SCHEDULER.isFeedHeld()) {
 		//cannot do homing because something is scheduled
 		Serial.print('Q');
 		return;
 	}
+	//positions are reset after homing - nothing can be committed later
+	reportFinishedInstructions();
 
-	ACCELERATION_SCHEDULER.initForHoming();
-	while (ACCELERATION_SCHEDULER.fillSchedule());
-	while (HOME_MASK != ACTIVATIONS_CLOCK_MASK)
-	{
-		CONSTANT_SCHEDULER.initForHoming();
-		//we can't keep here some unplanned steps - flush them all
-		while (CONSTANT_SCHEDULER.fillSchedule());
-	}
-	//arrived home
-
-	// wait until all steps are flushed
-	while (Steppers::isSchedulerRunning());
-
-	//now go slowly back to release home switches
-	digitalWrite(SLOT0_DIR_PIN, LOW);
-	digitalWrite(SLOT1_DIR_PIN, LOW);
-	digitalWrite(SLOT2_DIR_PIN, LOW);
-	digitalWrite(SLOT3_DIR_PIN, LOW);
-	delayMicroseconds(PORT_CHANGE_DELAY);
-	int slot0_home_rev = 0;
-	int slot1_home_rev = 0;
-	int slot2_home_rev = 0;
-	int slot3_home_rev = 0;
-
-	while (HOME_MASK > 0)
-	{
-		if (HOME_MASK & SLOT0_CLK_MASK) {
-			digitalWrite(SLOT0_CLK_PIN, LOW);
-			++slot0_home_rev;
-		}
+	IS_HOME_CALIBRATED = false;
+	HOMING_PHASE = HOMING_APPROACH;
+	armHomingSegment(-HOMING_SEGMENT_STEPS, HOMING_FAST_DELTA_TS, true, false);
+}
 
-		if (HOME_MASK & SLOT1_CLK_MASK) {
-			digitalWrite(SLOT1_CLK_PIN, LOW);
-			++slot1_home_rev;
+// Continues the running homing - next segment is armed while the scheduler runs the previous one.
+void continueHoming() {
+	bool isStopped = SEGMENT_SCHEDULER.isIdle() && !Steppers::isSchedulerRunning();
+	byte homeMask = 0;
+	for (byte i = 0; i < STEPPER_COUNT; ++i)
+		homeMask |= AXIS_CLK_MASKS[i];
+
+	switch (HOMING_PHASE) {
+	case HOMING_APPROACH:
+	case HOMING_SLOW_APPROACH:
+		if ((HOME_MASK & homeMask) != homeMask) {
+			//pressed switches block their axes, the others go on
+			if (SEGMENT_SCHEDULER.canArm())
+				armHomingSegment(-HOMING_SEGMENT_STEPS, HOMING_PHASE == HOMING_APPROACH ? HOMING_FAST_DELTA_TS : HOMING_SLOW_DELTA_TS, isStopped, false);
+			return;
 		}
 
-		if (HOME_MASK & SLOT2_CLK_MASK) {
-			digitalWrite(SLOT2_CLK_PIN, LOW);
-			++slot2_home_rev;
+		if (!isStopped)
+			//blocked steps of the armed segments have to run out before the switches are left
+			return;
+
+		setHomeMaskBlocking(false);
+		if (HOMING_PHASE == HOMING_APPROACH) {
+			HOMING_PHASE = HOMING_BACK_OFF;
+			backOffHoming();
 		}
+		else {
+			HOMING_PHASE = HOMING_RELEASE;
+			for (byte i = 0; i < STEPPER_COUNT; ++i)
+				HOMING_RELEASE_STEPS[i] = 0;
+		}
+		return;
 
-		if (HOME_MASK & SLOT3_CLK_MASK) {
-			digitalWrite(SLOT3_CLK_PIN, LOW);
-			++slot3_home_rev;
+	case HOMING_BACK_OFF:
+		if (!isStopped)
+			return;
+
+		if ((HOME_MASK & homeMask) != 0) {
+			//some switches are still pressed
+			backOffHoming();
+			return;
 		}
 
-		delayMicroseconds(PORT_CHANGE_DELAY);
-		digitalWrite(SLOT0_CLK_PIN, HIGH);
-		digitalWrite(SLOT1_CLK_PIN, HIGH);
-		digitalWrite(SLOT2_CLK_PIN, HIGH);
-		digitalWrite(SLOT3_CLK_PIN, HIGH);
+		setHomeMaskBlocking(true);
+		HOMING_PHASE = HOMING_SLOW_APPROACH;
+		return;
+
+	case HOMING_RELEASE:
+		if (!isStopped)
+			return;
 
-		delayMicroseconds(4000 - PORT_CHANGE_DELAY);
+		if ((HOME_MASK & homeMask) != 0) {
+			//a single step of the pressed axes (the switch is checked after each step)
+			for (byte i = 0; i < STEPPER_COUNT; ++i) {
+				if (HOME_MASK & AXIS_CLK_MASKS[i])
+					++HOMING_RELEASE_STEPS[i];
+			}
+			armHomingSegment(1, HOMING_SLOW_DELTA_TS, false, true);
+			return;
+		}
+
+		finishHoming();
+		return;
 	}
+}
+
+// Moves pressed axes away from their switches.
+void backOffHoming() {
+	uint16_t deltaTs[STEPPER_COUNT];
+	for (byte i = 0; i < STEPPER_COUNT; ++i)
+		deltaTs[i] = max(HOMING_FAST_DELTA_TS[i], (uint16_t)HOMING_BACK_OFF_MIN_DELTA_T);
+	armHomingSegment(HOMING_BACK_OFF_STEPS, deltaTs, false, true);
+}
 
-	//scheduler is disabled here - is it safe to udpate that without locking
+// Arms homing segment with the given steps of all axes (or of the axes with pressed switch only).
+void armHomingSegment(int16_t stepCount, const uint16_t* deltaTs, bool isRamp, bool isPressedOnly) {
+	int16_t steps[STEPPER_COUNT];
+	for (byte i = 0; i < STEPPER_COUNT; ++i)
+		steps[i] = !isPressedOnly || (HOME_MASK & AXIS_CLK_MASKS[i]) ? stepCount : 0;
+
+	SEGMENT_SCHEDULER.armHoming(steps, deltaTs, isRamp);
+}
+
+void finishHoming() {
+	//homing segments are dropped together with their steps
+	reportFinishedInstructions();
+	HOMING_PHASE = HOMING_IDLE;
+	setHomeMaskBlocking(true);
+
+	//positions are updated by the main loop only
 	SLOT0_STEPS = 0;
 	SLOT1_STEPS = 0;
 	SLOT2_STEPS = 0;
 	SLOT3_STEPS = 0;
 
 	Serial.print('|');
-	Serial.print(slot1_home_rev);
-	Serial.print(',');
-	Serial.print(slot0_home_rev);
-	Serial.print(',');
-	Serial.print(slot3_home_rev);
-	Serial.print(',');
-	Serial.println(slot2_home_rev);
+	for (byte i = 0; i < STEPPER_COUNT; ++i) {
+		if (i > 0)
+			Serial.print(',');
+		Serial.print(HOMING_RELEASE_STEPS[i]);
+	}
+	Serial.println();
 
 	IS_HOME_CALIBRATED = true;
 	//homing was successful
 	Serial.print('H');
 }
 
+// Turns blocking of the axes by their pressed home switches on or off.
+void setHomeMaskBlocking(bool isBlocking) {
+	noInterrupts();
+	IS_HOME_MASK_BLOCKING = isBlocking;
+	Steppers::setActivationMask(isBlocking ? HOME_MASK : 0);
+	interrupts();
+}
+
 void waitForAuthentication() {
-	int authenticationStep = 0;
+	size_t authenticationStep = 0;
 	const char* password = "$%!";
 	Serial.print("a");
 	while (authenticationStep < strlen(password))
 	{
-		char b = Serial.read();
+		char b = takeAuthenticationByte();
 		if (b <= 0)
 			continue;
 
@@ -299,9 +541,19 @@ void waitForAuthentication() {
 			Serial.print("a");
 		}
 	}
+	IS_AUTHENTICATED = true;
 	Serial.print("Y");
 }
 
+// Returns byte received before the authentication (-1 when there is none).
+int16_t takeAuthenticationByte() {
+	noInterrupts();
+	int16_t b = AUTHENTICATION_BYTE;
+	AUTHENTICATION_BYTE = -1;
+	interrupts();
+	return b;
+}
+
 void pciSetup(byte pin)
 {
 	*digitalPinToPCMSK(pin) |= bit(digitalPinToPCMSKbit(pin));  // enable pin
@@ -316,12 +568,89 @@ inline void setHomeMask() {
 	byte l4Pushed = (digitalRead(A4) == LOW) << 4;
 	byte mask = l1Pushed | l2Pushed | l3Pushed | l4Pushed;
 	HOME_MASK = mask;
-	Steppers::setActivationMask(HOME_MASK);
+	if (IS_HOME_MASK_BLOCKING)
+		Steppers::setActivationMask(HOME_MASK);
 }
 
-bool canAddPlan() {
-	//we have to keep at least one instruction segment free for interactive instructions
-	return boundedIncrement(INSTRUCTION_BUFFER_ARRIVAL_INDEX, BUFFERED_INSTRUCTION_COUNT) != INSTRUCTION_BUFFER_LAST_INDEX;
+// Sends report when the credit state changed (at most once per CREDIT_REPORT_PERIOD).
+void trySendCreditReport() {
+	bool hasChanged = UNREPORTED_FINISHED_COUNT > 0 || REPORTED_PLAN_SEQUENCE != ACCEPTED_PLAN_SEQUENCE || REPORTED_FREE_CREDITS != freePlanCredits();
+	if (!hasChanged || millis() - LAST_REPORT_TIME < CREDIT_REPORT_PERIOD)
+		return;
+
+	sendCreditReport();
+}
+
+// Count of plans the controller can send without waiting - free plan slots and the plan queue records which are not claimed
+// by the plans waiting in the slots (the main loop moves arriving plans into the queue before the next one is received).
+byte freePlanCredits() {
+	byte slots = FRAME_RECEIVER.freePlanSlots();
+	byte records = PLAN_QUEUE.freeRecords();
+	byte waitingFrames = FRAME_RECEIVER.usedSlots();
+	if (records <= waitingFrames)
+		return slots;
+
+	return min(slots + records - waitingFrames, 255);
+}
+
+// Credit report: 'K', sequence of the last accepted plan, free plan credits (after that plan), count of finished instructions.
+// Controller can send (free credits - plans sent after the reported sequence) plans without waiting.
+void sendCreditReport() {
+	REPORTED_PLAN_SEQUENCE = ACCEPTED_PLAN_SEQUENCE;
+	REPORTED_FREE_CREDITS = freePlanCredits();
+
+	byte data[] = { 'K', REPORTED_PLAN_SEQUENCE, REPORTED_FREE_CREDITS, UNREPORTED_FINISHED_COUNT };
+	Serial.write(data, sizeof(data));
+
+	UNREPORTED_FINISHED_COUNT = 0;
+	LAST_REPORT_TIME = millis();
+}
+
+// Pushes state report when the subscribed period elapsed or enough instructions finished.
+void trySendStateReport() {
+	bool isPeriodElapsed = STATE_REPORT_PERIOD > 0 && millis() - LAST_STATE_REPORT_TIME >= STATE_REPORT_PERIOD;
+	bool isInstructionCountReached = STATE_REPORT_INSTRUCTIONS > 0 && UNREPORTED_STATE_INSTRUCTIONS >= STATE_REPORT_INSTRUCTIONS;
+	if (isPeriodElapsed || isInstructionCountReached)
+		sendStateReport();
+}
+
+// State report: 'P', home calibration, count of finished instructions, positions (in the order of 'D' data).
+// Positions are committed by the main loop together with the finished instructions - the snapshot is always consistent.
+void sendStateReport() {
+	byte data[] = {
+		'P', IS_HOME_CALIBRATED,
+		INT32_TO_BYTES(EXECUTED_INSTRUCTION_COUNT),
+		INT32_TO_BYTES(SLOT1_STEPS),
+		INT32_TO_BYTES(SLOT0_STEPS),
+		INT32_TO_BYTES(SLOT3_STEPS),
+		INT32_TO_BYTES(SLOT2_STEPS)
+	};
+	Serial.write(data, sizeof(data));
+
+	UNREPORTED_STATE_INSTRUCTIONS = 0;
+	LAST_STATE_REPORT_TIME = millis();
+}
+
+// Telemetry report: 'T', lowest schedule occupancy, underrun stops, step interrupt lateness histogram,
+// grouped and missed steps of each axis (in the order of plan data) - all of them uint16 counted from the last report.
+void sendTelemetry() {
+	TimingTelemetry telemetry;
+	Steppers::takeTimingTelemetry(telemetry);
+	uint16_t groupedSteps[STEPPER_COUNT];
+	uint16_t missedSteps[STEPPER_COUNT];
+	SEGMENT_SCHEDULER.takeStepCounters(groupedSteps, missedSteps);
+
+	uint16_t minOccupancy = telemetry.minOccupancy;
+	byte data[] = { 'T', INT16_TO_BYTES(minOccupancy), INT16_TO_BYTES(telemetry.underrunStops) };
+	Serial.write(data, sizeof(data));
+	for (byte i = 0; i < ISR_LATENESS_BUCKET_COUNT; ++i) {
+		byte bucket[] = { INT16_TO_BYTES(telemetry.latenessHistogram[i]) };
+		Serial.write(bucket, sizeof(bucket));
+	}
+	for (byte i = 0; i < STEPPER_COUNT; ++i) {
+		byte axis[] = { INT16_TO_BYTES(groupedSteps[i]), INT16_TO_BYTES(missedSteps[i]) };
+		Serial.write(axis, sizeof(axis));
+	}
 }
 
 void sendPlanOverflow() {
@@ -333,39 +662,87 @@ void sendPlanAccepted() {
 }
 
 void tryToFetchNextPlans() {
-	if (INSTRUCTION_BUFFER_LAST_INDEX == INSTRUCTION_BUFFER_ARRIVAL_INDEX)
-		//no more plans available
+	if (HOMING_PHASE != HOMING_IDLE)
+		//plans wait until the positions are reset
 		return;
 
-	byte* buffer = 1 + INSTRUCTION_BUFFER + (INSTRUCTION_BUFFER_LAST_INDEX * INSTRUCTION_SIZE);
-	INSTRUCTION_BUFFER_LAST_INDEX = boundedIncrement(INSTRUCTION_BUFFER_LAST_INDEX, BUFFERED_INSTRUCTION_COUNT);
+	while (SEGMENT_SCHEDULER.canArm()) {
+		const byte* record = PLAN_QUEUE.front();
+		if (record == NULL)
+			//no more plans available
+			return;
 
-	switch (buffer[-1]) {
-	case 'A': {
-		enableAccelerationSchedule = true;
-		ACCELERATION_SCHEDULER.registerLastActivationSlack(lastSlack);
-		ACCELERATION_SCHEDULER.initFrom(buffer);
-		break;
-	}
-	case 'C': {
-		enableConstantSchedule = true;
-		CONSTANT_SCHEDULER.registerLastActivationSlack(lastSlack);
-		CONSTANT_SCHEDULER.initFrom(buffer);
-		break;
-	}
-	default:
-		//This should never happend - continuation would cause undefined behaviour
-		//so we rather block here.
-		for (;;)Serial.print('U');
-		break;
+		if (!PLAN_QUEUE.isFrontPlanned()) {
+			if (!SEGMENT_SCHEDULER.isNearEnd())
+				//the running move is far from its end - the next move can still come
+				return;
+
+			if (SEGMENT_SCHEDULER.isIdle() && millis() - LAST_MOVE_DECODE_TIME < MOVE_START_DELAY)
+				//the next move may be on the way
+				return;
+		}
+
+		//axes which finished already continue with the next plan
+		SEGMENT_SCHEDULER.arm(record);
+		PLAN_QUEUE.pop();
 	}
 }
 
-inline byte boundedIncrement(const byte valueToIncrement, const byte exclusiveBoundary) {
-	if (valueToIncrement + 1 >= exclusiveBoundary)
-		return 0;
+// Determine whether the plan in the frame slot can be decoded (arcs, splines and compact payloads can be out of their range).
+inline bool isValidPlanFrame(const byte* buffer) {
+	if (buffer[0] & COMPACT_FRAME_FLAG)
+		return PLAN_QUEUE.isValidCompact(buffer + 1, buffer + 1 + (buffer[0] & ~COMPACT_FRAME_FLAG));
+
+	return PLAN_QUEUE.isValidPlanData(buffer[0], buffer + 1);
+}
+
+// Moves accepted plans from the frame slots to the plan queue (as long as there is space for them).
+void decodeReceivedPlans() {
+	for (;;) {
+		byte* buffer = FRAME_RECEIVER.nextPlan();
+		if (buffer == NULL)
+			//no more plans available
+			return;
+
+		bool isDecoded;
+		if (buffer[0] & COMPACT_FRAME_FLAG) {
+			//compact frame starts with command and axis flags
+			isDecoded = PLAN_QUEUE.pushCompact(buffer + 1, buffer + 1 + (buffer[0] & ~COMPACT_FRAME_FLAG));
+		}
+		else {
+			switch (buffer[0]) {
+			case 'A':
+			case 'C':
+			case ARC_KIND:
+			case SPLINE_KIND:
+				isDecoded = PLAN_QUEUE.push(buffer[0], buffer + 1);
+				break;
+			case MOVE_KIND:
+				isDecoded = PLAN_QUEUE.pushMove(buffer + 1);
+				if (isDecoded)
+					LAST_MOVE_DECODE_TIME = millis();
+				break;
+			default:
+				//This should never happend - continuation would cause undefined behaviour
+				//so we rather block here.
+				for (;;)Serial.print('U');
+				break;
+			}
+		}
+
+		if (!isDecoded) {
+			if (isValidPlanFrame(buffer))
+				//queue is full - the plan waits in its slot
+				return;
 
-	return valueToIncrement + 1;
+			//plan out of its range is dropped (frames are checked when they arrive, nothing invalid should get here)
+			IS_RESYNC_REQUIRED = IS_CREDIT_MODE;
+			Serial.print('C'); //invalid frame
+		}
+
+		//plan was decoded or dropped - the slot can be reused
+		FRAME_RECEIVER.fetchPlan();
+	}
 }
 
 
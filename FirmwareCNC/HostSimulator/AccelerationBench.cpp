@@ -0,0 +1,205 @@
+/*
+Name:		AccelerationBench.cpp
+Author:	m9ra
+
+Compares AccelerationPlan against BoundedAccelerationPlan.
+Reports cycles per step (average and worst case) and subtraction loop iterations for typical ramps,
+check mode verifies both plans produce the same activations over a sweep of ramp parameters.
+
+usage: acceleration_bench [--check]
+*/
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLE_UNIT "TSC ticks"
+#else
+#define CYCLE_UNIT "nanoseconds"
+#endif
+
+#include "PlanFrames.h"
+
+// how many times each ramp is measured (minimum per step filters out host noise)
+#define MEASURE_REPEAT 50
+
+// the same boundary both plans use for the division
+#define DIVISION_DELTA_T 5000
+
+struct Ramp {
+	const char* name;
+	int16_t stepCount;
+	int32_t initialDeltaT;
+	int32_t n;
+};
+
+// exposes plan state needed for the loop iteration counting
+template<typename PlanType> class PlanProbe : public PlanType {
+public:
+	PlanProbe() : PlanType(SLOT0_CLK_MASK, SLOT0_DIR_MASK) {}
+
+	int32_t currentDeltaT() { return this->_currentDeltaT; }
+
+	uint32_t current4N() { return this->_current4N; }
+};
+
+struct RampCost {
+	double averageCycles;
+	uint64_t worstCycles;
+	double averageIterations;
+	uint32_t worstIterations;
+};
+
+inline uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void writeRamp(byte* data, const Ramp& ramp) {
+	AccelerationAxis axis = AccelerationAxis();
+	axis.stepCount = ramp.stepCount;
+	axis.initialDeltaT = ramp.initialDeltaT;
+	axis.n = ramp.n;
+
+	data = writeInt16(data, axis.stepCount);
+	data = writeInt32(data, axis.initialDeltaT);
+	data = writeInt32(data, axis.n);
+	data = writeInt16(data, axis.baseDelta);
+	writeInt16(data, axis.baseRemainder);
+}
+
+// subtraction loop iterations of the last createNextActivation call
+uint32_t loopIterations(bool isBounded, int32_t deltaT, int32_t nextDeltaT, uint32_t current4N) {
+	if (deltaT > DIVISION_DELTA_T)
+		return 0;
+
+	if (isBounded && current4N < 4 * RECIPROCAL_TABLE_LEN)
+		return 0;
+
+	return (uint32_t)abs(nextDeltaT - deltaT);
+}
+
+template<typename PlanType> RampCost measureRamp(const Ramp& ramp, bool isBounded) {
+	byte data[AccelerationPlan::dataSize];
+	writeRamp(data, ramp);
+
+	std::vector<uint64_t> stepCycles(ramp.stepCount > 0 ? ramp.stepCount : -ramp.stepCount, UINT64_MAX);
+	RampCost cost = RampCost();
+	uint64_t totalIterations = 0;
+	for (int repeat = 0; repeat < MEASURE_REPEAT; ++repeat) {
+		PlanProbe<PlanType> plan;
+		plan.loadFrom(data);
+		for (size_t i = 0; i < stepCycles.size(); ++i) {
+			int32_t deltaT = plan.currentDeltaT();
+			if (plan.current4N() == 0)
+				deltaT = deltaT * 676 / 1000;
+
+			uint64_t start = readCycles();
+			plan.createNextActivation();
+			uint64_t cycles = readCycles() - start;
+			stepCycles[i] = min(stepCycles[i], cycles);
+
+			if (repeat > 0)
+				continue;
+
+			uint32_t iterations = loopIterations(isBounded, deltaT, plan.currentDeltaT(), plan.current4N());
+			totalIterations += iterations;
+			cost.worstIterations = max(cost.worstIterations, iterations);
+		}
+	}
+
+	uint64_t totalCycles = 0;
+	for (size_t i = 0; i < stepCycles.size(); ++i) {
+		totalCycles += stepCycles[i];
+		cost.worstCycles = max(cost.worstCycles, stepCycles[i]);
+	}
+	cost.averageCycles = 1.0 * totalCycles / stepCycles.size();
+	cost.averageIterations = 1.0 * totalIterations / stepCycles.size();
+	return cost;
+}
+
+void printCost(const char* name, const RampCost& cost) {
+	printf("\t%-9s cycles/step avg %7.1f worst %6llu | loop iterations avg %6.2f worst %4u\n", name, cost.averageCycles, (unsigned long long)cost.worstCycles, cost.averageIterations, cost.worstIterations);
+}
+
+void runBenchmark() {
+	// ramps the way ControllerCNC plans them (2 MHz ticks)
+	const Ramp ramps[] = {
+		{ "homing start", 150, 2000, 6 },
+		{ "start ramp", 2000, 2000, 6 },
+		{ "slow start", 300, 20000, 1 },
+		{ "mid ramp", 1000, 600, 300 },
+		{ "deceleration", 150, 400, -156 },
+		{ "full stop", 1000, 300, -1000 },
+	};
+
+	printf("cycles are host " CYCLE_UNIT "\n");
+	for (size_t i = 0; i < sizeof(ramps) / sizeof(ramps[0]); ++i) {
+		const Ramp& ramp = ramps[i];
+		printf("%s (%d steps from %d, n=%d)\n", ramp.name, ramp.stepCount, ramp.initialDeltaT, ramp.n);
+		printCost("current", measureRamp<AccelerationPlan>(ramp, false));
+		printCost("bounded", measureRamp<BoundedAccelerationPlan>(ramp, true));
+	}
+}
+
+// both plans has to produce the same activations (and keep the same state)
+bool checkRamp(const Ramp& ramp) {
+	byte data[AccelerationPlan::dataSize];
+	writeRamp(data, ramp);
+
+	PlanProbe<AccelerationPlan> current;
+	PlanProbe<BoundedAccelerationPlan> bounded;
+	current.loadFrom(data);
+	bounded.loadFrom(data);
+
+	while (current.isActive || bounded.isActive) {
+		current.createNextActivation();
+		bounded.createNextActivation();
+		if (current.isActive != bounded.isActive || current.nextActivationTime != bounded.nextActivationTime || current.currentDeltaT() != bounded.currentDeltaT()) {
+			printf("\t[FAIL] %d steps from %d, n=%d differs at step %u\n", ramp.stepCount, ramp.initialDeltaT, ramp.n, current.stepCount - current.remainingSteps);
+			return false;
+		}
+	}
+	return true;
+}
+
+int runCheck() {
+	const int32_t initialDeltas[] = { 100, 250, 400, 999, 2000, 2500, 4999, 5000, 5001, 7000, 20000, 65535 };
+	int rampCount = 0;
+	int failureCount = 0;
+	for (size_t i = 0; i < sizeof(initialDeltas) / sizeof(initialDeltas[0]); ++i) {
+		for (int32_t n = -1200; n <= 1200; n += 3) {
+			Ramp ramp = { "", 3000, initialDeltas[i], n };
+			if (n < 0)
+				// deceleration cannot go below zero n
+				ramp.stepCount = (int16_t)(-n);
+
+			++rampCount;
+			if (!checkRamp(ramp))
+				++failureCount;
+		}
+	}
+
+	printf("acceleration plans\n");
+	printf("\t[%s] %d ramps with the same activations\n", failureCount ? "FAIL" : "OK", rampCount - failureCount);
+	return failureCount ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+	if (argc == 2 && strcmp(argv[1], "--check") == 0)
+		return runCheck();
+
+	if (argc > 1) {
+		printf("usage: %s [--check]\n", argv[0]);
+		return 2;
+	}
+
+	runBenchmark();
+	return 0;
+}
@@ -0,0 +1,210 @@
+/*
+Name:		Arduino.h
+Author:	m9ra
+
+Host stand-in for the Arduino core. Provides the subset of the Arduino API
+and ATmega328P registers the firmware uses, backed by Simulator.
+*/
+
+#ifndef _HostArduino_h
+#define _HostArduino_h
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+
+// StepperControl.h defines its own limits (as the avr toolchain does)
+#undef UINT16_MAX
+#undef INT32_MAX
+#undef INT32_MIN
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+
+#define F(string_literal) string_literal
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t*)(address))
+#define pgm_read_word(address) (*(const uint16_t*)(address))
+#define pgm_read_dword(address) (*(const uint32_t*)(address))
+
+#define bit(b) (1UL << (b))
+
+template<typename A, typename B> inline auto min(A a, B b) -> typename std::decay<decltype(a < b ? a : b)>::type { return a < b ? a : b; }
+template<typename A, typename B> inline auto max(A a, B b) -> typename std::decay<decltype(a > b ? a : b)>::type { return a > b ? a : b; }
+
+// Identifiers of the simulated registers.
+enum HostRegisterId {
+	REG_TCNT1, REG_TCCR1A, REG_TCCR1B, REG_TIMSK1, REG_TIFR1,
+	REG_TCCR2A, REG_TCCR2B, REG_OCR2A, REG_TIMSK2,
+	REG_PORTB, REG_PORTC, REG_PORTD, REG_DDRB, REG_DDRC, REG_DDRD,
+	REG_PCICR, REG_PCIFR, REG_PCMSK0, REG_PCMSK1, REG_PCMSK2,
+	REG_UBRR0H, REG_UBRR0L, REG_UCSR0A, REG_UCSR0B, REG_UCSR0C, REG_UDR0,
+	REG_SREG,
+	REG_COUNT
+};
+
+// Register access is routed to the simulator so that it can keep the simulated time in sync.
+uint16_t hostReadRegister(HostRegisterId id);
+void hostWriteRegister(HostRegisterId id, uint16_t value);
+
+template<typename ValueType> class HostRegister {
+public:
+	const HostRegisterId id;
+
+	explicit HostRegister(HostRegisterId id) :id(id) {}
+
+	inline operator ValueType() const { return (ValueType)hostReadRegister(id); }
+	inline HostRegister& operator=(ValueType value) { hostWriteRegister(id, value); return *this; }
+	inline HostRegister& operator=(const HostRegister& other) { hostWriteRegister(id, (ValueType)other); return *this; }
+	inline HostRegister& operator|=(ValueType value) { hostWriteRegister(id, (ValueType)(hostReadRegister(id) | value)); return *this; }
+	inline HostRegister& operator&=(ValueType value) { hostWriteRegister(id, (ValueType)(hostReadRegister(id) & value)); return *this; }
+	inline HostRegister& operator^=(ValueType value) { hostWriteRegister(id, (ValueType)(hostReadRegister(id) ^ value)); return *this; }
+};
+
+extern HostRegister<uint16_t> TCNT1;
+extern HostRegister<uint8_t> TCCR1A;
+extern HostRegister<uint8_t> TCCR1B;
+extern HostRegister<uint8_t> TIMSK1;
+extern HostRegister<uint8_t> TIFR1;
+extern HostRegister<uint8_t> TCCR2A;
+extern HostRegister<uint8_t> TCCR2B;
+extern HostRegister<uint8_t> OCR2A;
+extern HostRegister<uint8_t> TIMSK2;
+extern HostRegister<uint8_t> PORTB;
+extern HostRegister<uint8_t> PORTC;
+extern HostRegister<uint8_t> PORTD;
+extern HostRegister<uint8_t> DDRB;
+extern HostRegister<uint8_t> DDRC;
+extern HostRegister<uint8_t> DDRD;
+extern HostRegister<uint8_t> PCICR;
+extern HostRegister<uint8_t> PCIFR;
+extern HostRegister<uint8_t> PCMSK0;
+extern HostRegister<uint8_t> PCMSK1;
+extern HostRegister<uint8_t> PCMSK2;
+extern HostRegister<uint8_t> UBRR0H;
+extern HostRegister<uint8_t> UBRR0L;
+extern HostRegister<uint8_t> UCSR0A;
+extern HostRegister<uint8_t> UCSR0B;
+extern HostRegister<uint8_t> UCSR0C;
+extern HostRegister<uint8_t> UDR0;
+extern HostRegister<uint8_t> SREG;
+
+// Timer1 bits
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define TOIE1 0
+#define TOV1 0
+
+// Timer2 bits (only the CTC mode is emulated)
+#define WGM21 1
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define OCIE2A 1
+
+// USART0 bits (only the receive interrupt is emulated, transmission is timed by HostSerial)
+#define RXCIE0 7
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+
+// pin change interrupt bits
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+
+#define digitalPinToPCICR(p) (&PCICR)
+#define digitalPinToPCICRbit(p) (((p) <= 7) ? 2 : (((p) <= 13) ? 0 : 1))
+#define digitalPinToPCMSK(p) (((p) <= 7) ? &PCMSK2 : (((p) <= 13) ? &PCMSK0 : &PCMSK1))
+#define digitalPinToPCMSKbit(p) (((p) <= 7) ? (p) : (((p) <= 13) ? ((p) - 8) : ((p) - 14)))
+
+// 32-bit compare timer of the STEP_TIMER_HOST backend - it counts the Timer1 ticks (prescaler 8) and restarts at the compare match.
+uint32_t hostTimer32Counter();
+void hostTimer32SetCompare(uint32_t value);
+// Enabling restarts the counter and enables the compare interrupt, disabling stops both.
+void hostTimer32Enable(bool isEnabled);
+bool hostTimer32IsEnabled();
+
+// Interrupt vectors are plain functions called by the simulator.
+#define ISR(vector) void vector()
+void TIMER1_OVF_vect();
+void TIMER32_COMPARE_vect();
+void TIMER2_COMPA_vect();
+void PCINT1_vect();
+// default receive vector buffers bytes for Serial.read the way the Arduino core does
+void USART_RX_vect();
+void USART_UDRE_vect();
+
+void noInterrupts();
+void interrupts();
+#define cli() noInterrupts()
+#define sei() interrupts()
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+class HostSerial {
+public:
+	HostSerial() {}
+	// the sketch may define its own port (as the Arduino core HardwareSerial) - the registers are the simulated ones
+	HostSerial(HostRegister<uint8_t>* ubrrh, HostRegister<uint8_t>* ubrrl, HostRegister<uint8_t>* ucsra, HostRegister<uint8_t>* ucsrb, HostRegister<uint8_t>* ucsrc, HostRegister<uint8_t>* udr) {}
+
+	// Starts the port - the receive interrupt is enabled as the Arduino core does.
+	void begin(unsigned long baud);
+	int available();
+	int read();
+	int peek();
+	void flush();
+
+	size_t write(uint8_t value);
+	size_t write(const uint8_t* buffer, size_t size);
+
+	size_t print(char value);
+	size_t print(const char* value);
+	size_t print(int value);
+	size_t print(unsigned int value);
+	size_t print(long value);
+	size_t print(unsigned long value);
+	size_t print(double value);
+
+	size_t println();
+	size_t println(char value);
+	size_t println(const char* value);
+	size_t println(int value);
+	size_t println(unsigned int value);
+	size_t println(long value);
+	size_t println(unsigned long value);
+	size_t println(double value);
+
+	// transmission is timed by the simulator, there is no data register interrupt
+	void _tx_udr_empty_irq() {}
+};
+
+typedef HostSerial HardwareSerial;
+
+extern HostSerial Serial;
+
+#endif
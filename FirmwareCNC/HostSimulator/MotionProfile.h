@@ -0,0 +1,133 @@
+/*
+Name:		MotionProfile.h
+Author:	m9ra
+
+Ideal step times of constant and acceleration instructions - the analytic profiles the plans approximate.
+Times are in timer ticks (the ones of the plan data) from the start of the plan.
+*/
+
+#ifndef _MotionProfile_h
+#define _MotionProfile_h
+
+#include <math.h>
+#include <vector>
+
+#include "PlanFrames.h"
+
+// Step of an axis in the ideal profile.
+struct IdealStep {
+	// Time of the step in timer ticks.
+	double time;
+	// Index of the instruction which makes the step.
+	int instruction;
+	// Determine whether the step is the last one of the axis in the instruction.
+	bool isLast;
+};
+
+// Time of the given step (from 1) of a constant axis from its segment start - the period remainder is spread evenly.
+inline double constantStepTime(const ConstantAxis& axis, int step) {
+	double period = axis.baseDeltaT + 1.0 * axis.periodNumerator / abs(axis.stepCount);
+	double offset = axis.offset > INT32_MIN ? axis.offset : 0;
+	return offset + step * period;
+}
+
+// Time of the given step (from 1) of an acceleration axis from its segment start.
+// ControllerCNC plans deltaT = f / sqrt(2 * n * a) at ramp n, so the step at n comes at 2 * deltaT * sqrt(n * n0) from the standstill
+// (n0 is the n of the initial deltaT, zero n starts from the standstill with t = initialDeltaT * sqrt(n)). Deceleration mirrors it.
+inline double accelerationStepTime(const AccelerationAxis& axis, int step) {
+	double stepCount = abs(axis.stepCount);
+	double baseTime = step * (axis.baseDelta + abs(axis.baseRemainder) / stepCount);
+	if (axis.n == 0)
+		return axis.initialDeltaT * sqrt((double)step) + baseTime;
+
+	double n = abs(axis.n);
+	double standstillTime = 2.0 * axis.initialDeltaT * n;
+	if (axis.n > 0)
+		return standstillTime * (sqrt((n + step) / n) - 1) + baseTime;
+
+	return standstillTime * (1 - sqrt((n - step) / n)) + baseTime;
+}
+
+// Ratio gamma(x + a) / gamma(x + b) - products of the ramp recurrence factors telescope into it.
+inline double gammaRatio(double x, double a, double b) {
+	return exp(lgamma(x + a) - lgamma(x + b));
+}
+
+// Step period (from 0) of the firmware ramp recurrence without the base delta. The recurrence c_k = c_(k-1) * (4m - 1) / (4m + 1)
+// at m = n + k gives c_k = c_0 * gamma(n + k + 3/4) * gamma(n + 5/4) / (gamma(n + 3/4) * gamma(n + k + 5/4)), so deltaT follows
+// 1 / sqrt(n + k + 1/2) rather than 1 / sqrt(n + k). Zero n continues from 676/1000 of the initial deltaT (the c0 error compensation)
+// after the first step. Deceleration multiplies by (4m + 3) / (4m + 1) at m = n - k.
+inline double recurrenceStepPeriod(const AccelerationAxis& axis, int k) {
+	double n = abs(axis.n);
+	if (k == 0)
+		return axis.initialDeltaT;
+	if (axis.n == 0)
+		return axis.initialDeltaT * 676.0 / 1000 * gammaRatio(k, 0.75, 1.25) * gammaRatio(0, 1.25, 0.75);
+	if (axis.n > 0)
+		return axis.initialDeltaT * gammaRatio(n + k, 0.75, 1.25) * gammaRatio(n, 1.25, 0.75);
+	return axis.initialDeltaT * gammaRatio(n, 0.75, 0.25) * gammaRatio(n - k, 0.25, 0.75);
+}
+
+// Time of the given step (from 1) of an acceleration axis in the model of the firmware recurrence - the sum of its periods in real
+// numbers. It is not a reference of the profile, it separates the integer arithmetic of the firmware from the recurrence error.
+inline double recurrenceStepTime(const AccelerationAxis& axis, int step) {
+	double stepCount = abs(axis.stepCount);
+	double time = step * (axis.baseDelta + abs(axis.baseRemainder) / stepCount);
+	for (int k = 0; k < step; ++k)
+		time += recurrenceStepPeriod(axis, k);
+	return time;
+}
+
+// Time of the given step (from 1) of the axis in the instruction from its segment start (ramps follow the recurrence model optionally).
+inline double instructionStepTime(const PlanInstruction& instruction, int axis, int step, bool isRecurrence) {
+	if (instruction.kind == 'C')
+		return constantStepTime(instruction.constant[axis], step);
+	if (isRecurrence)
+		return recurrenceStepTime(instruction.acceleration[axis], step);
+	return accelerationStepTime(instruction.acceleration[axis], step);
+}
+
+// Determine whether the axis waits for the end of the previous instruction (SegmentPlan activation boundary).
+inline bool isActivationBoundary(const PlanInstruction& instruction, int axis) {
+	if (instructionSteps(instruction, axis) == 0)
+		return true;
+	return instruction.kind == 'C' && instruction.constant[axis].offset > INT32_MIN;
+}
+
+// Ideal steps of constant and acceleration instructions for every axis (ramps follow the recurrence model optionally). Axes continue
+// with the next instruction as soon as they finish the current one (at most one instruction ahead) - activation boundaries wait for the instruction end.
+inline void idealSteps(const std::vector<PlanInstruction>& plan, std::vector<IdealStep> steps[PLAN_AXIS_COUNT], bool isRecurrence = false) {
+	double axisEnds[PLAN_AXIS_COUNT] = { 0 };
+	double instructionEnd = 0;
+	double previousInstructionEnd = 0;
+	for (size_t i = 0; i < plan.size(); ++i) {
+		const PlanInstruction& instruction = plan[i];
+		double end = instructionEnd;
+		double starts[PLAN_AXIS_COUNT];
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+			bool waits = i == 0 || isActivationBoundary(instruction, axis) || isActivationBoundary(plan[i - 1], axis);
+			starts[axis] = waits ? instructionEnd : max(axisEnds[axis], previousInstructionEnd);
+
+			int stepCount = abs(instructionSteps(instruction, axis));
+			for (int step = 1; step <= stepCount; ++step) {
+				IdealStep idealStep;
+				idealStep.time = starts[axis] + instructionStepTime(instruction, axis, step, isRecurrence);
+				idealStep.instruction = (int)i;
+				idealStep.isLast = step == stepCount;
+				steps[axis].push_back(idealStep);
+			}
+			axisEnds[axis] = stepCount > 0 ? steps[axis].back().time : starts[axis];
+			end = max(end, axisEnds[axis]);
+		}
+
+		previousInstructionEnd = instructionEnd;
+		instructionEnd = end;
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+			if (instructionSteps(instruction, axis) == 0)
+				//the axis without steps waits for the instruction end
+				axisEnds[axis] = instructionEnd;
+		}
+	}
+}
+
+#endif
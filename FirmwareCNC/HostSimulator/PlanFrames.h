@@ -0,0 +1,311 @@
+/*
+Name:		PlanFrames.h
+Author:	m9ra
+
+Encoding of plan instructions the same way ControllerCNC sends them.
+*/
+
+#ifndef _PlanFrames_h
+#define _PlanFrames_h
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "StepperControl.h"
+
+// Count of axes carried by a single plan instruction.
+#define PLAN_AXIS_COUNT 4
+
+// Size of legacy frames (INSTRUCTION_SIZE of FirmwareCNC).
+#define PLAN_FRAME_SIZE 59
+
+struct ConstantAxis {
+	int16_t stepCount;
+	int32_t baseDeltaT;
+	uint16_t periodNumerator;
+	int32_t offset;
+};
+
+struct AccelerationAxis {
+	int16_t stepCount;
+	int32_t initialDeltaT;
+	int32_t n;
+	int16_t baseDelta;
+	int16_t baseRemainder;
+};
+
+// Move with ramps planned by the device (values of the axis with most steps).
+struct MoveAxes {
+	int16_t stepCount[PLAN_AXIS_COUNT];
+	int32_t cruiseDeltaT;
+	int32_t acceleration;
+	int32_t rampJerk;
+};
+
+// Axis following a quadrant arc (coordinate is relative to the center).
+struct ArcAxis {
+	int16_t stepCount;
+	int16_t coordinate;
+	uint16_t radius;
+	int32_t deltaT;
+};
+
+// Axis following a cubic spline (slopes are the end speeds relative to the mean speed, see SplineSegment).
+struct SplineAxis {
+	int16_t stepCount;
+	int32_t duration;
+	uint16_t startSlope;
+	uint16_t endSlope;
+	byte intervalShift;
+};
+
+struct PlanInstruction {
+	// 'C' for constant plans, 'A' for acceleration plans, 'R' for moves, 'O' for arcs, 'S' for splines
+	char kind;
+	ConstantAxis constant[PLAN_AXIS_COUNT];
+	AccelerationAxis acceleration[PLAN_AXIS_COUNT];
+	MoveAxes move;
+	ArcAxis arc[PLAN_AXIS_COUNT];
+	SplineAxis spline[PLAN_AXIS_COUNT];
+};
+
+// Steps of the given axis.
+inline int16_t instructionSteps(const PlanInstruction& instruction, int axis) {
+	if (instruction.kind == 'C')
+		return instruction.constant[axis].stepCount;
+	if (instruction.kind == 'R')
+		return instruction.move.stepCount[axis];
+	if (instruction.kind == 'O')
+		return instruction.arc[axis].stepCount;
+	if (instruction.kind == 'S')
+		return instruction.spline[axis].stepCount;
+	return instruction.acceleration[axis].stepCount;
+}
+
+inline byte* writeInt16(byte* buffer, int16_t value) {
+	buffer[0] = (byte)(value >> 8);
+	buffer[1] = (byte)value;
+	return buffer + 2;
+}
+
+inline byte* writeInt32(byte* buffer, int32_t value) {
+	buffer[0] = (byte)(value >> 24);
+	buffer[1] = (byte)(value >> 16);
+	buffer[2] = (byte)(value >> 8);
+	buffer[3] = (byte)value;
+	return buffer + 4;
+}
+
+// Writes plan data (without the command byte) as expected by PlanScheduler4D::initFrom.
+inline byte* writePlanData(byte* buffer, const PlanInstruction& instruction) {
+	if (instruction.kind == 'R') {
+		for (int i = 0; i < PLAN_AXIS_COUNT; ++i)
+			buffer = writeInt16(buffer, instruction.move.stepCount[i]);
+		buffer = writeInt32(buffer, instruction.move.cruiseDeltaT);
+		buffer = writeInt32(buffer, instruction.move.acceleration);
+		return writeInt32(buffer, instruction.move.rampJerk);
+	}
+
+	for (int i = 0; i < PLAN_AXIS_COUNT; ++i) {
+		if (instruction.kind == 'C') {
+			const ConstantAxis& axis = instruction.constant[i];
+			buffer = writeInt16(buffer, axis.stepCount);
+			buffer = writeInt32(buffer, axis.baseDeltaT);
+			buffer = writeInt16(buffer, (int16_t)axis.periodNumerator);
+			buffer = writeInt32(buffer, axis.offset);
+		}
+		else if (instruction.kind == 'O') {
+			const ArcAxis& axis = instruction.arc[i];
+			buffer = writeInt16(buffer, axis.stepCount);
+			buffer = writeInt16(buffer, axis.coordinate);
+			buffer = writeInt16(buffer, (int16_t)axis.radius);
+			buffer = writeInt32(buffer, axis.deltaT);
+		}
+		else if (instruction.kind == 'S') {
+			const SplineAxis& axis = instruction.spline[i];
+			buffer = writeInt16(buffer, axis.stepCount);
+			buffer = writeInt32(buffer, axis.duration);
+			buffer = writeInt16(buffer, (int16_t)axis.startSlope);
+			buffer = writeInt16(buffer, (int16_t)axis.endSlope);
+			*buffer++ = axis.intervalShift;
+		}
+		else {
+			const AccelerationAxis& axis = instruction.acceleration[i];
+			buffer = writeInt16(buffer, axis.stepCount);
+			buffer = writeInt32(buffer, axis.initialDeltaT);
+			buffer = writeInt32(buffer, axis.n);
+			buffer = writeInt16(buffer, axis.baseDelta);
+			buffer = writeInt16(buffer, axis.baseRemainder);
+		}
+	}
+	return buffer;
+}
+
+inline byte* writeUnsigned(byte* buffer, uint32_t value) {
+	while (value >= 0x80) {
+		*buffer++ = (byte)(value | 0x80);
+		value >>= 7;
+	}
+	*buffer++ = (byte)value;
+	return buffer;
+}
+
+inline byte* writeSigned(byte* buffer, int32_t value) {
+	//zigzag encoding (0, -1, 1, -2, ...)
+	return writeUnsigned(buffer, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+// Writes legacy frame (command, plan data and additive checksum) - returns frame size.
+inline size_t writeLegacyFrame(byte* frame, const PlanInstruction& instruction) {
+	memset(frame, 0, PLAN_FRAME_SIZE);
+	frame[0] = instruction.kind;
+	writePlanData(frame + 1, instruction);
+
+	uint16_t checksum = 0;
+	for (int i = 0; i < PLAN_FRAME_SIZE - 2; ++i)
+		checksum += frame[i];
+	writeInt16(frame + PLAN_FRAME_SIZE - 2, (int16_t)checksum);
+	return PLAN_FRAME_SIZE;
+}
+
+// Writes compact frame (length, command, axis flags, varint axis data and CRC-16) - returns frame size,
+// zero when the frame would not fit the legacy frame size (legacy frame has to be sent instead).
+// The delta references are updated the same way SegmentScheduler does.
+inline size_t writeCompactFrame(byte* frame, const PlanInstruction& instruction, int32_t deltaReferences[PLAN_AXIS_COUNT]) {
+	if (instruction.kind != 'A' && instruction.kind != 'C')
+		//moves, arcs and splines are sent in legacy frames only
+		return 0;
+
+	//axis data are at most 3 + 4 * 5 bytes long
+	byte payload[2 + PLAN_AXIS_COUNT * 23];
+	int32_t references[PLAN_AXIS_COUNT];
+	memcpy(references, deltaReferences, sizeof(references));
+
+	byte axisFlags = 0;
+	byte* data = payload + 2;
+	for (int i = 0; i < PLAN_AXIS_COUNT; ++i) {
+		if (instruction.kind == 'C') {
+			const ConstantAxis& axis = instruction.constant[i];
+			if (axis.stepCount == 0)
+				continue;
+
+			axisFlags |= COMPACT_AXIS_PRESENT << i;
+			data = writeSigned(data, axis.stepCount);
+			data = writeSigned(data, axis.baseDeltaT - references[i]);
+			data = writeUnsigned(data, axis.periodNumerator);
+			if (axis.offset > INT32_MIN) {
+				axisFlags |= COMPACT_AXIS_OFFSET << i;
+				data = writeSigned(data, axis.offset);
+			}
+			references[i] = axis.baseDeltaT;
+		}
+		else {
+			const AccelerationAxis& axis = instruction.acceleration[i];
+			if (axis.stepCount == 0)
+				continue;
+
+			axisFlags |= COMPACT_AXIS_PRESENT << i;
+			data = writeSigned(data, axis.stepCount);
+			data = writeSigned(data, axis.initialDeltaT - references[i]);
+			data = writeSigned(data, axis.n);
+			data = writeSigned(data, axis.baseDelta);
+			data = writeSigned(data, axis.baseRemainder);
+			references[i] = axis.initialDeltaT;
+		}
+	}
+	payload[0] = instruction.kind;
+	payload[1] = axisFlags;
+
+	size_t payloadSize = data - payload;
+	size_t frameSize = payloadSize + COMPACT_FRAME_OVERHEAD;
+	if (frameSize > PLAN_FRAME_SIZE)
+		return 0;
+
+	frame[0] = COMPACT_FRAME_FLAG | (byte)payloadSize;
+	memcpy(frame + 1, payload, payloadSize);
+
+	uint16_t crc = 0xFFFF;
+	for (size_t i = 0; i < frameSize - 2; ++i)
+		crc = crc16Update(crc, frame[i]);
+	writeInt16(frame + frameSize - 2, (int16_t)crc);
+
+	memcpy(deltaReferences, references, sizeof(references));
+	return frameSize;
+}
+
+inline PlanInstruction constantInstruction(int16_t steps1, int32_t deltaT1, int16_t steps2, int32_t deltaT2, int16_t steps3, int32_t deltaT3, int16_t steps4, int32_t deltaT4) {
+	PlanInstruction instruction = PlanInstruction();
+	instruction.kind = 'C';
+	int16_t steps[] = { steps1, steps2, steps3, steps4 };
+	int32_t deltas[] = { deltaT1, deltaT2, deltaT3, deltaT4 };
+	for (int i = 0; i < PLAN_AXIS_COUNT; ++i) {
+		instruction.constant[i].stepCount = steps[i];
+		instruction.constant[i].baseDeltaT = deltas[i];
+		instruction.constant[i].periodNumerator = 0;
+		instruction.constant[i].offset = INT32_MIN;
+	}
+	return instruction;
+}
+
+inline PlanInstruction accelerationInstruction(int16_t stepCount, int32_t initialDeltaT, int32_t n) {
+	PlanInstruction instruction = PlanInstruction();
+	instruction.kind = 'A';
+	for (int i = 0; i < PLAN_AXIS_COUNT; ++i) {
+		instruction.acceleration[i].stepCount = stepCount;
+		instruction.acceleration[i].initialDeltaT = initialDeltaT;
+		instruction.acceleration[i].n = n;
+	}
+	return instruction;
+}
+
+inline PlanInstruction moveInstruction(int16_t steps1, int16_t steps2, int16_t steps3, int16_t steps4, int32_t cruiseDeltaT, int32_t acceleration, int32_t rampJerk) {
+	PlanInstruction instruction = PlanInstruction();
+	instruction.kind = 'R';
+	int16_t steps[] = { steps1, steps2, steps3, steps4 };
+	for (int i = 0; i < PLAN_AXIS_COUNT; ++i)
+		instruction.move.stepCount[i] = steps[i];
+	instruction.move.cruiseDeltaT = cruiseDeltaT;
+	instruction.move.acceleration = acceleration;
+	instruction.move.rampJerk = rampJerk;
+	return instruction;
+}
+
+// Quadrant arc in the plane of axes 0 and 1 from the start point to the end point (relative to the center) - the other axes stay.
+inline PlanInstruction arcInstruction(int16_t startX, int16_t startY, int16_t endX, int16_t endY, uint16_t radius, int32_t deltaT) {
+	PlanInstruction instruction = PlanInstruction();
+	instruction.kind = 'O';
+	int16_t starts[] = { startX, startY };
+	int16_t ends[] = { endX, endY };
+	for (int i = 0; i < 2; ++i) {
+		instruction.arc[i].stepCount = ends[i] - starts[i];
+		instruction.arc[i].coordinate = starts[i];
+		instruction.arc[i].radius = radius;
+		instruction.arc[i].deltaT = deltaT;
+	}
+	return instruction;
+}
+
+// Cubic Bezier curve in the plane of axes 0 and 1 through the control points (relative to the start, the curve keeps the direction of each axis)
+// over the given duration - the other axes stay.
+inline PlanInstruction splineInstruction(const int16_t controls[3][2], int32_t duration, byte intervalShift) {
+	PlanInstruction instruction = PlanInstruction();
+	instruction.kind = 'S';
+	for (int i = 0; i < 2; ++i) {
+		SplineAxis& axis = instruction.spline[i];
+		axis.stepCount = controls[2][i];
+		axis.duration = duration;
+		axis.intervalShift = intervalShift;
+		if (axis.stepCount == 0)
+			continue;
+
+		//speeds at the ends of the Bezier curve are 3 * (P1 - P0) and 3 * (P3 - P2)
+		double startSlope = 3.0 * controls[0][i] / axis.stepCount;
+		double endSlope = 3.0 * (controls[2][i] - controls[1][i]) / axis.stepCount;
+		axis.startSlope = (uint16_t)(fmin(fmax(startSlope, 0), 3) * (1 << SPLINE_SLOPE_SHIFT) + 0.5);
+		axis.endSlope = (uint16_t)(fmin(fmax(endSlope, 0), 3) * (1 << SPLINE_SLOPE_SHIFT) + 0.5);
+	}
+	return instruction;
+}
+
+#endif
@@ -0,0 +1,40 @@
+#include "PulseTrace.h"
+
+const byte PulseTrace::clkMasks[SLOT_COUNT] = { SLOT0_CLK_MASK, SLOT1_CLK_MASK, SLOT2_CLK_MASK, SLOT3_CLK_MASK };
+const byte PulseTrace::dirMasks[SLOT_COUNT] = { SLOT0_DIR_MASK, SLOT1_DIR_MASK, SLOT2_DIR_MASK, SLOT3_DIR_MASK };
+
+byte PulseTrace::activation(const PortEvent & evt)
+{
+	return (evt.portB & B_SLOTS_MASK) | (evt.portD & D_SLOTS_MASK);
+}
+
+void PulseTrace::extractSteps(const std::vector<PortEvent>& events, std::vector<StepEvent>& steps)
+{
+	//clocks are idle HIGH
+	byte lastActivation = ACTIVATIONS_CLOCK_MASK;
+	for (size_t i = 0; i < events.size(); ++i) {
+		byte currentActivation = activation(events[i]);
+		byte fallingClocks = lastActivation & ~currentActivation & ACTIVATIONS_CLOCK_MASK;
+		lastActivation = currentActivation;
+		if (fallingClocks == 0)
+			continue;
+
+		for (byte slot = 0; slot < SLOT_COUNT; ++slot) {
+			if ((fallingClocks & clkMasks[slot]) == 0)
+				continue;
+
+			StepEvent step;
+			step.cycle = events[i].cycle;
+			step.slot = slot;
+			//direction LOW means positive step
+			step.direction = (currentActivation & dirMasks[slot]) ? -1 : 1;
+			steps.push_back(step);
+		}
+	}
+}
+
+void PulseTrace::write(FILE * output, const std::vector<PortEvent>& events)
+{
+	for (size_t i = 0; i < events.size(); ++i)
+		fprintf(output, "%llu %02x\n", (unsigned long long)events[i].cycle, activation(events[i]));
+}
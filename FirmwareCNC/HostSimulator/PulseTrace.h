@@ -0,0 +1,48 @@
+/*
+Name:		PulseTrace.h
+Author:	m9ra
+
+Decoding of the recorded port changes into per-slot steps.
+*/
+
+#ifndef _PulseTrace_h
+#define _PulseTrace_h
+
+#include <stdio.h>
+#include <vector>
+
+#include "Simulator.h"
+#include "StepperControl.h"
+
+// Count of stepper slots wired to the ports.
+#define SLOT_COUNT 4
+
+// Single step pulse decoded from the port changes.
+struct StepEvent {
+	// CPU cycle of the pulse start.
+	uint64_t cycle;
+	// Slot which made the step.
+	byte slot;
+	// +1 or -1 (the same convention as SLOT*_STEPS use).
+	int8_t direction;
+};
+
+class PulseTrace {
+public:
+	// Clock masks of the slots.
+	static const byte clkMasks[SLOT_COUNT];
+
+	// Direction masks of the slots.
+	static const byte dirMasks[SLOT_COUNT];
+
+	// Port state in the schedule activation layout (clock and direction bits of the slots).
+	static byte activation(const PortEvent& evt);
+
+	// Decodes steps (clock falling edges) from the port changes.
+	static void extractSteps(const std::vector<PortEvent>& events, std::vector<StepEvent>& steps);
+
+	// Writes the pulse stream as "cycle activation" lines.
+	static void write(FILE* output, const std::vector<PortEvent>& events);
+};
+
+#endif
@@ -0,0 +1,803 @@
+/*
+Name:		SessionReplay.cpp
+Author:	m9ra
+
+Runs the whole FirmwareCNC sketch (setup, loop, its receive interrupt and the protocol) on the simulated board
+against an emulated ControllerCNC link. Frames are generated (short segments along circles) or replayed from a capture
+of concatenated frames, the link runs at the given baud rate in the legacy ('Y' for each plan) or the credit mode.
+Reports sustained segments per second, underruns, overflow rejections and instruction boundary latency
+(from the instruction end in the step interrupt to the end of its report on the wire).
+The session can subscribe state pushes ('P' - by a period in ms or by a count of finished instructions),
+the check then compares each pushed snapshot with the positions of the instructions it counts.
+The homing session runs the homing ('H') against simulated home switches instead of the plans, state data ('D') are requested
+while it runs - the check follows the homing phases and compares the reported release steps with the steps made on the ports.
+Segments shorter than the link can bring make the session link bound - the check expects the credit link to stay saturated
+(the motion underruns then, but no frame may be rejected).
+
+usage: session_replay [--check] [--credit] [--compact] [--baud <rate>] [--segments <count>] [--segment-us <duration>] [--state-period <ms>] [--state-instructions <count>] [--homing] [--replay <file>] [--save <file>]
+*/
+
+#include <chrono>
+#include <deque>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "Simulator.h"
+#include "PlanFrames.h"
+#include "PulseTrace.h"
+
+// the sketch is built the way the Arduino builder does it (the Makefile generates its function prototypes)
+#include "FirmwareCNC_prototypes.h"
+#include "../FirmwareCNC/FirmwareCNC.ino"
+
+// slots in the order of plan axes (the same order FirmwareCNC uses)
+const byte AXIS_SLOTS[PLAN_AXIS_COUNT] = { 1, 0, 3, 2 };
+
+// baud rate of FirmwareCNC setup
+#define SESSION_BAUD 128000
+
+// plans ControllerCNC keeps unfinished in the legacy mode (DriverCNC.MaxIncompletePlanCount)
+#define LEGACY_MAX_INCOMPLETE_PLANS 7
+
+// simulated time the session may take besides the planned motion (setup plays the melody)
+#define SESSION_TIMEOUT_MARGIN (10ULL * Simulator::cpuFrequency)
+
+// a state push may be delayed by the main loop and by reports before it on the wire
+#define STATE_PUSH_TOLERANCE_US 2000
+
+// home switches of the homing session (in the order of plan axes) - a switch is pressed at its position and below it
+const uint8_t HOME_SWITCH_PINS[PLAN_AXIS_COUNT] = { A1, A2, A3, A4 };
+const int32_t HOME_SWITCH_POSITIONS[PLAN_AXIS_COUNT] = { -250, -130, -420, -60 };
+// steps above its position a pressed switch needs to be released
+#define HOME_SWITCH_HYSTERESIS 3
+
+// simulated time the homing session may take
+#define HOMING_TIMEOUT (10ULL * Simulator::cpuFrequency)
+
+// generated job - segments along circles, the speed does not depend on the segment duration
+#define DEFAULT_SEGMENT_COUNT 1000
+#define DEFAULT_SEGMENT_US 6000
+#define SEGMENTS_PER_CIRCLE 200
+// steps of the fastest axis in 6 ms
+#define SEGMENT_STEPS_PER_TICK (20.0 / 12000)
+
+// phases of the emulated controller
+#define LINK_WAITS_DEVICE 0
+#define LINK_AUTHENTICATES 1
+#define LINK_WAITS_CREDIT 2
+#define LINK_STREAMS 3
+
+// state pushed by the device ('P' report)
+struct StateSnapshot {
+	// cycle when the report was received
+	uint64_t cycle;
+	byte isHomeCalibrated;
+	uint32_t instructionCount;
+	// positions in the order of plan axes
+	int32_t positions[PLAN_AXIS_COUNT];
+};
+
+struct SessionFrame {
+	std::vector<byte> data;
+	// determine whether the frame carries a plan (it is acknowledged and reported when finished)
+	bool isPlan;
+};
+
+// frames sent to the device in the session
+std::vector<SessionFrame> frames;
+// indexes of the plan frames (the credit resync continues from the first plan which was not accepted)
+std::vector<size_t> planFrameIndexes;
+// determine whether plans are acknowledged by credit reports
+bool isCreditLink = false;
+// baud rate of the link in both directions
+uint32_t baudRate = SESSION_BAUD;
+
+byte linkPhase = LINK_WAITS_DEVICE;
+// index of the next frame to send
+size_t nextFrame = 0;
+// cycle when the last sent byte arrives to the device
+uint64_t linkFreeCycle = 0;
+uint64_t sentBytes = 0;
+
+// legacy mode - each plan waits for its 'Y' (a rejected plan is sent again)
+bool isAwaitingConfirmation = false;
+size_t awaitedFrame = 0;
+
+// plans sent (credit mode counts them from the last resync), accepted and free slots of the last credit report
+uint32_t sentPlans = 0;
+uint32_t acceptedPlans = 0;
+byte lastSequence = 0;
+byte freeSlots = 0;
+// plans are held after a lost one until the device resynchronizes by 'W'
+bool isResyncRequired = false;
+bool isResyncSent = false;
+uint64_t resyncArrivalCycle = 0;
+
+// reported finished plans
+uint32_t finishedPlans = 0;
+// instruction ends seen in the step interrupt counter (waiting for their reports)
+byte observedFinishedCount = 0;
+std::deque<uint64_t> instructionEnds;
+uint64_t firstEndCycle = 0;
+uint64_t lastEndCycle = 0;
+
+// state push subscription of the session (zeros do not subscribe) and the pushed snapshots
+uint16_t stateReportPeriod = 0;
+byte stateReportInstructions = 0;
+std::vector<StateSnapshot> stateSnapshots;
+
+// homing session - axis positions made by the steps on the ports move the home switches
+bool isHomingSession = false;
+int32_t axisPositions[PLAN_AXIS_COUNT] = { 0 };
+bool isSwitchPressed[PLAN_AXIS_COUNT] = { false };
+byte lastActivation = ACTIVATIONS_CLOCK_MASK;
+// steps made by the release phase (the homing reports them)
+uint32_t releaseSteps[PLAN_AXIS_COUNT] = { 0 };
+// phases in the order the homing went through them
+std::vector<byte> homingPhases;
+// homing phase when the state data came and their home calibration flag (state data are requested while the homing runs)
+bool isStateDataReceived = false;
+byte stateDataHomingPhase = HOMING_IDLE;
+byte stateDataHomeCalibration = 0;
+// text of the homing end ('|' release steps of the axes, 'H')
+std::string homingOutput;
+bool isHomingOutput = false;
+bool isHomingDone = false;
+uint32_t homingRejections = 0;
+
+// parsed device output (binary reports are collected until they are complete)
+size_t parsedBytes = 0;
+std::vector<byte> binaryReport;
+size_t binaryReportLength = 0;
+
+// session statistics
+uint32_t overflowRejections = 0;
+uint32_t frameErrors = 0;
+uint32_t missedStepReports = 0;
+uint32_t schedulerStarts = 0;
+uint64_t latencyTotal = 0;
+uint64_t latencyMax = 0;
+uint32_t latencyCount = 0;
+bool isSessionDone = false;
+
+// legacy size frame of a command (with its data)
+SessionFrame commandFrame(byte command, const byte* data = NULL, size_t size = 0) {
+	SessionFrame frame;
+	frame.data.assign(PLAN_FRAME_SIZE, 0);
+	frame.data[0] = command;
+	if (size > 0)
+		memcpy(&frame.data[1], data, size);
+
+	uint16_t checksum = 0;
+	for (int i = 0; i < PLAN_FRAME_SIZE - 2; ++i)
+		checksum += frame.data[i];
+	writeInt16(&frame.data[PLAN_FRAME_SIZE - 2], (int16_t)checksum);
+	frame.isPlan = false;
+	return frame;
+}
+
+// state push subscription - period in ms and count of instructions
+SessionFrame stateSubscriptionFrame(uint16_t period, byte instructionCount) {
+	byte data[] = { INT16_TO_BYTES(period), instructionCount };
+	return commandFrame('P', data, sizeof(data));
+}
+
+int32_t readInt32(const byte* buffer) {
+	return (int32_t)((uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16 | (uint32_t)buffer[2] << 8 | buffer[3]);
+}
+
+bool isPlanFrame(const std::vector<byte>& data) {
+	if (data[0] & COMPACT_FRAME_FLAG)
+		//compact frames carry plans only
+		return true;
+
+	return data[0] == 'A' || data[0] == 'C' || data[0] == 'R' || data[0] == ARC_KIND || data[0] == SPLINE_KIND;
+}
+
+// short segments along circles (the way ControllerCNC interpolates curves)
+std::vector<PlanInstruction> segmentPlan(int segmentCount, int32_t segmentUs) {
+	std::vector<PlanInstruction> plan;
+	int32_t duration = (int32_t)((int64_t)segmentUs * (TIMER_FREQUENCY / TIMESCALE));
+	for (int i = 0; i < segmentCount; ++i) {
+		double angle = 2 * M_PI * i / SEGMENTS_PER_CIRCLE;
+		double speeds[PLAN_AXIS_COUNT] = { sin(angle), cos(angle), sin(2 * angle), cos(3 * angle) };
+
+		PlanInstruction instruction = constantInstruction(0, 0, 0, 0, 0, 0, 0, 0);
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+			int16_t stepCount = (int16_t)lround(SEGMENT_STEPS_PER_TICK * duration * speeds[axis]);
+			if (stepCount == 0)
+				continue;
+
+			//all axes of the segment take the same time
+			ConstantAxis& constant = instruction.constant[axis];
+			constant.stepCount = stepCount;
+			constant.baseDeltaT = duration / abs(stepCount);
+			constant.periodNumerator = duration % abs(stepCount);
+		}
+		plan.push_back(instruction);
+	}
+	return plan;
+}
+
+void addPlanFrames(const std::vector<PlanInstruction>& plan, bool isCompact) {
+	int32_t references[PLAN_AXIS_COUNT] = { 0 };
+	for (size_t i = 0; i < plan.size(); ++i) {
+		byte data[PLAN_FRAME_SIZE];
+		size_t size = isCompact ? writeCompactFrame(data, plan[i], references) : 0;
+		if (size == 0)
+			size = writeLegacyFrame(data, plan[i]);
+
+		SessionFrame frame;
+		frame.data.assign(data, data + size);
+		frame.isPlan = true;
+		frames.push_back(frame);
+	}
+}
+
+// reads concatenated frames (compact frames carry their length in the first byte)
+bool loadFrames(const char* path) {
+	FILE* input = fopen(path, "rb");
+	if (input == NULL)
+		return false;
+
+	std::vector<byte> stream;
+	byte buffer[4096];
+	size_t size;
+	while ((size = fread(buffer, 1, sizeof(buffer), input)) > 0)
+		stream.insert(stream.end(), buffer, buffer + size);
+	fclose(input);
+
+	size_t offset = 0;
+	while (offset < stream.size()) {
+		byte first = stream[offset];
+		size_t frameSize = first & COMPACT_FRAME_FLAG ? (first & ~COMPACT_FRAME_FLAG) + COMPACT_FRAME_OVERHEAD : PLAN_FRAME_SIZE;
+		if (offset + frameSize > stream.size())
+			//truncated capture
+			return false;
+
+		SessionFrame frame;
+		frame.data.assign(stream.begin() + offset, stream.begin() + offset + frameSize);
+		frame.isPlan = isPlanFrame(frame.data);
+		frames.push_back(frame);
+		offset += frameSize;
+	}
+	return true;
+}
+
+bool saveFrames(const char* path) {
+	FILE* output = fopen(path, "wb");
+	if (output == NULL)
+		return false;
+
+	for (size_t i = 0; i < frames.size(); ++i)
+		fwrite(&frames[i].data[0], 1, frames[i].data.size(), output);
+	fclose(output);
+	return true;
+}
+
+void sendBytes(const byte* data, size_t size) {
+	Simulator::feedSerial(data, size, baudRate);
+	if (linkFreeCycle < Simulator::now())
+		linkFreeCycle = Simulator::now();
+	linkFreeCycle += size * (10ULL * Simulator::cpuFrequency / baudRate);
+	sentBytes += size;
+}
+
+void sendFrame(const SessionFrame& frame) {
+	sendBytes(&frame.data[0], frame.data.size());
+}
+
+// reported instructions are matched with their ends in the step interrupt
+void reportFinished(int count, uint64_t reportCycle) {
+	for (int i = 0; i < count; ++i) {
+		++finishedPlans;
+		if (instructionEnds.empty())
+			//the end was not observed (the report cannot come earlier)
+			continue;
+
+		uint64_t latency = reportCycle - instructionEnds.front();
+		instructionEnds.pop_front();
+		latencyTotal += latency;
+		latencyMax = max(latencyMax, latency);
+		++latencyCount;
+	}
+}
+
+// a plan was lost - legacy link sends it again, credit link resynchronizes
+void rejectPlan() {
+	if (isCreditLink) {
+		isResyncRequired = true;
+		return;
+	}
+
+	if (isAwaitingConfirmation) {
+		isAwaitingConfirmation = false;
+		nextFrame = awaitedFrame;
+		--sentPlans;
+	}
+}
+
+void processCreditReport(const std::vector<byte>& report, uint64_t reportCycle) {
+	acceptedPlans += (byte)(report[1] - lastSequence);
+	lastSequence = report[1];
+	freeSlots = report[2];
+	reportFinished(report[3], reportCycle);
+
+	if (linkPhase == LINK_WAITS_CREDIT)
+		linkPhase = LINK_STREAMS;
+
+	if (isResyncSent && reportCycle > resyncArrivalCycle + (10ULL * Simulator::cpuFrequency / baudRate)) {
+		//the report was sent after 'W' arrived - plans after the accepted ones were dropped
+		isResyncRequired = false;
+		isResyncSent = false;
+		sentPlans = acceptedPlans;
+		nextFrame = acceptedPlans < planFrameIndexes.size() ? planFrameIndexes[acceptedPlans] : frames.size();
+	}
+}
+
+// positions of the 'P' report come in the order of 'D' data (slots 1, 0, 3, 2 - the order of plan axes)
+void processStateReport(const std::vector<byte>& report, uint64_t reportCycle) {
+	StateSnapshot snapshot;
+	snapshot.cycle = reportCycle;
+	snapshot.isHomeCalibrated = report[1];
+	snapshot.instructionCount = (uint32_t)readInt32(&report[2]);
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis)
+		snapshot.positions[axis] = readInt32(&report[6 + 4 * axis]);
+	stateSnapshots.push_back(snapshot);
+}
+
+// 'D' report requested during the homing
+void processStateData(const std::vector<byte>& report) {
+	isStateDataReceived = true;
+	stateDataHomingPhase = HOMING_PHASE;
+	stateDataHomeCalibration = report[1];
+}
+
+// length of the binary report starting with the given byte (zero for single byte reports)
+size_t binaryReportSize(byte header) {
+	switch (header) {
+	case 'K':
+		return 4;
+	case 'D':
+		return 2 + 4 * 4;
+	case 'P':
+		return 2 + 4 + 4 * 4;
+	case 'T':
+		return 5 + 2 * ISR_LATENESS_BUCKET_COUNT + 4 * STEPPER_COUNT;
+	default:
+		return 0;
+	}
+}
+
+void parseOutput(byte value, uint64_t cycle) {
+	if (binaryReportLength > 0) {
+		binaryReport.push_back(value);
+		if (binaryReport.size() < binaryReportLength)
+			return;
+
+		if (binaryReport[0] == 'K')
+			processCreditReport(binaryReport, cycle);
+		else if (binaryReport[0] == 'P')
+			processStateReport(binaryReport, cycle);
+		else if (binaryReport[0] == 'D')
+			processStateData(binaryReport);
+		binaryReportLength = 0;
+		return;
+	}
+
+	if (isHomingOutput) {
+		homingOutput += (char)value;
+		if (value == 'H') {
+			isHomingOutput = false;
+			isHomingDone = true;
+		}
+		return;
+	}
+
+	if (linkPhase != LINK_WAITS_DEVICE && linkPhase != LINK_AUTHENTICATES) {
+		binaryReportLength = binaryReportSize(value);
+		if (binaryReportLength > 0) {
+			binaryReport.assign(1, value);
+			return;
+		}
+	}
+
+	switch (value) {
+	case 'a':
+		if (linkPhase == LINK_WAITS_DEVICE) {
+			sendBytes((const byte*)"$%!", 3);
+			linkPhase = LINK_AUTHENTICATES;
+		}
+		return;
+	case 'Y':
+		if (linkPhase == LINK_AUTHENTICATES) {
+			if (isCreditLink) {
+				sendFrame(commandFrame('W'));
+				linkPhase = LINK_WAITS_CREDIT;
+			}
+			else {
+				linkPhase = LINK_STREAMS;
+			}
+			return;
+		}
+		isAwaitingConfirmation = false;
+		return;
+	case 'F':
+		reportFinished(1, cycle);
+		return;
+	case 'O':
+		++overflowRejections;
+		rejectPlan();
+		return;
+	case 'E':
+	case 'C':
+		++frameErrors;
+		rejectPlan();
+		return;
+	case 'M':
+		++missedStepReports;
+		return;
+	case 'S':
+		++schedulerStarts;
+		return;
+	case '|':
+		isHomingOutput = true;
+		homingOutput.assign(1, (char)value);
+		return;
+	case 'Q':
+		++homingRejections;
+		isHomingDone = true;
+		return;
+	}
+}
+
+// sends next frames as the controller flow control allows it
+void pumpFrames() {
+	if (linkPhase != LINK_STREAMS)
+		return;
+
+	if (isCreditLink && isResyncRequired) {
+		if (!isResyncSent) {
+			sendFrame(commandFrame('W'));
+			resyncArrivalCycle = linkFreeCycle;
+			isResyncSent = true;
+		}
+		return;
+	}
+
+	while (nextFrame < frames.size()) {
+		const SessionFrame& frame = frames[nextFrame];
+		if (isCreditLink) {
+			if (frame.isPlan && sentPlans - acceptedPlans >= freeSlots)
+				return;
+		}
+		else {
+			if (isAwaitingConfirmation)
+				return;
+
+			//DriverCNC waits when there are too many unfinished plans
+			if (frame.isPlan && sentPlans - finishedPlans >= LEGACY_MAX_INCOMPLETE_PLANS)
+				return;
+		}
+
+		if (frame.isPlan) {
+			++sentPlans;
+			isAwaitingConfirmation = !isCreditLink;
+			awaitedFrame = nextFrame;
+		}
+		sendFrame(frame);
+		++nextFrame;
+	}
+}
+
+// steps on the ports move the axes, the switches are pressed (LOW) as the axes come to them
+void moveHomeSwitches() {
+	std::vector<PortEvent>& events = Simulator::portEvents();
+	for (size_t i = 0; i < events.size(); ++i) {
+		byte activation = PulseTrace::activation(events[i]);
+		byte fallingClocks = lastActivation & ~activation & ACTIVATIONS_CLOCK_MASK;
+		lastActivation = activation;
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+			byte slot = AXIS_SLOTS[axis];
+			if ((fallingClocks & PulseTrace::clkMasks[slot]) == 0)
+				continue;
+
+			//direction LOW means positive step
+			axisPositions[axis] += activation & PulseTrace::dirMasks[slot] ? -1 : 1;
+			if (HOMING_PHASE == HOMING_RELEASE)
+				++releaseSteps[axis];
+		}
+	}
+	events.clear();
+
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+		if (axisPositions[axis] <= HOME_SWITCH_POSITIONS[axis])
+			isSwitchPressed[axis] = true;
+		else if (axisPositions[axis] > HOME_SWITCH_POSITIONS[axis] + HOME_SWITCH_HYSTERESIS)
+			isSwitchPressed[axis] = false;
+		Simulator::setInput(HOME_SWITCH_PINS[axis], isSwitchPressed[axis] ? LOW : HIGH);
+	}
+
+	if (homingPhases.empty() ? HOMING_PHASE != HOMING_IDLE : homingPhases.back() != HOMING_PHASE)
+		homingPhases.push_back(HOMING_PHASE);
+}
+
+// controller side of the link - called by the simulator whenever the main context advances
+void pollSession() {
+	uint64_t now = Simulator::now();
+	for (byte count = FINISHED_INSTRUCTION_COUNT; observedFinishedCount != count; ++observedFinishedCount) {
+		if (firstEndCycle == 0)
+			firstEndCycle = now;
+		lastEndCycle = now;
+		instructionEnds.push_back(now);
+	}
+
+	std::string& output = Simulator::serialOutput();
+	std::vector<uint64_t>& outputCycles = Simulator::serialOutputCycles();
+	while (parsedBytes < output.size() && outputCycles[parsedBytes] <= now) {
+		parseOutput((byte)output[parsedBytes], outputCycles[parsedBytes]);
+		++parsedBytes;
+	}
+
+	if (isHomingSession)
+		moveHomeSwitches();
+
+	pumpFrames();
+
+	if (nextFrame == frames.size() && finishedPlans == planFrameIndexes.size() && linkPhase == LINK_STREAMS && (!isHomingSession || isHomingDone)) {
+		isSessionDone = true;
+		throw SimulationDeadline{ now };
+	}
+}
+
+// runs the sketch until all plans are reported finished (or the timeout passes)
+void runSession(uint64_t timeoutCycles) {
+	Simulator::reset();
+	Simulator::recordPorts = false;
+	for (size_t i = 0; i < frames.size(); ++i) {
+		if (frames[i].isPlan)
+			planFrameIndexes.push_back(i);
+	}
+
+	setup();
+	Serial.begin(baudRate);
+	//the homing session follows the steps on the ports (after the melody of setup)
+	Simulator::recordPorts = isHomingSession;
+	Simulator::setDeadline(Simulator::now() + timeoutCycles);
+	Simulator::setHostPoll(pollSession);
+	try {
+		loop();
+	}
+	catch (SimulationDeadline&) {
+	}
+	Simulator::setHostPoll(NULL);
+}
+
+int failureCount = 0;
+
+void expect(bool condition, const char* description) {
+	printf("\t[%s] %s\n", condition ? "OK" : "FAIL", description);
+	if (!condition)
+		++failureCount;
+}
+
+// homing has to go through its phases, answer state data meanwhile and report the steps which released the switches
+void checkHoming() {
+	const byte expectedPhases[] = { HOMING_APPROACH, HOMING_BACK_OFF, HOMING_SLOW_APPROACH, HOMING_RELEASE, HOMING_IDLE };
+	bool isInOrder = homingRejections == 0 && homingPhases.size() == sizeof(expectedPhases) && memcmp(&homingPhases[0], expectedPhases, sizeof(expectedPhases)) == 0;
+	expect(isInOrder, "homing phases go in order");
+	expect(isStateDataReceived && stateDataHomingPhase != HOMING_IDLE && stateDataHomeCalibration == 0, "state data are answered while the homing runs");
+
+	std::string expectedOutput = "|";
+	for (int axis = 0; axis < STEPPER_COUNT; ++axis) {
+		char steps[16];
+		snprintf(steps, sizeof(steps), axis > 0 ? ",%u" : "%u", releaseSteps[axis]);
+		expectedOutput += steps;
+	}
+	expectedOutput += "\r\nH";
+	expect(homingOutput == expectedOutput && IS_HOME_CALIBRATED, "homing reports the release steps");
+
+	//home is where the switches are released (the slow approach stops on the switch position)
+	bool isReleased = true;
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis)
+		isReleased &= releaseSteps[axis] == HOME_SWITCH_HYSTERESIS + 1 && axisPositions[axis] == HOME_SWITCH_POSITIONS[axis] + HOME_SWITCH_HYSTERESIS + 1;
+	expect(isReleased, "axes stop where their switches are released");
+}
+
+// pushed snapshots have to match the positions of the instructions they count and come as subscribed
+void checkStateSnapshots(const std::vector<PlanInstruction>& plan) {
+	//the subscription is answered before any plan finishes
+	bool isConsistent = !stateSnapshots.empty() && stateSnapshots[0].instructionCount == 0;
+	int32_t positions[PLAN_AXIS_COUNT] = { 0 };
+	size_t countedInstructions = 0;
+	for (size_t i = 0; i < stateSnapshots.size() && isConsistent; ++i) {
+		const StateSnapshot& snapshot = stateSnapshots[i];
+		//the home flag is a single byte (the session does not calibrate home)
+		if (snapshot.instructionCount < countedInstructions || snapshot.instructionCount > plan.size() || snapshot.isHomeCalibrated != 0) {
+			isConsistent = false;
+			continue;
+		}
+
+		for (; countedInstructions < snapshot.instructionCount; ++countedInstructions) {
+			for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis)
+				positions[axis] += instructionSteps(plan[countedInstructions], axis);
+		}
+		isConsistent = memcmp(positions, snapshot.positions, sizeof(positions)) == 0;
+	}
+	expect(isConsistent, "state snapshots match positions of the counted instructions");
+
+	if (stateSnapshots.size() < 2) {
+		expect(false, "state is pushed");
+		return;
+	}
+
+	uint64_t periodCycles = (uint64_t)stateReportPeriod * (Simulator::cpuFrequency / 1000);
+	uint64_t pushTolerance = STATE_PUSH_TOLERANCE_US * (Simulator::cpuFrequency / 1000000);
+	bool isPushedInTime = true;
+	for (size_t i = 1; i < stateSnapshots.size(); ++i) {
+		const StateSnapshot& previous = stateSnapshots[i - 1];
+		const StateSnapshot& snapshot = stateSnapshots[i];
+		if (stateReportPeriod > 0) {
+			uint64_t interval = snapshot.cycle - previous.cycle;
+			isPushedInTime &= interval + pushTolerance >= periodCycles && interval <= periodCycles + pushTolerance;
+		}
+		else {
+			//the main loop commits finished instructions much more often than they come
+			isPushedInTime &= snapshot.instructionCount - previous.instructionCount == stateReportInstructions;
+		}
+	}
+
+	if (stateReportPeriod > 0) {
+		expect(isPushedInTime, "state is pushed each period");
+		uint64_t unreportedCycles = lastEndCycle - stateSnapshots.back().cycle;
+		expect(lastEndCycle < stateSnapshots.back().cycle || unreportedCycles <= periodCycles + pushTolerance, "no period passes without a push");
+	}
+	else {
+		expect(isPushedInTime, "state is pushed after the subscribed count of instructions");
+		//the last push can be still on the wire when the session ends
+		uint32_t pushCount = (uint32_t)stateSnapshots.size() - 1;
+		uint32_t expectedPushCount = finishedPlans / stateReportInstructions;
+		expect(pushCount == expectedPushCount || pushCount + 1 == expectedPushCount, "count of pushed snapshots");
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bool isCheck = false;
+	bool isCompact = false;
+	int segmentCount = DEFAULT_SEGMENT_COUNT;
+	int32_t segmentUs = DEFAULT_SEGMENT_US;
+	const char* replayPath = NULL;
+	const char* savePath = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--check") == 0)
+			isCheck = true;
+		else if (strcmp(argv[i], "--credit") == 0)
+			isCreditLink = true;
+		else if (strcmp(argv[i], "--compact") == 0)
+			isCompact = true;
+		else if (strcmp(argv[i], "--baud") == 0 && i + 1 < argc)
+			baudRate = (uint32_t)atol(argv[++i]);
+		else if (strcmp(argv[i], "--segments") == 0 && i + 1 < argc)
+			segmentCount = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--segment-us") == 0 && i + 1 < argc)
+			segmentUs = atol(argv[++i]);
+		else if (strcmp(argv[i], "--state-period") == 0 && i + 1 < argc)
+			stateReportPeriod = (uint16_t)atoi(argv[++i]);
+		else if (strcmp(argv[i], "--state-instructions") == 0 && i + 1 < argc)
+			stateReportInstructions = (byte)atoi(argv[++i]);
+		else if (strcmp(argv[i], "--homing") == 0)
+			isHomingSession = true;
+		else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+			replayPath = argv[++i];
+		else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+			savePath = argv[++i];
+		else {
+			printf("usage: %s [--check] [--credit] [--compact] [--baud <rate>] [--segments <count>] [--segment-us <duration>] [--state-period <ms>] [--state-instructions <count>] [--homing] [--replay <file>] [--save <file>]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (baudRate == 0 || segmentCount <= 0 || segmentUs <= 0 || (isCheck && replayPath != NULL) || (isHomingSession && replayPath != NULL)) {
+		printf("invalid options\n");
+		return 2;
+	}
+
+	std::vector<PlanInstruction> plan;
+	if (isHomingSession) {
+		//state data are requested while the homing runs
+		frames.push_back(commandFrame('H'));
+		frames.push_back(commandFrame('D'));
+	}
+	else if (replayPath != NULL) {
+		if (!loadFrames(replayPath)) {
+			printf("cannot read frames from %s\n", replayPath);
+			return 2;
+		}
+	}
+	else {
+		plan = segmentPlan(segmentCount, segmentUs);
+		addPlanFrames(plan, isCompact);
+	}
+
+	bool isStateSubscribed = stateReportPeriod > 0 || stateReportInstructions > 0;
+	if (isStateSubscribed)
+		//the subscription goes before the plans (it is answered by the first snapshot)
+		frames.insert(frames.begin(), stateSubscriptionFrame(stateReportPeriod, stateReportInstructions));
+
+	if (savePath != NULL && !saveFrames(savePath)) {
+		printf("cannot write frames to %s\n", savePath);
+		return 2;
+	}
+
+	uint64_t frameBytes = 0;
+	for (size_t i = 0; i < frames.size(); ++i)
+		frameBytes += frames[i].data.size();
+
+	//every segment is given twice its planned time (replayed frames get a second for each)
+	uint64_t plannedCycles = isHomingSession ? HOMING_TIMEOUT : replayPath != NULL ? (uint64_t)frames.size() * Simulator::cpuFrequency : 2ULL * segmentCount * segmentUs * (Simulator::cpuFrequency / 1000000);
+	std::chrono::steady_clock::time_point hostStart = std::chrono::steady_clock::now();
+	runSession(plannedCycles + SESSION_TIMEOUT_MARGIN);
+	double hostSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - hostStart).count();
+
+	TimingTelemetry telemetry;
+	Steppers::takeTimingTelemetry(telemetry);
+
+	printf("session %s link%s at %u baud, %d frames (%.1f bytes per frame)\n", isCreditLink ? "credit" : "legacy", isCompact ? " with compact frames" : "", baudRate, (int)frames.size(), frames.empty() ? 0.0 : 1.0 * frameBytes / frames.size());
+	if (replayPath == NULL && !isHomingSession)
+		printf("\tplanned segments/s: %.1f\n", 1000000.0 / segmentUs);
+	double linkLimit = frameBytes == 0 ? 0.0 : baudRate / 10.0 / frameBytes * frames.size();
+	printf("\tlink limit segments/s: %.1f\n", linkLimit);
+	double motionSeconds = Simulator::toSeconds(lastEndCycle - firstEndCycle);
+	double sustainedRate = finishedPlans > 1 && motionSeconds > 0 ? (finishedPlans - 1) / motionSeconds : 0.0;
+	printf("\tsustained segments/s: %.1f\n", sustainedRate);
+	printf("\tfinished plans: %u of %u%s\n", finishedPlans, (unsigned)planFrameIndexes.size(), isSessionDone ? "" : " (timeout)");
+	printf("\tunderrun stops: %u, scheduler starts: %u, missed step reports: %u, lowest occupancy: %u\n", telemetry.underrunStops, schedulerStarts, missedStepReports, (unsigned)telemetry.minOccupancy);
+	printf("\toverflow rejections: %u, frame errors: %u, lost received bytes: %llu\n", overflowRejections, frameErrors, (unsigned long long)Simulator::serialOverrunCount);
+	printf("\tinstruction boundary latency: mean %.1f us, max %.1f us\n", latencyCount ? Simulator::toSeconds(latencyTotal / latencyCount) * 1e6 : 0.0, Simulator::toSeconds(latencyMax) * 1e6);
+	if (isHomingSession) {
+		printf("\thoming phases:");
+		for (size_t i = 0; i < homingPhases.size(); ++i)
+			printf(" %u", homingPhases[i]);
+		printf(", release steps:");
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis)
+			printf(" %u", releaseSteps[axis]);
+		printf("\n");
+	}
+	if (isStateSubscribed)
+		printf("\tpushed state snapshots: %u\n", (unsigned)stateSnapshots.size());
+	printf("\tsimulated %.2f s in %.2f s of host time\n", Simulator::toSeconds(Simulator::now()), hostSeconds);
+
+	if (!isCheck)
+		return 0;
+
+	printf("session check\n");
+	expect(isSessionDone, "all plans finished");
+	expect(overflowRejections == 0 && frameErrors == 0, "no rejected frames");
+	expect(Simulator::serialOverrunCount == 0, "no lost received bytes");
+	bool isLinkBound = replayPath == NULL && !isHomingSession && 1000000.0 / segmentUs > linkLimit;
+	if (isHomingSession)
+		//homing segments start the scheduler whenever an approach stops
+		checkHoming();
+	else if (isLinkBound && isCreditLink)
+		//plans come as fast as the link brings them
+		expect(sustainedRate >= 0.95 * linkLimit, "link is saturated");
+	else
+		expect(telemetry.underrunStops == 0 && schedulerStarts == 1, "no underruns");
+	expect(missedStepReports == 0, "no missed steps");
+
+	int32_t expectedPositions[PLAN_AXIS_COUNT] = { 0 };
+	for (size_t i = 0; i < plan.size(); ++i) {
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis)
+			expectedPositions[AXIS_SLOTS[axis]] += instructionSteps(plan[i], axis);
+	}
+	int32_t counterPositions[PLAN_AXIS_COUNT] = { SLOT0_STEPS, SLOT1_STEPS, SLOT2_STEPS, SLOT3_STEPS };
+	expect(memcmp(expectedPositions, counterPositions, sizeof(counterPositions)) == 0, "position counters");
+
+	if (isStateSubscribed)
+		checkStateSnapshots(plan);
+
+	printf(failureCount ? "%d checks failed\n" : "all checks passed\n", failureCount);
+	return failureCount ? 1 : 0;
+}
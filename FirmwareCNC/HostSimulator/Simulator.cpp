@@ -0,0 +1,947 @@
+#include "Simulator.h"
+
+#include <deque>
+
+HostRegister<uint16_t> TCNT1(REG_TCNT1);
+HostRegister<uint8_t> TCCR1A(REG_TCCR1A);
+HostRegister<uint8_t> TCCR1B(REG_TCCR1B);
+HostRegister<uint8_t> TIMSK1(REG_TIMSK1);
+HostRegister<uint8_t> TIFR1(REG_TIFR1);
+HostRegister<uint8_t> TCCR2A(REG_TCCR2A);
+HostRegister<uint8_t> TCCR2B(REG_TCCR2B);
+HostRegister<uint8_t> OCR2A(REG_OCR2A);
+HostRegister<uint8_t> TIMSK2(REG_TIMSK2);
+HostRegister<uint8_t> PORTB(REG_PORTB);
+HostRegister<uint8_t> PORTC(REG_PORTC);
+HostRegister<uint8_t> PORTD(REG_PORTD);
+HostRegister<uint8_t> DDRB(REG_DDRB);
+HostRegister<uint8_t> DDRC(REG_DDRC);
+HostRegister<uint8_t> DDRD(REG_DDRD);
+HostRegister<uint8_t> PCICR(REG_PCICR);
+HostRegister<uint8_t> PCIFR(REG_PCIFR);
+HostRegister<uint8_t> PCMSK0(REG_PCMSK0);
+HostRegister<uint8_t> PCMSK1(REG_PCMSK1);
+HostRegister<uint8_t> PCMSK2(REG_PCMSK2);
+HostRegister<uint8_t> UBRR0H(REG_UBRR0H);
+HostRegister<uint8_t> UBRR0L(REG_UBRR0L);
+HostRegister<uint8_t> UCSR0A(REG_UCSR0A);
+HostRegister<uint8_t> UCSR0B(REG_UCSR0B);
+HostRegister<uint8_t> UCSR0C(REG_UCSR0C);
+HostRegister<uint8_t> UDR0(REG_UDR0);
+HostRegister<uint8_t> SREG(REG_SREG);
+
+// the simulated program may define its own port
+__attribute__((weak)) HostSerial Serial;
+
+// vectors which are not defined by the simulated program stay empty
+__attribute__((weak)) void TIMER1_OVF_vect() {}
+__attribute__((weak)) void TIMER32_COMPARE_vect() {}
+__attribute__((weak)) void TIMER2_COMPA_vect() {}
+__attribute__((weak)) void PCINT1_vect() {}
+__attribute__((weak)) void USART_UDRE_vect() {}
+
+uint32_t Simulator::mainAccessCycles = 4;
+uint32_t Simulator::isrEntryCycles = 70;
+uint32_t Simulator::isrCycles = 100;
+uint32_t Simulator::receiveIsrCycles = 60;
+bool Simulator::echoSerial = false;
+bool Simulator::recordPorts = true;
+uint64_t Simulator::isrCount = 0;
+uint64_t Simulator::isrCycleTotal = 0;
+uint64_t Simulator::refillCount = 0;
+uint64_t Simulator::serialOverrunCount = 0;
+
+#define NEVER UINT64_MAX
+// cycles spent by a single register access inside an interrupt handler
+#define ISR_ACCESS_CYCLES 2
+// cycles charged to the pin change handler
+#define PCINT_CYCLES 80
+// cycles from the Timer2 compare request to the refill handler body (it saves the call clobbered registers)
+#define REFILL_ENTRY_CYCLES 40
+// cycles from the receive complete request to the receive handler body
+#define RECEIVE_ENTRY_CYCLES 40
+// received bytes kept by the USART (a byte which comes when both are unread is lost)
+#define USART_RX_FIFO_SIZE 2
+// size of the Arduino core RX buffer
+#define SERIAL_RX_BUFFER_SIZE 64
+// size of the Arduino core TX buffer
+#define SERIAL_TX_BUFFER_SIZE 64
+// pseudo register ids used for polling detection
+#define POLL_SERIAL_AVAILABLE (REG_COUNT + 1)
+#define POLL_TIME (REG_COUNT + 2)
+#define POLL_PIN (REG_COUNT + 3)
+#define POLL_TIMER32 (REG_COUNT + 4)
+// cycles of a single count of the 32-bit compare timer (it counts the timer ticks)
+#define TIMER32_PRESCALER 8
+
+namespace {
+	struct SerialArrival {
+		uint64_t cycle;
+		uint8_t value;
+	};
+
+	uint64_t currentCycle = 0;
+	uint64_t deadlineCycle = 0;
+	bool interruptsEnabled = true;
+	bool inInterrupt = false;
+	// the refill handler runs with the interrupts enabled - its body is timed as the main context
+	bool inRefill = false;
+	uint8_t registers[REG_COUNT] = { 0 };
+
+	// timer1 counter had timerValue at timerBase cycle
+	uint64_t timerBase = 0;
+	uint16_t timerValue = 0;
+
+	// 32-bit compare timer restarted at timer32Base cycle, its next match comes at timer32Match cycle
+	bool timer32Enabled = false;
+	bool timer32Pending = false;
+	uint64_t timer32Base = 0;
+	uint64_t timer32Match = 0;
+	uint32_t timer32Compare = 0;
+
+	// timer2 (CTC mode) restarted at timer2Base cycle, timer2Pending is its compare match flag
+	uint64_t timer2Base = 0;
+	bool timer2Pending = false;
+
+	// last read done by main context (used for polling detection)
+	int lastReadId = -1;
+	uint16_t lastReadValue = 0;
+
+	uint8_t inputLevels[20];
+	bool pcintPending = false;
+
+	uint32_t serialByteCycles = 0;
+	uint64_t lastArrivalCycle = 0;
+	uint64_t txFreeCycle = 0;
+	std::deque<SerialArrival> rxArrivals;
+	std::deque<uint8_t> rxBuffer;
+	std::string txOutput;
+	// cycles when the bytes of txOutput leave the port
+	std::vector<uint64_t> txCycles;
+	// index of the first byte in txCycles which was not transmitted yet (polling detection wakes up there)
+	size_t txWakeIndex = 0;
+
+	void(*hostPoll)() = NULL;
+
+	std::vector<PortEvent> events;
+
+	uint32_t timerPrescaler() {
+		static const uint32_t prescalers[] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+		return prescalers[registers[REG_TCCR1B] & 7];
+	}
+
+	// rolls timer1 up to the given cycle (overflow flag is raised on the way)
+	void syncTimer(uint64_t cycle) {
+		uint32_t prescaler = timerPrescaler();
+		if (prescaler == 0) {
+			timerBase = cycle;
+			return;
+		}
+
+		for (;;) {
+			uint64_t overflowCycle = timerBase + (uint64_t)(65536 - timerValue) * prescaler;
+			if (overflowCycle > cycle)
+				break;
+
+			registers[REG_TIFR1] |= 1 << TOV1;
+			timerBase = overflowCycle;
+			timerValue = 0;
+		}
+	}
+
+	uint16_t timerCounter() {
+		syncTimer(currentCycle);
+		uint32_t prescaler = timerPrescaler();
+		if (prescaler == 0)
+			return timerValue;
+
+		return (uint16_t)(timerValue + (currentCycle - timerBase) / prescaler);
+	}
+
+	uint64_t nextTimerInterrupt() {
+		if ((registers[REG_TIMSK1] & (1 << TOIE1)) == 0)
+			return NEVER;
+
+		syncTimer(currentCycle);
+		if (registers[REG_TIFR1] & (1 << TOV1))
+			return currentCycle;
+
+		uint32_t prescaler = timerPrescaler();
+		if (prescaler == 0)
+			return NEVER;
+
+		return timerBase + (uint64_t)(65536 - timerValue) * prescaler;
+	}
+
+	// rolls the compare timer up to the given cycle (the counter restarts at every match)
+	void syncTimer32(uint64_t cycle) {
+		if (!timer32Enabled)
+			return;
+
+		while (timer32Match <= cycle) {
+			timer32Pending = true;
+			timer32Base = timer32Match;
+			timer32Match = timer32Base + (uint64_t)max(timer32Compare, 1U) * TIMER32_PRESCALER;
+		}
+	}
+
+	uint32_t timer32Counter() {
+		syncTimer32(currentCycle);
+		if (!timer32Enabled)
+			return 0;
+
+		return (uint32_t)((currentCycle - timer32Base) / TIMER32_PRESCALER);
+	}
+
+	uint64_t nextTimer32Interrupt() {
+		if (!timer32Enabled)
+			return NEVER;
+
+		syncTimer32(currentCycle);
+		return timer32Pending ? currentCycle : timer32Match;
+	}
+
+	uint64_t timer2Period() {
+		static const uint32_t prescalers[] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+		return (uint64_t)(registers[REG_OCR2A] + 1) * prescalers[registers[REG_TCCR2B] & 7];
+	}
+
+	// rolls timer2 up to the given cycle (the counter restarts at every compare match)
+	void syncTimer2(uint64_t cycle) {
+		uint64_t period = timer2Period();
+		if (period == 0) {
+			timer2Base = cycle;
+			return;
+		}
+
+		while (timer2Base + period <= cycle) {
+			timer2Pending = true;
+			timer2Base += period;
+		}
+	}
+
+	uint64_t nextTimer2Interrupt() {
+		if ((registers[REG_TIMSK2] & (1 << OCIE2A)) == 0)
+			return NEVER;
+
+		syncTimer2(currentCycle);
+		if (timer2Pending)
+			return currentCycle;
+
+		uint64_t period = timer2Period();
+		if (period == 0)
+			return NEVER;
+
+		return timer2Base + period;
+	}
+
+	uint64_t nextSerialArrival() {
+		if (rxArrivals.empty())
+			return NEVER;
+
+		return rxArrivals.front().cycle;
+	}
+
+	uint64_t nextReceiveInterrupt() {
+		if ((registers[REG_UCSR0B] & (1 << RXCIE0)) == 0)
+			return NEVER;
+
+		return nextSerialArrival();
+	}
+
+	uint64_t nextInterrupt() {
+		if (!interruptsEnabled || inInterrupt)
+			return NEVER;
+
+		if (pcintPending)
+			return currentCycle;
+
+		return min(min(nextTimerInterrupt(), nextTimer32Interrupt()), min(nextTimer2Interrupt(), nextReceiveInterrupt()));
+	}
+
+	// runs the step interrupt handler (cycles of its body which does not touch the hardware are charged by isrCycles)
+	void runStepHandler(void(*handler)()) {
+		currentCycle += Simulator::isrEntryCycles;
+		uint64_t startCycle = currentCycle;
+		handler();
+		uint64_t endCycle = startCycle + Simulator::isrCycles;
+		if (currentCycle < endCycle)
+			currentCycle = endCycle;
+
+		++Simulator::isrCount;
+		Simulator::isrCycleTotal += currentCycle - startCycle + Simulator::isrEntryCycles;
+	}
+
+	// runs the refill handler - it enables the interrupts itself, so its body can be preempted like the main context
+	void runRefillHandler() {
+		currentCycle += REFILL_ENTRY_CYCLES;
+		bool wasInRefill = inRefill;
+		inRefill = true;
+		interruptsEnabled = false;
+		TIMER2_COMPA_vect();
+		//return from the interrupt enables the interrupts again
+		interruptsEnabled = true;
+		inRefill = wasInRefill;
+		++Simulator::refillCount;
+	}
+
+	// runs the receive handler with the oldest received byte in UDR0
+	void runReceiveHandler() {
+		while (rxArrivals.size() > USART_RX_FIFO_SIZE && rxArrivals[USART_RX_FIFO_SIZE].cycle <= currentCycle) {
+			//data overrun - the byte coming to the full FIFO is lost
+			rxArrivals.erase(rxArrivals.begin() + USART_RX_FIFO_SIZE);
+			++Simulator::serialOverrunCount;
+		}
+
+		registers[REG_UDR0] = rxArrivals.front().value;
+		rxArrivals.pop_front();
+
+		currentCycle += RECEIVE_ENTRY_CYCLES;
+		uint64_t endCycle = currentCycle + Simulator::receiveIsrCycles;
+		USART_RX_vect();
+		if (currentCycle < endCycle)
+			currentCycle = endCycle;
+	}
+
+	// fires earliest interrupt which is requested before limit, returns false if there is none
+	bool fireNextInterrupt(uint64_t limit) {
+		uint64_t requestCycle = nextInterrupt();
+		if (requestCycle == NEVER || requestCycle > limit)
+			return false;
+
+		if (requestCycle > currentCycle)
+			currentCycle = requestCycle;
+
+		if (!pcintPending && nextTimer2Interrupt() <= requestCycle) {
+			//timer2 vector comes before the step timer ones
+			timer2Pending = false;
+			runRefillHandler();
+			return true;
+		}
+
+		inInterrupt = true;
+		if (pcintPending) {
+			pcintPending = false;
+			PCINT1_vect();
+			currentCycle += PCINT_CYCLES;
+		}
+		else if (nextTimer32Interrupt() <= requestCycle) {
+			timer32Pending = false;
+			runStepHandler(TIMER32_COMPARE_vect);
+		}
+		else if (nextTimerInterrupt() <= requestCycle) {
+			syncTimer(currentCycle);
+			registers[REG_TIFR1] &= ~(1 << TOV1);
+			runStepHandler(TIMER1_OVF_vect);
+		}
+		else {
+			//receive complete has the lowest priority of the used vectors
+			runReceiveHandler();
+		}
+		inInterrupt = false;
+		return true;
+	}
+
+	void checkDeadline() {
+		if (deadlineCycle > 0 && currentCycle > deadlineCycle && !inInterrupt && !inRefill)
+			throw SimulationDeadline{ currentCycle };
+	}
+
+	// the host harness sees the simulated time from the main context only
+	void pollHost() {
+		if (hostPoll != NULL && !inInterrupt && !inRefill)
+			hostPoll();
+	}
+
+	// end of the next byte which is being transmitted (the host harness waits for it)
+	uint64_t nextTransmitEnd() {
+		if (hostPoll == NULL)
+			return NEVER;
+
+		while (txWakeIndex < txCycles.size() && txCycles[txWakeIndex] <= currentCycle)
+			++txWakeIndex;
+
+		return txWakeIndex < txCycles.size() ? txCycles[txWakeIndex] : NEVER;
+	}
+
+	// accounts a hardware access before it is done (main context consumes time, interrupts may fire meanwhile)
+	void hardwareAccess() {
+		if (!inInterrupt)
+			Simulator::consume(Simulator::mainAccessCycles);
+	}
+
+	// accounts a hardware access after it was done (interrupt context keeps the events ordered)
+	void hardwareAccessDone() {
+		if (inInterrupt)
+			currentCycle += ISR_ACCESS_CYCLES;
+	}
+
+	// main context repeatedly reading the same value is a busy wait - skip to the next event
+	void pollRead(int id, uint16_t value) {
+		if (inInterrupt || inRefill)
+			return;
+
+		if (id != lastReadId || value != lastReadValue) {
+			lastReadId = id;
+			lastReadValue = value;
+			return;
+		}
+
+		uint64_t wakeCycle = nextInterrupt();
+		uint64_t arrivalCycle = nextSerialArrival();
+		if (arrivalCycle < wakeCycle)
+			wakeCycle = arrivalCycle;
+
+		uint64_t transmitCycle = nextTransmitEnd();
+		if (transmitCycle < wakeCycle)
+			wakeCycle = transmitCycle;
+
+		if (wakeCycle != NEVER && wakeCycle > currentCycle) {
+			Simulator::runUntil(wakeCycle);
+			checkDeadline();
+			pollHost();
+		}
+
+		//the next read has to be compared again
+		lastReadId = -1;
+	}
+
+	// bytes go to the RX buffer directly when the receive interrupt does not buffer them
+	void pullSerialArrivals() {
+		if (registers[REG_UCSR0B] & (1 << RXCIE0))
+			return;
+
+		while (!rxArrivals.empty() && rxArrivals.front().cycle <= currentCycle) {
+			if (rxBuffer.size() < SERIAL_RX_BUFFER_SIZE)
+				rxBuffer.push_back(rxArrivals.front().value);
+			else
+				++Simulator::serialOverrunCount;
+
+			rxArrivals.pop_front();
+		}
+	}
+
+	void recordPortChange(HostRegisterId id, uint8_t oldValue) {
+		if (!Simulator::recordPorts || registers[id] == oldValue)
+			return;
+
+		PortEvent evt;
+		evt.cycle = currentCycle;
+		evt.portB = registers[REG_PORTB];
+		evt.portD = registers[REG_PORTD];
+		events.push_back(evt);
+	}
+
+	void serialTransmit(uint8_t value) {
+		lastReadId = -1;
+		txOutput.push_back((char)value);
+		if (Simulator::echoSerial) {
+			putchar(value);
+			fflush(stdout);
+		}
+
+		if (!inInterrupt) {
+			//wait while the TX buffer is full
+			uint64_t bufferedCycles = (uint64_t)serialByteCycles * SERIAL_TX_BUFFER_SIZE;
+			if (txFreeCycle > currentCycle + bufferedCycles)
+				Simulator::consume(txFreeCycle - currentCycle - bufferedCycles);
+		}
+
+		if (txFreeCycle < currentCycle)
+			txFreeCycle = currentCycle;
+		txFreeCycle += serialByteCycles;
+		txCycles.push_back(txFreeCycle);
+	}
+
+	uint16_t readRegister(HostRegisterId id) {
+		switch (id) {
+		case REG_TCNT1:
+			return timerCounter();
+		case REG_TIFR1:
+			syncTimer(currentCycle);
+			return registers[id];
+		case REG_SREG:
+			return interruptsEnabled ? 0x80 : 0;
+		default:
+			return registers[id];
+		}
+	}
+
+	void writeRegister(HostRegisterId id, uint16_t value) {
+		uint8_t oldValue = registers[id];
+		switch (id) {
+		case REG_TCNT1:
+			syncTimer(currentCycle);
+			timerBase = currentCycle;
+			timerValue = value;
+			return;
+		case REG_TCCR1B:
+			//keep counter value across prescaler changes
+			timerValue = timerCounter();
+			timerBase = currentCycle;
+			registers[id] = (uint8_t)value;
+			return;
+		case REG_TCCR2B:
+			//the counter restarts with the new clock (the firmware sets it once)
+			syncTimer2(currentCycle);
+			timer2Base = currentCycle;
+			registers[id] = (uint8_t)value;
+			return;
+		case REG_OCR2A:
+			syncTimer2(currentCycle);
+			registers[id] = (uint8_t)value;
+			return;
+		case REG_TIFR1:
+			//flags are cleared by writing one
+			syncTimer(currentCycle);
+			registers[id] &= ~(uint8_t)value;
+			return;
+		case REG_SREG:
+			interruptsEnabled = (value & 0x80) != 0;
+			return;
+		default:
+			registers[id] = (uint8_t)value;
+			if (id == REG_PORTB || id == REG_PORTD)
+				recordPortChange(id, oldValue);
+			return;
+		}
+	}
+
+	// maps arduino pin to its port register and bit
+	bool pinToPort(uint8_t pin, HostRegisterId& port, uint8_t& portBit) {
+		if (pin <= 7) {
+			port = REG_PORTD;
+			portBit = pin;
+		}
+		else if (pin <= 13) {
+			port = REG_PORTB;
+			portBit = pin - 8;
+		}
+		else if (pin <= 19) {
+			port = REG_PORTC;
+			portBit = pin - 14;
+		}
+		else {
+			return false;
+		}
+		return true;
+	}
+}
+
+// receive interrupt of the Arduino core - programs which read through Serial get the bytes buffered
+__attribute__((weak)) void USART_RX_vect() {
+	uint8_t value = UDR0;
+	if (rxBuffer.size() < SERIAL_RX_BUFFER_SIZE)
+		rxBuffer.push_back(value);
+	else
+		++Simulator::serialOverrunCount;
+}
+
+uint16_t hostReadRegister(HostRegisterId id) {
+	hardwareAccess();
+	uint16_t value = readRegister(id);
+	hardwareAccessDone();
+	pollRead(id, value);
+	return value;
+}
+
+void hostWriteRegister(HostRegisterId id, uint16_t value) {
+	hardwareAccess();
+	lastReadId = -1;
+	writeRegister(id, value);
+	hardwareAccessDone();
+
+	if (!inInterrupt)
+		//enabled interrupts may be pending already
+		Simulator::consume(0);
+}
+
+uint32_t hostTimer32Counter() {
+	hardwareAccess();
+	uint32_t value = timer32Counter();
+	hardwareAccessDone();
+	pollRead(POLL_TIMER32, (uint16_t)value);
+	return value;
+}
+
+void hostTimer32SetCompare(uint32_t value) {
+	hardwareAccess();
+	lastReadId = -1;
+	syncTimer32(currentCycle);
+	timer32Compare = value;
+	uint64_t compareCycle = timer32Base + (uint64_t)value * TIMER32_PRESCALER;
+	if (compareCycle <= currentCycle)
+		//counter passed the compare already - the match comes after the counter overflow
+		compareCycle += (1ULL << 32) * TIMER32_PRESCALER;
+	timer32Match = compareCycle;
+	hardwareAccessDone();
+
+	if (!inInterrupt)
+		Simulator::consume(0);
+}
+
+void hostTimer32Enable(bool isEnabled) {
+	hardwareAccess();
+	lastReadId = -1;
+	timer32Enabled = isEnabled;
+	timer32Pending = false;
+	timer32Base = currentCycle;
+	timer32Match = currentCycle + (uint64_t)max(timer32Compare, 1U) * TIMER32_PRESCALER;
+	hardwareAccessDone();
+
+	if (!inInterrupt)
+		Simulator::consume(0);
+}
+
+bool hostTimer32IsEnabled() {
+	hardwareAccess();
+	pollRead(POLL_TIMER32 + 1, timer32Enabled);
+	return timer32Enabled;
+}
+
+void noInterrupts() {
+	hardwareAccess();
+	lastReadId = -1;
+	interruptsEnabled = false;
+}
+
+void interrupts() {
+	hardwareAccess();
+	lastReadId = -1;
+	interruptsEnabled = true;
+	if (!inInterrupt)
+		Simulator::consume(0);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+	HostRegisterId port;
+	uint8_t portBit;
+	if (!pinToPort(pin, port, portBit))
+		return;
+
+	HostRegisterId ddr = port == REG_PORTB ? REG_DDRB : (port == REG_PORTC ? REG_DDRC : REG_DDRD);
+	if (mode == OUTPUT)
+		hostWriteRegister(ddr, registers[ddr] | (1 << portBit));
+	else
+		hostWriteRegister(ddr, registers[ddr] & ~(1 << portBit));
+
+	if (mode == INPUT_PULLUP)
+		hostWriteRegister(port, registers[port] | (1 << portBit));
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+	HostRegisterId port;
+	uint8_t portBit;
+	if (!pinToPort(pin, port, portBit))
+		return;
+
+	if (value == LOW)
+		hostWriteRegister(port, registers[port] & ~(1 << portBit));
+	else
+		hostWriteRegister(port, registers[port] | (1 << portBit));
+}
+
+int digitalRead(uint8_t pin) {
+	hardwareAccess();
+	if (pin >= 14 && pin <= 19) {
+		pollRead(POLL_PIN + pin, inputLevels[pin]);
+		return inputLevels[pin];
+	}
+
+	HostRegisterId port;
+	uint8_t portBit;
+	if (!pinToPort(pin, port, portBit))
+		return LOW;
+
+	return (registers[port] >> portBit) & 1;
+}
+
+unsigned long millis() {
+	hardwareAccess();
+	unsigned long value = (unsigned long)(currentCycle / (Simulator::cpuFrequency / 1000));
+	pollRead(POLL_TIME, (uint16_t)value);
+	return value;
+}
+
+unsigned long micros() {
+	hardwareAccess();
+	unsigned long value = (unsigned long)(currentCycle / (Simulator::cpuFrequency / 1000000));
+	pollRead(POLL_TIME, (uint16_t)value);
+	return value;
+}
+
+void delay(unsigned long ms) {
+	Simulator::consume((uint64_t)ms * (Simulator::cpuFrequency / 1000));
+}
+
+void delayMicroseconds(unsigned int us) {
+	Simulator::consume((uint64_t)us * (Simulator::cpuFrequency / 1000000));
+}
+
+void HostSerial::begin(unsigned long baud) {
+	//start bit + 8 data bits + stop bit
+	serialByteCycles = (uint32_t)(10ULL * Simulator::cpuFrequency / baud);
+	registers[REG_UCSR0B] = (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
+}
+
+int HostSerial::available() {
+	hardwareAccess();
+	pullSerialArrivals();
+	int count = (int)rxBuffer.size();
+	pollRead(POLL_SERIAL_AVAILABLE, (uint16_t)count);
+	return count;
+}
+
+int HostSerial::read() {
+	hardwareAccess();
+	pullSerialArrivals();
+	if (rxBuffer.empty()) {
+		pollRead(POLL_SERIAL_AVAILABLE, 0);
+		return -1;
+	}
+
+	uint8_t value = rxBuffer.front();
+	rxBuffer.pop_front();
+	return value;
+}
+
+int HostSerial::peek() {
+	hardwareAccess();
+	pullSerialArrivals();
+	if (rxBuffer.empty())
+		return -1;
+
+	return rxBuffer.front();
+}
+
+void HostSerial::flush() {
+	if (txFreeCycle > currentCycle)
+		Simulator::consume(txFreeCycle - currentCycle);
+}
+
+size_t HostSerial::write(uint8_t value) {
+	hardwareAccess();
+	serialTransmit(value);
+	return 1;
+}
+
+size_t HostSerial::write(const uint8_t * buffer, size_t size) {
+	for (size_t i = 0; i < size; ++i)
+		write(buffer[i]);
+
+	return size;
+}
+
+size_t HostSerial::print(char value) {
+	return write((uint8_t)value);
+}
+
+size_t HostSerial::print(const char * value) {
+	return write((const uint8_t*)value, strlen(value));
+}
+
+size_t HostSerial::print(int value) {
+	return print((long)value);
+}
+
+size_t HostSerial::print(unsigned int value) {
+	return print((unsigned long)value);
+}
+
+size_t HostSerial::print(long value) {
+	char buffer[24];
+	snprintf(buffer, sizeof(buffer), "%ld", value);
+	return print(buffer);
+}
+
+size_t HostSerial::print(unsigned long value) {
+	char buffer[24];
+	snprintf(buffer, sizeof(buffer), "%lu", value);
+	return print(buffer);
+}
+
+size_t HostSerial::print(double value) {
+	//arduino prints two decimal digits by default
+	char buffer[48];
+	snprintf(buffer, sizeof(buffer), "%.2f", value);
+	return print(buffer);
+}
+
+size_t HostSerial::println() {
+	return print("\r\n");
+}
+
+size_t HostSerial::println(char value) {
+	return print(value) + println();
+}
+
+size_t HostSerial::println(const char * value) {
+	return print(value) + println();
+}
+
+size_t HostSerial::println(int value) {
+	return print(value) + println();
+}
+
+size_t HostSerial::println(unsigned int value) {
+	return print(value) + println();
+}
+
+size_t HostSerial::println(long value) {
+	return print(value) + println();
+}
+
+size_t HostSerial::println(unsigned long value) {
+	return print(value) + println();
+}
+
+size_t HostSerial::println(double value) {
+	return print(value) + println();
+}
+
+void Simulator::reset()
+{
+	currentCycle = 0;
+	deadlineCycle = 0;
+	interruptsEnabled = true;
+	inInterrupt = false;
+	inRefill = false;
+	memset(registers, 0, sizeof(registers));
+	timerBase = 0;
+	timerValue = 0;
+	timer32Enabled = false;
+	timer32Pending = false;
+	timer32Base = 0;
+	timer32Match = 0;
+	timer32Compare = 0;
+	timer2Base = 0;
+	timer2Pending = false;
+	lastReadId = -1;
+	lastReadValue = 0;
+	//inputs are pulled up
+	memset(inputLevels, HIGH, sizeof(inputLevels));
+	pcintPending = false;
+
+	//the port is not started by the board reset (bytes are buffered without the receive interrupt)
+	serialByteCycles = (uint32_t)(10ULL * cpuFrequency / 128000);
+	lastArrivalCycle = 0;
+	txFreeCycle = 0;
+	rxArrivals.clear();
+	rxBuffer.clear();
+	txOutput.clear();
+	txCycles.clear();
+	txWakeIndex = 0;
+	hostPoll = NULL;
+
+	events.clear();
+	isrCount = 0;
+	isrCycleTotal = 0;
+	refillCount = 0;
+	serialOverrunCount = 0;
+}
+
+uint64_t Simulator::now()
+{
+	return currentCycle;
+}
+
+double Simulator::toSeconds(uint64_t cycles)
+{
+	return 1.0 * cycles / cpuFrequency;
+}
+
+void Simulator::consume(uint64_t cycles)
+{
+	uint64_t targetCycle = currentCycle + cycles;
+	for (;;) {
+		uint64_t requestCycle = nextInterrupt();
+		if (requestCycle == NEVER || requestCycle > targetCycle)
+			break;
+
+		uint64_t startCycle = max(requestCycle, currentCycle);
+		fireNextInterrupt(requestCycle);
+		//main context was stopped for the interrupt duration
+		targetCycle += currentCycle - startCycle;
+	}
+
+	if (currentCycle < targetCycle)
+		currentCycle = targetCycle;
+	checkDeadline();
+	pollHost();
+}
+
+void Simulator::runUntil(uint64_t cycle)
+{
+	while (fireNextInterrupt(cycle));
+
+	if (currentCycle < cycle)
+		currentCycle = cycle;
+}
+
+bool Simulator::waitForScheduler(uint64_t timeoutCycles)
+{
+	uint64_t timeoutCycle = currentCycle + timeoutCycles;
+	while ((registers[REG_TIMSK1] & (1 << TOIE1)) || timer32Enabled) {
+		uint64_t requestCycle = nextInterrupt();
+		if (requestCycle == NEVER || requestCycle > timeoutCycle)
+			return false;
+
+		runUntil(requestCycle);
+	}
+	return true;
+}
+
+void Simulator::setDeadline(uint64_t cycle)
+{
+	deadlineCycle = cycle;
+}
+
+void Simulator::setHostPoll(void(*poll)())
+{
+	hostPoll = poll;
+}
+
+void Simulator::setInput(uint8_t pin, uint8_t level)
+{
+	if (pin < 14 || pin > 19 || inputLevels[pin] == level)
+		return;
+
+	inputLevels[pin] = level;
+	bool isMasked = (registers[REG_PCMSK1] & (1 << (pin - 14))) == 0;
+	bool isEnabled = (registers[REG_PCICR] & (1 << PCIE1)) != 0;
+	if (!isMasked && isEnabled) {
+		pcintPending = true;
+		runUntil(currentCycle);
+	}
+}
+
+void Simulator::feedSerial(const uint8_t * data, size_t length, uint32_t baud)
+{
+	uint64_t byteCycles = 10ULL * cpuFrequency / baud;
+	if (lastArrivalCycle < currentCycle)
+		lastArrivalCycle = currentCycle;
+
+	for (size_t i = 0; i < length; ++i) {
+		lastArrivalCycle += byteCycles;
+
+		SerialArrival arrival;
+		arrival.cycle = lastArrivalCycle;
+		arrival.value = data[i];
+		rxArrivals.push_back(arrival);
+	}
+}
+
+std::string & Simulator::serialOutput()
+{
+	return txOutput;
+}
+
+std::vector<uint64_t>& Simulator::serialOutputCycles()
+{
+	return txCycles;
+}
+
+std::vector<PortEvent>& Simulator::portEvents()
+{
+	return events;
+}
@@ -0,0 +1,113 @@
+/*
+Name:		Simulator.h
+Author:	m9ra
+
+Cycle accounting emulator of the ATmega328P peripherals used by the firmware
+(and of the 32-bit compare timer of the STEP_TIMER_HOST backend, Timer2 is emulated in CTC mode only,
+USART0 receives through its receive complete interrupt once Serial.begin enables it).
+Time advances only when the emulated code touches the hardware (registers, Serial, time functions)
+or when the host harness asks for it. Interrupt handlers are fired at the exact simulated overflow times.
+*/
+
+#ifndef _Simulator_h
+#define _Simulator_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+
+// Snapshot of the output ports taken whenever a port write changes them.
+struct PortEvent {
+	// CPU cycle of the port write.
+	uint64_t cycle;
+	// Value of PORTB after the write.
+	uint8_t portB;
+	// Value of PORTD after the write.
+	uint8_t portD;
+};
+
+// Thrown from the main context when the simulated time passes the deadline (used to leave endless loops).
+struct SimulationDeadline {
+	uint64_t cycle;
+};
+
+class Simulator {
+public:
+	// Simulated CPU clock.
+	static const uint32_t cpuFrequency = 16000000;
+
+	// Cycles consumed by main context for a single hardware access.
+	static uint32_t mainAccessCycles;
+
+	// Cycles from the interrupt request to the step handler body (its lateness sample and TCNT1 reload come next).
+	static uint32_t isrEntryCycles;
+
+	// Cycles charged for the remaining part of the step handler (estimate of the avr build, it was ~230 with the step accounting).
+	static uint32_t isrCycles;
+
+	// Cycles charged for the body of the receive handler (estimate of the FirmwareCNC one which stores the byte into a frame slot).
+	static uint32_t receiveIsrCycles;
+
+	// Determine whether serial output is echoed to stdout.
+	static bool echoSerial;
+
+	// Determine whether port changes are recorded.
+	static bool recordPorts;
+
+	// How many times the step timer handler was fired.
+	static uint64_t isrCount;
+
+	// Total cycles charged to the step timer handler.
+	static uint64_t isrCycleTotal;
+
+	// How many times the schedule refill handler (Timer2 compare) was fired.
+	static uint64_t refillCount;
+
+	// How many received bytes were lost because of the full RX buffer (or the USART data overrun).
+	static uint64_t serialOverrunCount;
+
+	// Resets whole simulated board (registers, time, serial and recorded events).
+	static void reset();
+
+	// Current simulated CPU cycle.
+	static uint64_t now();
+
+	// Converts cycles to seconds.
+	static double toSeconds(uint64_t cycles);
+
+	// Lets main context consume given cycles (interrupts are fired meanwhile).
+	static void consume(uint64_t cycles);
+
+	// Runs interrupts until given cycle is reached.
+	static void runUntil(uint64_t cycle);
+
+	// Runs until the step scheduler disables itself. Returns false on timeout.
+	static bool waitForScheduler(uint64_t timeoutCycles);
+
+	// Main context throws SimulationDeadline after given cycle (zero disables the deadline).
+	static void setDeadline(uint64_t cycle);
+
+	// Host function called from the main context whenever the simulated time advances (NULL disables it).
+	// It may feed the serial port or throw SimulationDeadline, the polling detection wakes up at the end of each transmitted byte.
+	static void setHostPoll(void(*poll)());
+
+	// Sets level of an input pin (pin change interrupts are fired accordingly).
+	static void setInput(uint8_t pin, uint8_t level);
+
+	// Queues bytes arriving to the serial port with the given baud rate (after already queued bytes).
+	static void feedSerial(const uint8_t* data, size_t length, uint32_t baud);
+
+	// Everything written to serial port.
+	static std::string& serialOutput();
+
+	// Cycles when the bytes of serialOutput leave the port.
+	static std::vector<uint64_t>& serialOutputCycles();
+
+	// Recorded port changes.
+	static std::vector<PortEvent>& portEvents();
+};
+
+#endif
@@ -0,0 +1,1761 @@
+/*
+Name:		StepperBench.cpp
+Author:	m9ra
+
+Runs plans through the real StepperControl schedulers on the simulated board.
+Reports host throughput of the step engine and checks the produced pulse stream.
+Motion mode compares step times of scripted plans with their ideal profiles against the golden file (--record writes it).
+
+usage: stepper_bench [--check] [--sram] [--motion <golden file> [--record] [--sync-reference <golden file>]] [--compact] [--dump <file>] [--repeat <count>]
+*/
+
+#include <chrono>
+#include <math.h>
+#include <new>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "Simulator.h"
+#include "PulseTrace.h"
+#include "PlanFrames.h"
+#include "MotionProfile.h"
+
+typedef SegmentScheduler<Slot1Axis, Slot0Axis, Slot3Axis, Slot2Axis> BenchScheduler;
+BenchScheduler SEGMENT_SCHEDULER;
+
+// refill interrupt the same way FirmwareCNC defines it (checkRefillInterrupt enables it)
+SCHEDULE_REFILL_ISR {
+	SEGMENT_SCHEDULER.refillSchedule();
+}
+
+// slots in the order of plan axes (the same order FirmwareCNC uses)
+const byte AXIS_SLOTS[PLAN_AXIS_COUNT] = { 1, 0, 3, 2 };
+
+// cycles of a single timer tick (prescaler 8)
+#define TICK_CYCLES 8
+
+// cycles of a single schedule tick (a timer tick without the prescaler in the high resolution mode)
+#define SCHEDULE_TICK_CYCLES (TICK_CYCLES / SCHEDULE_TICK_SCALE)
+
+// how long we wait for the scheduler to finish the plans
+#define SCHEDULER_TIMEOUT (60ULL * Simulator::cpuFrequency)
+
+// baud rate of the controller link (FirmwareCNC setup)
+#define SERIAL_BAUD 128000
+
+// instruction buffering of FirmwareCNC (frame slots and decoded plan queue) in its SRAM budget
+#define FIRMWARE_FRAME_SLOTS 3
+#define FIRMWARE_SRAM_SIZE 2048
+#define FIRMWARE_SRAM_STACK_RESERVE 320
+#define FIRMWARE_SRAM_GLOBALS_RESERVE 352
+#define FIRMWARE_PLAN_QUEUE_SRAM_BUDGET (FIRMWARE_SRAM_SIZE - FIRMWARE_SRAM_STACK_RESERVE - FIRMWARE_SRAM_GLOBALS_RESERVE - SCHEDULE_SRAM_SIZE \
+	- SEGMENT_SCHEDULER_SRAM(PLAN_AXIS_COUNT) - FRAME_RECEIVER_SRAM(PLAN_FRAME_SIZE, FIRMWARE_FRAME_SLOTS))
+// the shortest queue FirmwareCNC accepts (rings which do not fit the budget run with it, --sram reports them)
+#define FIRMWARE_MIN_PLAN_QUEUE_SIZE (2 * PlanQueue<1, PLAN_AXIS_COUNT>::maxRecordSize)
+#ifdef STEP_TIMER_32BIT
+// 32-bit boards keep the longer ring besides the queue of the raw frames
+#define FIRMWARE_PLAN_QUEUE_SIZE (PLAN_FRAME_SIZE * 3)
+#else
+#define FIRMWARE_BUDGETED_PLAN_QUEUE_SIZE (FIRMWARE_PLAN_QUEUE_SRAM_BUDGET - PLAN_QUEUE_SRAM(0, PLAN_AXIS_COUNT))
+#define FIRMWARE_PLAN_QUEUE_SIZE (FIRMWARE_BUDGETED_PLAN_QUEUE_SIZE > FIRMWARE_MIN_PLAN_QUEUE_SIZE ? FIRMWARE_BUDGETED_PLAN_QUEUE_SIZE : FIRMWARE_MIN_PLAN_QUEUE_SIZE)
+#endif
+
+// how long a move from the standstill waits for the next move in ms (FirmwareCNC setup)
+#define MOVE_START_DELAY 10
+
+// plans decoded the same way FirmwareCNC does
+PlanQueue<FIRMWARE_PLAN_QUEUE_SIZE, PLAN_AXIS_COUNT> PLAN_QUEUE;
+
+// determine whether instructions are sent in compact frames
+bool useCompactFrames = false;
+
+// delta references of the compact frame sender
+int32_t compactReferences[PLAN_AXIS_COUNT] = { 0 };
+
+// count of bytes the instructions were sent in
+uint64_t sentFrameBytes = 0;
+
+// time of the last decoded move in ms
+unsigned long lastMoveDecodeTime = 0;
+
+// determine whether instruction ends are counted instead of reported by 'F' (credit mode of FirmwareCNC)
+bool isInstructionEndBatching = false;
+
+// count of instruction ends which were not reported by 'F'
+int batchedInstructionEnds = 0;
+
+void resetBoard() {
+	Simulator::reset();
+	Steppers::initialize();
+
+	//clocks are idle HIGH
+	PORTB = B_SLOTS_MASK & ACTIVATIONS_CLOCK_MASK;
+	PORTD = D_SLOTS_MASK & ACTIVATIONS_CLOCK_MASK;
+	Simulator::portEvents().clear();
+
+	SLOT0_STEPS = 0;
+	SLOT1_STEPS = 0;
+	SLOT2_STEPS = 0;
+	SLOT3_STEPS = 0;
+
+	//scheduler starts from the power on state (directions of the previous run are forgotten)
+	SEGMENT_SCHEDULER.~BenchScheduler();
+	new (&SEGMENT_SCHEDULER) BenchScheduler();
+
+	isInstructionEndBatching = false;
+	batchedInstructionEnds = 0;
+	Steppers::takeFinishedInstructionCount();
+	TimingTelemetry telemetry;
+	Steppers::takeTimingTelemetry(telemetry);
+
+	while (PLAN_QUEUE.front() != NULL)
+		PLAN_QUEUE.pop();
+	PLAN_QUEUE.resetCompactReferences();
+	memset(compactReferences, 0, sizeof(compactReferences));
+	sentFrameBytes = 0;
+	lastMoveDecodeTime = 0;
+}
+
+// accepts frame the same way FirmwareCNC does
+bool isValidFrame(const byte* frame, size_t frameSize) {
+	if (frame[0] & COMPACT_FRAME_FLAG) {
+		uint16_t crc = 0xFFFF;
+		for (size_t i = 0; i < frameSize - 2; ++i)
+			crc = crc16Update(crc, frame[i]);
+		return (uint16_t)READ_UINT16(frame, frameSize - 2) == crc;
+	}
+
+	uint16_t checksum = 0;
+	for (size_t i = 0; i < frameSize - 2; ++i)
+		checksum += frame[i];
+	return (uint16_t)READ_UINT16(frame, frameSize - 2) == checksum;
+}
+
+// decodes frame into the plan queue - returns false when the queue is full
+bool decodeFrame(const byte* frame) {
+	if (frame[0] & COMPACT_FRAME_FLAG)
+		return PLAN_QUEUE.pushCompact(frame + 1, frame + 1 + (frame[0] & ~COMPACT_FRAME_FLAG));
+
+	if (frame[0] == 'R') {
+		bool isDecoded = PLAN_QUEUE.pushMove(frame + 1);
+		if (isDecoded)
+			lastMoveDecodeTime = millis();
+		return isDecoded;
+	}
+
+	return PLAN_QUEUE.push(frame[0], frame + 1);
+}
+
+// commits positions of the finished instructions and reports them the same way FirmwareCNC loop does
+void reportFinishedInstructions() {
+	byte count = SEGMENT_SCHEDULER.takeFinishedInstructions();
+	if (isInstructionEndBatching) {
+		batchedInstructionEnds += count;
+		return;
+	}
+
+	for (; count > 0; --count)
+		Serial.print('F');
+}
+
+// arms queued plans the same way FirmwareCNC loop does (as soon as the scheduler can take it)
+void armQueuedPlans() {
+	reportFinishedInstructions();
+	while (SEGMENT_SCHEDULER.canArm() && PLAN_QUEUE.front() != NULL) {
+		if (!PLAN_QUEUE.isFrontPlanned()) {
+			if (!SEGMENT_SCHEDULER.isNearEnd())
+				//the running move is far from its end - the next move can still come
+				break;
+
+			if (SEGMENT_SCHEDULER.isIdle() && millis() - lastMoveDecodeTime < MOVE_START_DELAY)
+				//the next move may be on the way
+				break;
+		}
+
+		SEGMENT_SCHEDULER.arm(PLAN_QUEUE.front());
+		PLAN_QUEUE.pop();
+	}
+}
+
+void executeInstruction(const PlanInstruction& instruction) {
+	byte frame[PLAN_FRAME_SIZE];
+	size_t frameSize = 0;
+	if (useCompactFrames)
+		frameSize = writeCompactFrame(frame, instruction, compactReferences);
+	if (frameSize == 0)
+		frameSize = writeLegacyFrame(frame, instruction);
+
+	if (!isValidFrame(frame, frameSize)) {
+		printf("\tINVALID FRAME\n");
+		return;
+	}
+	sentFrameBytes += frameSize;
+
+	while (!decodeFrame(frame)) {
+		armQueuedPlans();
+		SEGMENT_SCHEDULER.fillSchedule();
+	}
+	armQueuedPlans();
+}
+
+bool executePlan(const std::vector<PlanInstruction>& plan) {
+	for (size_t i = 0; i < plan.size(); ++i)
+		executeInstruction(plan[i]);
+
+	while (PLAN_QUEUE.front() != NULL) {
+		armQueuedPlans();
+		if (!SEGMENT_SCHEDULER.fillSchedule() && SEGMENT_SCHEDULER.isIdle())
+			//the loop waits for the held move
+			Simulator::consume(Simulator::cpuFrequency / 10000);
+	}
+
+	while (SEGMENT_SCHEDULER.fillSchedule());
+	bool isFinished = Simulator::waitForScheduler(SCHEDULER_TIMEOUT);
+	reportFinishedInstructions();
+	return isFinished;
+}
+
+std::vector<PlanInstruction> cruisePlan(int repeat) {
+	std::vector<PlanInstruction> plan;
+	for (int i = 0; i < repeat; ++i) {
+		int16_t direction = i % 2 ? -1 : 1;
+		plan.push_back(constantInstruction(1000 * direction, 400, 800 * direction, 500, 1000 * direction, 400, 500 * direction, 800));
+	}
+	return plan;
+}
+
+std::vector<PlanInstruction> rampPlan(int repeat) {
+	std::vector<PlanInstruction> plan;
+	for (int i = 0; i < repeat; ++i) {
+		int16_t direction = i % 2 ? -1 : 1;
+		plan.push_back(accelerationInstruction(150 * direction, 2000, 6));
+		plan.push_back(constantInstruction(400 * direction, 400, 400 * direction, 400, 400 * direction, 400, 400 * direction, 400));
+		plan.push_back(accelerationInstruction(150 * direction, 400, -156));
+	}
+	return plan;
+}
+
+// the same moves as rampPlan with ramps planned by the device
+std::vector<PlanInstruction> movePlan(int repeat) {
+	std::vector<PlanInstruction> plan;
+	for (int i = 0; i < repeat; ++i) {
+		int16_t direction = i % 2 ? -1 : 1;
+		plan.push_back(moveInstruction(700 * direction, 700 * direction, 700 * direction, 700 * direction, 400, MAX_ACCELERATION * STEPS_PER_REVOLUTION, 0));
+	}
+	return plan;
+}
+
+// short segments along circles (the way ControllerCNC interpolates curves)
+std::vector<PlanInstruction> densePlan(int repeat) {
+	std::vector<PlanInstruction> plan;
+	const int32_t duration = 12000;
+	const int segmentsPerCircle = 200;
+	for (int i = 0; i < repeat * 10; ++i) {
+		double angle = 2 * M_PI * i / segmentsPerCircle;
+		double speeds[PLAN_AXIS_COUNT] = { sin(angle), cos(angle), sin(2 * angle), cos(3 * angle) };
+
+		PlanInstruction instruction = constantInstruction(0, 0, 0, 0, 0, 0, 0, 0);
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+			int16_t stepCount = (int16_t)lround(20 * speeds[axis]);
+			if (stepCount == 0)
+				continue;
+
+			//all axes of the segment take the same time
+			ConstantAxis& constant = instruction.constant[axis];
+			constant.stepCount = stepCount;
+			constant.baseDeltaT = duration / abs(stepCount);
+			constant.periodNumerator = duration % abs(stepCount);
+		}
+		plan.push_back(instruction);
+	}
+	return plan;
+}
+
+int countChar(const std::string& text, char c) {
+	int count = 0;
+	for (size_t i = 0; i < text.size(); ++i)
+		count += text[i] == c;
+	return count;
+}
+
+void runBenchmark(const char* name, const std::vector<PlanInstruction>& plan, const char* dumpPath) {
+	resetBoard();
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool isFinished = executePlan(plan);
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	double hostSeconds = std::chrono::duration<double>(end - start).count();
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+
+	double simulatedSeconds = Simulator::toSeconds(Simulator::now());
+	printf("%s\n", name);
+	printf("\tinstructions: %u\n", (unsigned)plan.size());
+	printf("\tsteps: %u\n", (unsigned)steps.size());
+	printf("\tsimulated time: %.3f s\n", simulatedSeconds);
+	printf("\thost time: %.3f s\n", hostSeconds);
+	printf("\thost throughput: %.2f Msteps/s\n", steps.size() / hostSeconds / 1e6);
+	printf("\tstep interrupts: %llu\n", (unsigned long long)Simulator::isrCount);
+	printf("\tinterrupt CPU load: %.1f %%\n", 100.0 * Simulator::isrCycleTotal / Simulator::now());
+	printf("\tmissed step reports: %d\n", countChar(Simulator::serialOutput(), 'M'));
+	TimingTelemetry telemetry;
+	Steppers::takeTimingTelemetry(telemetry);
+	printf("\tunderrun stops: %d (lowest schedule occupancy %d)\n", telemetry.underrunStops, (int)telemetry.minOccupancy);
+	printf("\tframe bytes per instruction: %.1f (%.0f instructions/s at %d baud)\n", 1.0 * sentFrameBytes / plan.size(), SERIAL_BAUD / 10.0 * plan.size() / sentFrameBytes, SERIAL_BAUD);
+	if (!isFinished)
+		printf("\tSCHEDULER TIMEOUT\n");
+
+	if (dumpPath != NULL) {
+		FILE* output = fopen(dumpPath, "w");
+		if (output == NULL) {
+			printf("\tcannot write %s\n", dumpPath);
+			return;
+		}
+		PulseTrace::write(output, Simulator::portEvents());
+		fclose(output);
+	}
+}
+
+int failureCount = 0;
+
+void expect(bool condition, const char* description) {
+	printf("\t[%s] %s\n", condition ? "OK" : "FAIL", description);
+	if (!condition)
+		++failureCount;
+}
+
+#ifdef STEP_ENGINE_DDA
+// fixed rate engine steps on its own tick grid - the mean period stays and every step is at most one segment off
+void checkDdaSteps() {
+	printf("dda steps\n");
+	resetBoard();
+
+	PlanInstruction cruise = constantInstruction(2000, 400, -1000, 800, 0, 0, 0, 0);
+	cruise.constant[0].periodNumerator = 1234;
+	expect(executePlan(std::vector<PlanInstruction>(2, cruise)), "scheduler finished");
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	std::vector<uint64_t> axisCycles[2];
+	for (size_t i = 0; i < steps.size(); ++i) {
+		for (int axis = 0; axis < 2; ++axis) {
+			if (steps[i].slot == AXIS_SLOTS[axis])
+				axisCycles[axis].push_back(steps[i].cycle);
+		}
+	}
+	expect(axisCycles[0].size() == 4000 && axisCycles[1].size() == 2000, "all steps were made");
+
+	bool isOnGrid = true;
+	double maxDeviation = 0;
+	for (int axis = 0; axis < 2; ++axis) {
+		const std::vector<uint64_t>& cycles = axisCycles[axis];
+		double meanDeltaT = (double)(cycles.back() - cycles.front()) / (cycles.size() - 1) / TICK_CYCLES;
+		for (size_t i = 1; i < cycles.size(); ++i) {
+			int64_t interval = (cycles[i] - cycles[i - 1]) / SCHEDULE_TICK_CYCLES;
+			int64_t gridOffset = interval % DDA_PERIOD;
+			isOnGrid &= gridOffset < 4 * SCHEDULE_TICK_SCALE || gridOffset > DDA_PERIOD - 4 * SCHEDULE_TICK_SCALE;
+
+			double deviation = fabs((cycles[i] - cycles.front()) / TICK_CYCLES - i * meanDeltaT);
+			if (deviation > maxDeviation)
+				maxDeviation = deviation;
+		}
+	}
+
+	double expectedDeltaT = 400 + 1234 / 2000.0;
+	double meanDeltaT = (double)(axisCycles[0].back() - axisCycles[0].front()) / (axisCycles[0].size() - 1) / TICK_CYCLES;
+	printf("\tmean deltaT: %.2f (expected %.2f), largest deviation: %.0f ticks\n", meanDeltaT, expectedDeltaT, maxDeviation);
+	expect(fabs(meanDeltaT - expectedDeltaT) < expectedDeltaT * 0.005, "mean period");
+	expect(isOnGrid, "steps on the interrupt grid");
+	expect(maxDeviation <= DDA_PERIOD / SCHEDULE_TICK_SCALE * DDA_SEGMENT_TICKS, "deviation within a segment");
+	expect(SLOT1_STEPS == 4000 && SLOT0_STEPS == -2000, "position counters");
+}
+#endif
+
+// ported StepperTest::testActivationClock - steps has to come exactly in the requested period
+void checkActivationClock() {
+	printf("activation clock\n");
+	resetBoard();
+
+	int16_t stepCount = 1000;
+	int32_t stepDelayTick = 400;
+	std::vector<PlanInstruction> plan;
+	plan.push_back(constantInstruction(stepCount, stepDelayTick, 0, 0, 0, 0, 0, 0));
+	expect(executePlan(plan), "scheduler finished");
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	expect(steps.size() == (size_t)stepCount, "step count");
+
+	bool hasExactPeriod = true;
+	for (size_t i = 1; i < steps.size(); ++i)
+		hasExactPeriod &= steps[i].cycle - steps[i - 1].cycle == (uint64_t)stepDelayTick * TICK_CYCLES;
+	expect(hasExactPeriod, "exact step period");
+	expect(SLOT1_STEPS == stepCount, "position counter");
+}
+
+// slow axis keeps its period across the longest timer delays (the 32-bit timer needs no empty activations between the steps)
+void checkSlowAxis() {
+	printf("slow axis\n");
+	resetBoard();
+
+	int16_t stepCount = 20;
+	int32_t stepDelayTick = 100000;
+	std::vector<PlanInstruction> plan;
+	plan.push_back(constantInstruction(stepCount, stepDelayTick, 0, 0, 0, 0, 0, 0));
+	expect(executePlan(plan), "scheduler finished");
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	expect(steps.size() == (size_t)stepCount, "step count");
+
+	bool hasExactPeriod = true;
+	for (size_t i = 1; i < steps.size(); ++i)
+		hasExactPeriod &= steps[i].cycle - steps[i - 1].cycle == (uint64_t)stepDelayTick * TICK_CYCLES;
+	printf("\tstep interrupts: %llu\n", (unsigned long long)Simulator::isrCount);
+	expect(hasExactPeriod, "exact step period");
+#ifdef STEP_TIMER_32BIT
+	//the last interrupt stops the scheduler
+	expect(Simulator::isrCount == (uint64_t)stepCount + 1, "no empty activations");
+#endif
+}
+
+// fractional period is kept within a schedule tick (the high resolution ticks are compared with the default ones by the output of both builds)
+void checkFractionalPeriod() {
+	printf("fractional period\n");
+	resetBoard();
+
+	int16_t stepCount = 2000;
+	PlanInstruction instruction = constantInstruction(stepCount, 400, 0, 0, 0, 0, 0, 0);
+	instruction.constant[0].periodNumerator = 1234;
+	std::vector<PlanInstruction> plan;
+	plan.push_back(instruction);
+	expect(executePlan(plan), "scheduler finished");
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	expect(steps.size() == (size_t)stepCount, "step count");
+
+	//errors of the step periods and of the step times against the exact period (in CPU cycles)
+	double periodCycles = (400 + 1234.0 / stepCount) * TICK_CYCLES;
+	double maxPeriodError = 0, maxTimeError = 0, squareSum = 0;
+	for (size_t i = 1; i < steps.size(); ++i) {
+		double periodError = fabs((steps[i].cycle - steps[i - 1].cycle) - periodCycles);
+		double timeError = fabs((steps[i].cycle - steps[0].cycle) - i * periodCycles);
+		maxPeriodError = max(maxPeriodError, periodError);
+		maxTimeError = max(maxTimeError, timeError);
+		squareSum += periodError * periodError;
+	}
+	double nsPerCycle = 1e9 / Simulator::cpuFrequency;
+	printf("\tper-step timing error: %.1f ns rms, %.1f ns max, step time drift: %.1f ns max (schedule tick %.1f ns)\n",
+		sqrt(squareSum / (steps.size() - 1)) * nsPerCycle, maxPeriodError * nsPerCycle, maxTimeError * nsPerCycle, SCHEDULE_TICK_CYCLES * nsPerCycle);
+	expect(maxPeriodError < SCHEDULE_TICK_CYCLES, "period error within a schedule tick");
+	expect(maxTimeError <= SCHEDULE_TICK_CYCLES, "steps do not drift");
+}
+
+// steps of all axes has to be emitted and counted by the step interrupt
+void checkPositions(const char* name, const std::vector<PlanInstruction>& plan) {
+	printf("%s positions\n", name);
+	resetBoard();
+	expect(executePlan(plan), "scheduler finished");
+
+	int32_t expectedPositions[SLOT_COUNT] = { 0 };
+	for (size_t i = 0; i < plan.size(); ++i) {
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+			expectedPositions[AXIS_SLOTS[axis]] += instructionSteps(plan[i], axis);
+		}
+	}
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	int32_t tracePositions[SLOT_COUNT] = { 0 };
+	for (size_t i = 0; i < steps.size(); ++i)
+		tracePositions[steps[i].slot] += steps[i].direction;
+
+	int32_t counterPositions[SLOT_COUNT] = { SLOT0_STEPS, SLOT1_STEPS, SLOT2_STEPS, SLOT3_STEPS };
+	expect(memcmp(expectedPositions, tracePositions, sizeof(tracePositions)) == 0, "pulse stream positions");
+	expect(memcmp(expectedPositions, counterPositions, sizeof(counterPositions)) == 0, "position counters");
+	expect(countChar(Simulator::serialOutput(), 'F') == (int)plan.size(), "instruction end reports");
+}
+
+// constant steps are repeated from a few schedule entries with the same timing the plan produces
+void checkScheduleRuns(const char* name, const PlanInstruction& instruction) {
+	printf("%s schedule runs\n", name);
+	resetBoard();
+	byte frame[PLAN_FRAME_SIZE];
+	writeLegacyFrame(frame, instruction);
+	decodeFrame(frame);
+	armQueuedPlans();
+
+	//runs are limited by the look-ahead - entries are counted while the scheduler runs
+	int entryCount = 0;
+	bool isScheduled = false;
+	uint64_t timeout = Simulator::now() + SCHEDULER_TIMEOUT;
+	while (!isScheduled && Simulator::now() < timeout) {
+		ScheduleIndex start = SCHEDULE_START;
+		isScheduled = !SEGMENT_SCHEDULER.fillSchedule();
+		entryCount += scheduleOccupancy(SCHEDULE_START, start);
+	}
+	expect(isScheduled && Simulator::waitForScheduler(SCHEDULER_TIMEOUT), "scheduler finished");
+	reportFinishedInstructions();
+	int stepCount = abs(instruction.constant[0].stepCount);
+	printf("\tschedule entries: %d for %d steps\n", entryCount, stepCount);
+	expect(entryCount * 10 < stepCount, "steps are repeated by runs");
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	bool hasPlanTiming = true;
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+		const ConstantAxis& constant = instruction.constant[axis];
+		if (constant.stepCount == 0)
+			continue;
+
+		//reference timing of the plan
+		ConstantSegment segment = { constant.baseDeltaT, constant.stepCount, constant.periodNumerator };
+		const byte* data = (const byte*)&segment;
+		SegmentPlan plan(0, 0);
+		plan.loadFrom('C', COMPACT_AXIS_PRESENT, data);
+		plan.createNextActivation();
+
+		std::vector<uint64_t> axisSteps;
+		for (size_t i = 0; i < steps.size(); ++i) {
+			if (steps[i].slot == AXIS_SLOTS[axis])
+				axisSteps.push_back(steps[i].cycle);
+		}
+
+		hasPlanTiming &= axisSteps.size() == (size_t)abs(constant.stepCount);
+		for (size_t i = 1; hasPlanTiming && i < axisSteps.size(); ++i) {
+			plan.createNextActivation();
+			hasPlanTiming &= axisSteps[i] - axisSteps[i - 1] == (uint64_t)plan.nextActivationTime * SCHEDULE_TICK_CYCLES;
+		}
+	}
+	expect(hasPlanTiming, "step timing of the plan");
+	expect(SLOT1_STEPS == instruction.constant[0].stepCount, "position counter");
+}
+
+// steps of different axes closer than MIN_ACTIVATION_DELAY are grouped (the step comes earlier, the next one later)
+bool isGroupedInterval(int64_t intervalTicks, int32_t deltaT) {
+	int32_t groupingTicks = MIN_ACTIVATION_DELAY / SCHEDULE_TICK_SCALE;
+	return intervalTicks >= deltaT - groupingTicks && intervalTicks <= deltaT + groupingTicks;
+}
+
+// axes with different instruction durations has to keep their own timing across instruction boundaries
+void checkSeamlessAxes() {
+	printf("seamless axes\n");
+	resetBoard();
+
+	//second axis finishes every constant instruction earlier, third one later
+	const int16_t constantSteps[PLAN_AXIS_COUNT] = { 100, 99, 101, 50 };
+	const int32_t constantDeltas[PLAN_AXIS_COUNT] = { 400, 400, 400, 800 };
+	const int16_t rampSteps = 20;
+
+	int instructionCount = 20;
+	std::vector<PlanInstruction> plan;
+	for (int i = 0; i < instructionCount; ++i) {
+		plan.push_back(constantInstruction(constantSteps[0], constantDeltas[0], constantSteps[1], constantDeltas[1], constantSteps[2], constantDeltas[2], constantSteps[3], constantDeltas[3]));
+		plan.push_back(accelerationInstruction(rampSteps, 2000, 6));
+		plan.push_back(accelerationInstruction(rampSteps, 1000, -26));
+	}
+	expect(executePlan(plan), "scheduler finished");
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+
+	bool hasExactBoundaries = true;
+	bool hasExactPeriod = true;
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+		std::vector<uint64_t> axisSteps;
+		for (size_t i = 0; i < steps.size(); ++i) {
+			if (steps[i].slot == AXIS_SLOTS[axis])
+				axisSteps.push_back(steps[i].cycle);
+		}
+
+		int cycleLength = constantSteps[axis] + 2 * rampSteps;
+		for (size_t i = 1; i < axisSteps.size(); ++i) {
+			int cycleStep = i % cycleLength;
+			int64_t interval = (axisSteps[i] - axisSteps[i - 1]) / TICK_CYCLES;
+			if (cycleStep == 0)
+				hasExactBoundaries &= isGroupedInterval(interval, constantDeltas[axis]);
+			else if (cycleStep == constantSteps[axis])
+				hasExactBoundaries &= isGroupedInterval(interval, 2000);
+			else if (cycleStep == constantSteps[axis] + rampSteps)
+				hasExactBoundaries &= isGroupedInterval(interval, 1000);
+			else if (cycleStep < constantSteps[axis])
+				hasExactPeriod &= isGroupedInterval(interval, constantDeltas[axis]);
+		}
+	}
+
+	expect(hasExactBoundaries, "first segment step follows the previous segment");
+	expect(hasExactPeriod, "constant period (up to grouping)");
+	expect(countChar(Simulator::serialOutput(), 'M') == 0, "no missed steps");
+	expect(countChar(Simulator::serialOutput(), 'F') == (int)plan.size(), "instruction end reports");
+}
+
+// compact frames has to produce the same pulse stream as legacy frames
+void checkCompactFrames(const char* name, const std::vector<PlanInstruction>& plan) {
+	printf("%s compact frames\n", name);
+	useCompactFrames = false;
+	resetBoard();
+	executePlan(plan);
+	std::vector<PortEvent> legacyEvents = Simulator::portEvents();
+	uint64_t legacyBytes = sentFrameBytes;
+
+	useCompactFrames = true;
+	resetBoard();
+	expect(executePlan(plan), "scheduler finished");
+	useCompactFrames = false;
+
+	const std::vector<PortEvent>& events = Simulator::portEvents();
+	bool isSame = events.size() == legacyEvents.size();
+	for (size_t i = 0; isSame && i < events.size(); ++i)
+		isSame = events[i].cycle == legacyEvents[i].cycle && PulseTrace::activation(events[i]) == PulseTrace::activation(legacyEvents[i]);
+	expect(isSame, "the same pulse stream as legacy frames");
+	expect(sentFrameBytes * 3 <= legacyBytes, "at least 3x less bytes");
+
+	byte frame[PLAN_FRAME_SIZE];
+	int32_t references[PLAN_AXIS_COUNT] = { 0 };
+	size_t frameSize = writeCompactFrame(frame, plan[0], references);
+	const byte* payloadEnd = frame + frameSize - 2;
+	bool isTruncatedRejected = PLAN_QUEUE.isValidCompact(frame + 1, payloadEnd);
+	for (const byte* end = frame + 1; end < payloadEnd; ++end)
+		isTruncatedRejected &= !PLAN_QUEUE.isValidCompact(frame + 1, end);
+	expect(isTruncatedRejected, "truncated payload is rejected");
+	frame[frameSize / 2] ^= 0x04;
+	expect(!isValidFrame(frame, frameSize), "corrupted frame is rejected");
+}
+
+// batched instruction ends are counted instead of reported by 'F'
+void checkInstructionEndBatching(const char* name, const std::vector<PlanInstruction>& plan) {
+	printf("%s instruction end batching\n", name);
+	resetBoard();
+	isInstructionEndBatching = true;
+	expect(executePlan(plan), "scheduler finished");
+	expect(countChar(Simulator::serialOutput(), 'F') == 0, "no instruction end reports");
+	expect(batchedInstructionEnds == (int)plan.size(), "finished instruction count");
+	expect(Steppers::takeFinishedInstructionCount() == 0, "count is taken once");
+}
+
+// axes stepping at MIN_DELTA_T with interleaved steps (every step takes its own interrupt) keep their period
+void checkMinDeltaT() {
+	printf("min delta t\n");
+	resetBoard();
+
+	//delta is in us, plans are on 0.5us scale
+	const int32_t deltaT = MIN_DELTA_T * 2;
+	PlanInstruction instruction = constantInstruction(2000, deltaT, 2000, deltaT, 2000, deltaT, 2000, deltaT);
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis)
+		instruction.constant[axis].offset = axis * deltaT / PLAN_AXIS_COUNT;
+
+	std::vector<PlanInstruction> plan;
+	plan.push_back(instruction);
+	expect(executePlan(plan), "scheduler finished");
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	bool hasPlanPeriod = steps.size() == (size_t)PLAN_AXIS_COUNT * 2000;
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+		uint64_t lastCycle = 0;
+		for (size_t i = 0; i < steps.size(); ++i) {
+			if (steps[i].slot != AXIS_SLOTS[axis])
+				continue;
+
+			//interrupt can wait for a few cycles when the main loop blocks it (the long ring reads its index atomically)
+			hasPlanPeriod &= lastCycle == 0 || llabs((int64_t)(steps[i].cycle - lastCycle) - deltaT * TICK_CYCLES) <= TICK_CYCLES;
+			lastCycle = steps[i].cycle;
+		}
+	}
+	printf("\tinterrupt CPU load: %.1f %%\n", 100.0 * Simulator::isrCycleTotal / Simulator::now());
+	expect(hasPlanPeriod, "step period (up to a timer tick)");
+	expect(countChar(Simulator::serialOutput(), 'M') == 0, "no missed steps");
+	expect(SLOT1_STEPS == 2000 && SLOT0_STEPS == 2000 && SLOT3_STEPS == 2000 && SLOT2_STEPS == 2000, "position counters");
+}
+
+// timing counters see the underrun, interrupt lateness, grouped and missed steps
+void checkTimingTelemetry() {
+	printf("timing telemetry\n");
+	resetBoard();
+
+	//main loop does not refill the schedule - the step interrupt runs out of entries
+	byte frame[PLAN_FRAME_SIZE];
+	writeLegacyFrame(frame, accelerationInstruction(1000, 2000, 6));
+	decodeFrame(frame);
+	armQueuedPlans();
+	SEGMENT_SCHEDULER.fillSchedule();
+	Steppers::startScheduler();
+	Simulator::waitForScheduler(SCHEDULER_TIMEOUT);
+	expect(executePlan(std::vector<PlanInstruction>()), "scheduler finished");
+
+	TimingTelemetry telemetry;
+	Steppers::takeTimingTelemetry(telemetry);
+	uint64_t histogramTotal = 0;
+	for (int i = 0; i < ISR_LATENESS_BUCKET_COUNT; ++i)
+		histogramTotal += telemetry.latenessHistogram[i];
+	expect(telemetry.underrunStops == 1, "underrun stop");
+	expect(histogramTotal == Simulator::isrCount, "lateness of every step interrupt");
+
+	resetBoard();
+	std::vector<PlanInstruction> plan;
+	//second axis steps shortly after the first one
+	PlanInstruction groupedInstruction = constantInstruction(100, 400, 100, 400, 0, 0, 0, 0);
+	groupedInstruction.constant[1].offset = MIN_ACTIVATION_DELAY / SCHEDULE_TICK_SCALE / 2;
+	plan.push_back(groupedInstruction);
+	//direction is reversed without time for the direction change
+	plan.push_back(constantInstruction(-100, 30, 0, 0, 0, 0, 0, 0));
+	plan.push_back(constantInstruction(100, 400, 0, 0, 0, 0, 0, 0));
+	expect(executePlan(plan), "scheduler finished");
+
+	uint16_t groupedSteps[PLAN_AXIS_COUNT];
+	uint16_t missedSteps[PLAN_AXIS_COUNT];
+	SEGMENT_SCHEDULER.takeStepCounters(groupedSteps, missedSteps);
+	Steppers::takeTimingTelemetry(telemetry);
+	printf("\tgrouped steps: %d %d %d %d, missed steps: %d %d %d %d, lowest occupancy: %d\n", groupedSteps[0], groupedSteps[1], groupedSteps[2], groupedSteps[3], missedSteps[0], missedSteps[1], missedSteps[2], missedSteps[3], (int)telemetry.minOccupancy);
+	expect(groupedSteps[0] == 0 && groupedSteps[1] == 100, "grouped steps of the second axis");
+	expect(missedSteps[0] == 1 && missedSteps[1] == 0, "missed step of the reversed axis");
+	expect(telemetry.underrunStops == 0 && telemetry.minOccupancy > 0, "no underrun");
+}
+
+// runs the plan while the main loop spends protocolCycles on the protocol after every frame
+// (the main loop fills the schedule only when the refill interrupt is disabled)
+bool executeBusyPlan(const std::vector<PlanInstruction>& plan, uint64_t protocolCycles) {
+	bool isRefillEnabled = isScheduleRefillEnabled();
+	size_t sentCount = 0;
+	while (sentCount < plan.size() || PLAN_QUEUE.front() != NULL || !SEGMENT_SCHEDULER.isIdle()) {
+		if (sentCount < plan.size()) {
+			byte frame[PLAN_FRAME_SIZE];
+			writeLegacyFrame(frame, plan[sentCount]);
+			if (decodeFrame(frame))
+				++sentCount;
+		}
+		armQueuedPlans();
+		if (!isRefillEnabled)
+			SEGMENT_SCHEDULER.fillSchedule();
+		Steppers::sendDeferredReports();
+		Simulator::consume(protocolCycles);
+	}
+
+	bool isFinished = Simulator::waitForScheduler(SCHEDULER_TIMEOUT);
+	reportFinishedInstructions();
+	Steppers::sendDeferredReports();
+	return isFinished;
+}
+
+// refill interrupt keeps the schedule filled while the main loop is blocked by the protocol
+void checkRefillInterrupt() {
+	printf("refill interrupt\n");
+	const uint64_t protocolCycles = Simulator::cpuFrequency / 20;
+	std::vector<PlanInstruction> plan = cruisePlan(4);
+
+	resetBoard();
+	expect(executeBusyPlan(plan, protocolCycles), "scheduler finished without the refill");
+	TimingTelemetry telemetry;
+	Steppers::takeTimingTelemetry(telemetry);
+	int mainLoopStops = telemetry.underrunStops;
+
+	resetBoard();
+	enableScheduleRefill();
+	bool isFinished = executeBusyPlan(plan, protocolCycles);
+	disableScheduleRefill();
+	expect(isFinished, "scheduler finished with the refill");
+	Steppers::takeTimingTelemetry(telemetry);
+	printf("\tunderrun stops: %d without the refill, %d with the refill (%llu refills, lowest occupancy %d)\n", mainLoopStops, telemetry.underrunStops, (unsigned long long)Simulator::refillCount, (int)telemetry.minOccupancy);
+#ifndef STEP_ENGINE_DDA
+	//fixed rate entries span many steps - the blocked main loop does not underrun them
+	expect(mainLoopStops > 0, "blocked main loop underruns the schedule");
+#endif
+	expect(telemetry.underrunStops == 0, "no underrun with the refill");
+
+	int32_t expectedPositions[SLOT_COUNT] = { 0 };
+	for (size_t i = 0; i < plan.size(); ++i) {
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis)
+			expectedPositions[AXIS_SLOTS[axis]] += instructionSteps(plan[i], axis);
+	}
+	int32_t counterPositions[SLOT_COUNT] = { SLOT0_STEPS, SLOT1_STEPS, SLOT2_STEPS, SLOT3_STEPS };
+	expect(memcmp(expectedPositions, counterPositions, sizeof(counterPositions)) == 0, "position counters");
+	expect(countChar(Simulator::serialOutput(), 'M') == 0, "no missed steps");
+	expect(countChar(Simulator::serialOutput(), 'F') == (int)plan.size(), "instruction end reports");
+}
+
+// moves planned by the device keep the acceleration limit, reach the cruise and keep all axes on the line
+void checkMove(const char* name, int32_t rampJerk) {
+	printf("%s move\n", name);
+	resetBoard();
+
+	const int32_t cruiseDeltaT = 400;
+	const int32_t acceleration = 20000;
+	const int16_t axisSteps[PLAN_AXIS_COUNT] = { 4000, -3000, 1000, 0 };
+	std::vector<PlanInstruction> plan;
+	plan.push_back(moveInstruction(axisSteps[0], axisSteps[1], axisSteps[2], axisSteps[3], cruiseDeltaT, acceleration, rampJerk));
+	expect(executePlan(plan), "scheduler finished");
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	std::vector<uint64_t> axisCycles[PLAN_AXIS_COUNT];
+	for (size_t i = 0; i < steps.size(); ++i) {
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+			if (steps[i].slot == AXIS_SLOTS[axis])
+				axisCycles[axis].push_back(steps[i].cycle);
+		}
+	}
+
+	//speed changes of the leading axis (steps/s^2) - speeds are averaged over a few steps, grouped steps of other axes shift them a little
+	const std::vector<uint64_t>& leader = axisCycles[0];
+	const size_t window = 32;
+	double peakAcceleration = 0, startAcceleration = 0;
+	for (size_t i = 2 * window; i < leader.size(); ++i) {
+		double span1 = Simulator::toSeconds(leader[i - window] - leader[i - 2 * window]);
+		double span2 = Simulator::toSeconds(leader[i] - leader[i - window]);
+		double windowAcceleration = fabs(window / span2 - window / span1) / ((span1 + span2) / 2);
+		peakAcceleration = fmax(peakAcceleration, windowAcceleration);
+		if (i < 3 * window)
+			startAcceleration = fmax(startAcceleration, windowAcceleration);
+	}
+
+	int cruiseSteps = 0;
+	for (size_t i = 1; i < leader.size(); ++i)
+		cruiseSteps += llabs((int64_t)(leader[i] - leader[i - 1]) - cruiseDeltaT * TICK_CYCLES) <= MIN_ACTIVATION_DELAY * SCHEDULE_TICK_CYCLES;
+
+	//axes stay on the line of the move (a step of quantization and a little of the ramp approximation)
+	int32_t positions[SLOT_COUNT] = { 0 };
+	double lineDistance = 0;
+	for (size_t i = 0; i < steps.size(); ++i) {
+		positions[steps[i].slot] += steps[i].direction;
+		for (int axis = 1; axis < PLAN_AXIS_COUNT; ++axis) {
+			double linePosition = (double)positions[AXIS_SLOTS[0]] * axisSteps[axis] / axisSteps[0];
+			lineDistance = fmax(lineDistance, fabs(positions[AXIS_SLOTS[axis]] - linePosition));
+		}
+	}
+
+	printf("\tpeak acceleration: %.0f steps/s^2 (first steps %.0f), cruise steps: %d, distance from the line: %.2f steps\n", peakAcceleration, startAcceleration, cruiseSteps, lineDistance);
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis)
+		expect(axisCycles[axis].size() == (size_t)abs(axisSteps[axis]), "axis step count");
+	expect(SLOT1_STEPS == axisSteps[0] && SLOT0_STEPS == axisSteps[1] && SLOT3_STEPS == axisSteps[2] && SLOT2_STEPS == axisSteps[3], "position counters");
+	expect(peakAcceleration < acceleration * 1.1, "acceleration limit");
+	expect(cruiseSteps > abs(axisSteps[0]) / 2, "cruise speed");
+	expect(lineDistance < 1.5, "axes keep the line");
+	if (rampJerk > 0)
+		expect(startAcceleration < peakAcceleration / 2, "acceleration grows from the standstill");
+}
+
+// polygon of the given count of moves along a circle (the way aerofoil paths are cut)
+std::vector<PlanInstruction> polylinePlan(int segmentCount, bool isStopping) {
+	std::vector<PlanInstruction> plan;
+	const double radius = 3000;
+	int32_t position[2] = { (int32_t)lround(radius), 0 };
+	for (int i = 1; i <= segmentCount; ++i) {
+		double angle = 2 * M_PI * i / segmentCount;
+		int32_t target[2] = { (int32_t)lround(radius * cos(angle)), (int32_t)lround(radius * sin(angle)) };
+		plan.push_back(moveInstruction(target[0] - position[0], target[1] - position[1], 0, 0, 300, 20000, 0));
+		if (isStopping)
+			//plan between the moves makes them stop
+			plan.push_back(constantInstruction(0, 0, 0, 0, 0, 0, 0, 0));
+		position[0] = target[0];
+		position[1] = target[1];
+	}
+	return plan;
+}
+
+// queued moves pass their junctions without stopping when the geometry allows it
+void checkLookAhead() {
+	printf("look-ahead\n");
+	resetBoard();
+	expect(executePlan(polylinePlan(36, true)), "scheduler finished");
+	double stoppingSeconds = Simulator::toSeconds(Simulator::now());
+
+	checkPositions("polyline", polylinePlan(36, false));
+	double plannedSeconds = Simulator::toSeconds(Simulator::now());
+	expect(countChar(Simulator::serialOutput(), 'M') == 0, "no missed steps");
+
+	//the same line split into moves takes the same time
+	resetBoard();
+	std::vector<PlanInstruction> line(1, moveInstruction(4000, 2000, 0, 0, 300, 20000, 0));
+	expect(executePlan(line), "scheduler finished");
+	double lineSeconds = Simulator::toSeconds(Simulator::now());
+	resetBoard();
+	std::vector<PlanInstruction> splitLine(4, moveInstruction(1000, 500, 0, 0, 300, 20000, 0));
+	expect(executePlan(splitLine), "scheduler finished");
+	double splitLineSeconds = Simulator::toSeconds(Simulator::now());
+
+	printf("\tpolygon: %.3f s (%.3f s stopping at the corners), line: %.3f s (%.3f s split into moves)\n", plannedSeconds, stoppingSeconds, lineSeconds, splitLineSeconds);
+	expect(plannedSeconds < stoppingSeconds * 0.75, "corners without stops");
+	expect(fabs(splitLineSeconds - lineSeconds) < lineSeconds * 0.02, "split line without stops");
+}
+
+// circle of quadrant arcs (the same circle in both planes)
+std::vector<PlanInstruction> circlePlan(int16_t radius, int32_t deltaT) {
+	const int16_t points[][2] = { { radius, 0 }, { 0, radius }, { (int16_t)-radius, 0 }, { 0, (int16_t)-radius }, { radius, 0 } };
+	std::vector<PlanInstruction> plan;
+	for (int i = 0; i < 4; ++i) {
+		PlanInstruction arc = arcInstruction(points[i][0], points[i][1], points[i + 1][0], points[i + 1][1], radius, deltaT);
+		arc.arc[2] = arc.arc[0];
+		arc.arc[3] = arc.arc[1];
+		plan.push_back(arc);
+	}
+	return plan;
+}
+
+// arcs keep the steps on the circle with constant speed along it
+void checkArcs() {
+	printf("arcs\n");
+	const int16_t radius = 3000;
+	const int32_t deltaT = 300;
+	checkPositions("circle", circlePlan(radius, deltaT));
+	double seconds = Simulator::toSeconds(Simulator::now());
+	double expectedSeconds = 2 * M_PI * radius * deltaT / TIMER_FREQUENCY;
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	int32_t positions[SLOT_COUNT] = { 0 };
+	double radiusError = 0;
+	for (size_t i = 0; i < steps.size(); ++i) {
+		positions[steps[i].slot] += steps[i].direction;
+		for (int plane = 0; plane < 2; ++plane) {
+			double x = radius + positions[AXIS_SLOTS[2 * plane]];
+			double y = positions[AXIS_SLOTS[2 * plane + 1]];
+			radiusError = fmax(radiusError, fabs(sqrt(x * x + y * y) - radius));
+		}
+	}
+
+	printf("\tcircle: %.3f s (%.3f s expected), distance from the circle: %.2f steps, %d bytes sent\n", seconds, expectedSeconds, radiusError, (int)sentFrameBytes);
+	expect(fabs(seconds - expectedSeconds) < expectedSeconds * 0.01, "speed along the arcs");
+	expect(radiusError < 1.5, "steps keep the circle");
+	expect(countChar(Simulator::serialOutput(), 'M') == 0, "no missed steps");
+
+	//4 * deltaT * radius of the schedule ticks overflows, the other arc leaves its quadrant
+	byte frame[PLAN_FRAME_SIZE];
+	writeLegacyFrame(frame, arcInstruction(radius, 0, 0, radius, radius, ARC_MAX_DELTA_T_RADIUS / radius));
+	bool isSlowArcRejected = !PLAN_QUEUE.isValidArc(frame + 1);
+	writeLegacyFrame(frame, arcInstruction(radius, 0, 0, radius, radius, ARC_MAX_DELTA_T_RADIUS / radius - 1));
+	bool isArcAccepted = PLAN_QUEUE.isValidArc(frame + 1);
+	writeLegacyFrame(frame, arcInstruction(radius / 2, radius / 2, (int16_t)-radius / 2, radius, radius, deltaT));
+	expect(isSlowArcRejected && isArcAccepted && !PLAN_QUEUE.isValidArc(frame + 1), "arcs out of range are rejected");
+	expect(!PLAN_QUEUE.push(ARC_KIND, frame + 1) && PLAN_QUEUE.front() == NULL, "arcs out of range are not decoded");
+}
+
+// circle of cubic Bezier quadrants (the same circle in both planes)
+std::vector<PlanInstruction> splineCirclePlan(int16_t radius, int32_t duration) {
+	//control points of the quadrants relative to their start (the inner points are at 0.5523 of the radius along the tangents)
+	int16_t handle = (int16_t)(0.5523 * radius + 0.5);
+	std::vector<PlanInstruction> plan;
+	int16_t x = radius, y = 0;
+	for (int i = 0; i < 4; ++i) {
+		//the start point turned by a quarter is the end point
+		int16_t endX = -y, endY = x;
+		int16_t controls[3][2] = {
+			{ (int16_t)(-y * handle / radius), (int16_t)(x * handle / radius) },
+			{ (int16_t)(endX - x + endY * handle / radius), (int16_t)(endY - y - endX * handle / radius) },
+			{ (int16_t)(endX - x), (int16_t)(endY - y) }
+		};
+		PlanInstruction spline = splineInstruction(controls, duration, SPLINE_MAX_INTERVAL_SHIFT);
+		spline.spline[2] = spline.spline[0];
+		spline.spline[3] = spline.spline[1];
+		plan.push_back(spline);
+		x = endX;
+		y = endY;
+	}
+	return plan;
+}
+
+// splines follow the curve with the intervals of the segment time
+void checkSplines() {
+	printf("splines\n");
+	const int16_t radius = 3000;
+	const int32_t duration = (int32_t)(M_PI / 2 * radius * 300);
+	checkPositions("spline circle", splineCirclePlan(radius, duration));
+	double seconds = Simulator::toSeconds(Simulator::now());
+	double expectedSeconds = 4.0 * duration / TIMER_FREQUENCY;
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	int32_t positions[SLOT_COUNT] = { 0 };
+	double radiusError = 0;
+	for (size_t i = 0; i < steps.size(); ++i) {
+		positions[steps[i].slot] += steps[i].direction;
+		for (int plane = 0; plane < 2; ++plane) {
+			double x = radius + positions[AXIS_SLOTS[2 * plane]];
+			double y = positions[AXIS_SLOTS[2 * plane + 1]];
+			radiusError = fmax(radiusError, fabs(sqrt(x * x + y * y) - radius));
+		}
+	}
+
+	printf("\tcircle: %.3f s (%.3f s expected), distance from the circle: %.2f steps, %d bytes sent\n", seconds, expectedSeconds, radiusError, (int)sentFrameBytes);
+	expect(fabs(seconds - expectedSeconds) < expectedSeconds * 0.01, "time of the splines");
+	//the Bezier quadrants leave the circle by 0.03 % of the radius
+	expect(radiusError < 2.5, "steps keep the curve");
+	expect(countChar(Simulator::serialOutput(), 'M') == 0, "no missed steps");
+
+	//slopes over SPLINE_MAX_SLOPE could reverse the axis, the intervals are limited by the rounding of the forward differences
+	byte frame[PLAN_FRAME_SIZE];
+	PlanInstruction spline = splineCirclePlan(radius, duration)[0];
+	writeLegacyFrame(frame, spline);
+	bool isSplineAccepted = PLAN_QUEUE.isValidSpline(frame + 1);
+	spline.spline[1].startSlope = SPLINE_MAX_SLOPE + 1;
+	writeLegacyFrame(frame, spline);
+	bool isSteepSplineRejected = !PLAN_QUEUE.isValidSpline(frame + 1);
+	spline = splineCirclePlan(radius, duration)[0];
+	spline.spline[0].intervalShift = SPLINE_MAX_INTERVAL_SHIFT + 1;
+	writeLegacyFrame(frame, spline);
+	expect(isSplineAccepted && isSteepSplineRejected && !PLAN_QUEUE.isValidSpline(frame + 1), "splines out of range are rejected");
+	expect(!PLAN_QUEUE.push(SPLINE_KIND, frame + 1) && PLAN_QUEUE.front() == NULL, "splines out of range are not decoded");
+}
+
+// homing segments run through the step ring - a ramp up to the approach speed, pressed switches block steps of their axes
+void checkHomingSegments() {
+	printf("homing segments\n");
+	resetBoard();
+	const int16_t approachSteps[PLAN_AXIS_COUNT] = { -100, -100, -100, -100 };
+	const uint16_t deltaTs[PLAN_AXIS_COUNT] = { 400, 400, 800, 2000 };
+	//switch of the last axis is pressed
+	Steppers::setActivationMask(PulseTrace::clkMasks[AXIS_SLOTS[3]]);
+	SEGMENT_SCHEDULER.armHoming(approachSteps, deltaTs, true);
+	SEGMENT_SCHEDULER.armHoming(approachSteps, deltaTs, false);
+	while (SEGMENT_SCHEDULER.fillSchedule());
+	expect(Simulator::waitForScheduler(SCHEDULER_TIMEOUT), "scheduler finished");
+	Steppers::setActivationMask(0);
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	std::vector<uint64_t> axisCycles[PLAN_AXIS_COUNT];
+	for (size_t i = 0; i < steps.size(); ++i) {
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+			if (steps[i].slot == AXIS_SLOTS[axis])
+				axisCycles[axis].push_back(steps[i].cycle);
+		}
+	}
+
+	//ramps end where the deltaT reaches the approach deltaT (n grows from HOMING_RAMP_N)
+	const std::vector<uint64_t>& leader = axisCycles[0];
+	size_t rampSteps = HOMING_RAMP_N * HOMING_RAMP_DELTA_T * HOMING_RAMP_DELTA_T / (deltaTs[0] * deltaTs[0]) - HOMING_RAMP_N;
+	double startDeltaT = (double)(leader[1] - leader[0]) / TICK_CYCLES;
+	double rampEndDeltaT = (double)(leader[rampSteps] - leader[rampSteps - 1]) / TICK_CYCLES;
+	int approachSteadySteps = 0;
+	for (size_t i = rampSteps + 1; i < leader.size(); ++i)
+		approachSteadySteps += llabs((int64_t)(leader[i] - leader[i - 1]) - deltaTs[0] * TICK_CYCLES) <= MIN_ACTIVATION_DELAY * SCHEDULE_TICK_CYCLES;
+
+	printf("\tsteps: %d %d %d %d, ramp deltaT: %.0f -> %.0f\n", (int)axisCycles[0].size(), (int)axisCycles[1].size(), (int)axisCycles[2].size(), (int)axisCycles[3].size(), startDeltaT, rampEndDeltaT);
+	expect(axisCycles[0].size() == rampSteps + 100 && axisCycles[1].size() == rampSteps + 100, "ramp and approach steps");
+	expect(axisCycles[2].size() < axisCycles[0].size() && axisCycles[2].size() > 100, "shorter ramp of the slower axis");
+	expect(axisCycles[3].empty(), "pressed switch blocks its axis");
+	expect(startDeltaT < HOMING_RAMP_DELTA_T && startDeltaT > deltaTs[0] * 2, "ramp starts slowly");
+	expect(fabs(rampEndDeltaT - deltaTs[0]) < deltaTs[0] * 0.1, "ramp reaches the approach speed");
+	expect(approachSteadySteps == 99, "approach keeps its speed");
+}
+
+// feed override scales the step periods of the whole plan (runs included), positions stay
+void checkFeedOverride(byte percent) {
+	printf("feed override %d %%\n", percent);
+	resetBoard();
+	SEGMENT_SCHEDULER.setFeedOverride(percent);
+	PlanInstruction cruise = constantInstruction(2000, 400, -1000, 800, 0, 0, 0, 0);
+	cruise.constant[0].periodNumerator = 1234;
+	expect(executePlan(std::vector<PlanInstruction>(2, cruise)), "scheduler finished");
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	std::vector<uint64_t> axisCycles[2];
+	for (size_t i = 0; i < steps.size(); ++i) {
+		for (int axis = 0; axis < 2; ++axis) {
+			if (steps[i].slot == AXIS_SLOTS[axis])
+				axisCycles[axis].push_back(steps[i].cycle);
+		}
+	}
+
+	double meanDeltaTs[2];
+	for (int axis = 0; axis < 2; ++axis) {
+		const std::vector<uint64_t>& cycles = axisCycles[axis];
+		meanDeltaTs[axis] = (double)(cycles.back() - cycles.front()) / (cycles.size() - 1) / TICK_CYCLES;
+	}
+
+	double expectedDeltaT = (400 + 1234 / 2000.0) * 100 / percent;
+	printf("\tmean deltaT: %.2f %.2f (expected %.2f)\n", meanDeltaTs[0], meanDeltaTs[1], expectedDeltaT);
+	expect(axisCycles[0].size() == 4000 && axisCycles[1].size() == 2000, "all steps were made");
+	expect(fabs(meanDeltaTs[0] - expectedDeltaT) < expectedDeltaT * 0.005, "period is scaled");
+	expect(fabs(meanDeltaTs[1] - 2 * meanDeltaTs[0]) < meanDeltaTs[0] * 0.01, "axes keep their ratio");
+	expect(SLOT1_STEPS == 4000 && SLOT0_STEPS == -2000, "position counters");
+}
+
+// changed feed override ramps the moving axes to the new speed with the acceleration limit
+void checkFeedOverrideRamp() {
+	printf("feed override ramp\n");
+	resetBoard();
+	const int32_t cruiseDeltaT = 400;
+	byte frame[PLAN_FRAME_SIZE];
+	writeLegacyFrame(frame, constantInstruction(4000, cruiseDeltaT, -2000, 2 * cruiseDeltaT, 0, 0, 0, 0));
+	decodeFrame(frame);
+	armQueuedPlans();
+
+	//override is raised in the cruise and lowered after the raised speed is reached
+	uint64_t raiseCycle = Simulator::now() + Simulator::cpuFrequency / 10;
+	uint64_t lowerCycle = raiseCycle + Simulator::cpuFrequency * 15 / 100;
+	bool isRaised = false, isLowered = false;
+	uint64_t timeout = Simulator::now() + SCHEDULER_TIMEOUT;
+	while ((!isLowered || Steppers::isSchedulerRunning()) && Simulator::now() < timeout) {
+		if (!isRaised && Simulator::now() >= raiseCycle) {
+			SEGMENT_SCHEDULER.setFeedOverride(200);
+			isRaised = true;
+		}
+		if (!isLowered && Simulator::now() >= lowerCycle) {
+			SEGMENT_SCHEDULER.setFeedOverride(50);
+			isLowered = true;
+		}
+		SEGMENT_SCHEDULER.fillSchedule();
+		Simulator::consume(Simulator::cpuFrequency / 10000);
+	}
+	expect(!Steppers::isSchedulerRunning(), "scheduler finished");
+	reportFinishedInstructions();
+	bool isRunning = !SEGMENT_SCHEDULER.isFeedHeld();
+	SEGMENT_SCHEDULER.setFeedOverride(100);
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	std::vector<uint64_t> axisCycles[2];
+	for (size_t i = 0; i < steps.size(); ++i) {
+		for (int axis = 0; axis < 2; ++axis) {
+			if (steps[i].slot == AXIS_SLOTS[axis])
+				axisCycles[axis].push_back(steps[i].cycle);
+		}
+	}
+
+	//speed changes of the leading axis (steps/s^2) averaged over a few steps
+	const std::vector<uint64_t>& leader = axisCycles[0];
+	const size_t window = 32;
+	double peakAcceleration = 0;
+	double maxRatio = 1;
+	for (size_t i = 2; i < leader.size(); ++i) {
+		double ratio = (double)(leader[i] - leader[i - 1]) / (leader[i - 1] - leader[i - 2]);
+		maxRatio = max(maxRatio, max(ratio, 1 / ratio));
+		if (i < 2 * window)
+			continue;
+		double span1 = Simulator::toSeconds(leader[i - window] - leader[i - 2 * window]);
+		double span2 = Simulator::toSeconds(leader[i] - leader[i - window]);
+		peakAcceleration = fmax(peakAcceleration, fabs(window / span2 - window / span1) / ((span1 + span2) / 2));
+	}
+
+	//periods before the lowered override and at the end
+	double raisedDeltaT = 0, loweredDeltaT = 0;
+	for (size_t i = 1; i < leader.size(); ++i) {
+		if (leader[i] < lowerCycle)
+			raisedDeltaT = (double)(leader[i] - leader[i - 1]) / TICK_CYCLES;
+	}
+	if (leader.size() > 1)
+		loweredDeltaT = (double)(leader.back() - leader[leader.size() - 2]) / TICK_CYCLES;
+
+	printf("\tdeltaT: %d -> %.0f -> %.0f, max period ratio: %.2f, peak acceleration: %.0f steps/s^2\n", (int)cruiseDeltaT, raisedDeltaT, loweredDeltaT, maxRatio, peakAcceleration);
+	expect(isRunning, "override ramp is not a hold");
+	expect(fabs(raisedDeltaT - cruiseDeltaT / 2) < cruiseDeltaT * 0.02 && fabs(loweredDeltaT - cruiseDeltaT * 2) < cruiseDeltaT * 0.04, "override reaches its speed");
+#ifndef STEP_ENGINE_DDA
+	double maxAcceleration = (double)MAX_ACCELERATION * STEPS_PER_REVOLUTION;
+	expect(peakAcceleration < maxAcceleration * 1.1, "override changes keep the acceleration limit");
+	expect(maxRatio < 1.1, "override changes are smooth");
+#else
+	//steps of the fixed rate engine are shifted by its period
+	expect(maxRatio < 2, "override changes are smooth");
+#endif
+	expect(axisCycles[0].size() == 4000 && axisCycles[1].size() == 2000, "all steps were made");
+	expect(SLOT1_STEPS == 4000 && SLOT0_STEPS == -2000, "position counters");
+}
+
+// feed hold decelerates the axes together within the look-ahead, plans wait while held and resume continues with the exact step counts
+void checkFeedHold() {
+	printf("feed hold\n");
+	resetBoard();
+	const int32_t cruiseDeltaT = 300;
+	byte frame[PLAN_FRAME_SIZE];
+	writeLegacyFrame(frame, constantInstruction(3000, cruiseDeltaT, -1500, 2 * cruiseDeltaT, 0, 0, 0, 0));
+	decodeFrame(frame);
+	armQueuedPlans();
+
+	//hold comes in the middle of the cruise
+	uint64_t holdCycle = Simulator::now() + Simulator::cpuFrequency / 10;
+	while (Simulator::now() < holdCycle) {
+		SEGMENT_SCHEDULER.fillSchedule();
+		Simulator::consume(Simulator::cpuFrequency / 10000);
+	}
+	SEGMENT_SCHEDULER.holdFeed();
+	uint64_t timeout = Simulator::now() + SCHEDULER_TIMEOUT;
+	while (Steppers::isSchedulerRunning() && Simulator::now() < timeout) {
+		SEGMENT_SCHEDULER.fillSchedule();
+		Simulator::consume(Simulator::cpuFrequency / 10000);
+	}
+	expect(!Steppers::isSchedulerRunning(), "axes stopped");
+
+	std::vector<StepEvent> heldSteps;
+	PulseTrace::extractSteps(Simulator::portEvents(), heldSteps);
+	int32_t heldPositions[SLOT_COUNT] = { 0 };
+	for (size_t i = 0; i < heldSteps.size(); ++i)
+		heldPositions[heldSteps[i].slot] += heldSteps[i].direction;
+	reportFinishedInstructions();
+	int32_t counterPositions[SLOT_COUNT] = { SLOT0_STEPS, SLOT1_STEPS, SLOT2_STEPS, SLOT3_STEPS };
+	expect(memcmp(heldPositions, counterPositions, sizeof(counterPositions)) == 0, "position counters of the held instruction");
+	TimingTelemetry telemetry;
+	Steppers::takeTimingTelemetry(telemetry);
+	expect(telemetry.underrunStops == 0, "hold is not an underrun");
+	uint64_t holdDuration = Simulator::cpuFrequency / 10;
+	uint64_t resumeCycle = Simulator::now() + holdDuration;
+	while (Simulator::now() < resumeCycle) {
+		SEGMENT_SCHEDULER.fillSchedule();
+		Simulator::consume(Simulator::cpuFrequency / 10000);
+	}
+
+	std::vector<StepEvent> steps;
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	expect(steps.size() == heldSteps.size(), "no steps while held");
+
+	SEGMENT_SCHEDULER.resumeFeed();
+	expect(executePlan(std::vector<PlanInstruction>()), "scheduler finished");
+
+	steps.clear();
+	PulseTrace::extractSteps(Simulator::portEvents(), steps);
+	std::vector<uint64_t> axisCycles[2];
+	size_t heldAxisSteps[2] = { 0, 0 };
+	for (size_t i = 0; i < steps.size(); ++i) {
+		for (int axis = 0; axis < 2; ++axis) {
+			if (steps[i].slot != AXIS_SLOTS[axis])
+				continue;
+			axisCycles[axis].push_back(steps[i].cycle);
+			if (i < heldSteps.size())
+				++heldAxisSteps[axis];
+		}
+	}
+
+	//consecutive periods of the ramps change smoothly (the held gap is left out)
+	const std::vector<uint64_t>& leader = axisCycles[0];
+	size_t held = heldAxisSteps[0];
+	double maxRatio = 1;
+	size_t rampStart = 0;
+	for (size_t i = 2; i < leader.size(); ++i) {
+		if (i == held || i == held + 1)
+			continue;
+		double ratio = (double)(leader[i] - leader[i - 1]) / (leader[i - 1] - leader[i - 2]);
+		maxRatio = max(maxRatio, max(ratio, 1 / ratio));
+		if (rampStart == 0 && leader[i - 1] > holdCycle && ratio > 1.01)
+			rampStart = i - 1;
+	}
+	double stopDeltaT = (double)(leader[held - 1] - leader[held - 2]) / TICK_CYCLES;
+	double startDeltaT = (double)(leader[held + 1] - leader[held]) / TICK_CYCLES;
+
+	//speed changes of the leading axis (steps/s^2) averaged over a few steps, windows over the held gap are left out
+	const size_t window = 32;
+	double peakAcceleration = 0;
+	for (size_t i = 2 * window; i < leader.size(); ++i) {
+		if (i - 2 * window < held && i >= held)
+			continue;
+		double span1 = Simulator::toSeconds(leader[i - window] - leader[i - 2 * window]);
+		double span2 = Simulator::toSeconds(leader[i] - leader[i - window]);
+		peakAcceleration = fmax(peakAcceleration, fabs(window / span2 - window / span1) / ((span1 + span2) / 2));
+	}
+	double holdLatency = rampStart > 0 ? (double)(leader[rampStart] - holdCycle) / TICK_CYCLES : INFINITY;
+	double stopDuration = Simulator::toSeconds(leader[held - 1] - holdCycle);
+	double cruiseSpeed = (double)TIMER_FREQUENCY / cruiseDeltaT;
+	double maxAcceleration = (double)MAX_ACCELERATION * STEPS_PER_REVOLUTION;
+
+	printf("\tsteps at hold: %d %d, deltaT: %.0f -> stop -> %.0f, max period ratio: %.2f\n", (int)heldAxisSteps[0], (int)heldAxisSteps[1], stopDeltaT, startDeltaT, maxRatio);
+	printf("\thold latency: %.0f ticks, stop after %.1f ms, peak acceleration: %.0f steps/s^2\n", holdLatency, stopDuration * 1000, peakAcceleration);
+	expect(held > 0 && held < 3000, "hold stopped the cruise");
+	expect(abs(2 * (int)heldAxisSteps[1] - (int)heldAxisSteps[0]) <= 2, "axes stopped together");
+	expect(holdLatency < 2 * SCHEDULE_LOOKAHEAD / SCHEDULE_TICK_SCALE, "ramp starts within the look-ahead");
+	expect(stopDeltaT > cruiseDeltaT && startDeltaT > cruiseDeltaT, "axes ramp down and up");
+	expect(stopDuration > (cruiseSpeed - MAX_JUNCTION_SPEED_CHANGE) / maxAcceleration, "hold ramp is not shorter than the acceleration allows");
+#ifndef STEP_ENGINE_DDA
+	//steps of the fixed rate engine are shifted by its period
+	expect(stopDeltaT * MAX_JUNCTION_SPEED_CHANGE >= TIMER_FREQUENCY && startDeltaT * MAX_JUNCTION_SPEED_CHANGE >= TIMER_FREQUENCY, "axes stop and start with the junction speed");
+	expect(peakAcceleration < maxAcceleration * 1.1, "ramps keep the acceleration limit");
+#endif
+	expect(maxRatio < 2, "ramps are smooth");
+	expect(axisCycles[0].size() == 3000 && axisCycles[1].size() == 1500, "all steps were made");
+	expect(SLOT1_STEPS == 3000 && SLOT0_STEPS == -1500, "position counters");
+	Steppers::takeTimingTelemetry(telemetry);
+	expect(telemetry.underrunStops == 0, "resumed hold is not an underrun");
+}
+
+// receive interrupt validates frames byte by byte and keeps plans in their slots
+void checkFrameReceiver() {
+	printf("frame receiver\n");
+	FrameReceiver<PLAN_FRAME_SIZE, 6> receiver;
+	std::vector<PlanInstruction> plan = densePlan(1);
+
+	byte legacyFrame[PLAN_FRAME_SIZE];
+	size_t legacySize = writeLegacyFrame(legacyFrame, plan[0]);
+	byte compactFrame[PLAN_FRAME_SIZE];
+	int32_t references[PLAN_AXIS_COUNT] = { 0 };
+	size_t compactSize = writeCompactFrame(compactFrame, plan[1], references);
+	byte stateFrame[PLAN_FRAME_SIZE] = { 'D' };
+	writeInt16(stateFrame + PLAN_FRAME_SIZE - 2, 'D');
+	//length of the payload does not fit into the slot (its CRC is valid)
+	byte oversizeFrame[PLAN_FRAME_SIZE];
+	memcpy(oversizeFrame, compactFrame, PLAN_FRAME_SIZE - 2);
+	oversizeFrame[0] = COMPACT_FRAME_FLAG | (PLAN_FRAME_SIZE - 2);
+	uint16_t oversizeCrc = 0xFFFF;
+	for (size_t i = 0; i < PLAN_FRAME_SIZE - 2; ++i)
+		oversizeCrc = crc16Update(oversizeCrc, oversizeFrame[i]);
+	writeInt16(oversizeFrame + PLAN_FRAME_SIZE - 2, oversizeCrc);
+
+	std::vector<byte> stream;
+	stream.insert(stream.end(), legacyFrame, legacyFrame + legacySize);
+	stream.insert(stream.end(), compactFrame, compactFrame + compactSize);
+	stream.insert(stream.end(), compactFrame, compactFrame + compactSize);
+	stream[stream.size() - 3] ^= 0x10;
+	stream.insert(stream.end(), oversizeFrame, oversizeFrame + PLAN_FRAME_SIZE);
+	stream.insert(stream.end(), stateFrame, stateFrame + PLAN_FRAME_SIZE);
+	for (size_t i = 0; i < stream.size(); ++i)
+		receiver.receive(stream[i]);
+
+	bool isLegacyReceived = receiver.receivedFrame() != NULL && memcmp(receiver.receivedFrame(), legacyFrame, legacySize) == 0;
+	receiver.processFrame(true);
+	bool isCompactReceived = receiver.receivedFrame() != NULL && receiver.receivedFrameSize() == compactSize && memcmp(receiver.receivedFrame(), compactFrame, compactSize) == 0;
+	receiver.processFrame(true);
+	bool isStateReceived = receiver.receivedFrame() != NULL && receiver.receivedFrame()[0] == 'D';
+	receiver.processFrame(false);
+	expect(isLegacyReceived && isCompactReceived && isStateReceived && receiver.receivedFrame() == NULL, "valid frames received in order");
+	expect(receiver.takeInvalidFrameCount() == 2, "corrupted and oversized frames are counted");
+
+	bool isPlanOrder = receiver.nextPlan() != NULL && receiver.nextPlan()[0] == 'C';
+	receiver.fetchPlan();
+	isPlanOrder &= receiver.nextPlan() != NULL && (receiver.nextPlan()[0] & COMPACT_FRAME_FLAG);
+	receiver.fetchPlan();
+	expect(isPlanOrder && receiver.nextPlan() == NULL, "plans fetched in order");
+
+	byte moveFrame[PLAN_FRAME_SIZE] = { MOVE_KIND };
+	expect(receiver.isPlanFrame(moveFrame) && !receiver.isPlanFrame(stateFrame), "moves are plan frames");
+
+	//one slot is written, one is kept for interactive instructions
+	int acceptedCount = 0;
+	for (int i = 0; i < 6; ++i) {
+		for (size_t j = 0; j < legacySize; ++j)
+			receiver.receive(legacyFrame[j]);
+
+		if (receiver.receivedFrame() != NULL) {
+			receiver.processFrame(true);
+			++acceptedCount;
+		}
+	}
+	expect(acceptedCount == 4 && receiver.takeOverflowFrameCount() == 2 && receiver.freePlanSlots() == 0, "plans overflow keeps a slot for interactive instructions");
+
+	for (size_t j = 0; j < PLAN_FRAME_SIZE; ++j)
+		receiver.receive(stateFrame[j]);
+	expect(receiver.receivedFrame() != NULL && receiver.receivedFrame()[0] == 'D', "interactive instruction fits into the full ring");
+	receiver.processFrame(false);
+
+	for (size_t j = 0; j < 10; ++j)
+		receiver.receive(legacyFrame[j]);
+	receiver.checkIncompleteFrame(100, 2);
+	bool isKeptEarly = !receiver.checkIncompleteFrame(102, 2);
+	expect(isKeptEarly && receiver.checkIncompleteFrame(103, 2), "incomplete frame is erased");
+}
+
+// ramps of three axes from the standstill to the cruise and back - all axes take the same time the way ControllerCNC synchronizes them
+std::vector<PlanInstruction> synchronousRampPlan(int repeat) {
+	const int16_t rampSteps[PLAN_AXIS_COUNT] = { 300, -150, 100, 0 };
+	//duration of each ramp and of the cruise between them
+	const double duration = 103923;
+	std::vector<PlanInstruction> plan;
+	for (int i = 0; i < repeat; ++i) {
+		int16_t direction = i % 2 ? -1 : 1;
+		PlanInstruction acceleration = accelerationInstruction(0, 0, 0);
+		PlanInstruction cruise = constantInstruction(0, 0, 0, 0, 0, 0, 0, 0);
+		PlanInstruction deceleration = accelerationInstruction(0, 0, 0);
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+			int16_t stepCount = rampSteps[axis] * direction;
+			if (stepCount == 0)
+				continue;
+
+			int16_t steps = abs(stepCount);
+			int32_t cruiseDeltaT = (int32_t)lround(duration / 2 / steps);
+			acceleration.acceleration[axis].stepCount = stepCount;
+			acceleration.acceleration[axis].initialDeltaT = (int32_t)lround(duration / sqrt((double)steps));
+
+			cruise.constant[axis].stepCount = stepCount * 2;
+			cruise.constant[axis].baseDeltaT = (int32_t)duration / (steps * 2);
+			cruise.constant[axis].periodNumerator = (uint16_t)((int32_t)duration % (steps * 2));
+
+			deceleration.acceleration[axis].stepCount = stepCount;
+			deceleration.acceleration[axis].initialDeltaT = cruiseDeltaT;
+			deceleration.acceleration[axis].n = -steps;
+		}
+		plan.push_back(acceleration);
+		plan.push_back(cruise);
+		plan.push_back(deceleration);
+	}
+	return plan;
+}
+
+// Accuracy of the pulse stream against the ideal profile of the plan.
+struct MotionAccuracy {
+	// largest deviation of a step from the ideal profile in ns (the profile is shifted to center the deviations)
+	double maxError;
+	// largest deviation of a step from the model of the firmware ramp recurrence in ns (the integer arithmetic error)
+	double recurrenceError;
+	// root mean square of the deviations in ns
+	double rmsError;
+	// largest spread of the axis deviations at the ends of an instruction in ns
+	double syncDrift;
+	// steps grouped into the activations of the other axes
+	int groupedSteps;
+	// steps which were late for their time
+	int missedSteps;
+};
+
+// allowed difference from the golden values (they are written with one decimal)
+#define MOTION_GOLDEN_TOLERANCE 0.1
+
+// nanoseconds of a CPU cycle
+#define CYCLE_NS (1e9 / Simulator::cpuFrequency)
+
+// largest deviation of the steps from the ideal ones in ns (the ideal steps are shifted to center the deviations)
+double centeredError(const std::vector<uint64_t> steps[PLAN_AXIS_COUNT], const std::vector<IdealStep> ideal[PLAN_AXIS_COUNT]) {
+	double minDeviation = INFINITY;
+	double maxDeviation = -INFINITY;
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+		for (size_t i = 0; i < min(steps[axis].size(), ideal[axis].size()); ++i) {
+			double deviation = steps[axis][i] - ideal[axis][i].time * TICK_CYCLES;
+			minDeviation = min(minDeviation, deviation);
+			maxDeviation = max(maxDeviation, deviation);
+		}
+	}
+	return maxDeviation > minDeviation ? (maxDeviation - minDeviation) / 2 * CYCLE_NS : 0;
+}
+
+// runs constant and acceleration plans and measures their steps against the ideal profile - returns false when steps are missing
+bool measureMotion(const char* name, const std::vector<PlanInstruction>& plan, MotionAccuracy& accuracy, FILE* dump) {
+	resetBoard();
+	bool isFinished = executePlan(plan);
+
+	std::vector<IdealStep> ideal[PLAN_AXIS_COUNT];
+	idealSteps(plan, ideal);
+
+	std::vector<StepEvent> events;
+	PulseTrace::extractSteps(Simulator::portEvents(), events);
+	std::vector<uint64_t> steps[PLAN_AXIS_COUNT];
+	for (size_t i = 0; i < events.size(); ++i) {
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+			if (AXIS_SLOTS[axis] == events[i].slot)
+				steps[axis].push_back(events[i].cycle);
+		}
+	}
+
+	//deviations are measured from the centered profile
+	double minDeviation = INFINITY;
+	double maxDeviation = -INFINITY;
+	bool hasAllSteps = isFinished;
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+		hasAllSteps &= steps[axis].size() == ideal[axis].size();
+		for (size_t i = 0; i < min(steps[axis].size(), ideal[axis].size()); ++i) {
+			double deviation = steps[axis][i] - ideal[axis][i].time * TICK_CYCLES;
+			minDeviation = min(minDeviation, deviation);
+			maxDeviation = max(maxDeviation, deviation);
+		}
+	}
+	double center = (minDeviation + maxDeviation) / 2;
+
+	accuracy = MotionAccuracy();
+	accuracy.maxError = (maxDeviation - minDeviation) / 2 * CYCLE_NS;
+	std::vector<IdealStep> recurrence[PLAN_AXIS_COUNT];
+	idealSteps(plan, recurrence, true);
+	accuracy.recurrenceError = centeredError(steps, recurrence);
+	std::vector<double> instructionMin(plan.size(), INFINITY);
+	std::vector<double> instructionMax(plan.size(), -INFINITY);
+	size_t stepCount = 0;
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+		for (size_t i = 0; i < min(steps[axis].size(), ideal[axis].size()); ++i) {
+			const IdealStep& idealStep = ideal[axis][i];
+			double idealCycle = idealStep.time * TICK_CYCLES + center;
+			double deviation = steps[axis][i] - idealCycle;
+			accuracy.rmsError += deviation * deviation;
+			++stepCount;
+			if (idealStep.isLast) {
+				instructionMin[idealStep.instruction] = min(instructionMin[idealStep.instruction], deviation);
+				instructionMax[idealStep.instruction] = max(instructionMax[idealStep.instruction], deviation);
+			}
+			if (dump != NULL)
+				fprintf(dump, "%s %d %d %llu %.1f\n", name, axis, idealStep.instruction, (unsigned long long)steps[axis][i], idealCycle);
+		}
+	}
+	accuracy.rmsError = stepCount ? sqrt(accuracy.rmsError / stepCount) * CYCLE_NS : 0;
+	for (size_t i = 0; i < plan.size(); ++i) {
+		if (instructionMax[i] > instructionMin[i])
+			accuracy.syncDrift = max(accuracy.syncDrift, (instructionMax[i] - instructionMin[i]) * CYCLE_NS);
+	}
+
+	uint16_t groupedSteps[PLAN_AXIS_COUNT];
+	uint16_t missedSteps[PLAN_AXIS_COUNT];
+	SEGMENT_SCHEDULER.takeStepCounters(groupedSteps, missedSteps);
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis) {
+		accuracy.groupedSteps += groupedSteps[axis];
+		accuracy.missedSteps += missedSteps[axis];
+	}
+	return hasAllSteps;
+}
+
+// Motion set measured by the accuracy suite.
+struct MotionSet {
+	const char* name;
+	std::vector<PlanInstruction> plan;
+};
+
+std::vector<MotionSet> motionSets() {
+	PlanInstruction remainderCruise = constantInstruction(3000, 400, 0, 0, 0, 0, 0, 0);
+	remainderCruise.constant[0].periodNumerator = 1234;
+	PlanInstruction diagonalCruise = constantInstruction(-2000, 300, -2000, 300, 2000, 300, 2000, 300);
+	for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis)
+		diagonalCruise.constant[axis].periodNumerator = 777;
+
+	std::vector<MotionSet> sets;
+	sets.push_back({ "cruise", cruisePlan(4) });
+	sets.push_back({ "remainder-cruise", std::vector<PlanInstruction>(2, remainderCruise) });
+	sets.push_back({ "diagonal-cruise", std::vector<PlanInstruction>(2, diagonalCruise) });
+	sets.push_back({ "ramp", rampPlan(4) });
+	sets.push_back({ "synchronous-ramp", synchronousRampPlan(2) });
+	sets.push_back({ "dense", densePlan(4) });
+	return sets;
+}
+
+// Reads a line of the golden file into the name of the set and its accuracy - returns false for comments and broken lines.
+bool readGoldenLine(const char* line, char name[64], MotionAccuracy& accuracy) {
+	accuracy = MotionAccuracy();
+	return line[0] != '#' && sscanf(line, "%63s %lf %lf %d %d %lf", name, &accuracy.maxError, &accuracy.syncDrift, &accuracy.groupedSteps, &accuracy.missedSteps, &accuracy.recurrenceError) == 6;
+}
+
+// Compares sync drift of the motion sets with the golden file of another step engine.
+// The instructions may end later by one interrupt of the DDA engine at most (steps are made on its interrupt grid).
+void checkSyncReference(const char* referencePath, const std::vector<MotionSet>& sets, const std::vector<MotionAccuracy>& accuracies) {
+	FILE* reference = fopen(referencePath, "r");
+	if (reference == NULL) {
+		printf("cannot read %s\n", referencePath);
+		++failureCount;
+		return;
+	}
+	printf("%s\n", referencePath);
+	double ddaPeriodNs = (double)DDA_PERIOD / SCHEDULE_TICK_SCALE * TICK_CYCLES * CYCLE_NS;
+	char line[256];
+	while (fgets(line, sizeof(line), reference) != NULL) {
+		char name[64];
+		MotionAccuracy limit;
+		if (!readGoldenLine(line, name, limit))
+			continue;
+
+		for (size_t i = 0; i < sets.size(); ++i) {
+			if (strcmp(sets[i].name, name) != 0)
+				continue;
+
+			char description[128];
+			snprintf(description, sizeof(description), "%s sync drift within the DDA period of the reference (%.1f ns)", name, limit.syncDrift);
+			expect(accuracies[i].syncDrift <= limit.syncDrift + ddaPeriodNs + MOTION_GOLDEN_TOLERANCE, description);
+		}
+	}
+	fclose(reference);
+}
+
+// Runs the motion sets and compares their accuracy with the golden file (or records it) - returns count of failures.
+int checkMotion(const char* goldenPath, const char* referencePath, bool isRecord, const char* dumpPath) {
+	FILE* dump = NULL;
+	if (dumpPath != NULL) {
+		dump = fopen(dumpPath, "w");
+		if (dump == NULL)
+			printf("cannot write %s\n", dumpPath);
+	}
+
+	std::vector<MotionSet> sets = motionSets();
+	std::vector<MotionAccuracy> accuracies(sets.size());
+	printf("motion accuracy\n");
+	for (size_t i = 0; i < sets.size(); ++i) {
+		MotionAccuracy& accuracy = accuracies[i];
+		bool hasAllSteps = measureMotion(sets[i].name, sets[i].plan, accuracy, dump);
+		printf("\t%-18s timing error %8.1f ns max %8.1f ns rms, sync drift %8.1f ns, grouped steps %4d, missed steps %d, recurrence model error %8.1f ns\n",
+			sets[i].name, accuracy.maxError, accuracy.rmsError, accuracy.syncDrift, accuracy.groupedSteps, accuracy.missedSteps, accuracy.recurrenceError);
+		expect(hasAllSteps, "all steps of the plan");
+	}
+	if (dump != NULL)
+		fclose(dump);
+
+	if (isRecord) {
+		FILE* golden = fopen(goldenPath, "w");
+		if (golden == NULL) {
+			printf("cannot write %s\n", goldenPath);
+			return 1;
+		}
+		fprintf(golden, "# motion accuracy recorded by stepper_bench --motion --record\n");
+		fprintf(golden, "# set, max timing error [ns], sync drift [ns], grouped steps, missed steps, recurrence model error [ns]\n");
+		for (size_t i = 0; i < sets.size(); ++i)
+			fprintf(golden, "%s %.1f %.1f %d %d %.1f\n", sets[i].name, accuracies[i].maxError, accuracies[i].syncDrift, accuracies[i].groupedSteps, accuracies[i].missedSteps, accuracies[i].recurrenceError);
+		fclose(golden);
+		printf("\trecorded %s\n", goldenPath);
+		return failureCount;
+	}
+
+	FILE* golden = fopen(goldenPath, "r");
+	if (golden == NULL) {
+		printf("cannot read %s\n", goldenPath);
+		return 1;
+	}
+	printf("%s\n", goldenPath);
+	std::vector<bool> isCompared(sets.size(), false);
+	char line[256];
+	while (fgets(line, sizeof(line), golden) != NULL) {
+		char name[64];
+		MotionAccuracy limit;
+		if (!readGoldenLine(line, name, limit))
+			continue;
+
+		for (size_t i = 0; i < sets.size(); ++i) {
+			if (strcmp(sets[i].name, name) != 0)
+				continue;
+
+			//improvements pass (they are recorded by make golden)
+			const MotionAccuracy& accuracy = accuracies[i];
+			char description[128];
+			snprintf(description, sizeof(description), "%s timing error (golden %.1f ns)", name, limit.maxError);
+			expect(accuracy.maxError <= limit.maxError + MOTION_GOLDEN_TOLERANCE, description);
+			snprintf(description, sizeof(description), "%s sync drift (golden %.1f ns)", name, limit.syncDrift);
+			expect(accuracy.syncDrift <= limit.syncDrift + MOTION_GOLDEN_TOLERANCE, description);
+			snprintf(description, sizeof(description), "%s grouped and missed steps (golden %d, %d)", name, limit.groupedSteps, limit.missedSteps);
+			expect(accuracy.groupedSteps <= limit.groupedSteps && accuracy.missedSteps <= limit.missedSteps, description);
+			snprintf(description, sizeof(description), "%s recurrence model error (golden %.1f ns)", name, limit.recurrenceError);
+			expect(accuracy.recurrenceError <= limit.recurrenceError + MOTION_GOLDEN_TOLERANCE, description);
+			isCompared[i] = true;
+		}
+	}
+	fclose(golden);
+
+	for (size_t i = 0; i < sets.size(); ++i) {
+		if (!isCompared[i])
+			printf("\t[FAIL] %s is not in the golden file\n", sets[i].name);
+		failureCount += !isCompared[i];
+	}
+	if (referencePath != NULL)
+		checkSyncReference(referencePath, sets, accuracies);
+	return failureCount;
+}
+
+// how many plans of the given kind are buffered by the firmware (queue and the frame slot which is not reserved)
+int bufferedPlanCount(const std::vector<PlanInstruction>& plan) {
+	resetBoard();
+	int count = FIRMWARE_FRAME_SLOTS - 2;
+	for (size_t i = 0; i < plan.size(); ++i) {
+		byte frame[PLAN_FRAME_SIZE];
+		writeLegacyFrame(frame, plan[i]);
+		if (!decodeFrame(frame))
+			break;
+		++count;
+	}
+	return count;
+}
+
+// SRAM taken by the instruction buffering of FirmwareCNC (sizes of the avr build)
+void reportSram() {
+	printf("static SRAM of FirmwareCNC\n");
+	printf("\tschedule ring: %d entries, %d bytes\n", SCHEDULE_BUFFER_LEN, SCHEDULE_SRAM_SIZE);
+	printf("\tframe slots: %d x %d bytes\n", FIRMWARE_FRAME_SLOTS, PLAN_FRAME_SIZE);
+	printf("\tplan queue: %d bytes (record header %d, constant axis %d (+4 offset), acceleration axis %d, move %d + 2 per axis)\n",
+		FIRMWARE_PLAN_QUEUE_SIZE, PLAN_RECORD_HEADER_SIZE, (int)sizeof(ConstantSegment), (int)sizeof(AccelerationSegment), (int)sizeof(MoveHeader));
+#ifndef STEP_TIMER_32BIT
+	int schedulerSram = SEGMENT_SCHEDULER_SRAM(PLAN_AXIS_COUNT);
+	int receiverSram = FRAME_RECEIVER_SRAM(PLAN_FRAME_SIZE, FIRMWARE_FRAME_SLOTS);
+	int queueSram = PLAN_QUEUE_SRAM(FIRMWARE_PLAN_QUEUE_SIZE, PLAN_AXIS_COUNT);
+	int freeSram = FIRMWARE_SRAM_SIZE - FIRMWARE_SRAM_STACK_RESERVE - FIRMWARE_SRAM_GLOBALS_RESERVE - SCHEDULE_SRAM_SIZE - schedulerSram - receiverSram - queueSram;
+	printf("\tUno budget (%d bytes): ring %d, segment scheduler %d, frame receiver %d, plan queue %d, globals %d, stack %d", FIRMWARE_SRAM_SIZE,
+		SCHEDULE_SRAM_SIZE, schedulerSram, receiverSram, queueSram, FIRMWARE_SRAM_GLOBALS_RESERVE, FIRMWARE_SRAM_STACK_RESERVE);
+	printf(freeSram < 0 ? " - over by %d bytes\n" : "\n", -freeSram);
+#endif
+	printf("\tbuffered plans (raw frames kept 5): cruise %d, ramp %d, dense %d\n", bufferedPlanCount(cruisePlan(64)), bufferedPlanCount(rampPlan(32)), bufferedPlanCount(densePlan(8)));
+	resetBoard();
+}
+
+int main(int argc, char** argv) {
+	bool isCheck = false;
+	bool isRecord = false;
+	const char* goldenPath = NULL;
+	const char* dumpPath = NULL;
+	const char* referencePath = NULL;
+	int repeat = 200;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--check") == 0)
+			isCheck = true;
+		else if (strcmp(argv[i], "--sram") == 0) {
+			reportSram();
+			return 0;
+		}
+		else if (strcmp(argv[i], "--motion") == 0 && i + 1 < argc)
+			goldenPath = argv[++i];
+		else if (strcmp(argv[i], "--record") == 0)
+			isRecord = true;
+		else if (strcmp(argv[i], "--compact") == 0)
+			useCompactFrames = true;
+		else if (strcmp(argv[i], "--sync-reference") == 0 && i + 1 < argc)
+			referencePath = argv[++i];
+		else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc)
+			dumpPath = argv[++i];
+		else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+			repeat = atoi(argv[++i]);
+		else {
+			printf("usage: %s [--check] [--sram] [--motion <golden file> [--record] [--sync-reference <golden file>]] [--compact] [--dump <file>] [--repeat <count>]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (goldenPath != NULL) {
+		int motionFailures = checkMotion(goldenPath, referencePath, isRecord, dumpPath);
+		printf(motionFailures ? "%d checks failed\n" : "all checks passed\n", motionFailures);
+		return motionFailures ? 1 : 0;
+	}
+
+	if (isCheck) {
+#ifdef STEP_ENGINE_DDA
+		//exact step timing is a property of the step engine only
+		checkDdaSteps();
+		checkPositions("cruise", cruisePlan(4));
+		checkPositions("ramp", rampPlan(4));
+		checkPositions("dense", densePlan(4));
+		checkInstructionEndBatching("ramp", rampPlan(4));
+		checkPositions("move", movePlan(4));
+		checkPositions("circle", circlePlan(3000, 300));
+		checkPositions("spline circle", splineCirclePlan(3000, (int32_t)(M_PI / 2 * 3000 * 300)));
+		checkFeedOverride(30);
+		checkFeedOverride(200);
+		checkFeedOverrideRamp();
+		checkFeedHold();
+		checkFrameReceiver();
+		checkRefillInterrupt();
+#else
+		checkActivationClock();
+		checkSlowAxis();
+		checkFractionalPeriod();
+		checkPositions("cruise", cruisePlan(4));
+		checkPositions("ramp", rampPlan(4));
+		checkSeamlessAxes();
+
+		PlanInstruction remainderCruise = constantInstruction(3000, 400, 0, 0, 0, 0, 0, 0);
+		remainderCruise.constant[0].periodNumerator = 1234;
+		checkScheduleRuns("single axis", remainderCruise);
+		PlanInstruction diagonalCruise = constantInstruction(-2000, 300, -2000, 300, 2000, 300, 2000, 300);
+		for (int axis = 0; axis < PLAN_AXIS_COUNT; ++axis)
+			diagonalCruise.constant[axis].periodNumerator = 777;
+		checkScheduleRuns("diagonal", diagonalCruise);
+		checkCompactFrames("dense", densePlan(4));
+		checkInstructionEndBatching("ramp", rampPlan(4));
+		checkMinDeltaT();
+		checkTimingTelemetry();
+		checkPositions("move", movePlan(4));
+		checkMove("trapezoid", 0);
+		checkMove("constant jerk", 100000);
+		checkLookAhead();
+		checkArcs();
+		checkSplines();
+		checkHomingSegments();
+		checkFeedOverride(30);
+		checkFeedOverride(200);
+		checkFeedOverrideRamp();
+		checkFeedHold();
+		checkFrameReceiver();
+		checkRefillInterrupt();
+#endif
+
+		printf(failureCount ? "%d checks failed\n" : "all checks passed\n", failureCount);
+		return failureCount ? 1 : 0;
+	}
+
+	runBenchmark("cruise", cruisePlan(repeat), dumpPath);
+	runBenchmark("ramp", rampPlan(repeat), NULL);
+	runBenchmark("dense", densePlan(repeat), NULL);
+	runBenchmark("move", movePlan(repeat), NULL);
+	return 0;
+}
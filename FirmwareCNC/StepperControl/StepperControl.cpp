@@ -1,85 +1,361 @@
 #include "StepperControl.h"
 
 
-bool INSTRUCTION_ENDS[SCHEDULE_BUFFER_LEN + 1] = { 0 };
-uint16_t SCHEDULE_BUFFER[SCHEDULE_BUFFER_LEN + 1] = { 0 };
-byte SCHEDULE_ACTIVATIONS[SCHEDULE_BUFFER_LEN + 1] = { 0 };
+#ifdef STEP_ENGINE_DDA
+DdaSegment SCHEDULE_SEGMENTS[SCHEDULE_BUFFER_LEN];
+
+// clocks of the slots in the order of the segment steps
+static const byte DDA_CLOCK_MASKS[MAX_AXIS_COUNT] = { SLOT0_CLK_MASK, SLOT1_CLK_MASK, SLOT2_CLK_MASK, SLOT3_CLK_MASK };
+// segment collected from the written entries
+static DdaSegment DDA_WINDOW = { 0 };
+// time collected into the window (it goes below zero when the steps needed longer segment than the entries)
+static int32_t DDA_WINDOW_TIME = 0;
+// window times of the first and the last step of each slot
+static int32_t DDA_FIRST_STEP_TIMES[4];
+static int32_t DDA_LAST_STEP_TIMES[4];
+// phases of the last steps written for each slot relative to the window start (the negated accumulators of the interrupt)
+static int32_t DDA_STEP_PHASES[4] = { 0 };
+// phases since the last step of each slot - they are carried over the segments
+static uint16_t DDA_ACCUMULATORS[4] = { 0 };
+// phase of the next step of each slot
+static uint16_t DDA_STEP_PERIODS[4];
+// steps left to the running segment
+static byte DDA_REMAINING_STEPS[4];
+// interrupts left to the running segment
+static byte DDA_REMAINING_TICKS = 0;
+#else
+ScheduleTime SCHEDULE_BUFFER[SCHEDULE_BUFFER_LEN] = { 0 };
+byte SCHEDULE_CLOCKS[SCHEDULE_BUFFER_LEN * SCHEDULE_CLOCK_BITS / 8] = { 0 };
+
+#if SCHEDULE_CLOCK_BITS == 4
+#define CLOCK_ACTIVATION(clocks) (ACTIVATIONS_CLOCK_MASK & ~(((clocks) & 1 ? SLOT0_CLK_MASK : 0) | ((clocks) & 2 ? SLOT1_CLK_MASK : 0) | ((clocks) & 4 ? SLOT2_CLK_MASK : 0) | ((clocks) & 8 ? SLOT3_CLK_MASK : 0)))
+const byte CLOCK_ACTIVATIONS[16] = {
+	CLOCK_ACTIVATION(0), CLOCK_ACTIVATION(1), CLOCK_ACTIVATION(2), CLOCK_ACTIVATION(3),
+	CLOCK_ACTIVATION(4), CLOCK_ACTIVATION(5), CLOCK_ACTIVATION(6), CLOCK_ACTIVATION(7),
+	CLOCK_ACTIVATION(8), CLOCK_ACTIVATION(9), CLOCK_ACTIVATION(10), CLOCK_ACTIVATION(11),
+	CLOCK_ACTIVATION(12), CLOCK_ACTIVATION(13), CLOCK_ACTIVATION(14), CLOCK_ACTIVATION(15)
+};
+#endif
+
+ScheduleEvent SCHEDULE_EVENTS[SCHEDULE_EVENT_LEN];
+volatile byte SCHEDULE_EVENT_START = 0;
+volatile byte SCHEDULE_EVENT_END = 0;
+
+ScheduleRun SCHEDULE_RUNS[SCHEDULE_RUN_LEN];
+volatile byte SCHEDULE_RUN_START = 0;
+volatile byte SCHEDULE_RUN_END = 0;
+
+// flags of the entry at SCHEDULE_END (they come with the timer reset of the previous entry)
+volatile byte SCHEDULE_ENTRY_FLAGS = 0;
+#endif
+byte SCHEDULED_DIRECTIONS = 0;
 byte CUMULATIVE_SCHEDULE_ACTIVATION = 0;
 
 
 
-volatile byte SCHEDULE_START = 0;
-volatile byte SCHEDULE_END = 0;
+volatile ScheduleIndex SCHEDULE_START = 0;
+volatile ScheduleIndex SCHEDULE_END = 0;
+
+// direction bits of the activations (changed by the events)
+volatile byte SCHEDULE_DIRECTIONS = 0;
 
 volatile byte ACTIVATION_MASK = 0;
+volatile byte FINISHED_INSTRUCTION_COUNT = 0;
+// finished instructions which were taken by the main loop already (cumulative, it overflows)
+byte TAKEN_INSTRUCTION_COUNT = 0;
+volatile byte ARMED_INSTRUCTION_COUNT = 0;
+
+volatile ScheduleIndex SCHEDULE_MIN_OCCUPANCY = SCHEDULE_BUFFER_LEN - 1;
+volatile uint16_t ISR_LATENESS_HISTOGRAM[ISR_LATENESS_BUCKET_COUNT] = { 0 };
+volatile uint16_t UNDERRUN_STOP_COUNT = 0;
+volatile bool SCHEDULE_HOLD_FLAG = false;
 volatile bool SCHEDULER_STOP_EVENT_FLAG = false;
 volatile bool SCHEDULER_START_EVENT_FLAG = false;
+volatile bool IS_SCHEDULE_REFILL_RUNNING = false;
+// reports raised by the refill interrupt which wait for the main loop
+volatile byte DEFERRED_START_REPORTS = 0;
+volatile byte DEFERRED_MISSED_REPORTS = 0;
+
+int32_t SLOT0_STEPS = 0;
+int32_t SLOT1_STEPS = 0;
+int32_t SLOT2_STEPS = 0;
+int32_t SLOT3_STEPS = 0;
+
+#ifdef STEP_ENGINE_DDA
+// Determine whether the collected segment has nothing to step or report.
+static inline bool isDdaWindowEmpty() {
+	return (DDA_WINDOW.steps[0] | DDA_WINDOW.steps[1] | DDA_WINDOW.steps[2] | DDA_WINDOW.steps[3] | DDA_WINDOW.instructionEnds) == 0;
+}
+
+// Converts window time to the step phase which makes the interrupt nearest to the time.
+static inline int32_t ddaStepPhase(int32_t time) {
+	return time * DDA_PHASE_ONE / DDA_PERIOD - DDA_PHASE_ONE / 2;
+}
+
+// Writes the collected segment with the given count of interrupts (each step needs its own interrupt).
+// The steps of each slot are placed between the phases of their first and last entry, the phase
+// of the last step is carried to the next segment the same way as the interrupt carries it.
+static void writeDdaSegment(int32_t ticks) {
+	int32_t segmentTicks = ticks < 1 ? 1 : min(ticks, (int32_t)255);
+	int32_t lastPhases[4];
+	for (byte i = 0; i < 4; ++i) {
+		byte steps = DDA_WINDOW.steps[i];
+		int32_t phase = DDA_STEP_PHASES[i];
+		if (steps > 0) {
+			int32_t firstPeriod = max(ddaStepPhase(DDA_FIRST_STEP_TIMES[i]) - phase, (int32_t)0);
+			phase += firstPeriod;
+			int32_t period = DDA_PHASE_ONE;
+			if (steps > 1)
+				period = max((ddaStepPhase(DDA_LAST_STEP_TIMES[i]) - phase) / (steps - 1), (int32_t)DDA_PHASE_ONE);
+			phase += period * (steps - 1);
+
+			DDA_WINDOW.firstPeriods[i] = firstPeriod;
+			DDA_WINDOW.periods[i] = period;
+			//the last step has to be made by the segment
+			segmentTicks = max(segmentTicks, max((int32_t)steps, (phase + DDA_PHASE_ONE - 1) / DDA_PHASE_ONE));
+		}
+		lastPhases[i] = phase;
+	}
+
+	segmentTicks = min(segmentTicks, (int32_t)255);
+	DDA_WINDOW.ticks = segmentTicks;
+	SCHEDULE_SEGMENTS[SCHEDULE_START] = DDA_WINDOW;
+	setScheduleStart(nextScheduleIndex(SCHEDULE_START));
+
+	for (byte i = 0; i < 4; ++i)
+		//the interrupt does not let the phases fall further behind
+		DDA_STEP_PHASES[i] = max(lastPhases[i] - segmentTicks * DDA_PHASE_ONE, -(int32_t)DDA_PHASE_MAX);
+
+	//time of the longer segment is taken from the next one
+	DDA_WINDOW_TIME -= segmentTicks * DDA_PERIOD;
+	memset(DDA_WINDOW.steps, 0, sizeof(DDA_WINDOW.steps));
+	DDA_WINDOW.instructionEnds = 0;
+}
+
+void writeScheduleEntry(ScheduleTime activationTime, byte activation, byte instructionEnds, byte flags) {
+	DDA_WINDOW_TIME += activationTime;
+	//segments written for the activation end with the interrupt before the one of the activation
+	if (ddaStepPhase(DDA_WINDOW_TIME) > DDA_SEGMENT_TICKS * DDA_PHASE_ONE) {
+		//the activation comes after the collected segment
+		if (!isDdaWindowEmpty())
+			writeDdaSegment(DDA_SEGMENT_TICKS);
+		if (ddaStepPhase(DDA_WINDOW_TIME) > DDA_SEGMENT_TICKS * DDA_PHASE_ONE)
+			//pause without steps
+			writeDdaSegment((ddaStepPhase(DDA_WINDOW_TIME) - 1) / DDA_PHASE_ONE);
+	}
+
+	byte directions = activation & ~ACTIVATIONS_CLOCK_MASK;
+	if (directions != DDA_WINDOW.directions) {
+		if (!isDdaWindowEmpty())
+			//steps of a segment share the directions
+			writeDdaSegment((ddaStepPhase(DDA_WINDOW_TIME) - 1) / DDA_PHASE_ONE);
+		DDA_WINDOW.directions = directions;
+	}
+	SCHEDULED_DIRECTIONS = directions;
+
+	for (byte i = 0; i < 4; ++i) {
+		if ((activation & DDA_CLOCK_MASKS[i]) == 0) {
+			if (DDA_WINDOW.steps[i]++ == 0)
+				DDA_FIRST_STEP_TIMES[i] = DDA_WINDOW_TIME;
+			DDA_LAST_STEP_TIMES[i] = DDA_WINDOW_TIME;
+		}
+	}
+	DDA_WINDOW.instructionEnds += instructionEnds;
+	if (instructionEnds != 0)
+		//steps of the next instruction come with other periods
+		flushScheduleEntries();
+}
 
-volatile int32_t SLOT0_STEPS = 0;
-volatile int32_t SLOT1_STEPS = 0;
-volatile int32_t SLOT2_STEPS = 0;
-volatile int32_t SLOT3_STEPS = 0;
+void flushScheduleEntries() {
+	if (!isDdaWindowEmpty())
+		//the segment ends with the interrupt of its last activation (the rest of the window time goes to the next one)
+		writeDdaSegment((ddaStepPhase(DDA_WINDOW_TIME) + DDA_PHASE_ONE - 1) / DDA_PHASE_ONE);
+}
 
-ISR(TIMER1_OVF_vect) {
+// Prepares the segment to run - its directions are set by the current interrupt already.
+static inline void startDdaSegment(ScheduleIndex index) {
+	DdaSegment& segment = SCHEDULE_SEGMENTS[index];
+	DDA_REMAINING_TICKS = segment.ticks;
+	for (byte i = 0; i < 4; ++i) {
+		DDA_REMAINING_STEPS[i] = segment.steps[i];
+		DDA_STEP_PERIODS[i] = segment.firstPeriods[i];
+		if (DDA_ACCUMULATORS[i] > DDA_PHASE_MAX)
+			//long pauses are not remembered (the accumulator would overflow)
+			DDA_ACCUMULATORS[i] = DDA_PHASE_MAX;
+	}
+	SCHEDULE_DIRECTIONS = segment.directions;
+}
+
+STEP_TIMER_ISR {
 	//pins go LOW here (pulse start)
-	byte activation = SCHEDULE_ACTIVATIONS[SCHEDULE_END] | ACTIVATION_MASK;
+	ScheduleTime lateness = readStepTimer();
 
 	//THE TIMER RESET IS TUNED HERE (!!!NO CHANGES BEFORE THIS!!!)
-	TCNT1 = SCHEDULE_BUFFER[SCHEDULE_END];
+	reloadStepTimer(stepTimerWord(DDA_PERIOD));
+	acknowledgeStepTimer();
+
+	ScheduleIndex end = SCHEDULE_END;
+	DdaSegment& segment = SCHEDULE_SEGMENTS[end];
+	byte activation = ACTIVATIONS_CLOCK_MASK;
+	for (byte i = 0; i < 4; ++i) {
+		DDA_ACCUMULATORS[i] += DDA_PHASE_ONE;
+		if (DDA_REMAINING_STEPS[i] != 0 && DDA_ACCUMULATORS[i] >= DDA_STEP_PERIODS[i]) {
+			DDA_ACCUMULATORS[i] -= DDA_STEP_PERIODS[i];
+			DDA_STEP_PERIODS[i] = segment.periods[i];
+			--DDA_REMAINING_STEPS[i];
+			activation &= ~DDA_CLOCK_MASKS[i];
+		}
+	}
+	activation |= SCHEDULE_DIRECTIONS | ACTIVATION_MASK;
+
+	writeStepPorts(activation);
+	ScheduleTime pulseStart = readStepTimer();
+
+	if (--DDA_REMAINING_TICKS == 0) {
+		//positions are committed by the main loop (steps of the instructions are known there)
+		FINISHED_INSTRUCTION_COUNT += segment.instructionEnds;
+		end = nextScheduleIndex(end);
+		SCHEDULE_END = end;
+		if (SCHEDULE_START == end) {
+			//we are at schedule end
+			disableStepTimer();
+			SCHEDULER_STOP_EVENT_FLAG = true;
+			if (FINISHED_INSTRUCTION_COUNT != ARMED_INSTRUCTION_COUNT && !SCHEDULE_HOLD_FLAG && UNDERRUN_STOP_COUNT != UINT16_MAX)
+				//steps of the armed instructions did not come in time
+				++UNDERRUN_STOP_COUNT;
+		}
+		else {
+			startDdaSegment(end);
+
+			ScheduleIndex occupancy = scheduleOccupancy(SCHEDULE_START, end);
+			if (occupancy < SCHEDULE_MIN_OCCUPANCY && (byte)(ARMED_INSTRUCTION_COUNT - FINISHED_INSTRUCTION_COUNT) > 1)
+				//the schedule drains although the next instruction is armed (draining of the last one is expected)
+				SCHEDULE_MIN_OCCUPANCY = occupancy;
+		}
+	}
 
-	PORTB = B_SLOTS_MASK & activation;
-	PORTD = D_SLOTS_MASK & activation;
+	//telemetry is counted while the pulse lasts
+	lateness /= STEP_TIMER_TICK_COUNTS;
+	byte bucket = lateness >= (ISR_LATENESS_BUCKET_COUNT << ISR_LATENESS_BUCKET_SHIFT) ? ISR_LATENESS_BUCKET_COUNT - 1 : lateness >> ISR_LATENESS_BUCKET_SHIFT;
+	if (ISR_LATENESS_HISTOGRAM[bucket] != UINT16_MAX)
+		++ISR_LATENESS_HISTOGRAM[bucket];
 
-	bool isInstructionEnd = INSTRUCTION_ENDS[SCHEDULE_END];
-	if (SCHEDULE_START == SCHEDULE_END) {
+	//pulse has to take 3us at least
+	while ((ScheduleTime)(readStepTimer() - pulseStart) < MIN_PULSE_WIDTH * STEP_TIMER_TICK_COUNTS);
+
+	//pins go HIGH here (pulse end) - directions of the next segment are set one interrupt before its steps
+	writeStepPorts(ACTIVATIONS_CLOCK_MASK | SCHEDULE_DIRECTIONS);
+}
+
+bool Steppers::startScheduler() {
+	if (isStepTimerEnabled()) {
+		//scheduler is already enabled
+		//we are free to do other things
+		return true;
+	}
+
+	if (SCHEDULE_START == SCHEDULE_END)
+		//schedule is empty - no point in schedule enabling
+		return false;
+
+
+	sendSchedulerReport('S'); //enabling scheduler
+
+	SCHEDULER_START_EVENT_FLAG = true;
+	startDdaSegment(SCHEDULE_END);
+
+	//directions wait one interrupt for the first steps
+	writeStepPorts(ACTIVATIONS_CLOCK_MASK | SCHEDULE_DIRECTIONS);
+	reloadStepTimer(stepTimerWord(DDA_PERIOD));
+	enableStepTimer();
+
+	return false;
+}
+#else
+// Run entry was fired - prepares timing of the next repetition, returns false after the last repetition.
+static inline bool repeatScheduleRun(ScheduleIndex end, ScheduleTime timerWord) {
+	ScheduleRun& run = SCHEDULE_RUNS[SCHEDULE_RUN_END & (SCHEDULE_RUN_LEN - 1)];
+	if (--run.remainingCount == 0) {
+		//the last repetition is timed now
+		++SCHEDULE_RUN_END;
+		return false;
+	}
+
+	ScheduleTime runWord = run.timerWord;
+	run.remainderBuffer += run.remainderNumerator;
+	if (run.remainderBuffer > run.remainderDenominator) {
+		run.remainderBuffer -= run.remainderDenominator;
+		runWord += STEP_TIMER_TICK_WORD;
+	}
+	SCHEDULE_BUFFER[end] = (timerWord & SCHEDULE_FLAGS_MASK) | (runWord & ~SCHEDULE_FLAGS_MASK);
+	return true;
+}
+
+STEP_TIMER_ISR {
+	//pins go LOW here (pulse start)
+	//ticks from the overflow (entry latency and blocking by other interrupts) - it is a part of the tuned reset
+	ScheduleTime lateness = readStepTimer();
+	ScheduleIndex end = SCHEDULE_END;
+	ScheduleTime timerWord = SCHEDULE_BUFFER[end];
+
+	//THE TIMER RESET IS TUNED HERE (!!!NO CHANGES BEFORE THIS!!!)
+	reloadStepTimer(timerWord);
+	acknowledgeStepTimer();
+
+	byte flags = SCHEDULE_ENTRY_FLAGS;
+	byte instructionEnds = 0;
+	if (flags & SCHEDULE_EVENT_FLAG) {
+		ScheduleEvent& evt = SCHEDULE_EVENTS[SCHEDULE_EVENT_END & (SCHEDULE_EVENT_LEN - 1)];
+		SCHEDULE_DIRECTIONS = evt.directions;
+		instructionEnds = evt.instructionEnds;
+		++SCHEDULE_EVENT_END;
+	}
+
+	byte activation = readScheduleClocks(end) | SCHEDULE_DIRECTIONS | ACTIVATION_MASK;
+
+	writeStepPorts(activation);
+	ScheduleTime pulseStart = readStepTimer();
+
+	if ((flags & SCHEDULE_RUN_FLAG) && repeatScheduleRun(end, timerWord)) {
+		//the entry is fired again (its event was taken already)
+		SCHEDULE_ENTRY_FLAGS = SCHEDULE_RUN_FLAG;
+	}
+	else if (SCHEDULE_START == end) {
 		//we are at schedule end
-		TIMSK1 = 0;
+		disableStepTimer();
 		SCHEDULER_STOP_EVENT_FLAG = true;
+		if ((byte)(FINISHED_INSTRUCTION_COUNT + instructionEnds) != ARMED_INSTRUCTION_COUNT && !SCHEDULE_HOLD_FLAG && UNDERRUN_STOP_COUNT != UINT16_MAX)
+			//steps of the armed instructions did not come in time
+			++UNDERRUN_STOP_COUNT;
 	}
 	else {
-		++SCHEDULE_END;
-	}
-	//---HERE WE HAVE TO spent 3us at least (because of the minimal pulse width)
-	byte nactivation = ~activation;
-	byte step0 = nactivation & (SLOT0_CLK_MASK | SLOT0_DIR_MASK);
-	int8_t step0p = (step0 == (SLOT0_CLK_MASK | SLOT0_DIR_MASK));
-	int8_t step0n = (step0 == SLOT0_CLK_MASK);
-
-	byte step1 = nactivation & (SLOT1_CLK_MASK | SLOT1_DIR_MASK);
-	int8_t step1p = (step1 == (SLOT1_CLK_MASK | SLOT1_DIR_MASK));
-	int8_t step1n = (step1 == SLOT1_CLK_MASK);
-
-	byte step2 = nactivation & (SLOT2_CLK_MASK | SLOT2_DIR_MASK);
-	int8_t step2p = (step2 == (SLOT2_CLK_MASK | SLOT2_DIR_MASK));
-	int8_t step2n = (step2 == SLOT2_CLK_MASK);
-
-	byte step3 = nactivation & (SLOT3_CLK_MASK | SLOT3_DIR_MASK);
-	int8_t step3p = (step3 == (SLOT3_CLK_MASK | SLOT3_DIR_MASK));
-	int8_t step3n = (step3 == SLOT3_CLK_MASK);
-
-	SLOT0_STEPS += (int32_t)(step0p - step0n);
-	SLOT1_STEPS += (int32_t)(step1p - step1n);
-	SLOT2_STEPS += (int32_t)(step2p - step2n);
-	SLOT3_STEPS += (int32_t)(step3p - step3n);
-
-	/*	Serial.print('|');
-	Serial.print(step2p);
-	Serial.print(' ');
-	Serial.print(step2n);
-	Serial.print(' ');
-	Serial.println(SLOT2_STEPS);*/
-	//------------------------------------
+		SCHEDULE_ENTRY_FLAGS = (timerWord >> SCHEDULE_FLAGS_SHIFT) & (SCHEDULE_EVENT_FLAG | SCHEDULE_RUN_FLAG);
+		SCHEDULE_END = nextScheduleIndex(end);
+
+		ScheduleIndex occupancy = scheduleOccupancy(SCHEDULE_START, end);
+		if (occupancy < SCHEDULE_MIN_OCCUPANCY && (byte)(ARMED_INSTRUCTION_COUNT - FINISHED_INSTRUCTION_COUNT - instructionEnds) > 1)
+			//the schedule drains although the next instruction is armed (draining of the last one is expected)
+			SCHEDULE_MIN_OCCUPANCY = occupancy;
+	}
+	//positions are committed by the main loop (steps of the instructions are known there)
+	FINISHED_INSTRUCTION_COUNT += instructionEnds;
+
+	//telemetry is counted while the pulse lasts
+	lateness /= STEP_TIMER_TICK_COUNTS;
+	byte bucket = lateness >= (ISR_LATENESS_BUCKET_COUNT << ISR_LATENESS_BUCKET_SHIFT) ? ISR_LATENESS_BUCKET_COUNT - 1 : lateness >> ISR_LATENESS_BUCKET_SHIFT;
+	if (ISR_LATENESS_HISTOGRAM[bucket] != UINT16_MAX)
+		++ISR_LATENESS_HISTOGRAM[bucket];
+
+	//pulse has to take 3us at least (the step bookkeeping used to take that long)
+	while ((ScheduleTime)(readStepTimer() - pulseStart) < MIN_PULSE_WIDTH * STEP_TIMER_TICK_COUNTS);
 
 	//pins go HIGH here (pulse end)
-	if (isInstructionEnd)
-		Serial.write('F');
-	PORTB |= B_SLOTS_MASK & ACTIVATIONS_CLOCK_MASK;
-	PORTD |= D_SLOTS_MASK & ACTIVATIONS_CLOCK_MASK;
+	releaseStepClocks();
 
 }
 
 bool Steppers::startScheduler() {
-	if (TIMSK1 != 0) {
+	if (isStepTimerEnabled()) {
 		//scheduler is already enabled
 		//we are free to do other things
 		return true;
@@ -90,38 +366,104 @@ bool Steppers::startScheduler() {
 		return false;
 
 
-	Serial.print('S'); //enabling scheduler
+	sendSchedulerReport('S'); //enabling scheduler
 
 	SCHEDULER_START_EVENT_FLAG = true;
-	TCNT1 = SCHEDULE_BUFFER[SCHEDULE_END++];
-	TIMSK1 = (1 << TOIE1); //enable scheduler
+	//activation of the first entry was done when the scheduler stopped
+	ScheduleTime timerWord = SCHEDULE_BUFFER[SCHEDULE_END];
+	reloadStepTimer(timerWord);
+	SCHEDULE_ENTRY_FLAGS = (timerWord >> SCHEDULE_FLAGS_SHIFT) & (SCHEDULE_EVENT_FLAG | SCHEDULE_RUN_FLAG);
+	SCHEDULE_END = nextScheduleIndex(SCHEDULE_END);
+	enableStepTimer(); //enable scheduler
 
 	return false;
 }
+#endif
 
 void Steppers::setActivationMask(byte mask) {
 	ACTIVATION_MASK = mask;
 }
 
+byte Steppers::takeFinishedInstructionCount() {
+	//single byte is read atomically - the interrupt does not have to be blocked
+	byte finishedCount = FINISHED_INSTRUCTION_COUNT;
+	byte count = finishedCount - TAKEN_INSTRUCTION_COUNT;
+	TAKEN_INSTRUCTION_COUNT = finishedCount;
+	return count;
+}
+
+void Steppers::takeTimingTelemetry(TimingTelemetry& telemetry) {
+	noInterrupts();
+	telemetry.minOccupancy = SCHEDULE_MIN_OCCUPANCY;
+	telemetry.underrunStops = UNDERRUN_STOP_COUNT;
+	SCHEDULE_MIN_OCCUPANCY = SCHEDULE_BUFFER_LEN - 1;
+	UNDERRUN_STOP_COUNT = 0;
+	for (byte i = 0; i < ISR_LATENESS_BUCKET_COUNT; ++i) {
+		telemetry.latenessHistogram[i] = ISR_LATENESS_HISTOGRAM[i];
+		ISR_LATENESS_HISTOGRAM[i] = 0;
+	}
+	interrupts();
+}
+
+void sendSchedulerReport(char report)
+{
+	if (!IS_SCHEDULE_REFILL_RUNNING) {
+		Serial.print(report);
+		return;
+	}
+
+	//the refill may have interrupted a Serial write of the main loop
+	volatile byte& count = report == 'S' ? DEFERRED_START_REPORTS : DEFERRED_MISSED_REPORTS;
+	if (count != UINT8_MAX)
+		++count;
+}
+
+void Steppers::sendDeferredReports()
+{
+	noInterrupts();
+	byte startReports = DEFERRED_START_REPORTS;
+	byte missedReports = DEFERRED_MISSED_REPORTS;
+	DEFERRED_START_REPORTS = 0;
+	DEFERRED_MISSED_REPORTS = 0;
+	interrupts();
+
+	for (; startReports > 0; --startReports)
+		Serial.print('S');
+	for (; missedReports > 0; --missedReports)
+		Serial.print('M');
+}
+
 bool Steppers::isSchedulerRunning()
 {
-	return TIMSK1 > 0;
+	return isStepTimerEnabled();
 }
 
 void Steppers::initialize()
 {
 	noInterrupts(); // disable all interrupts
-	TCCR1A = 0;
-	TCCR1B = 0;
-	TIMSK1 = 0;
-
-	TCCR1B |= 1 << CS11; // 8 prescaler
+	initializeStepTimer();
+	initializeRefillTimer(); // the sketch enables the refill
 	interrupts(); // enable all interrupts
 }
 
 
+// Converts period of the plan data into the schedule ticks - the finer ticks take a part of the remainder
+// which is distributed over the steps (its denominator stays).
+static inline void scalePeriod(int32_t& deltaT, uint16_t& remainder, uint16_t stepCount)
+{
+#if SCHEDULE_TICK_SHIFT > 0
+	deltaT *= SCHEDULE_TICK_SCALE;
+	if (stepCount == 0)
+		return;
+
+	uint32_t scaledRemainder = (uint32_t)remainder * SCHEDULE_TICK_SCALE;
+	deltaT += scaledRemainder / stepCount;
+	remainder = scaledRemainder % stepCount;
+#endif
+}
+
 AccelerationPlan::AccelerationPlan(byte clkPin, byte dirPin)
-	: Plan(clkPin, dirPin), _currentDeltaT(0), _current4N(0), _currentDeltaTBuffer2(0), _isDeceleration(false)
+	: Plan(clkPin, dirPin), _isDeceleration(false), _current4N(0), _currentDeltaTBuffer2(0), _currentDeltaT(0)
 {
 }
 
@@ -133,6 +475,11 @@ void AccelerationPlan::loadFrom(byte * data)
 	int16_t baseDelta = READ_INT16(data, 2 + 4 + 4);
 	int16_t baseRemainder = READ_INT16(data, 2 + 4 + 4 + 2);
 
+	this->load(stepCount, initialDeltaT, n, baseDelta, baseRemainder);
+}
+
+void AccelerationPlan::load(int16_t stepCount, int32_t initialDeltaT, int32_t n, int16_t baseDelta, int16_t baseRemainder)
+{
 	this->stepCount = abs(stepCount);
 	this->remainingSteps = this->stepCount;
 	this->isActive = this->remainingSteps > 0;
@@ -141,18 +488,20 @@ void AccelerationPlan::loadFrom(byte * data)
 	this->isActivationBoundary = !this->isActive;
 
 	this->_isDeceleration = n < 0;
-	this->_baseDeltaT = baseDelta;
-	this->_baseRemainder = abs(baseRemainder);
+	int32_t baseDeltaT = baseDelta;
+	uint16_t remainder = abs(baseRemainder);
+	scalePeriod(baseDeltaT, remainder, this->stepCount);
+	this->_baseDeltaT = baseDeltaT;
+	this->_baseRemainder = remainder;
 	this->_baseRemainderBuffer = this->_baseRemainder / 2;
-	this->_currentDeltaT = initialDeltaT;
+	this->_currentDeltaT = initialDeltaT * SCHEDULE_TICK_SCALE;
 	this->_current4N = ((uint32_t)4) * abs(n);
 	this->_currentDeltaTBuffer2 = 0;
 }
 
 void AccelerationPlan::initForHoming()
 {
-	//TODO refactore homing settings somewhere
-	int16_t stepCount = -150;
+	int16_t stepCount = -HOMING_RAMP_STEPS;
 	this->stepCount = abs(stepCount);
 	this->remainingSteps = this->stepCount;
 	this->isActive = this->remainingSteps > 0;
@@ -160,12 +509,12 @@ void AccelerationPlan::initForHoming()
 	this->nextActivationTime = 0;
 	this->isActivationBoundary = !this->isActive;
 
-	int n = 6;
+	int n = HOMING_RAMP_N;
 	this->_isDeceleration = n < 0;
 	this->_baseDeltaT = 0;
 	this->_baseRemainder = 0;
 	this->_baseRemainderBuffer = this->_baseRemainder / 2;
-	this->_currentDeltaT = 2000;
+	this->_currentDeltaT = HOMING_RAMP_DELTA_T * SCHEDULE_TICK_SCALE;
 	this->_current4N = ((uint32_t)4) * abs(n);
 	this->_currentDeltaTBuffer2 = 0;
 }
@@ -225,6 +574,753 @@ void AccelerationPlan::createNextActivation()
 
 }
 
+const uint16_t RECIPROCAL_TABLE[RECIPROCAL_TABLE_LEN] PROGMEM = {
+	0, 13107, 7281, 5041, 3855, 3120, 2621, 2259, 1985, 1771, 1598, 1456, 1337, 1236, 1149, 1074,
+	1008, 949, 897, 851, 809, 771, 736, 704, 675, 648, 624, 601, 579, 560, 541, 524,
+	508, 492, 478, 464, 451, 439, 428, 417, 407, 397, 387, 378, 370, 362, 354, 346,
+	339, 332, 326, 319, 313, 307, 302, 296, 291, 286, 281, 276, 271, 267, 263, 259,
+	255, 251, 247, 243, 240, 236, 233, 229, 226, 223, 220, 217, 214, 212, 209, 206,
+	204, 201, 199, 196, 194, 192, 189, 187, 185, 183, 181, 179, 177, 175, 173, 172,
+	170, 168, 166, 165, 163, 161, 160, 158, 157, 155, 154, 152, 151, 149, 148, 147,
+	145, 144, 143, 142, 140, 139, 138, 137, 136, 135, 134, 132, 131, 130, 129, 128,
+	127, 126, 125, 124, 123, 122, 122, 121, 120, 119, 118, 117, 116, 115, 115, 114,
+	113, 112, 112, 111, 110, 109, 109, 108, 107, 106, 106, 105, 104, 104, 103, 102,
+	102, 101, 100, 100, 99, 99, 98, 97, 97, 96, 96, 95, 95, 94, 94, 93,
+	92, 92, 91, 91, 90, 90, 89, 89, 88, 88, 87, 87, 87, 86, 86, 85,
+	85, 84, 84, 83, 83, 83, 82, 82, 81, 81, 81, 80, 80, 79, 79, 79,
+	78, 78, 77, 77, 77, 76, 76, 76, 75, 75, 75, 74, 74, 74, 73, 73,
+	73, 72, 72, 72, 71, 71, 71, 70, 70, 70, 69, 69, 69, 69, 68, 68,
+	68, 67, 67, 67, 67, 66, 66, 66, 65, 65, 65, 65, 64, 64, 64, 64
+};
+
+const uint16_t JERK_RECIPROCAL_TABLE[RECIPROCAL_TABLE_LEN] PROGMEM = {
+	0, 16384, 9362, 6553, 5041, 4096, 3449, 2978, 2621, 2340, 2114, 1927, 1771, 1638, 1524, 1424,
+	1337, 1260, 1191, 1129, 1074, 1024, 978, 936, 897, 862, 829, 799, 771, 744, 720, 697,
+	675, 655, 636, 618, 601, 585, 569, 555, 541, 528, 516, 504, 492, 481, 471, 461,
+	451, 442, 434, 425, 417, 409, 402, 394, 387, 381, 374, 368, 362, 356, 350, 344,
+	339, 334, 329, 324, 319, 315, 310, 306, 302, 297, 293, 289, 286, 282, 278, 275,
+	271, 268, 265, 262, 259, 256, 253, 250, 247, 244, 241, 239, 236, 234, 231, 229,
+	226, 224, 222, 219, 217, 215, 213, 211, 209, 207, 205, 203, 201, 199, 197, 196,
+	194, 192, 191, 189, 187, 186, 184, 183, 181, 180, 178, 177, 175, 174, 172, 171,
+	170, 168, 167, 166, 165, 163, 162, 161, 160, 159, 157, 156, 155, 154, 153, 152,
+	151, 150, 149, 148, 147, 146, 145, 144, 143, 142, 141, 140, 139, 138, 137, 137,
+	136, 135, 134, 133, 132, 132, 131, 130, 129, 129, 128, 127, 126, 126, 125, 124,
+	123, 123, 122, 121, 121, 120, 119, 119, 118, 117, 117, 116, 115, 115, 114, 114,
+	113, 112, 112, 111, 111, 110, 110, 109, 109, 108, 107, 107, 106, 106, 105, 105,
+	104, 104, 103, 103, 102, 102, 101, 101, 100, 100, 100, 99, 99, 98, 98, 97,
+	97, 96, 96, 96, 95, 95, 94, 94, 94, 93, 93, 92, 92, 92, 91, 91,
+	90, 90, 90, 89, 89, 89, 88, 88, 87, 87, 87, 86, 86, 86, 85, 85
+};
+
+BoundedAccelerationPlan::BoundedAccelerationPlan(byte clkPin, byte dirPin)
+	: AccelerationPlan(clkPin, dirPin)
+{
+}
+
+void BoundedAccelerationPlan::createNextActivation()
+{
+	if (this->remainingSteps == 0) {
+		this->isActive = false;
+		return;
+	}
+
+	--this->remainingSteps;
+	this->nextActivationTime = this->_currentDeltaT + this->_baseDeltaT;
+
+	if (this->_baseRemainder > 0) {
+		this->_baseRemainderBuffer += this->_baseRemainder;
+		if (this->_baseRemainderBuffer > this->stepCount) {
+			this->_baseRemainderBuffer -= this->stepCount;
+			this->nextActivationTime += 1;
+		}
+	}
+
+	if (this->_current4N == 0) {
+		//compensate for error at c0
+		this->_currentDeltaT = this->_currentDeltaT * 676 / 1000;
+	}
+
+	int32_t nextDeltaT = this->_currentDeltaT;
+	int32_t nextDeltaTChange = 0;
+	this->_currentDeltaTBuffer2 += nextDeltaT * 2;
+
+	if (this->_isDeceleration) {
+		this->_current4N -= 4;
+	}
+	else {
+		this->_current4N += 4;
+	}
+
+	uint32_t divisor = this->_current4N + 1;
+	if (nextDeltaT > 5000) {
+		nextDeltaTChange = this->_currentDeltaTBuffer2 / divisor;
+		this->_currentDeltaTBuffer2 = this->_currentDeltaTBuffer2 % divisor;
+	}
+	else if (this->_current4N < 4 * RECIPROCAL_TABLE_LEN) {
+		//buffer fits 14 bits here (remainder from last step + 2 * 5000)
+		uint16_t buffer = this->_currentDeltaTBuffer2;
+		byte n = this->_current4N >> 2;
+		if (n == 0) {
+			//division by one
+			nextDeltaTChange = buffer;
+			buffer = 0;
+		}
+		else {
+			//estimate is smaller by one at most
+			uint16_t change = ((uint32_t)buffer * pgm_read_word(&RECIPROCAL_TABLE[n])) >> 16;
+			buffer -= change * (uint16_t)divisor;
+			if (buffer >= divisor) {
+				buffer -= divisor;
+				change += 1;
+			}
+			nextDeltaTChange = change;
+		}
+		this->_currentDeltaTBuffer2 = buffer;
+	}
+	else {
+		//divisor is above 1024 - at most 10 subtractions are needed
+		while (this->_currentDeltaTBuffer2 >= divisor) {
+			this->_currentDeltaTBuffer2 -= divisor;
+			nextDeltaTChange += 1;
+		}
+	}
+	nextDeltaT = this->_isDeceleration ? nextDeltaT + nextDeltaTChange : nextDeltaT - nextDeltaTChange;
+	this->_currentDeltaT = nextDeltaT;
+}
+
+SegmentPlan::SegmentPlan(byte clkPin, byte dirPin)
+	: BoundedAccelerationPlan(clkPin, dirPin), _isConstant(false), _hasOffset(false), _offset(0),
+	_isConstantJerk(false), _curveKind(0)
+{
+	memset(&this->_move, 0, sizeof(this->_move));
+}
+
+void SegmentPlan::loadFrom(byte kind, byte axisFlags, const byte *& segment)
+{
+	this->_isConstantJerk = false;
+	this->_curveKind = 0;
+	this->_move.cruiseSteps = 0;
+	this->_move.decelerationSteps = 0;
+
+	if ((axisFlags & COMPACT_AXIS_PRESENT) == 0) {
+		//axis without steps
+		if (kind == 'C')
+			this->loadConstant(0, 0, 0, INT32_MIN);
+		else
+			this->load(0, 0, 0, 0, 0);
+		this->_isConstant = kind == 'C';
+		this->_hasOffset = false;
+		return;
+	}
+
+	if (kind == 'C') {
+		const ConstantSegment* constant = (const ConstantSegment*)segment;
+		segment += sizeof(ConstantSegment);
+
+		int32_t offset = INT32_MIN;
+		if (axisFlags & COMPACT_AXIS_OFFSET) {
+			memcpy(&offset, segment, sizeof(offset));
+			segment += sizeof(offset);
+		}
+
+		this->loadConstant(constant->stepCount, constant->baseDeltaT, constant->periodNumerator, offset);
+		return;
+	}
+
+	if (kind == ARC_KIND) {
+		const ArcSegment* arc = (const ArcSegment*)segment;
+		segment += sizeof(ArcSegment);
+
+		this->loadArc(arc->stepCount, arc->deltaT, arc->coordinate, arc->radius);
+		return;
+	}
+
+	if (kind == SPLINE_KIND) {
+		const SplineSegment* spline = (const SplineSegment*)segment;
+		segment += sizeof(SplineSegment);
+
+		this->loadSpline(spline->stepCount, spline->duration, spline->startSlope, spline->endSlope, spline->intervalShift);
+		return;
+	}
+
+	const AccelerationSegment* acceleration = (const AccelerationSegment*)segment;
+	segment += sizeof(AccelerationSegment);
+
+	this->load(acceleration->stepCount, acceleration->initialDeltaT, acceleration->n, acceleration->baseDelta, acceleration->baseRemainder);
+	this->_isConstant = false;
+	this->_hasOffset = false;
+}
+
+void SegmentPlan::loadConstant(int16_t stepCount, int32_t baseDeltaT, uint16_t periodNumerator, int32_t offset)
+{
+	this->_isConstant = true;
+	this->_offset = offset;
+	this->_hasOffset = this->_offset > INT32_MIN;
+
+	this->stepCount = abs(stepCount);
+	this->remainingSteps = this->stepCount;
+	this->stepMask = stepCount < 0 ? this->dirMask : 0;
+	this->isActive = this->remainingSteps > 0;
+	this->nextActivationTime = 0;
+	this->isActivationBoundary = this->stepCount == 0 || this->_hasOffset;
+
+	if (this->_hasOffset)
+		this->_offset *= SCHEDULE_TICK_SCALE;
+
+	//period remainder is distributed the same way as base remainder of acceleration
+	scalePeriod(baseDeltaT, periodNumerator, this->stepCount);
+	this->_baseDeltaT = baseDeltaT;
+	this->_baseRemainder = periodNumerator;
+	this->_baseRemainderBuffer = 0;
+	if (periodNumerator > 0)
+		this->_baseRemainderBuffer = this->stepCount / periodNumerator;
+}
+
+void initMoveHeader(MoveHeader& move, const int16_t* stepCounts, byte axisCount, int32_t cruiseDeltaT, int32_t acceleration, int32_t rampJerk)
+{
+	uint16_t leaderSteps = 1;
+	float length2 = 0;
+	for (byte i = 0; i < axisCount; ++i) {
+		uint16_t steps = abs(stepCounts[i]);
+		leaderSteps = max(leaderSteps, steps);
+		length2 += (float)steps * steps;
+	}
+
+	//machine limits are enforced regardless of the requested values
+	float maxAcceleration = (float)MAX_ACCELERATION * STEPS_PER_REVOLUTION;
+	float leaderAcceleration = acceleration > 0 && acceleration < maxAcceleration ? acceleration : maxAcceleration;
+	float leaderSpeed = (float)TIMER_FREQUENCY / max(cruiseDeltaT, (int32_t)MIN_DELTA_T * 2);
+
+	//values of the leading axis are scaled to the path
+	move.length = max(sqrt(length2), 1.0f);
+	float scale = move.length / leaderSteps;
+	float speed = leaderSpeed * scale;
+	move.acceleration = leaderAcceleration * scale;
+	move.nominalSpeed2 = speed * speed;
+	move.rampJerk = 0;
+	if (rampJerk > 0)
+		//acceleration at the end of the ramp must not exceed the limit
+		move.rampJerk = min(rampJerk * scale, move.acceleration * move.acceleration / (2 * speed));
+
+	move.maxEntrySpeed2 = 0;
+	move.entrySpeed2 = 0;
+	move.exitSpeed2 = 0;
+}
+
+void limitJunctionSpeed(MoveHeader& move, const int16_t* stepCounts, const MoveHeader& previousMove, const int16_t* previousStepCounts, byte axisCount)
+{
+	if (move.rampJerk > 0 || previousMove.rampJerk > 0)
+		//constant jerk ramps start and stop at the standstill
+		return;
+
+	//axis speed is the path speed multiplied by the axis direction
+	float maxDirectionChange = 0;
+	for (byte i = 0; i < axisCount; ++i)
+		maxDirectionChange = max(maxDirectionChange, fabs(stepCounts[i] / move.length - previousStepCounts[i] / previousMove.length));
+
+	float speed2 = min(move.nominalSpeed2, previousMove.nominalSpeed2);
+	if (maxDirectionChange > 0) {
+		float junctionSpeed = MAX_JUNCTION_SPEED_CHANGE / maxDirectionChange;
+		speed2 = min(speed2, junctionSpeed * junctionSpeed);
+	}
+	move.maxEntrySpeed2 = speed2;
+}
+
+void planMoveChain(MoveHeader** chain, byte count)
+{
+	//backward pass - every move can stop by the end of the chain
+	float speed2 = 0;
+	for (byte i = count; i-- > 1;) {
+		MoveHeader& move = *chain[i];
+		speed2 = min(move.maxEntrySpeed2, speed2 + 2 * move.acceleration * move.length);
+		move.entrySpeed2 = speed2;
+	}
+
+	//forward pass - the first move keeps its entry speed (the previous move is armed already)
+	for (byte i = 0; i < count; ++i) {
+		MoveHeader& move = *chain[i];
+		if (i + 1 == count) {
+			move.exitSpeed2 = 0;
+			break;
+		}
+
+		MoveHeader& nextMove = *chain[i + 1];
+		nextMove.entrySpeed2 = min(nextMove.entrySpeed2, move.entrySpeed2 + 2 * move.acceleration * move.length);
+		move.exitSpeed2 = nextMove.entrySpeed2;
+	}
+}
+
+//rounds a ramp length in steps of an axis - lengths over the uint16_t range are clamped before the cast
+static uint16_t roundRampSteps(float steps)
+{
+	return (uint16_t)(min(steps, (float)UINT16_MAX) + 0.5f);
+}
+
+void SegmentPlan::loadMove(const MoveHeader& move, int16_t stepCount)
+{
+	this->_isConstantJerk = false;
+	this->_curveKind = 0;
+	this->_move.cruiseSteps = 0;
+	this->_move.decelerationSteps = 0;
+	this->_hasOffset = false;
+	uint16_t steps = abs(stepCount);
+	if (steps == 0) {
+		//axis without steps
+		this->loadConstant(0, 0, 0, INT32_MIN);
+		return;
+	}
+
+	//n of the ramp formula scales with the steps ratio - the axis keeps the line of the move
+	float ratio = steps / move.length;
+	float frequency = SCHEDULE_FREQUENCY;
+	float entryN = 0, exitN = 0, cruiseN, cruiseSpeed, initialDeltaT;
+	this->_isConstantJerk = move.rampJerk > 0;
+	if (this->_isConstantJerk) {
+		//ramps from and to the standstill - steps grow with cube of the ramp time
+		float rampTime = sqrt(2 * sqrt(move.nominalSpeed2) / move.rampJerk);
+		cruiseN = min(move.rampJerk * rampTime * rampTime * rampTime / 6, move.length / 2);
+		rampTime = cbrt(6 * cruiseN / move.rampJerk);
+		cruiseSpeed = move.rampJerk * rampTime * rampTime / 2;
+		initialDeltaT = frequency * cbrt(6 / (move.rampJerk * ratio));
+	}
+	else {
+		float doubleAcceleration = 2 * move.acceleration;
+		entryN = move.entrySpeed2 / doubleAcceleration;
+		exitN = move.exitSpeed2 / doubleAcceleration;
+		//ramps meet when the cruise speed is not reached
+		cruiseN = min(move.nominalSpeed2 / doubleAcceleration, (move.length + entryN + exitN) / 2);
+		cruiseSpeed = sqrt(doubleAcceleration * cruiseN);
+		initialDeltaT = frequency * sqrt(2 / (move.acceleration * ratio));
+	}
+
+	uint16_t axisEntryN = roundRampSteps(entryN * ratio);
+	uint16_t axisExitN = roundRampSteps(exitN * ratio);
+	uint16_t minCruiseN = max(axisEntryN, axisExitN);
+	uint16_t axisCruiseN = max(roundRampSteps(cruiseN * ratio), minCruiseN);
+	while (axisCruiseN > minCruiseN && 2 * (uint32_t)axisCruiseN - axisEntryN - axisExitN > steps)
+		//rounded ramps have to fit into the steps
+		--axisCruiseN;
+
+	uint16_t accelerationSteps = min((uint16_t)(axisCruiseN - axisEntryN), steps);
+	this->_move.decelerationSteps = min((uint16_t)(axisCruiseN - axisExitN), (uint16_t)(steps - accelerationSteps));
+	this->_move.decelerationN = axisCruiseN;
+	this->_move.cruiseSteps = steps - accelerationSteps - this->_move.decelerationSteps;
+
+	float cruiseDeltaT = frequency / (cruiseSpeed * ratio);
+	this->_move.cruiseDeltaT = (int32_t)cruiseDeltaT;
+	this->_move.cruiseNumerator = (uint16_t)((cruiseDeltaT - this->_move.cruiseDeltaT) * this->_move.cruiseSteps);
+
+	this->stepMask = stepCount < 0 ? this->dirMask : 0;
+	this->isActive = true;
+	this->nextActivationTime = 0;
+	this->isActivationBoundary = true;
+
+	if (accelerationSteps == 0) {
+		//the move enters at its cruise speed
+		this->startNextPhase();
+		return;
+	}
+
+	//acceleration ramp continues from the entry speed (deltaT of n-th step of the ramp)
+	this->_isConstant = false;
+	this->_isDeceleration = false;
+	this->stepCount = this->remainingSteps = accelerationSteps;
+	this->_baseDeltaT = 0;
+	this->_baseRemainder = 0;
+	this->_baseRemainderBuffer = 0;
+	if (axisEntryN > 0)
+		initialDeltaT *= sqrt(axisEntryN + 1.0f) - sqrt((float)axisEntryN);
+	this->_currentDeltaT = (int32_t)(initialDeltaT + 0.5f);
+	this->_current4N = (uint32_t)4 * axisEntryN;
+	this->_currentDeltaTBuffer2 = 0;
+}
+
+void SegmentPlan::startNextPhase()
+{
+	if (this->_move.cruiseSteps > 0) {
+		this->_isConstant = true;
+		this->stepCount = this->remainingSteps = this->_move.cruiseSteps;
+		this->_move.cruiseSteps = 0;
+		this->_baseDeltaT = this->_move.cruiseDeltaT;
+		this->_baseRemainder = this->_move.cruiseNumerator;
+		this->_baseRemainderBuffer = 0;
+		return;
+	}
+
+	//deceleration from the cruise speed
+	this->_isConstant = false;
+	this->_isDeceleration = true;
+	this->stepCount = this->remainingSteps = this->_move.decelerationSteps;
+	this->_move.decelerationSteps = 0;
+	this->_baseDeltaT = 0;
+	this->_baseRemainder = 0;
+	this->_baseRemainderBuffer = 0;
+	this->_currentDeltaT = this->_move.cruiseDeltaT;
+	this->_current4N = (uint32_t)(this->_isConstantJerk ? 3 : 4) * this->_move.decelerationN;
+	this->_currentDeltaTBuffer2 = 0;
+}
+
+void SegmentPlan::loadHoming(int16_t stepCount, uint16_t deltaT, bool isRamp)
+{
+	this->_isConstantJerk = false;
+	this->_curveKind = 0;
+	this->_move.cruiseSteps = 0;
+	this->_move.decelerationSteps = 0;
+
+	if (isRamp && stepCount != 0 && deltaT < HOMING_RAMP_DELTA_T) {
+		//deltaT of the ramp falls with square root of n - the ramp ends where it reaches the deltaT
+		uint32_t endN = (uint32_t)HOMING_RAMP_N * HOMING_RAMP_DELTA_T * HOMING_RAMP_DELTA_T / ((uint32_t)deltaT * deltaT);
+		int16_t rampSteps = min(endN - HOMING_RAMP_N, (uint32_t)INT16_MAX);
+		this->load(stepCount < 0 ? -rampSteps : rampSteps, HOMING_RAMP_DELTA_T, HOMING_RAMP_N, 0, 0);
+		this->_isConstant = false;
+		this->_hasOffset = false;
+		return;
+	}
+
+	this->loadConstant(stepCount, deltaT, 0, INT32_MIN);
+}
+
+void SegmentPlan::createNextActivation()
+{
+	if (this->_curveKind == ARC_KIND) {
+		this->createNextArcActivation();
+		return;
+	}
+
+	if (this->_curveKind == SPLINE_KIND) {
+		this->createNextSplineActivation();
+		return;
+	}
+
+	if (this->remainingSteps == 0 && this->_move.cruiseSteps + this->_move.decelerationSteps > 0)
+		//move continues with the next phase
+		this->startNextPhase();
+
+	if (this->_isConstantJerk && !this->_isConstant) {
+		this->createNextJerkActivation();
+		return;
+	}
+
+	if (!this->_isConstant) {
+		BoundedAccelerationPlan::createNextActivation();
+		return;
+	}
+
+	this->createNextConstantActivation();
+}
+
+void SegmentPlan::createNextConstantActivation()
+{
+	if (this->remainingSteps == 0) {
+		this->isActive = false;
+		return;
+	}
+
+	--this->remainingSteps;
+	this->nextActivationTime = this->_baseDeltaT;
+
+	if (this->_baseRemainder > 0) {
+		this->_baseRemainderBuffer += this->_baseRemainder;
+		if (this->_baseRemainderBuffer > this->stepCount) {
+			this->_baseRemainderBuffer -= this->stepCount;
+			this->nextActivationTime += 1;
+		}
+	}
+
+	if (this->_hasOffset) {
+		this->nextActivationTime += this->_offset;
+		this->_hasOffset = false;
+	}
+}
+
+void SegmentPlan::createNextJerkActivation()
+{
+	if (this->remainingSteps == 0) {
+		this->isActive = false;
+		return;
+	}
+
+	--this->remainingSteps;
+	this->nextActivationTime = this->_currentDeltaT;
+
+	if (this->_current4N == 0) {
+		//compensate for error at c0 (ramp time grows with cube root of the steps, the following steps keep the ratio)
+		this->_currentDeltaT = this->_currentDeltaT * 505 / 1000;
+	}
+
+	int32_t nextDeltaT = this->_currentDeltaT;
+	int32_t nextDeltaTChange = 0;
+	this->_currentDeltaTBuffer2 += nextDeltaT * 2;
+
+	//_current4N holds 3n for the constant jerk
+	if (this->_isDeceleration) {
+		this->_current4N -= 3;
+	}
+	else {
+		this->_current4N += 3;
+	}
+
+	uint32_t divisor = this->_current4N + 1;
+	if (nextDeltaT > 5000) {
+		nextDeltaTChange = this->_currentDeltaTBuffer2 / divisor;
+		this->_currentDeltaTBuffer2 = this->_currentDeltaTBuffer2 % divisor;
+	}
+	else if (this->_current4N < 3 * RECIPROCAL_TABLE_LEN) {
+		//buffer fits 14 bits here (remainder from last step + 2 * 5000)
+		uint16_t buffer = this->_currentDeltaTBuffer2;
+		byte n = (uint16_t)this->_current4N / 3;
+		if (n == 0) {
+			//division by one
+			nextDeltaTChange = buffer;
+			buffer = 0;
+		}
+		else {
+			//estimate is smaller by one at most
+			uint16_t change = ((uint32_t)buffer * pgm_read_word(&JERK_RECIPROCAL_TABLE[n])) >> 16;
+			buffer -= change * (uint16_t)divisor;
+			if (buffer >= divisor) {
+				buffer -= divisor;
+				change += 1;
+			}
+			nextDeltaTChange = change;
+		}
+		this->_currentDeltaTBuffer2 = buffer;
+	}
+	else {
+		//divisor is above 768 - at most 14 subtractions are needed
+		while (this->_currentDeltaTBuffer2 >= divisor) {
+			this->_currentDeltaTBuffer2 -= divisor;
+			nextDeltaTChange += 1;
+		}
+	}
+	nextDeltaT = this->_isDeceleration ? nextDeltaT + nextDeltaTChange : nextDeltaT - nextDeltaTChange;
+	this->_currentDeltaT = nextDeltaT;
+}
+
+// Floor of the square root (bit by bit - used when an arc segment is loaded or its other coordinate changes fast).
+static uint16_t squareRoot(uint32_t value)
+{
+	uint32_t root = 0;
+	uint32_t bit = (uint32_t)1 << 30;
+	while (bit > value)
+		bit >>= 2;
+
+	while (bit != 0) {
+		if (value >= root + bit) {
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
+
+// Square root rounded to the nearest value (n * (n - 1) < value <= n * (n + 1)).
+static uint32_t roundedSquareRoot(uint32_t value)
+{
+	uint32_t root = squareRoot(value);
+	if (value > root * (root + 1))
+		++root;
+	return root;
+}
+
+void SegmentPlan::loadArc(int16_t stepCount, int32_t deltaT, int16_t coordinate, uint16_t radius)
+{
+	this->_curveKind = ARC_KIND;
+	this->_isConstant = false;
+	this->_hasOffset = false;
+
+	this->stepCount = abs(stepCount);
+	this->remainingSteps = this->stepCount;
+	this->isActive = this->remainingSteps > 0;
+	this->stepMask = stepCount < 0 ? this->dirMask : 0;
+	this->nextActivationTime = 0;
+	this->isActivationBoundary = !this->isActive;
+
+	//doubled values keep the whole circle in 32 bits
+	uint32_t doubledRadius = 2 * (uint32_t)radius;
+	uint32_t doubledCoordinate = 2 * (uint32_t)abs(coordinate);
+	uint32_t radius2 = doubledRadius * doubledRadius;
+	uint32_t coordinate2 = doubledCoordinate * doubledCoordinate;
+	this->_arc.coordinate = coordinate;
+	this->_arc.otherCoordinate2 = coordinate2 < radius2 ? radius2 - coordinate2 : 0;
+	this->_arc.otherCoordinate = roundedSquareRoot(this->_arc.otherCoordinate2);
+	this->_arc.stepTimeRadius = 4 * (uint32_t)deltaT * SCHEDULE_TICK_SCALE * radius;
+}
+
+void SegmentPlan::createNextArcActivation()
+{
+	if (this->remainingSteps == 0) {
+		this->isActive = false;
+		return;
+	}
+
+	--this->remainingSteps;
+
+	//squared other coordinate changes by the difference of squares (of the doubled coordinates)
+	int32_t coordinate = this->_arc.coordinate;
+	int32_t nextCoordinate = this->stepMask ? coordinate - 1 : coordinate + 1;
+	int32_t change = 4 * (nextCoordinate - coordinate) * (nextCoordinate + coordinate);
+	this->_arc.coordinate = nextCoordinate;
+	if (change > 0)
+		this->_arc.otherCoordinate2 = (uint32_t)change < this->_arc.otherCoordinate2 ? this->_arc.otherCoordinate2 - change : 0;
+	else
+		this->_arc.otherCoordinate2 += -change;
+
+	//the rounded root changes slowly except near the end of the quadrant (the root is computed again there)
+	uint32_t otherCoordinate = this->_arc.otherCoordinate;
+	uint32_t nextOtherCoordinate = otherCoordinate;
+	byte corrections = ARC_ROOT_CORRECTIONS;
+	while (corrections > 0 && nextOtherCoordinate > 0 && nextOtherCoordinate * (nextOtherCoordinate - 1) >= this->_arc.otherCoordinate2) {
+		--nextOtherCoordinate;
+		--corrections;
+	}
+	while (corrections > 0 && nextOtherCoordinate * (nextOtherCoordinate + 1) < this->_arc.otherCoordinate2) {
+		++nextOtherCoordinate;
+		--corrections;
+	}
+	if (corrections == 0)
+		nextOtherCoordinate = roundedSquareRoot(this->_arc.otherCoordinate2);
+	this->_arc.otherCoordinate = nextOtherCoordinate;
+
+	//time of the step along the arc is divided by mean of the other coordinate (exact at the end of the quadrant too),
+	//rounding keeps the axes of the arc in time with each other
+	uint32_t coordinateSum = max(otherCoordinate + nextOtherCoordinate, (uint32_t)1);
+	this->nextActivationTime = (this->_arc.stepTimeRadius + coordinateSum / 2) / coordinateSum;
+}
+
+// Rounded position of the spline with the given steps at the end of the given interval (before the last one).
+// Hermite basis of the curve is exact in 1 / intervals^3, slopes of a curve which keeps its direction keep the sum below 2^32.
+static uint16_t splinePosition(uint16_t steps, uint16_t startSlope, uint16_t endSlope, byte interval, byte intervalShift)
+{
+	uint32_t intervalCount = (uint32_t)1 << intervalShift;
+	uint32_t u = interval;
+	uint32_t distanceBasis = u * u * (3 * intervalCount - 2 * u);
+	uint32_t startBasis = u * (intervalCount - u) * (intervalCount - u);
+	uint32_t endBasis = u * u * (intervalCount - u);
+	uint32_t position = (distanceBasis << SPLINE_SLOPE_SHIFT) + startSlope * startBasis - endSlope * endBasis;
+
+	byte shift = SPLINE_SLOPE_SHIFT + 3 * intervalShift;
+	return ((uint64_t)position * steps + ((uint64_t)1 << (shift - 1))) >> shift;
+}
+
+void SegmentPlan::loadSpline(int16_t stepCount, int32_t duration, uint16_t startSlope, uint16_t endSlope, byte intervalShift)
+{
+	this->_curveKind = SPLINE_KIND;
+	this->_isConstant = true;
+	this->_hasOffset = false;
+
+	this->stepCount = 0;
+	this->remainingSteps = 0;
+	this->isActive = stepCount != 0;
+	this->stepMask = stepCount < 0 ? this->dirMask : 0;
+	this->nextActivationTime = 0;
+	this->isActivationBoundary = !this->isActive;
+
+	uint32_t time = (uint32_t)duration * SCHEDULE_TICK_SCALE;
+	this->_intervalTime = time >> intervalShift;
+	this->_spline.steps = abs(stepCount);
+	this->_spline.pendingSteps = this->_spline.steps;
+	this->_spline.startSlope = startSlope;
+	this->_spline.endSlope = endSlope;
+	this->_spline.interval = 0;
+	this->_spline.intervalShift = intervalShift;
+	this->_spline.longIntervalCount = time & ((1 << intervalShift) - 1);
+}
+
+void SegmentPlan::createNextSplineActivation()
+{
+	//intervals without steps delay the first step of the next interval (the time after the last step is left as the slack of the next segment)
+	int32_t emptyTime = this->remainingSteps == 0 ? this->startNextInterval() : 0;
+	this->createNextConstantActivation();
+	this->nextActivationTime += emptyTime;
+}
+
+int32_t SegmentPlan::startNextInterval()
+{
+	byte intervalCount = 1 << this->_spline.intervalShift;
+	int32_t emptyTime = 0;
+	while (this->_spline.interval < intervalCount) {
+		++this->_spline.interval;
+		int32_t intervalTime = this->_intervalTime;
+		if (intervalCount - this->_spline.interval < this->_spline.longIntervalCount)
+			intervalTime += 1;
+
+		//the last interval takes the steps which are left
+		uint16_t steps = this->_spline.pendingSteps;
+		if (this->_spline.interval < intervalCount) {
+			//steps to the rounded position at the interval end
+			uint16_t position = splinePosition(this->_spline.steps, this->_spline.startSlope, this->_spline.endSlope, this->_spline.interval, this->_spline.intervalShift);
+			uint16_t madeSteps = this->_spline.steps - this->_spline.pendingSteps;
+			steps = position > madeSteps ? min((uint16_t)(position - madeSteps), steps) : 0;
+		}
+		this->_spline.pendingSteps -= steps;
+
+		if (steps == 0) {
+			emptyTime += intervalTime;
+			continue;
+		}
+
+		//steps are spread over the interval as the constant segment spreads them (its last step ends the interval)
+		this->stepCount = steps;
+		this->remainingSteps = steps;
+		this->_baseDeltaT = intervalTime / steps;
+		this->_baseRemainder = intervalTime % steps;
+		this->_baseRemainderBuffer = this->_baseRemainder > 0 ? steps / this->_baseRemainder : 0;
+		return emptyTime;
+	}
+	return emptyTime;
+}
+
+bool SegmentPlan::canRepeat(uint16_t minDelay, uint16_t maxDelay)
+{
+	if (!this->_isConstant || this->_hasOffset || !this->isActive || this->remainingSteps < SCHEDULE_RUN_MIN_LENGTH)
+		return false;
+
+	//whole period has to fit into a single timer reset
+	return this->_baseDeltaT > minDelay && this->_baseDeltaT + 1 <= maxDelay &&
+		this->nextActivationTime > minDelay && this->nextActivationTime <= maxDelay;
+}
+
+bool SegmentPlan::repeatsLike(const SegmentPlan& plan)
+{
+	return this->_isConstant && !this->_hasOffset && this->isActive &&
+		this->nextActivationTime == plan.nextActivationTime && this->remainingSteps == plan.remainingSteps && this->stepCount == plan.stepCount &&
+		this->_baseDeltaT == plan._baseDeltaT && this->_baseRemainder == plan._baseRemainder && this->_baseRemainderBuffer == plan._baseRemainderBuffer;
+}
+
+void SegmentPlan::initRun(ScheduleRun& run, uint16_t count, uint16_t timeScale)
+{
+	uint16_t deltaT = this->_baseDeltaT;
+	uint16_t remainder = this->_baseRemainder;
+	if (timeScale != FEED_SCALE_UNITY) {
+		//fraction of the scaled base period goes to the remainder (its denominator stays)
+		uint32_t scaledDeltaT = (uint32_t)this->_baseDeltaT * timeScale;
+		uint32_t scaledRemainder = ((scaledDeltaT & (FEED_SCALE_UNITY - 1)) * this->stepCount + (uint32_t)this->_baseRemainder * timeScale) >> FEED_SCALE_SHIFT;
+		deltaT = (scaledDeltaT >> FEED_SCALE_SHIFT) + scaledRemainder / this->stepCount;
+		remainder = scaledRemainder % this->stepCount;
+	}
+
+	run.timerWord = stepTimerWord(deltaT);
+	run.remainingCount = count;
+	run.remainderNumerator = remainder;
+	run.remainderDenominator = this->stepCount;
+	run.remainderBuffer = this->_baseRemainderBuffer;
+}
+
+int32_t SegmentPlan::repeatSteps(uint16_t count)
+{
+	int32_t duration = 0;
+	for (uint16_t i = 0; i < count; ++i) {
+		duration += this->nextActivationTime;
+		this->createNextActivation();
+	}
+	return duration;
+}
+
 void ConstantPlan::createNextActivation()
 {
 	if (this->remainingSteps == 0) {
@@ -268,8 +1364,12 @@ void ConstantPlan::loadFrom(byte * data)
 	this->_offset = offset;
 	this->_hasOffset = this->_offset > INT32_MIN;
 
+	if (this->_hasOffset)
+		this->_offset *= SCHEDULE_TICK_SCALE;
+
 	this->stepCount = abs(stepCount);
 	this->remainingSteps = this->stepCount;
+	scalePeriod(baseDeltaT, periodNumerator, this->stepCount);
 	this->_baseDeltaT = baseDeltaT;
 	this->stepMask = stepCount < 0 ? this->dirMask : 0;
 	this->isActive = this->remainingSteps > 0;
@@ -285,8 +1385,7 @@ void ConstantPlan::loadFrom(byte * data)
 
 void ConstantPlan::initForHoming()
 {
-	//TODO refactor homing settings somewhere
-	int16_t stepCount = -200;
+	int16_t stepCount = -HOMING_STEPS;
 	this->stepCount = abs(stepCount);
 	this->remainingSteps = this->stepCount;
 	this->stepMask = stepCount < 0 ? this->dirMask : 0;
@@ -294,14 +1393,14 @@ void ConstantPlan::initForHoming()
 	this->nextActivationTime = 0;
 	this->isActivationBoundary = !this->isActive;
 
-	this->_baseDeltaT = 400;
+	this->_baseDeltaT = HOMING_DELTA_T * SCHEDULE_TICK_SCALE;
 	this->_periodNumerator = 0;
 	this->_periodDenominator = 0;
 	this->_periodAccumulator = 0;
 }
 
 Plan::Plan(byte clkMask, byte dirMask) :
-	clkMask(clkMask), dirMask(dirMask),
-	stepMask(0), stepCount(0), remainingSteps(0), isActive(false), isActivationBoundary(false), nextActivationTime(0)
+	nextActivationTime(0), stepCount(0), remainingSteps(0), isActive(false), isActivationBoundary(false),
+	clkMask(clkMask), dirMask(dirMask), stepMask(0)
 {
 }
@@ -9,34 +9,103 @@ Editor:	http://www.visualmicro.com
 #define _StepperControl_h
 
 #if defined(ARDUINO) && ARDUINO >= 100
-#include "arduino.h"
+#include "Arduino.h"
 #else
 #include "WProgram.h"
 #endif
 
 #if defined(__SAM3X8E__)
-#undef __FlashStringHelper::F(string_literal)
+#undef F
 #define F(string_literal) string_literal
 #endif
 
+#if defined(__AVR__)
+// CRC update without the bit loop (see crc16Update)
+#include <util/crc16.h>
+#endif
+
 
 #define READ_INT16(buff, position) ((((int16_t)buff[(position)]) << 8) + buff[(position) + 1])
 #define READ_INT32(buff, position) ((((int32_t)buff[(position)]) << 24)+(((int32_t)buff[(position) + 1]) << 16)+(((int32_t)buff[(position) + 2]) << 8) + buff[(position) + 3])
 #define READ_UINT16(buff, position) ((((uint16_t)buff[(position)]) << 8) + buff[(position) + 1])
 #define INT32_TO_BYTES(vl) (((byte*)&vl)[3]), (((byte*)&vl)[2]), (((byte*)&vl)[1]), (((byte*)&vl)[0])
 #define INT16_TO_BYTES(vl) (((byte*)&vl)[1]), (((byte*)&vl)[0])
+#ifndef UINT16_MAX
 #define UINT16_MAX 65535
+#endif
+#ifndef INT32_MAX
 #define INT32_MAX 2147483647
+#endif
+#ifndef INT32_MIN
 #define INT32_MIN -2147483648
+#endif
+
+// first byte of compact frame has this flag (the rest of the byte is payload length)
+#define COMPACT_FRAME_FLAG 0x80
+// length byte and CRC-16 which wrap the compact payload
+#define COMPACT_FRAME_OVERHEAD 3
+// axis flag of compact plan - axis data are present
+#define COMPACT_AXIS_PRESENT 0x01
+// axis flag of compact plan - constant axis has offset
+#define COMPACT_AXIS_OFFSET 0x10
+// record kind of moves (their frames are plans too)
+#define MOVE_KIND 'R'
+// record kind of arcs (their frames are plans too)
+#define ARC_KIND 'O'
+// record kind of splines (their frames are plans too)
+#define SPLINE_KIND 'S'
+// axes of the build - the schedule clocks and the plan record axis flags follow it (see SCHEDULE_CLOCK_BITS and AxisFlags),
+// the step port and the slot step counters have 4 slots
+#ifndef MAX_AXIS_COUNT
+#define MAX_AXIS_COUNT 4
+#endif
+#if MAX_AXIS_COUNT > 8
+#error "schedule clocks and plan record axis flags have room for 8 axes"
+#endif
+
+// axis flags of plan records - present bits of the axes from the lowest bit, offset bits from RECORD_AXIS_OFFSET_SHIFT
+// (a byte up to 4 axes in the order of the compact axis flags, a word for more axes)
+#if MAX_AXIS_COUNT > 4
+typedef uint16_t AxisFlags;
+#define RECORD_AXIS_OFFSET_SHIFT 8
+#else
+typedef byte AxisFlags;
+#define RECORD_AXIS_OFFSET_SHIFT 4
+#endif
+// command and axis flags of plan records
+#define PLAN_RECORD_HEADER_SIZE (1 + (int)sizeof(AxisFlags))
 
 
 #define MAX_ACCELERATION 200 //rev/s^2
 #define START_DELTA_T 350 //us
+// step interrupt is estimated to ~11us (positions are counted by the main loop) - it is kept on 100us until it is measured on hardware
 #define MIN_DELTA_T 100	//us
 #define STEPS_PER_REVOLUTION 400 //200 with 1/2 microstep
 #define TIMESCALE 1000000 //us
+#define TIMER_FREQUENCY 2000000 //ticks per second (16MHz with 8 prescaler)
 #define CLIP_D(delta) max(MIN_DELTA_T,min(START_DELTA_T,delta))
 
+// STEP_TIMER_HIGH_RESOLUTION runs Timer1 without the prescaler - the schedule counts 62.5ns ticks then.
+// Plan data keep the 0.5us ticks, plans convert them when loaded (period remainders are distributed by the finer ticks).
+#ifdef STEP_TIMER_HIGH_RESOLUTION
+// schedule ticks of a single plan tick (as a power of 2)
+#define SCHEDULE_TICK_SHIFT 3
+#else
+#define SCHEDULE_TICK_SHIFT 0
+#endif
+// schedule ticks of a single plan tick
+#define SCHEDULE_TICK_SCALE (1 << SCHEDULE_TICK_SHIFT)
+// schedule ticks per second
+#define SCHEDULE_FREQUENCY ((uint32_t)TIMER_FREQUENCY * SCHEDULE_TICK_SCALE)
+
+// homing ramps start with this deltaT at n of the ramp formula (ticks)
+#define HOMING_RAMP_DELTA_T 2000
+#define HOMING_RAMP_N 6
+// homing segments of the legacy plans
+#define HOMING_RAMP_STEPS 150
+#define HOMING_STEPS 200
+#define HOMING_DELTA_T 400
+
 //port 8 (PORTB 1st bit)
 #define SLOT0_CLK_PIN 8
 #define SLOT0_CLK_MASK (1<<0)
@@ -71,42 +140,308 @@ Editor:	http://www.visualmicro.com
 // combined clock mask
 #define ACTIVATIONS_CLOCK_MASK (SLOT0_CLK_MASK | SLOT1_CLK_MASK | SLOT2_CLK_MASK | SLOT3_CLK_MASK )
 
-// how long (on 0.5us scale)
+// how long (on schedule ticks)
 //	* before pulse the dir has to be specified 
 // KEEPING BOTH VALUES SAME enables computation optimization
-#define PORT_CHANGE_DELAY (20 * 2)
+#define PORT_CHANGE_DELAY (20 * 2 * SCHEDULE_TICK_SCALE)
+
+// minimal width of the clock pulse (on schedule ticks, one more tick covers the partial tick of the pulse start)
+#define MIN_PULSE_WIDTH (3 * 2 * SCHEDULE_TICK_SCALE + 1)
 
 // minimal time between two activations (is used for activation grouping)
-#define MIN_ACTIVATION_DELAY (10 * 2)
+#define MIN_ACTIVATION_DELAY (10 * 2 * SCHEDULE_TICK_SCALE)
 
 // compensetaion subtracted for every activation (has to be smaller than min activation delay)
+#ifdef STEP_TIMER_HIGH_RESOLUTION
+// timer counts every CPU cycle from the overflow to the reset (the 8 prescaler rounded them to whole ticks)
+#define TIMER_RESET_COMPENSATION 73
+#else
 #define TIMER_RESET_COMPENSATION 10
+#endif
+
+// Step timer backends - the step interrupt and Steppers reach the timer and the step ports through the functions below.
+//	* AVR Timer1 - 16-bit counter which is reset by every activation (the host simulator emulates its registers)
+//	* SAM3X8E TC1 channel 0 - 32-bit counter which restarts at its RC compare
+//	* STEP_TIMER_HOST - 32-bit compare timer of the host simulator (the same timing as the SAM3X8E one)
+#if defined(__SAM3X8E__)
+#define STEP_TIMER_SAM3X
+#elif !defined(STEP_TIMER_HOST)
+#define STEP_TIMER_AVR
+#endif
+
+#if defined(STEP_TIMER_HIGH_RESOLUTION) && !defined(STEP_TIMER_AVR)
+#error High resolution schedule ticks are available with the AVR Timer1 only
+#endif
+
+#ifdef STEP_TIMER_AVR
+// activation times and timer words of the 16-bit timer
+typedef uint16_t ScheduleTime;
+#define SCHEDULE_TIME_SIZE 2
+#else
+#define STEP_TIMER_32BIT
+// activation times and timer words of the 32-bit timer
+typedef uint32_t ScheduleTime;
+#define SCHEDULE_TIME_SIZE 4
+#endif
+
+// STEP_ENGINE_DDA selects the fixed rate step engine - its interrupt comes every DDA_PERIOD ticks and steps the axes
+// by phase accumulators of velocity segments (the schedule entries are collected into the segments).
+// The default engine times every activation by its own timer reset.
+
+// timer ticks between two interrupts of the DDA engine (20 kHz)
+#define DDA_PERIOD (100 * SCHEDULE_TICK_SCALE)
+
+// longest segment of the DDA engine with steps (in its interrupts)
+#define DDA_SEGMENT_TICKS 32
+
+// count of segments which can be written by a single schedule entry (full segment, pause, direction change) and its flush
+#define DDA_ENTRY_SEGMENTS 4
+
+// step phase of a single DDA interrupt (the phases keep fractions of the interrupts)
+#define DDA_PHASE_ONE 64
+
+// longest phase an idle slot remembers (the accumulators of the slots have to take the longest segment on top of it)
+#define DDA_PHASE_MAX (UINT16_MAX - 255 * DDA_PHASE_ONE)
+
+#ifdef STEP_ENGINE_DDA
+// length of the segment ring
+#ifndef SCHEDULE_BUFFER_LEN
+#define SCHEDULE_BUFFER_LEN 16
+#endif
+#elif defined(STEP_TIMER_32BIT)
+// length of the schedule ring - 32-bit boards have SRAM for the longer ring
+#ifndef SCHEDULE_BUFFER_LEN
+#define SCHEDULE_BUFFER_LEN 1024
+#endif
+#else
+// length of the schedule ring - 128 entries (3ms of the fastest interleaved steps) leave the Uno SRAM to the segment scheduler
+// and the plan queue, 256 entries count on byte overflows and 384 entries need boards with more SRAM (indexes has to be accessed atomically then)
+// The ring takes 2.5 bytes per entry from the plan queue (see make sram): 64 entries leave 336 bytes to the queue (10 cruise plans),
+// 128 entries 176 bytes (6 cruise plans) and 256 entries are 117 bytes over the Uno budget with an empty queue - even without the
+// armed segments of the scheduler (224 bytes of 4 axes) the queue would keep 2 cruise plans only.
+#ifndef SCHEDULE_BUFFER_LEN
+#define SCHEDULE_BUFFER_LEN 128
+#endif
+#endif
+
+#if SCHEDULE_BUFFER_LEN > 256
+typedef uint16_t ScheduleIndex;
+#else
+typedef byte ScheduleIndex;
+#endif
+
+#if SCHEDULE_BUFFER_LEN > 256 && defined(STEP_TIMER_AVR)
+// 16-bit indexes are not accessed atomically by the 8-bit core
+#define SCHEDULE_INDEX_LOCKED
+#endif
+
+#ifdef STEP_TIMER_32BIT
+// longest time between two activations - slow axes do not need empty activations (the feed scaling stays in 32-bit math)
+#define SCHEDULE_MAX_DELAY 0x00FFFFFFUL
+#else
+// longest time between two activations (the highest bits of the timer resets are free for the entry flags) - longer delays
+// are chained by empty activations (~1ms apart with the high resolution ticks)
+#define SCHEDULE_MAX_DELAY 16383
+#endif
+
+// entry flag - the next activation takes an event (direction change or instruction ends)
+#define SCHEDULE_EVENT_FLAG 0x80
+// entry flag - the next entry is repeated by a run
+#define SCHEDULE_RUN_FLAG 0x40
+// position of the entry flags in the timer word (its highest byte)
+#define SCHEDULE_FLAGS_SHIFT ((SCHEDULE_TIME_SIZE - 1) * 8)
+// entry flags in the timer word
+#define SCHEDULE_FLAGS_MASK (((ScheduleTime)(SCHEDULE_EVENT_FLAG | SCHEDULE_RUN_FLAG)) << SCHEDULE_FLAGS_SHIFT)
+
+// count of event slots (has to be power of two)
+#define SCHEDULE_EVENT_LEN 16
+
+// count of run slots (has to be power of two)
+#define SCHEDULE_RUN_LEN 4
+
+// shortest stretch of steps which is worth a run
+#define SCHEDULE_RUN_MIN_LENGTH 4
+
+// longest run (keeps run duration in int32 range)
+#define SCHEDULE_RUN_MAX_LENGTH 1024
+
+// longest period of a run (keeps run duration in int32 range with the 32-bit timer)
+#define SCHEDULE_RUN_MAX_DELAY 32767
+
+// occupancy where the scheduler lets the main loop arm the next instruction (longer rings would take all the armed ones before)
+#define SCHEDULE_ARM_OCCUPANCY 255
+
+// occupancy below which the refill interrupt fills the schedule (it tops the schedule up to the full ring then)
+#define SCHEDULE_REFILL_OCCUPANCY (SCHEDULE_BUFFER_LEN * 3 / 4)
+
+// period of the refill interrupt (Timer2 ticks of 4us - 1ms, the ring lasts longer even with the fastest steps)
+#define SCHEDULE_REFILL_PERIOD 250
+
+// scaled time which the schedule is filled ahead of the step interrupt (~8ms, several refill periods) - a run does not last longer,
+// so the feed hold ramp starts within two of them
+#define SCHEDULE_LOOKAHEAD (16384UL * SCHEDULE_TICK_SCALE)
+// run durations are kept for the look-ahead in units of 256 ticks (~128us, a run fits into a byte then)
+#define SCHEDULE_RUN_TIME_SHIFT (8 + SCHEDULE_TICK_SHIFT)
+
+// fixed point of the time scale which the feed override applies to the written activation times
+#define FEED_SCALE_SHIFT 8
+// time scale of the 100 % feed
+#define FEED_SCALE_UNITY (1 << FEED_SCALE_SHIFT)
+// range of the feed override (in percents) - planned ramps are scaled in time, so their acceleration follows the square
+// of the override (up to 4x MAX_ACCELERATION at 200 %), changes of the override ramp with MAX_ACCELERATION (see FEED_OVERRIDING)
+#define FEED_OVERRIDE_MIN 10
+#define FEED_OVERRIDE_MAX 200
+
+// feed hold ramps the time scale after each quantum of plan time (ticks) by the speed of the leading axis in the quantum
+#define FEED_HOLD_QUANTUM (2048 * SCHEDULE_TICK_SCALE)
+// speed change of the leading axis in a quantum of the real time (steps per quantum in 1/65536) - the hold ramps
+// with MAX_ACCELERATION which bounds the planned ramps too
+#define FEED_HOLD_SPEED_CHANGE ((uint32_t)((float)MAX_ACCELERATION * STEPS_PER_REVOLUTION * FEED_HOLD_QUANTUM / SCHEDULE_FREQUENCY * FEED_HOLD_QUANTUM / SCHEDULE_FREQUENCY * 65536))
+// speed of the leading axis where the hold stops and the resume starts (steps per quantum of the real time in 1/256)
+#define FEED_HOLD_STOP_SPEED ((uint32_t)((float)MAX_JUNCTION_SPEED_CHANGE * FEED_HOLD_QUANTUM / SCHEDULE_FREQUENCY * 256))
+
+// states of the feed hold
+#define FEED_RUNNING 0
+#define FEED_STOPPING 1
+#define FEED_HELD 2
+#define FEED_RESUMING 3
+// the time scale ramps to the changed feed override (the same way as the resume, it is not a hold)
+#define FEED_OVERRIDING 4
+
+// step counts of armed instructions which were not committed to positions yet (power of 2)
+#ifdef STEP_TIMER_32BIT
+// the longer ring keeps more instructions in flight
+#define INSTRUCTION_STEPS_LEN 32
+#else
+#define INSTRUCTION_STEPS_LEN 8
+#endif
+
+// width of the step interrupt lateness buckets (schedule ticks as a power of 2 - the width stays 2us with the high resolution)
+#define ISR_LATENESS_BUCKET_SHIFT (2 + SCHEDULE_TICK_SHIFT)
+
+// count of the step interrupt lateness buckets (the last one takes all the later interrupts)
+#define ISR_LATENESS_BUCKET_COUNT 8
+
+#ifdef STEP_ENGINE_DDA
+// SRAM taken by the segment ring
+#define SCHEDULE_SRAM_SIZE (SCHEDULE_BUFFER_LEN * (3 + 5 * MAX_AXIS_COUNT))
+#else
+// bits of the slot clocks of a schedule entry - nibbles of two entries share a byte up to 4 axes, more axes take a byte for each entry
+#if MAX_AXIS_COUNT > 4
+#define SCHEDULE_CLOCK_BITS 8
+#else
+#define SCHEDULE_CLOCK_BITS 4
+#endif
+
+// SRAM taken by the schedule ring (timer resets, clocks, events and runs)
+#define SCHEDULE_SRAM_SIZE (SCHEDULE_BUFFER_LEN * SCHEDULE_TIME_SIZE + SCHEDULE_BUFFER_LEN * SCHEDULE_CLOCK_BITS / 8 + SCHEDULE_EVENT_LEN * 2 + SCHEDULE_RUN_LEN * (int)sizeof(ScheduleRun))
+#endif
+
+// SRAM of the static buffers on AVR (FirmwareCNC sizes its plan queue by them, its avr build checks them against sizeof)
+// segment scheduler - two segments (56 bytes), their pointers, step counts of the armed instructions, counters and hold ramp steps
+// of each axis with 34 bytes of state (35 with 16-bit schedule indexes) and durations of the written runs
+#define SEGMENT_SCHEDULER_SRAM(axisCount) ((axisCount) * (2 * 56 + 2 * 2 + INSTRUCTION_STEPS_LEN * 2 + 2 * 2 + 1) + (SCHEDULE_BUFFER_LEN > 256 ? 35 : 34) + SCHEDULE_RUN_LEN)
+// frame receiver - slots with their states and sizes, 14 bytes of indexes and counters
+#define FRAME_RECEIVER_SRAM(slotSize, slotCount) ((slotCount) * ((slotSize) + 2) + 14)
+// plan queue - record buffer, 11 bytes of offsets and the compact delta references
+#define PLAN_QUEUE_SRAM(capacity, axisCount) ((capacity) + 11 + (axisCount) * 4)
+
+// Velocity segment of the DDA engine - the steps of each slot come in even phases after the phase of its first step.
+struct DdaSegment {
+	// count of the interrupts (at least the count of the steps of each slot)
+	byte ticks;
+	// steps of the slots (in the order of the slot numbers)
+	byte steps[MAX_AXIS_COUNT];
+	// phases between the last step of the previous segments and the first step of each slot (in DDA_PHASE_ONE of the interrupts)
+	uint16_t firstPeriods[MAX_AXIS_COUNT];
+	// phases between the following steps of each slot
+	uint16_t periods[MAX_AXIS_COUNT];
+	// direction bits of the segment steps (they are set one interrupt before the segment starts)
+	byte directions;
+	// count of instructions which end with the segment
+	byte instructionEnds;
+};
+
+// Change of the port state which is rare enough to be kept out of the schedule entries.
+struct ScheduleEvent {
+	// direction bits of the activation and all the following ones
+	byte directions;
+	// count of instructions which end with the activation
+	byte instructionEnds;
+};
+
+// Repetition of a schedule entry with constant step period (remainder is distributed the same way as by the plans).
+struct ScheduleRun {
+	// timer word of the base period
+	ScheduleTime timerWord;
+	// how many times the entry will be fired yet
+	uint16_t remainingCount;
+	// period remainder added for each step
+	uint16_t remainderNumerator;
+	// period remainder which makes one tick
+	uint16_t remainderDenominator;
+	// accumulated period remainder
+	uint16_t remainderBuffer;
+};
+
+#ifdef STEP_ENGINE_DDA
+// segments of the DDA engine (SCHEDULE_END is the running one)
+extern DdaSegment SCHEDULE_SEGMENTS[];
+#else
+// timer words of the entries - the highest bits keep flags of the next entry (see SCHEDULE_FLAGS_MASK)
+extern ScheduleTime SCHEDULE_BUFFER[];
+// clocks of the slots which step with the entry activation (see SCHEDULE_CLOCK_BITS - the even entry of a nibble pair in the low bits)
+extern byte SCHEDULE_CLOCKS[];
+#if SCHEDULE_CLOCK_BITS == 4
+// activation of the clock nibble (clocks are active LOW)
+extern const byte CLOCK_ACTIVATIONS[];
+#endif
+
+// events of the flagged entries (in the order of the entries)
+extern ScheduleEvent SCHEDULE_EVENTS[];
+// event which will be written next (index is masked by SCHEDULE_EVENT_LEN)
+extern volatile byte SCHEDULE_EVENT_START;
+// event which will be taken next (index is masked by SCHEDULE_EVENT_LEN)
+extern volatile byte SCHEDULE_EVENT_END;
+
+// runs of the flagged schedule entries (in the order of the entries)
+extern ScheduleRun SCHEDULE_RUNS[];
+// run which will be written next (index is masked by SCHEDULE_RUN_LEN)
+extern volatile byte SCHEDULE_RUN_START;
+// run which is actually repeated (index is masked by SCHEDULE_RUN_LEN)
+extern volatile byte SCHEDULE_RUN_END;
+#endif
+
+// direction bits of the last scheduled activation
+extern byte SCHEDULED_DIRECTIONS;
 
-// length of the schedule buffer (CANNOT be changed easily - it counts on byte overflows)
-#define SCHEDULE_BUFFER_LEN 256
-
-// buffer where instruction ends are marked for schedule.
-extern bool INSTRUCTION_ENDS[];
-// buffer for step signal timing
-extern uint16_t SCHEDULE_BUFFER[];
-// bitwise activation mask for step signals (selecting active ports)
-extern byte SCHEDULE_ACTIVATIONS[];
-
-// distance from home in steps
-extern volatile int32_t SLOT0_STEPS;
-// distance from home in steps
-extern volatile int32_t SLOT1_STEPS;
-// distance from home in steps
-extern volatile int32_t SLOT2_STEPS;
-// distance from home in steps
-extern volatile int32_t SLOT3_STEPS;
+// distance from home in steps (committed when the instruction finishes)
+extern int32_t SLOT0_STEPS;
+// distance from home in steps (committed when the instruction finishes)
+extern int32_t SLOT1_STEPS;
+// distance from home in steps (committed when the instruction finishes)
+extern int32_t SLOT2_STEPS;
+// distance from home in steps (committed when the instruction finishes)
+extern int32_t SLOT3_STEPS;
 
+// count of finished instructions (cumulative, it overflows - only the step interrupt writes it)
 extern volatile byte FINISHED_INSTRUCTION_COUNT;
+// count of armed instructions (cumulative, it overflows - stop before the last of them finished is an underrun)
+extern volatile byte ARMED_INSTRUCTION_COUNT;
+
+// lowest count of entries left for the step interrupt while more instructions were armed (since the last telemetry take)
+extern volatile ScheduleIndex SCHEDULE_MIN_OCCUPANCY;
+// histogram of timer ticks from the overflow to the step interrupt (counters saturate)
+extern volatile uint16_t ISR_LATENESS_HISTOGRAM[];
+// count of stops when armed instructions were not finished (counter saturates)
+extern volatile uint16_t UNDERRUN_STOP_COUNT;
+// determine whether the schedule drains because of the feed hold (its stop is not an underrun)
+extern volatile bool SCHEDULE_HOLD_FLAG;
 
 // pointer where new timing will be stored
-extern volatile byte SCHEDULE_START;
+extern volatile ScheduleIndex SCHEDULE_START;
 // pointer where scheduler is actually reading
-extern volatile byte SCHEDULE_END;
+extern volatile ScheduleIndex SCHEDULE_END;
 // cumulative activation with state up to lastly scheduled activation
 extern byte CUMULATIVE_SCHEDULE_ACTIVATION;
 
@@ -116,10 +451,454 @@ extern volatile bool SCHEDULER_STOP_EVENT_FLAG;
 //Determine whether scheduler was started from last flag reset (is useful for plan schedulers)
 extern volatile bool SCHEDULER_START_EVENT_FLAG;
 
+#if defined(STEP_TIMER_AVR)
+// timer counts of a single tick
+#define STEP_TIMER_TICK_COUNTS 1
+// change of the timer word which makes the activation one tick later
+#define STEP_TIMER_TICK_WORD ((ScheduleTime)-1)
+// step interrupt handler
+#define STEP_TIMER_ISR ISR(TIMER1_OVF_vect)
+
+// Timer word of the activation which comes after the given time (timer reset which overflows then).
+inline ScheduleTime stepTimerWord(ScheduleTime activationTime) {
+	return UINT16_MAX - activationTime + TIMER_RESET_COMPENSATION;
+}
+
+// Activation time of the timer word (its entry flags stand for the highest bits of the reset).
+inline ScheduleTime stepTimerTime(ScheduleTime timerWord) {
+	return UINT16_MAX - (timerWord | SCHEDULE_FLAGS_MASK) + TIMER_RESET_COMPENSATION;
+}
+
+// Counts from the last activation.
+inline ScheduleTime readStepTimer() {
+	return TCNT1;
+}
+
+// Times the next activation by the timer word (its entry flags are overwritten - the reset is high enough).
+inline void reloadStepTimer(ScheduleTime timerWord) {
+	TCNT1 = timerWord | SCHEDULE_FLAGS_MASK;
+}
+
+// Clears the request of the step interrupt (overflow flag is cleared by the interrupt entry).
+inline void acknowledgeStepTimer() {
+}
+
+inline void enableStepTimer() {
+	TIMSK1 = (1 << TOIE1);
+}
+
+inline void disableStepTimer() {
+	TIMSK1 = 0;
+}
+
+inline bool isStepTimerEnabled() {
+	return TIMSK1 > 0;
+}
+
+inline void initializeStepTimer() {
+	TCCR1A = 0;
+	TCCR1B = 0;
+	TIMSK1 = 0;
+
+#ifdef STEP_TIMER_HIGH_RESOLUTION
+	TCCR1B |= 1 << CS10; // no prescaler
+#else
+	TCCR1B |= 1 << CS11; // 8 prescaler
+#endif
+}
+#elif defined(STEP_TIMER_SAM3X)
+// TC1 channel 0 counts MCK/2 (42 MHz)
+#define STEP_TIMER_TICK_COUNTS (42000000 / TIMER_FREQUENCY)
+#define STEP_TIMER_TICK_WORD ((ScheduleTime)STEP_TIMER_TICK_COUNTS)
+#define STEP_TIMER_ISR void TC3_Handler()
+#define STEP_TIMER_CHANNEL (TC1->TC_CHANNEL[0])
+
+// Timer word of the activation which comes after the given time (RC compare).
+inline ScheduleTime stepTimerWord(ScheduleTime activationTime) {
+	return activationTime * STEP_TIMER_TICK_COUNTS;
+}
+
+// Activation time of the timer word (entry flags are left out).
+inline ScheduleTime stepTimerTime(ScheduleTime timerWord) {
+	return (timerWord & ~SCHEDULE_FLAGS_MASK) / STEP_TIMER_TICK_COUNTS;
+}
+
+// Counts from the last activation (the counter restarts at the compare).
+inline ScheduleTime readStepTimer() {
+	return STEP_TIMER_CHANNEL.TC_CV;
+}
+
+// Times the next activation by the timer word - the counter runs from the served compare already, so no compensation is needed.
+inline void reloadStepTimer(ScheduleTime timerWord) {
+	STEP_TIMER_CHANNEL.TC_RC = timerWord & ~SCHEDULE_FLAGS_MASK;
+}
+
+// Clears the request of the step interrupt (reading the status does it).
+inline void acknowledgeStepTimer() {
+	STEP_TIMER_CHANNEL.TC_SR;
+}
+
+inline void enableStepTimer() {
+	STEP_TIMER_CHANNEL.TC_IER = TC_IER_CPCS;
+	STEP_TIMER_CHANNEL.TC_CCR = TC_CCR_CLKEN | TC_CCR_SWTRG;
+}
+
+inline void disableStepTimer() {
+	STEP_TIMER_CHANNEL.TC_IDR = TC_IDR_CPCS;
+	STEP_TIMER_CHANNEL.TC_CCR = TC_CCR_CLKDIS;
+}
+
+inline bool isStepTimerEnabled() {
+	return (STEP_TIMER_CHANNEL.TC_IMR & TC_IMR_CPCS) != 0;
+}
+
+inline void initializeStepTimer() {
+	pmc_set_writeprotect(false);
+	pmc_enable_periph_clk(ID_TC3);
+	TC_Configure(TC1, 0, TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC | TC_CMR_TCCLKS_TIMER_CLOCK1);
+	STEP_TIMER_CHANNEL.TC_IDR = 0xFFFFFFFF;
+	NVIC_EnableIRQ(TC3_IRQn);
+}
+#else
+// compare timer of the host simulator counts the ticks
+#define STEP_TIMER_TICK_COUNTS 1
+#define STEP_TIMER_TICK_WORD ((ScheduleTime)1)
+#define STEP_TIMER_ISR void TIMER32_COMPARE_vect()
+
+inline ScheduleTime stepTimerWord(ScheduleTime activationTime) {
+	return activationTime;
+}
+
+inline ScheduleTime stepTimerTime(ScheduleTime timerWord) {
+	return timerWord & ~SCHEDULE_FLAGS_MASK;
+}
+
+inline ScheduleTime readStepTimer() {
+	return hostTimer32Counter();
+}
+
+inline void reloadStepTimer(ScheduleTime timerWord) {
+	hostTimer32SetCompare(timerWord & ~SCHEDULE_FLAGS_MASK);
+}
+
+inline void acknowledgeStepTimer() {
+}
+
+inline void enableStepTimer() {
+	hostTimer32Enable(true);
+}
+
+inline void disableStepTimer() {
+	hostTimer32Enable(false);
+}
+
+inline bool isStepTimerEnabled() {
+	return hostTimer32IsEnabled();
+}
+
+inline void initializeStepTimer() {
+	hostTimer32Enable(false);
+}
+#endif
+
+#ifdef STEP_TIMER_SAM3X
+// pins of the activation bits (bit order of the slot masks)
+static const byte STEP_PORT_PINS[8] = { SLOT0_CLK_PIN, SLOT0_DIR_PIN, SLOT1_CLK_PIN, SLOT1_DIR_PIN, SLOT2_CLK_PIN, SLOT2_DIR_PIN, SLOT3_CLK_PIN, SLOT3_DIR_PIN };
+
+// Sets the step pins by the activation (clocks go LOW for the steps).
+inline void writeStepPorts(byte activation) {
+	for (byte i = 0; i < 8; ++i) {
+		const PinDescription& pin = g_APinDescription[STEP_PORT_PINS[i]];
+		if (activation & (1 << i))
+			pin.pPort->PIO_SODR = pin.ulPin;
+		else
+			pin.pPort->PIO_CODR = pin.ulPin;
+	}
+}
+
+// Ends the step pulse (clocks go HIGH).
+inline void releaseStepClocks() {
+	for (byte i = 0; i < 8; i += 2) {
+		const PinDescription& pin = g_APinDescription[STEP_PORT_PINS[i]];
+		pin.pPort->PIO_SODR = pin.ulPin;
+	}
+}
+#else
+// Sets the step pins by the activation (clocks go LOW for the steps).
+inline void writeStepPorts(byte activation) {
+	PORTB = B_SLOTS_MASK & activation;
+	PORTD = D_SLOTS_MASK & activation;
+}
+
+// Ends the step pulse (clocks go HIGH).
+inline void releaseStepClocks() {
+	PORTB |= B_SLOTS_MASK & ACTIVATIONS_CLOCK_MASK;
+	PORTD |= D_SLOTS_MASK & ACTIVATIONS_CLOCK_MASK;
+}
+#endif
+
+// determine whether the refill interrupt fills the schedule (Serial reports of the scheduler are deferred then)
+extern volatile bool IS_SCHEDULE_REFILL_RUNNING;
+
+// Schedule refill interrupt - the sketch defines SCHEDULE_REFILL_ISR which calls SegmentScheduler::refillSchedule,
+// so the main loop is left to the protocol. The step interrupt preempts the refill.
+#if defined(STEP_TIMER_SAM3X)
+// TC1 channel 1 counts MCK/128 - its NVIC priority is below the step timer one
+#define SCHEDULE_REFILL_ISR void TC4_Handler()
+#define SCHEDULE_REFILL_CHANNEL (TC1->TC_CHANNEL[1])
+
+inline void initializeRefillTimer() {
+	pmc_enable_periph_clk(ID_TC4);
+	TC_Configure(TC1, 1, TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC | TC_CMR_TCCLKS_TIMER_CLOCK4);
+	SCHEDULE_REFILL_CHANNEL.TC_RC = VARIANT_MCK / 128 / 1000;
+	SCHEDULE_REFILL_CHANNEL.TC_IDR = 0xFFFFFFFF;
+	NVIC_SetPriority(TC4_IRQn, 15);
+	NVIC_EnableIRQ(TC4_IRQn);
+	SCHEDULE_REFILL_CHANNEL.TC_CCR = TC_CCR_CLKEN | TC_CCR_SWTRG;
+}
+
+inline void enableScheduleRefill() {
+	SCHEDULE_REFILL_CHANNEL.TC_IER = TC_IER_CPCS;
+}
+
+inline void disableScheduleRefill() {
+	SCHEDULE_REFILL_CHANNEL.TC_IDR = TC_IDR_CPCS;
+}
+
+inline bool isScheduleRefillEnabled() {
+	return (SCHEDULE_REFILL_CHANNEL.TC_IMR & TC_IMR_CPCS) != 0;
+}
+
+// Starts the refill body (the lower NVIC priority lets the step interrupt in).
+inline void beginScheduleRefill() {
+	SCHEDULE_REFILL_CHANNEL.TC_SR;
+	IS_SCHEDULE_REFILL_RUNNING = true;
+}
+
+inline void endScheduleRefill() {
+	IS_SCHEDULE_REFILL_RUNNING = false;
+}
+#else
+// Timer2 in CTC mode (the host simulator emulates its registers)
+#define SCHEDULE_REFILL_ISR ISR(TIMER2_COMPA_vect)
+
+inline void initializeRefillTimer() {
+	TIMSK2 = 0;
+	TCCR2A = 1 << WGM21; // CTC
+	TCCR2B = 1 << CS22; // 64 prescaler
+	OCR2A = SCHEDULE_REFILL_PERIOD - 1;
+}
+
+inline void enableScheduleRefill() {
+	TIMSK2 = 1 << OCIE2A;
+}
+
+inline void disableScheduleRefill() {
+	TIMSK2 = 0;
+}
+
+inline bool isScheduleRefillEnabled() {
+	return TIMSK2 != 0;
+}
+
+// Starts the refill body - AVR has no interrupt priorities, so the refill masks itself and enables the step interrupt.
+inline void beginScheduleRefill() {
+	TIMSK2 = 0;
+	IS_SCHEDULE_REFILL_RUNNING = true;
+	interrupts();
+}
+
+// Ends the refill body (the refill interrupt is unmasked with the interrupts disabled, its return enables them).
+inline void endScheduleRefill() {
+	noInterrupts();
+	IS_SCHEDULE_REFILL_RUNNING = false;
+	TIMSK2 = 1 << OCIE2A;
+}
+#endif
+
+// Keeps the refill interrupt away while the main loop changes the scheduler - returns whether the refill was enabled.
+inline bool pauseScheduleRefill() {
+	bool isEnabled = isScheduleRefillEnabled();
+	if (isEnabled)
+		disableScheduleRefill();
+	return isEnabled;
+}
+
+inline void resumeScheduleRefill(bool isEnabled) {
+	if (isEnabled)
+		enableScheduleRefill();
+}
+
+// Sends report of the scheduler ('S' scheduler enabled, 'M' step time missed) - the main loop sends it when the refill interrupt runs
+// (Serial writes are not reentrant).
+void sendSchedulerReport(char report);
+
+// Index of the entry which follows the given one.
+inline ScheduleIndex nextScheduleIndex(ScheduleIndex index) {
+#if SCHEDULE_BUFFER_LEN == 256
+	//byte overflow
+	return index + 1;
+#else
+	return index + 1 >= SCHEDULE_BUFFER_LEN ? 0 : index + 1;
+#endif
+}
+
+// Reading position of the step interrupt (seen from the main loop).
+inline ScheduleIndex readScheduleEnd() {
+#ifdef SCHEDULE_INDEX_LOCKED
+	noInterrupts();
+	ScheduleIndex end = SCHEDULE_END;
+	interrupts();
+	return end;
+#else
+	return SCHEDULE_END;
+#endif
+}
+
+// Determine whether the step interrupt reads the given entry (seen from the main loop) - the locked indexes compare their low byte only,
+// which is read atomically (the step interrupt does not pass 256 entries between two calls, the index is little endian).
+inline bool isScheduleEndAt(ScheduleIndex index) {
+#ifdef SCHEDULE_INDEX_LOCKED
+	return *(volatile byte*)&SCHEDULE_END == (byte)index;
+#else
+	return SCHEDULE_END == index;
+#endif
+}
+
+// Publishes entries written up to the given index to the step interrupt.
+inline void setScheduleStart(ScheduleIndex start) {
+#ifdef SCHEDULE_INDEX_LOCKED
+	noInterrupts();
+	SCHEDULE_START = start;
+	interrupts();
+#else
+	SCHEDULE_START = start;
+#endif
+}
+
+// Count of entries which were written and not fired yet.
+inline ScheduleIndex scheduleOccupancy(ScheduleIndex start, ScheduleIndex end) {
+	if (start >= end)
+		return start - end;
+	return SCHEDULE_BUFFER_LEN - (end - start);
+}
+
+// Count of entries which can be written now.
+inline ScheduleIndex freeScheduleEntries() {
+	ScheduleIndex start = SCHEDULE_START;
+	ScheduleIndex end = readScheduleEnd();
+	if (end > start)
+		return end - start - 1;
+	return SCHEDULE_BUFFER_LEN - 1 - (start - end);
+}
+
+#ifdef STEP_ENGINE_DDA
+// Determine whether there is no space for the segments of the next entry.
+inline bool isScheduleFull() {
+	return freeScheduleEntries() < DDA_ENTRY_SEGMENTS;
+}
+#else
+// Determine whether there is no space for the next entry (or for its event).
+inline bool isScheduleFull() {
+	return nextScheduleIndex(SCHEDULE_START) == readScheduleEnd() || (byte)(SCHEDULE_EVENT_START - SCHEDULE_EVENT_END) >= SCHEDULE_EVENT_LEN;
+}
+#endif
+
+// Limits time to the next activation by the timer range (empty activations are scheduled in between).
+inline ScheduleTime limitActivationTime(int32_t activationTime, ScheduleTime maxDelay = SCHEDULE_MAX_DELAY) {
+	if (activationTime <= (int32_t)maxDelay)
+		return activationTime;
+
+	//the rest has to be long enough for a standalone activation
+	return min((int32_t)maxDelay, activationTime - 2 * MIN_ACTIVATION_DELAY);
+}
+
+#ifdef STEP_ENGINE_DDA
+// Collects schedule entry into the velocity segments - activation comes after the given time and the instruction ends
+// are reported with the segment. The caller has to check that schedule is not full.
+void writeScheduleEntry(ScheduleTime activationTime, byte activation, byte instructionEnds, byte flags = 0);
+
+// Writes the segment collected from the last entries (schedulers call it when there is nothing more to schedule).
+void flushScheduleEntries();
+#else
+#if SCHEDULE_CLOCK_BITS == 8
+// Stores clocks of the given activation into the entry byte.
+inline void writeScheduleClocks(ScheduleIndex index, byte activation) {
+	SCHEDULE_CLOCKS[index] = activation & ACTIVATIONS_CLOCK_MASK;
+}
+
+// Activation clocks of the entry (clocks are active LOW).
+inline byte readScheduleClocks(ScheduleIndex index) {
+	return SCHEDULE_CLOCKS[index];
+}
+#else
+// Stores clocks of the given activation into the entry nibble.
+inline void writeScheduleClocks(ScheduleIndex index, byte activation) {
+	byte clocks = ((activation & SLOT0_CLK_MASK) ? 0 : 1) | ((activation & SLOT1_CLK_MASK) ? 0 : 2) | ((activation & SLOT2_CLK_MASK) ? 0 : 4) | ((activation & SLOT3_CLK_MASK) ? 0 : 8);
+	byte& pair = SCHEDULE_CLOCKS[index >> 1];
+	if (index & 1)
+		pair = (pair & 0x0F) | (clocks << 4);
+	else
+		pair = (pair & 0xF0) | clocks;
+}
+
+// Activation clocks of the entry (clocks are active LOW).
+inline byte readScheduleClocks(ScheduleIndex index) {
+	byte clocks = SCHEDULE_CLOCKS[index >> 1];
+	if (index & 1)
+		clocks >>= 4;
+	return CLOCK_ACTIVATIONS[clocks & 0x0F];
+}
+#endif
+
+// Writes schedule entry - activation comes after the given time and the instruction ends are reported with it.
+// The caller has to check that schedule is not full.
+inline void writeScheduleEntry(ScheduleTime activationTime, byte activation, byte instructionEnds, byte flags = 0) {
+	ScheduleIndex index = SCHEDULE_START;
+	byte directions = activation & ~ACTIVATIONS_CLOCK_MASK;
+	if (directions != SCHEDULED_DIRECTIONS || instructionEnds > 0) {
+		//directions are kept until the next change
+		ScheduleEvent& evt = SCHEDULE_EVENTS[SCHEDULE_EVENT_START & (SCHEDULE_EVENT_LEN - 1)];
+		evt.directions = directions;
+		evt.instructionEnds = instructionEnds;
+		++SCHEDULE_EVENT_START;
+		SCHEDULED_DIRECTIONS = directions;
+		flags |= SCHEDULE_EVENT_FLAG;
+	}
+
+	SCHEDULE_BUFFER[index] = (stepTimerWord(activationTime) & ~SCHEDULE_FLAGS_MASK) | (((ScheduleTime)flags) << SCHEDULE_FLAGS_SHIFT);
+	writeScheduleClocks(nextScheduleIndex(index), activation);
+
+	//we can shift the start after activation is properly saved to array
+	setScheduleStart(nextScheduleIndex(index));
+}
+
+// Entries are written as they come - there is nothing to flush.
+inline void flushScheduleEntries() {
+}
+#endif
+
+// Increments the counter unless it reached its maximum.
+inline void countSaturated(uint16_t& counter) {
+	if (counter != UINT16_MAX)
+		++counter;
+}
+
+// Position of the slot with the given clock.
+inline int32_t& slotSteps(byte clkMask) {
+	if (clkMask == SLOT0_CLK_MASK)
+		return SLOT0_STEPS;
+	if (clkMask == SLOT1_CLK_MASK)
+		return SLOT1_STEPS;
+	if (clkMask == SLOT2_CLK_MASK)
+		return SLOT2_STEPS;
+	return SLOT3_STEPS;
+}
+
 
 class Plan {
 public:
-	// Time of next scheduled activation
+	// Time of next scheduled activation (schedule ticks - int32 keeps ~134s with the high resolution ones)
 	int32_t nextActivationTime;
 
 	// How many steps was planned by this plan.
@@ -194,6 +973,9 @@ public:
 	// Creates next activation.
 	void createNextActivation();
 protected:
+	// Loads plan from decoded values.
+	void load(int16_t stepCount, int32_t initialDeltaT, int32_t n, int16_t baseDelta, int16_t baseRemainder);
+
 	// determine whether plan corresponds to deceleration
 	bool _isDeceleration;
 	// current n parameter of Taylor incremental acceleration formula
@@ -210,239 +992,2057 @@ protected:
 	int32_t _baseRemainderBuffer;
 };
 
-class Steppers {
-public:
-	// Initialize registered steppers - no new steppers can be created afterewards.
-	static void initialize();
-
-	// Starts scheduler.
-	static bool startScheduler();
-
-	// Determine whether scheduler is started.
-	static bool isSchedulerRunning();
+// count of n values covered by the reciprocal table
+#define RECIPROCAL_TABLE_LEN 256
 
-	// Blocks given ports by mask (one blocks, zero unblocks)
-	static void setActivationMask(byte mask);
-private:
-	// Determine whether steppers environment is initialized.
-	static bool _isInitialized;
-};
+// floor(65536 / (4n + 1)) for n < RECIPROCAL_TABLE_LEN (n = 0 is not used)
+extern const uint16_t RECIPROCAL_TABLE[] PROGMEM;
 
+// floor(65536 / (3n + 1)) for n < RECIPROCAL_TABLE_LEN (n = 0 is not used) - constant jerk ramps
+extern const uint16_t JERK_RECIPROCAL_TABLE[] PROGMEM;
 
-struct ActivationSlack4D
-{
-	int32_t d1;
-	int32_t d2;
-	int32_t d3;
-	int32_t d4;
+// Acceleration plan with bounded cost of the activation creation.
+// Produces exactly the same activations as AccelerationPlan, but the subtraction loop
+// is replaced by reciprocal table for n < RECIPROCAL_TABLE_LEN (at most 10 subtractions remain above).
+class BoundedAccelerationPlan : public AccelerationPlan {
+public:
+	BoundedAccelerationPlan(byte clkPin, byte dirPin);
 
-	inline void reset() {
-		d1 = 0;
-		d2 = 0;
-		d3 = 0;
-		d4 = 0;
-	}
+	// Creates next activation.
+	void createNextActivation();
 };
 
-template<typename PlanType> class PlanScheduler4D {
-public:
-	ActivationSlack4D slack;
+// Updates CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF) of compact frames.
+// The receive interrupt updates it for each byte - avr-libc computes the same polynomial without the bit loop.
+inline uint16_t crc16Update(uint16_t crc, byte data) {
+#if defined(__AVR__)
+	return _crc_xmodem_update(crc, data);
+#else
+	crc ^= ((uint16_t)data) << 8;
+	for (byte i = 0; i < 8; ++i)
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	return crc;
+#endif
+}
 
-	PlanScheduler4D(byte clkMask1, byte dirMask1, byte clkMask2, byte dirMask2, byte clkMask3, byte dirMask3, byte clkMask4, byte dirMask4)
-		:_d1(clkMask1, dirMask1), _d2(clkMask2, dirMask2), _d3(clkMask3, dirMask3), _d4(clkMask4, dirMask4), _needInit(false),_hasEnd(false), slack()
+// Reads varint (7 bits per byte, low bits first) values of compact frames.
+// Reads past the end of the data give zero and mark the reader as overrun.
+class CompactReader {
+public:
+	CompactReader(const byte* data, const byte* end)
+		:_data(data), _end(end), _isOverrun(false)
 	{
-		slack.reset();
 	}
 
-	void registerLastActivationSlack(ActivationSlack4D &slack) {
-		this->slack = slack;
+	inline uint32_t readUnsigned() {
+		uint32_t value = 0;
+		byte shift = 0;
+		byte current;
+		do {
+			if (_data >= _end || shift > 28) {
+				//varint does not end within the data
+				_isOverrun = true;
+				return 0;
+			}
+			current = *_data++;
+			value |= ((uint32_t)(current & 0x7F)) << shift;
+			shift += 7;
+		} while (current & 0x80);
+		return value;
 	}
 
-	void initForHoming() {
-		this->_d1.initForHoming();
-		this->_d2.initForHoming();
-		this->_d3.initForHoming();
-		this->_d4.initForHoming();
-
-		this->_d1.createNextActivation();
-		this->_d2.createNextActivation();
-		this->_d3.createNextActivation();
-		this->_d4.createNextActivation();
-		this->_needInit = true;
-		this->_hasEnd = false;
+	// signed values are zigzag encoded (0, -1, 1, -2, ...)
+	inline int32_t readSigned() {
+		uint32_t value = readUnsigned();
+		return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
 	}
 
-	// loads plan from given data
-	void initFrom(byte * data)
+	// Determine whether any read needed more data than there was.
+	inline bool isOverrun() {
+		return _isOverrun;
+	}
+
+private:
+	// data which will be read next
+	const byte* _data;
+
+	// end of the data
+	const byte* _end;
+
+	// determine whether a read passed the end
+	bool _isOverrun;
+};
+
+// Ring of instruction frames filled by the serial receive interrupt (legacy and compact frames).
+// Receive interrupt writes frames directly into the slots and validates them byte by byte,
+// main loop processes received frames in order - plans stay in their slots until they are fetched.
+template<byte SlotSize, byte SlotCount> class FrameReceiver {
+public:
+	FrameReceiver()
+		:_fetchIndex(0), _processIndex(0), _receiveIndex(0), _receiveOffset(0), _frameSize(SlotSize), _checksum(0),
+		_invalidFrameCount(0), _overflowFrameCount(0), _seenOffset(0), _seenOffsetTime(0)
 	{
-		if (SCHEDULER_STOP_EVENT_FLAG) {
-			//scheduler reset means slack reset
-			this->slack.reset();
-			SCHEDULER_STOP_EVENT_FLAG = false;
-		}
+		memset(_slotStates, SLOT_FREE, sizeof(_slotStates));
+	}
 
+	// Stores byte received by the serial interrupt.
+	inline void receive(byte data) {
+		byte* slot = _slots[_receiveIndex];
+		byte offset = _receiveOffset;
+		if (offset == 0) {
+			//the first byte determines frame size and checksum
+			bool isCompact = data & COMPACT_FRAME_FLAG;
+			//oversized compact frame is received into the whole slot and rejected at its end
+			_frameSize = isCompact ? min(SlotSize, (data & ~COMPACT_FRAME_FLAG) + COMPACT_FRAME_OVERHEAD) : SlotSize;
+			_checksum = isCompact ? 0xFFFF : 0;
+		}
 
-		this->_d1.loadFrom(data);
-		this->_d2.loadFrom(data + _d1.dataSize);
-		this->_d3.loadFrom(data + _d2.dataSize + _d1.dataSize);
-		this->_d4.loadFrom(data + _d3.dataSize + _d2.dataSize + _d1.dataSize);
+		slot[offset] = data;
+		++offset;
+		if (offset <= _frameSize - 2) {
+			_checksum = (slot[0] & COMPACT_FRAME_FLAG) ? crc16Update(_checksum, data) : _checksum + data;
+			_receiveOffset = offset;
+			return;
+		}
 
-		this->_d1.createNextActivation();
-		this->_d2.createNextActivation();
-		this->_d3.createNextActivation();
-		this->_d4.createNextActivation();
+		if (offset < _frameSize) {
+			//the first checksum byte
+			_receiveOffset = offset;
+			return;
+		}
 
-		bool isStepTimeMissed = false;
-		
-		isStepTimeMissed |= this->applySlack(this->slack.d1, _d1);
-		isStepTimeMissed |= this->applySlack(this->slack.d2, _d2);
-		isStepTimeMissed |= this->applySlack(this->slack.d3, _d3);
-		isStepTimeMissed |= this->applySlack(this->slack.d4, _d4);
+		//whole frame is here
+		_receiveOffset = 0;
+		if (READ_UINT16(slot, _frameSize - 2) != _checksum || ((slot[0] & COMPACT_FRAME_FLAG) && !isCompactSizeValid(slot[0]))) {
+			++_invalidFrameCount;
+			return;
+		}
 
-		if (isStepTimeMissed)
-			Serial.print('M');
+		//at least one slot has to stay free for the interactive instructions
+		byte requiredSlots = isPlanFrame(slot) ? 2 : 1;
+		if (freeSlots() < requiredSlots) {
+			++_overflowFrameCount;
+			return;
+		}
 
-		this->_needInit = true;
-		this->_hasEnd = true;
+		_slotStates[_receiveIndex] = SLOT_RECEIVED;
+		_frameSizes[_receiveIndex] = _frameSize;
+		_receiveIndex = nextIndex(_receiveIndex);
 	}
 
-	// fills schedule buffer with plan data
-	// returns true when buffer is full (temporarly), false when plan is over
-	bool fillSchedule(bool startScheduler = true) {
-		while (_d1.isActive || _d2.isActive || _d3.isActive || _d4.isActive) {
-			//find earliest plan
-			int32_t minActiveActivationTime = INT32_MAX;
-			//TODO this can be slightly optimized (binary tree like comparison)
-			if (_d1.isActive)
-				minActiveActivationTime = min(minActiveActivationTime, _d1.nextActivationTime);
-			if (_d2.isActive)
-				minActiveActivationTime = min(minActiveActivationTime, _d2.nextActivationTime);
-			if (_d3.isActive)
-				minActiveActivationTime = min(minActiveActivationTime, _d3.nextActivationTime);
-			if (_d4.isActive)
-				minActiveActivationTime = min(minActiveActivationTime, _d4.nextActivationTime);
+	// Received frame which was not processed yet (NULL when there is none).
+	inline byte* receivedFrame() {
+		if (_processIndex == _receiveIndex)
+			return NULL;
 
-			//limit activation to timer resolution (we can output empty activation intermediate step)
-			uint16_t earliestActivationTime = min(UINT16_MAX, minActiveActivationTime);
+		return _slots[_processIndex];
+	}
 
-			if (_needInit) {
-				earliestActivationTime = PORT_CHANGE_DELAY;
+	// Size of the received frame.
+	inline byte receivedFrameSize() {
+		return _frameSizes[_processIndex];
+	}
 
-				CUMULATIVE_SCHEDULE_ACTIVATION = ACTIVATIONS_CLOCK_MASK;
-				CUMULATIVE_SCHEDULE_ACTIVATION |= this->_d1.stepMask;
-				CUMULATIVE_SCHEDULE_ACTIVATION |= this->_d2.stepMask;
-				CUMULATIVE_SCHEDULE_ACTIVATION |= this->_d3.stepMask;
-				CUMULATIVE_SCHEDULE_ACTIVATION |= this->_d4.stepMask;
-				_needInit = false;
-			}
+	// Finishes processing of the received frame - plan frames stay in the ring until they are fetched.
+	inline void processFrame(bool keepAsPlan) {
+		_slotStates[_processIndex] = keepAsPlan ? SLOT_PLAN : SLOT_FREE;
+		_processIndex = nextIndex(_processIndex);
+	}
 
-			CUMULATIVE_SCHEDULE_ACTIVATION |= ACTIVATIONS_CLOCK_MASK;
+	// Oldest kept plan frame (NULL when there is none).
+	inline byte* nextPlan() {
+		skipFreeSlots();
+		if (_fetchIndex == _processIndex)
+			return NULL;
 
-			//subtract earliest plan other plans		
-			triggerPlan(_d1, earliestActivationTime);
-			triggerPlan(_d2, earliestActivationTime);
-			triggerPlan(_d3, earliestActivationTime);
-			triggerPlan(_d4, earliestActivationTime);
+		return _slots[_fetchIndex];
+	}
 
-			//schedule
-			while ((byte)(SCHEDULE_START + 1) == SCHEDULE_END && startScheduler) {
-				//wait until schedule buffer has empty space				
-				Steppers::startScheduler();
-			}
+	// Releases slot of the plan returned by nextPlan.
+	inline void fetchPlan() {
+		_slotStates[_fetchIndex] = SLOT_FREE;
+		_fetchIndex = nextIndex(_fetchIndex);
+	}
 
-			SCHEDULE_BUFFER[SCHEDULE_START] = UINT16_MAX - earliestActivationTime + TIMER_RESET_COMPENSATION;
-			INSTRUCTION_ENDS[SCHEDULE_START] = this->_hasEnd && !(_d1.isActive || _d2.isActive || _d3.isActive || _d4.isActive);
-			SCHEDULE_ACTIVATIONS[(byte)(SCHEDULE_START + 1)] = CUMULATIVE_SCHEDULE_ACTIVATION;
-			
-			//we can shift the start after activation is properly saved to array
-			++SCHEDULE_START;
+	// Count of plans which can be received now.
+	inline byte freePlanSlots() {
+		skipFreeSlots();
+		byte slots = freeSlots();
+		return slots > 1 ? slots - 1 : 0;
+	}
 
-			/*/Serial.print("| t:");
-			Serial.print(earliestActivationTime);
-			Serial.print(", a:");
-			Serial.println(CUMULATIVE_SCHEDULE_ACTIVATION);//*/
+	// Count of slots taken by received frames (plans keep them until they are fetched).
+	inline byte usedSlots() {
+		skipFreeSlots();
+		return (_receiveIndex + SlotCount - _fetchIndex) % SlotCount;
+	}
 
-			if ((byte)(SCHEDULE_START + 1) == SCHEDULE_END)
-				//we have free time
-				return true;
-		}
-		this->slack.d1 = _d1.nextActivationTime;
-		this->slack.d2 = _d2.nextActivationTime;
-		this->slack.d3 = _d3.nextActivationTime;
-		this->slack.d4 = _d4.nextActivationTime;
-		
-		if (startScheduler)
-			Steppers::startScheduler();
-		return false;
+	// Determine whether a plan frame (instead of an interactive instruction) is in the buffer.
+	static inline bool isPlanFrame(const byte* frame) {
+		return (frame[0] & COMPACT_FRAME_FLAG) || frame[0] == 'A' || frame[0] == 'C' || frame[0] == MOVE_KIND || frame[0] == ARC_KIND || frame[0] == SPLINE_KIND;
 	}
-private:
 
-	inline bool applySlack(int32_t &slackTime, PlanType &plan) {
-		if (plan.isActivationBoundary) {
-			slackTime = 0;
+	// Determine whether the first byte of compact frame gives a size with some payload which fits into the slot.
+	static inline bool isCompactSizeValid(byte first) {
+		byte payloadSize = first & ~COMPACT_FRAME_FLAG;
+		return payloadSize > 0 && payloadSize + COMPACT_FRAME_OVERHEAD <= SlotSize;
+	}
+
+	// Erases incomplete frame when no byte arrived for the given time - returns true when it was erased.
+	bool checkIncompleteFrame(unsigned long now, unsigned long timeout) {
+		byte offset = _receiveOffset;
+		if (offset != _seenOffset) {
+			_seenOffset = offset;
+			_seenOffsetTime = now;
 			return false;
 		}
 
-		plan.nextActivationTime += slackTime;
-		if (plan.nextActivationTime < PORT_CHANGE_DELAY) {
-			plan.nextActivationTime = PORT_CHANGE_DELAY;
+		if (offset == 0 || now - _seenOffsetTime <= timeout)
+			return false;
 
-			//we cannot go backwards in time - step was missed
-			return true;
-		}
+		noInterrupts();
+		bool isErased = _receiveOffset == offset;
+		if (isErased)
+			_receiveOffset = 0;
+		interrupts();
 
-		//step was not missed
-		return false;
+		_seenOffset = 0;
+		return isErased;
 	}
 
-	inline void triggerPlan(PlanType& plan, uint16_t nextActivationTime) {
-		if (!plan.isActive) {
-			if (!plan.isActivationBoundary)
-				// this plan is not a boundary - continue to calculate slack
-				plan.nextActivationTime -= nextActivationTime;
-			//there is nothing to do
-			return;
-		}
+	// Returns count of frames with invalid checksum from the last call.
+	inline byte takeInvalidFrameCount() {
+		return takeCount(_invalidFrameCount);
+	}
 
-		plan.nextActivationTime -= nextActivationTime;
+	// Returns count of frames dropped because of full ring from the last call.
+	inline byte takeOverflowFrameCount() {
+		return takeCount(_overflowFrameCount);
+	}
 
-		if (plan.nextActivationTime > MIN_ACTIVATION_DELAY)
-			//no steps for the plan now
-			return;
+private:
+	enum SlotState { SLOT_FREE, SLOT_RECEIVED, SLOT_PLAN };
 
-		// make the appropriate pin LOW
-		CUMULATIVE_SCHEDULE_ACTIVATION &= ~(plan.clkMask);
+	// frames are written here
+	byte _slots[SlotCount][SlotSize];
 
-		if (plan.nextActivationTime > 0) {
-			//activations would come too early one after another - we will group them
-			byte skippedTime = plan.nextActivationTime;
-			plan.createNextActivation();
-			plan.nextActivationTime += skippedTime;
-		}
-		else {
-			//compute next activation
-			plan.createNextActivation();
-		}
-	}
+	// state of each slot
+	byte _slotStates[SlotCount];
 
+	// size of received frames
+	byte _frameSizes[SlotCount];
 
-	// data for the first dimension
-	PlanType _d1;
+	// slot of the next plan (main loop)
+	byte _fetchIndex;
 
-	//data for the second dimension
-	PlanType _d2;
+	// slot of the next received frame to process (main loop)
+	byte _processIndex;
 
-	//data for the third dimension
-	PlanType _d3;
+	// slot which is actually written (receive interrupt)
+	volatile byte _receiveIndex;
 
-	//data for the fourth dimension
-	PlanType _d4;
+	// offset within actually written slot (receive interrupt)
+	volatile byte _receiveOffset;
 
-	//determine whether initialization is needed
-	bool _needInit;
+	// size of the actually written frame (receive interrupt)
+	byte _frameSize;
 
-	///determine whether instruction end will be reported to scheduler
-	bool _hasEnd;
-};
+	// checksum of the actually written frame (receive interrupt)
+	uint16_t _checksum;
 
-#endif
\ No newline at end of file
+	// frames with invalid checksum which were not reported yet
+	volatile byte _invalidFrameCount;
+
+	// frames which did not fit into the ring and were not reported yet
+	volatile byte _overflowFrameCount;
+
+	// receive offset seen by the last incomplete frame check
+	byte _seenOffset;
+
+	// time when the receive offset was seen
+	unsigned long _seenOffsetTime;
+
+	static inline byte nextIndex(byte index) {
+		return index + 1 >= SlotCount ? 0 : index + 1;
+	}
+
+	// slots of processed interactive instructions are released
+	inline void skipFreeSlots() {
+		while (_fetchIndex != _processIndex && _slotStates[_fetchIndex] == SLOT_FREE)
+			_fetchIndex = nextIndex(_fetchIndex);
+	}
+
+	// free slots without the actually written one
+	inline byte freeSlots() {
+		byte usedSlots = (_receiveIndex + SlotCount - _fetchIndex) % SlotCount;
+		return SlotCount - 1 - usedSlots;
+	}
+
+	inline byte takeCount(volatile byte& counter) {
+		noInterrupts();
+		byte count = counter;
+		counter = 0;
+		interrupts();
+		return count;
+	}
+};
+
+// Decoded constant segment of a single axis (int32_t offset follows when the axis has COMPACT_AXIS_OFFSET flag).
+struct __attribute__((packed)) ConstantSegment {
+	int32_t baseDeltaT;
+	int16_t stepCount;
+	uint16_t periodNumerator;
+};
+
+// Decoded acceleration segment of a single axis.
+struct __attribute__((packed)) AccelerationSegment {
+	int32_t initialDeltaT;
+	int32_t n;
+	int16_t stepCount;
+	int16_t baseDelta;
+	int16_t baseRemainder;
+};
+
+// Decoded arc segment of a single axis (the axis follows a circle around the center with constant speed along the arc).
+// Arc does not leave its quadrant, so the axis keeps its direction.
+struct __attribute__((packed)) ArcSegment {
+	// deltaT of a single step along the arc (deltaT * radius has to stay below ARC_MAX_DELTA_T_RADIUS)
+	int32_t deltaT;
+	int16_t stepCount;
+	// coordinate of the axis at the segment start relative to the center
+	int16_t coordinate;
+	// radius of the arc in steps (below 32768)
+	uint16_t radius;
+};
+
+// limit of deltaT * radius - 4 * deltaT * radius in the schedule ticks has to fit into 32 bits
+#define ARC_MAX_DELTA_T_RADIUS ((((uint32_t)1) << 30) >> SCHEDULE_TICK_SHIFT)
+
+// steps of the rounded root which the arc takes incrementally - faster changes (near the end of the quadrant) compute the root again
+#define ARC_ROOT_CORRECTIONS 4
+
+// Size of arc data of a single axis - int16_t steps, int16_t start coordinate relative to the center, uint16_t radius and int32_t deltaT along the arc.
+#define ARC_AXIS_DATA_SIZE (2 + 2 + 2 + 4)
+
+// Decoded spline segment of a single axis - cubic Hermite curve of the axis position over the time of the segment
+// (from zero to the steps, speeds at its ends are given by the slopes). Quadratic splines are the curves whose slopes sum to 2.
+// Slopes keep the axis in its direction (the host splits curves where an axis reverses, as arcs are split at the quadrants).
+// The curve is sampled at the ends of equal time intervals and the steps of an interval are spread evenly over it.
+struct __attribute__((packed)) SplineSegment {
+	// time of the whole segment (ticks)
+	int32_t duration;
+	int16_t stepCount;
+	// start speed of the axis relative to its mean speed (in 1 / (1 << SPLINE_SLOPE_SHIFT), at most SPLINE_MAX_SLOPE)
+	uint16_t startSlope;
+	// end speed of the axis relative to its mean speed (in 1 / (1 << SPLINE_SLOPE_SHIFT), at most SPLINE_MAX_SLOPE)
+	uint16_t endSlope;
+	// the segment has 1 << intervalShift intervals (at most SPLINE_MAX_INTERVAL_SHIFT)
+	byte intervalShift;
+};
+
+// fraction bits of the spline slopes
+#define SPLINE_SLOPE_SHIFT 14
+
+// slopes up to three times the mean speed keep the cubic in the direction of the axis
+#define SPLINE_MAX_SLOPE (3 << SPLINE_SLOPE_SHIFT)
+
+// 64 intervals at most - the curve is evaluated in 32 bits (intervals^3 << SPLINE_SLOPE_SHIFT)
+#define SPLINE_MAX_INTERVAL_SHIFT 6
+
+// Size of spline data of a single axis - int16_t steps, int32_t duration, uint16_t start slope, uint16_t end slope and byte interval shift.
+#define SPLINE_AXIS_DATA_SIZE (2 + 4 + 2 + 2 + 1)
+
+// Header of the move record (int16_t steps of the present axes follow).
+// Values are along the path of the move - euclidean length of the steps of all axes, speeds are squared steps/s.
+struct __attribute__((packed)) MoveHeader {
+	float length;
+	float acceleration;
+	// jerk of constant jerk ramps (zero for constant acceleration ramps) - the acceleration grows from zero at the standstill
+	// and drops to zero at once at the cruise, these ramps are not S-curves (no jerk limited transition into the cruise)
+	float rampJerk;
+	float nominalSpeed2;
+	// the highest entry speed allowed by the junction with the previous move
+	float maxEntrySpeed2;
+	float entrySpeed2;
+	float exitSpeed2;
+};
+
+// Size of move instruction data - int16_t steps of 4 axes, int32_t cruise deltaT, int32_t acceleration and int32_t ramp jerk.
+#define MOVE_DATA_SIZE (4 * 2 + 4 + 4 + 4)
+
+// speed change which an axis takes instantly at the junction of moves (steps/s) - the same as the start from the standstill
+#define MAX_JUNCTION_SPEED_CHANGE (TIMESCALE / START_DELTA_T)
+
+// steps which are left to the scheduled segments when the newest move is armed without its next move
+#define MOVE_ARM_STEPS 32
+
+// Initializes move header (cruise deltaT, acceleration and ramp jerk belong to the axis with most steps, zero ramp jerk means trapezoid).
+// Machine limits are enforced here, the move starts and stops at the standstill until it is planned together with the previous one.
+void initMoveHeader(MoveHeader& move, const int16_t* stepCounts, byte axisCount, int32_t cruiseDeltaT, int32_t acceleration, int32_t rampJerk);
+
+// Limits entry speed of the move by the speed changes of the axes at the junction with the previous move.
+void limitJunctionSpeed(MoveHeader& move, const int16_t* stepCounts, const MoveHeader& previousMove, const int16_t* previousStepCounts, byte axisCount);
+
+// Plans entry and exit speeds of the queued moves (the first one keeps its entry speed, the last one stops).
+void planMoveChain(MoveHeader** chain, byte count);
+
+// Record axis flags of the axis with the given flags (COMPACT_AXIS_PRESENT/COMPACT_AXIS_OFFSET).
+inline AxisFlags toRecordAxisFlags(byte flags, byte axis) {
+	return ((AxisFlags)(flags & COMPACT_AXIS_PRESENT) << axis) | ((AxisFlags)((flags & COMPACT_AXIS_OFFSET) ? 1 : 0) << (RECORD_AXIS_OFFSET_SHIFT + axis));
+}
+
+// Flags (COMPACT_AXIS_PRESENT/COMPACT_AXIS_OFFSET) of the axis in the record axis flags.
+inline byte fromRecordAxisFlags(AxisFlags flags, byte axis) {
+	return ((flags >> axis) & COMPACT_AXIS_PRESENT) | (((flags >> (RECORD_AXIS_OFFSET_SHIFT + axis)) & 1) ? COMPACT_AXIS_OFFSET : 0);
+}
+
+// Axis flags of the plan record (records are not aligned).
+inline AxisFlags readRecordAxisFlags(const byte* record) {
+	AxisFlags axisFlags;
+	memcpy(&axisFlags, record + 1, sizeof(axisFlags));
+	return axisFlags;
+}
+
+// Queue of plans decoded into native segments when they arrive (so nothing is decoded at the instruction boundary).
+// Record: command, axis flags (see AxisFlags), segments of present axes.
+// Axes without steps are elided.
+template<uint16_t Capacity, byte AxisCount> class PlanQueue {
+	static_assert(AxisCount <= MAX_AXIS_COUNT, "axis flags of plan records have room for MAX_AXIS_COUNT axes");
+public:
+	// the largest plan record (all axes have constant segment with offset or acceleration segment)
+	static const byte maxPlanRecordSize = PLAN_RECORD_HEADER_SIZE + AxisCount * (sizeof(ConstantSegment) + sizeof(int32_t) > sizeof(AccelerationSegment) ? sizeof(ConstantSegment) + sizeof(int32_t) : sizeof(AccelerationSegment));
+	// the largest move record (all axes have steps)
+	static const byte maxMoveRecordSize = PLAN_RECORD_HEADER_SIZE + sizeof(MoveHeader) + AxisCount * sizeof(int16_t);
+	// the largest record
+	static const byte maxRecordSize = maxPlanRecordSize > maxMoveRecordSize ? maxPlanRecordSize : maxMoveRecordSize;
+	// the longest chain of moves which fits into the queue
+	static const byte maxChainLength = Capacity / (PLAN_RECORD_HEADER_SIZE + sizeof(MoveHeader) + sizeof(int16_t)) + 1;
+
+	PlanQueue()
+		:_readOffset(0), _writeOffset(0), _backOffset(0), _wrapOffset(Capacity), _usedBytes(0), _count(0)
+	{
+		resetCompactReferences();
+	}
+
+	// Decodes plan data of the given kind ('A', 'C', ARC_KIND or SPLINE_KIND) - returns false when the queue is full or the data are out of their range.
+	// (frames are checked by isValidPlanData when they arrive, the caller tells both cases apart the same way)
+	bool push(byte kind, const byte* data) {
+		if (!isValidPlanData(kind, data))
+			return false;
+
+		byte record[maxRecordSize];
+		byte* segment = record + PLAN_RECORD_HEADER_SIZE;
+		AxisFlags axisFlags = 0;
+		byte dataSize = kind == 'C' ? ConstantPlan::dataSize : (kind == ARC_KIND ? ARC_AXIS_DATA_SIZE : (kind == SPLINE_KIND ? SPLINE_AXIS_DATA_SIZE : AccelerationPlan::dataSize));
+		for (byte i = 0; i < AxisCount; ++i, data += dataSize) {
+			int16_t stepCount = READ_INT16(data, 0);
+			if (stepCount == 0)
+				//axis without steps is elided
+				continue;
+
+			if (kind == 'C') {
+				int32_t offset = READ_INT32(data, 2 + 4 + 2);
+				bool hasOffset = offset > INT32_MIN;
+				axisFlags |= toRecordAxisFlags(hasOffset ? COMPACT_AXIS_PRESENT | COMPACT_AXIS_OFFSET : COMPACT_AXIS_PRESENT, i);
+				segment = writeConstant(segment, stepCount, READ_INT32(data, 2), READ_UINT16(data, 2 + 4), hasOffset, offset);
+			}
+			else if (kind == ARC_KIND) {
+				axisFlags |= toRecordAxisFlags(COMPACT_AXIS_PRESENT, i);
+				segment = writeArc(segment, stepCount, READ_INT16(data, 2), READ_UINT16(data, 2 + 2), READ_INT32(data, 2 + 2 + 2));
+			}
+			else if (kind == SPLINE_KIND) {
+				axisFlags |= toRecordAxisFlags(COMPACT_AXIS_PRESENT, i);
+				segment = writeSpline(segment, stepCount, READ_INT32(data, 2), READ_UINT16(data, 2 + 4), READ_UINT16(data, 2 + 4 + 2), data[2 + 4 + 2 + 2]);
+			}
+			else {
+				axisFlags |= toRecordAxisFlags(COMPACT_AXIS_PRESENT, i);
+				segment = writeAcceleration(segment, stepCount, READ_INT32(data, 2), READ_INT32(data, 2 + 4), READ_INT16(data, 2 + 4 + 4), READ_INT16(data, 2 + 4 + 4 + 2));
+			}
+		}
+
+		return pushRecord(kind, axisFlags, record, segment);
+	}
+
+	// Determine whether arc data of each axis stay in their quadrant and in the range of the 32-bit arc timing.
+	static bool isValidArc(const byte* data) {
+		for (byte i = 0; i < AxisCount; ++i, data += ARC_AXIS_DATA_SIZE) {
+			int16_t stepCount = READ_INT16(data, 0);
+			if (stepCount == 0)
+				continue;
+
+			int16_t coordinate = READ_INT16(data, 2);
+			int32_t endCoordinate = (int32_t)coordinate + stepCount;
+			int32_t radius = READ_UINT16(data, 2 + 2);
+			int32_t deltaT = READ_INT32(data, 2 + 2 + 2);
+			if (radius == 0 || radius >= 32768 || deltaT <= 0 || (uint32_t)deltaT >= ARC_MAX_DELTA_T_RADIUS / radius)
+				return false;
+
+			if (abs((int32_t)coordinate) > radius || abs(endCoordinate) > radius || (coordinate < 0 && endCoordinate > 0) || (coordinate > 0 && endCoordinate < 0))
+				//the arc would leave its quadrant
+				return false;
+		}
+		return true;
+	}
+
+	// Determine whether spline data of each axis keep the axis in its direction and fit into the 32-bit interval timing.
+	static bool isValidSpline(const byte* data) {
+		for (byte i = 0; i < AxisCount; ++i, data += SPLINE_AXIS_DATA_SIZE) {
+			if (READ_INT16(data, 0) == 0)
+				continue;
+
+			int32_t duration = READ_INT32(data, 2);
+			byte intervalShift = data[2 + 4 + 2 + 2];
+			if (intervalShift > SPLINE_MAX_INTERVAL_SHIFT || (duration >> intervalShift) <= 0 || duration > INT32_MAX / SCHEDULE_TICK_SCALE)
+				return false;
+
+			if (READ_UINT16(data, 2 + 4) > SPLINE_MAX_SLOPE || READ_UINT16(data, 2 + 4 + 2) > SPLINE_MAX_SLOPE)
+				//the axis could reverse
+				return false;
+		}
+		return true;
+	}
+
+	// Determine whether plan data of the given kind are in their range (arcs and splines are checked, the other kinds always are).
+	static inline bool isValidPlanData(byte kind, const byte* data) {
+		if (kind == ARC_KIND)
+			return isValidArc(data);
+		if (kind == SPLINE_KIND)
+			return isValidSpline(data);
+		return true;
+	}
+
+	// Decodes move data (see MOVE_DATA_SIZE) and plans it together with the queued moves - returns false when the queue is full.
+	bool pushMove(const byte* data) {
+		static_assert(AxisCount <= 4, "move frames have steps of 4 axes");
+		int16_t stepCounts[AxisCount];
+		for (byte i = 0; i < AxisCount; ++i)
+			stepCounts[i] = READ_INT16(data, i * 2);
+
+		byte record[maxRecordSize];
+		MoveHeader* move = (MoveHeader*)(record + PLAN_RECORD_HEADER_SIZE);
+		const byte* parameters = data + 4 * 2;
+		initMoveHeader(*move, stepCounts, AxisCount, READ_INT32(parameters, 0), READ_INT32(parameters, 4), READ_INT32(parameters, 4 + 4));
+
+		if (_count > 0 && _buffer[_backOffset] == MOVE_KIND) {
+			//the previous move did not start yet - it can pass the junction without stopping
+			int16_t previousStepCounts[AxisCount];
+			const byte* previousRecord = _buffer + _backOffset;
+			readMoveSteps(previousRecord, previousStepCounts);
+			limitJunctionSpeed(*move, stepCounts, *(const MoveHeader*)(previousRecord + PLAN_RECORD_HEADER_SIZE), previousStepCounts, AxisCount);
+		}
+
+		byte* segment = record + PLAN_RECORD_HEADER_SIZE + sizeof(MoveHeader);
+		AxisFlags axisFlags = 0;
+		for (byte i = 0; i < AxisCount; ++i) {
+			if (stepCounts[i] == 0)
+				//axis without steps is elided
+				continue;
+
+			axisFlags |= toRecordAxisFlags(COMPACT_AXIS_PRESENT, i);
+			memcpy(segment, &stepCounts[i], sizeof(int16_t));
+			segment += sizeof(int16_t);
+		}
+
+		if (!pushRecord(MOVE_KIND, axisFlags, record, segment))
+			return false;
+
+		planMoves();
+		return true;
+	}
+
+	// Determine whether the oldest record is planned for good - the newest move stops at its end unless the next move comes
+	// (it is armed anyway when the running instruction gets close to its end).
+	inline bool isFrontPlanned() {
+		if (_count != 1 || _buffer[_readOffset] != MOVE_KIND)
+			return true;
+
+		return ((const MoveHeader*)(_buffer + _readOffset + PLAN_RECORD_HEADER_SIZE))->rampJerk > 0;
+	}
+
+	// Reads steps of all axes of the move record.
+	static void readMoveSteps(const byte* record, int16_t* stepCounts) {
+		const byte* segment = record + PLAN_RECORD_HEADER_SIZE + sizeof(MoveHeader);
+		AxisFlags axisFlags = readRecordAxisFlags(record);
+		for (byte i = 0; i < AxisCount; ++i) {
+			stepCounts[i] = 0;
+			if (fromRecordAxisFlags(axisFlags, i) & COMPACT_AXIS_PRESENT) {
+				memcpy(&stepCounts[i], segment, sizeof(int16_t));
+				segment += sizeof(int16_t);
+			}
+		}
+	}
+
+	// Decodes compact plan payload (command, axis flags and varint axis data) - returns false when the queue is full or the payload is malformed.
+	// (frames are checked by isValidCompact when they arrive, the caller tells both cases apart the same way)
+	bool pushCompact(const byte* payload, const byte* payloadEnd) {
+		byte record[maxRecordSize];
+		int32_t references[AxisCount];
+		memcpy(references, _deltaReferences, sizeof(references));
+
+		byte* segment = decodeCompact(payload, payloadEnd, record, references);
+		if (segment == NULL)
+			return false;
+
+		if (!pushRecord(payload[0], record[1], record, segment))
+			return false;
+
+		memcpy(_deltaReferences, references, sizeof(references));
+		return true;
+	}
+
+	// Determine whether compact plan payload has a plan command and all its axis data.
+	static bool isValidCompact(const byte* payload, const byte* payloadEnd) {
+		byte record[maxRecordSize];
+		int32_t references[AxisCount] = { 0 };
+		return decodeCompact(payload, payloadEnd, record, references) != NULL;
+	}
+
+	// Compact plans encode deltaT against the previous one of the axis - the sender resets it together with this call.
+	void resetCompactReferences() {
+		for (byte i = 0; i < AxisCount; ++i)
+			_deltaReferences[i] = 0;
+	}
+
+	// The oldest record (NULL when the queue is empty).
+	inline const byte* front() {
+		if (_count == 0)
+			return NULL;
+
+		return _buffer + _readOffset;
+	}
+
+	// Removes the oldest record.
+	void pop() {
+		byte size = recordSize(_buffer + _readOffset);
+		_readOffset += size;
+		_usedBytes -= size;
+		--_count;
+
+		if (_count == 0) {
+			//empty queue starts from the beginning again
+			_readOffset = _writeOffset = _usedBytes = 0;
+			_wrapOffset = Capacity;
+		}
+		else if (_readOffset == _wrapOffset) {
+			//the rest of the buffer was skipped by the writer
+			_usedBytes -= Capacity - _wrapOffset;
+			_readOffset = 0;
+			_wrapOffset = Capacity;
+		}
+	}
+
+	// Count of queued plans.
+	inline byte count() {
+		return _count;
+	}
+
+	// Count of records which surely fit into the free space (the largest records, one of them may be skipped at the buffer end).
+	inline byte freeRecords() {
+		uint16_t records = (Capacity - _usedBytes) / maxRecordSize;
+		return records > 1 ? min(records - 1, (uint16_t)255) : 0;
+	}
+
+	// Size of the given record.
+	static byte recordSize(const byte* record) {
+		byte size = record[0] == MOVE_KIND ? PLAN_RECORD_HEADER_SIZE + sizeof(MoveHeader) : PLAN_RECORD_HEADER_SIZE;
+		AxisFlags axisFlags = readRecordAxisFlags(record);
+		for (byte i = 0; i < AxisCount; ++i) {
+			byte flags = fromRecordAxisFlags(axisFlags, i);
+			if ((flags & COMPACT_AXIS_PRESENT) == 0)
+				continue;
+
+			if (record[0] == 'C')
+				size += sizeof(ConstantSegment) + ((flags & COMPACT_AXIS_OFFSET) ? sizeof(int32_t) : 0);
+			else if (record[0] == MOVE_KIND)
+				size += sizeof(int16_t);
+			else if (record[0] == ARC_KIND)
+				size += sizeof(ArcSegment);
+			else if (record[0] == SPLINE_KIND)
+				size += sizeof(SplineSegment);
+			else
+				size += sizeof(AccelerationSegment);
+		}
+		return size;
+	}
+
+private:
+	// decoded plans
+	byte _buffer[Capacity];
+
+	// offset of the oldest record
+	uint16_t _readOffset;
+
+	// offset where next record will be written
+	uint16_t _writeOffset;
+
+	// offset of the newest record
+	uint16_t _backOffset;
+
+	// end of records before the writer continued from the beginning (Capacity when it did not)
+	uint16_t _wrapOffset;
+
+	// bytes taken by records (including the end skipped by the writer)
+	uint16_t _usedBytes;
+
+	// count of records
+	byte _count;
+
+	// last deltaT of each axis which compact plans are encoded against
+	int32_t _deltaReferences[AxisCount];
+
+	static inline byte* writeConstant(byte* segment, int16_t stepCount, int32_t baseDeltaT, uint16_t periodNumerator, bool hasOffset, int32_t offset) {
+		ConstantSegment* constant = (ConstantSegment*)segment;
+		constant->baseDeltaT = baseDeltaT;
+		constant->stepCount = stepCount;
+		constant->periodNumerator = periodNumerator;
+		segment += sizeof(ConstantSegment);
+		if (hasOffset) {
+			memcpy(segment, &offset, sizeof(offset));
+			segment += sizeof(offset);
+		}
+		return segment;
+	}
+
+	static inline byte* writeAcceleration(byte* segment, int16_t stepCount, int32_t initialDeltaT, int32_t n, int16_t baseDelta, int16_t baseRemainder) {
+		AccelerationSegment* acceleration = (AccelerationSegment*)segment;
+		acceleration->initialDeltaT = initialDeltaT;
+		acceleration->n = n;
+		acceleration->stepCount = stepCount;
+		acceleration->baseDelta = baseDelta;
+		acceleration->baseRemainder = baseRemainder;
+		return segment + sizeof(AccelerationSegment);
+	}
+
+	static inline byte* writeArc(byte* segment, int16_t stepCount, int16_t coordinate, uint16_t radius, int32_t deltaT) {
+		ArcSegment* arc = (ArcSegment*)segment;
+		arc->deltaT = deltaT;
+		arc->stepCount = stepCount;
+		arc->coordinate = coordinate;
+		arc->radius = radius;
+		return segment + sizeof(ArcSegment);
+	}
+
+	static inline byte* writeSpline(byte* segment, int16_t stepCount, int32_t duration, uint16_t startSlope, uint16_t endSlope, byte intervalShift) {
+		SplineSegment* spline = (SplineSegment*)segment;
+		spline->duration = duration;
+		spline->stepCount = stepCount;
+		spline->startSlope = startSlope;
+		spline->endSlope = endSlope;
+		spline->intervalShift = intervalShift;
+		return segment + sizeof(SplineSegment);
+	}
+
+	// Decodes compact plan payload into the record (its axis flags included) - returns end of the record, NULL when the payload is malformed.
+	static byte* decodeCompact(const byte* payload, const byte* payloadEnd, byte* record, int32_t* references) {
+		static_assert(AxisCount <= 4, "compact frames have axis flags of 4 axes");
+		if (payloadEnd - payload < 2 || (payload[0] != 'A' && payload[0] != 'C'))
+			//command and axis flags are missing or the command is not a plan
+			return NULL;
+
+		byte* segment = record + PLAN_RECORD_HEADER_SIZE;
+		byte kind = payload[0];
+		AxisFlags axisFlags = 0;
+		CompactReader reader(payload + 2, payloadEnd);
+		for (byte i = 0; i < AxisCount; ++i) {
+			byte flags = payload[1] >> i;
+			if ((flags & COMPACT_AXIS_PRESENT) == 0)
+				continue;
+
+			axisFlags |= toRecordAxisFlags(flags, i);
+			int16_t stepCount = reader.readSigned();
+			references[i] += reader.readSigned();
+			if (kind == 'C') {
+				uint16_t periodNumerator = reader.readUnsigned();
+				bool hasOffset = flags & COMPACT_AXIS_OFFSET;
+				int32_t offset = hasOffset ? reader.readSigned() : INT32_MIN;
+				segment = writeConstant(segment, stepCount, references[i], periodNumerator, hasOffset, offset);
+			}
+			else {
+				int32_t n = reader.readSigned();
+				int16_t baseDelta = reader.readSigned();
+				int16_t baseRemainder = reader.readSigned();
+				segment = writeAcceleration(segment, stepCount, references[i], n, baseDelta, baseRemainder);
+			}
+		}
+
+		memcpy(record + 1, &axisFlags, sizeof(axisFlags));
+		return reader.isOverrun() ? NULL : segment;
+	}
+
+	// plans speeds of the moves queued after the last plan record
+	void planMoves() {
+		MoveHeader* chain[maxChainLength];
+		byte chainLength = 0;
+		uint16_t offset = _readOffset;
+		for (byte i = 0; i < _count; ++i) {
+			byte* record = _buffer + offset;
+			MoveHeader* move = (MoveHeader*)(record + PLAN_RECORD_HEADER_SIZE);
+			if (record[0] != MOVE_KIND || move->rampJerk > 0)
+				//plans and constant jerk moves stop the chain
+				chainLength = 0;
+			else
+				chain[chainLength++] = move;
+
+			offset += recordSize(record);
+			if (offset == _wrapOffset)
+				offset = 0;
+		}
+
+		planMoveChain(chain, chainLength);
+	}
+
+	// copies decoded record to the queue - returns false when it does not fit
+	bool pushRecord(byte kind, AxisFlags axisFlags, byte* record, byte* recordEnd) {
+		record[0] = kind;
+		memcpy(record + 1, &axisFlags, sizeof(axisFlags));
+		byte size = recordEnd - record;
+
+		uint16_t offset = _writeOffset;
+		uint16_t skippedBytes = 0;
+		if (offset + size > Capacity) {
+			//record has to be contiguous - continue from the beginning
+			skippedBytes = Capacity - offset;
+			offset = 0;
+		}
+
+		if (_usedBytes + skippedBytes + size > Capacity)
+			return false;
+
+		if (skippedBytes > 0)
+			_wrapOffset = _writeOffset;
+
+		memcpy(_buffer + offset, record, size);
+		_backOffset = offset;
+		_usedBytes += skippedBytes + size;
+		_writeOffset = offset + size;
+		++_count;
+		return true;
+	}
+};
+
+// Segment of a single axis - either constant or acceleration plan.
+// Allows axes to chain constant and acceleration segments independently.
+// Segment of a move runs its phases (acceleration, cruise, deceleration) one after another.
+// Arc segment steps the axis along a circle (incremental integer square root with a bounded correction, a single division per step).
+// Spline segment runs its intervals one after another as constant phases (the curve is evaluated and divided once per interval).
+class SegmentPlan : public BoundedAccelerationPlan {
+public:
+	SegmentPlan(byte clkPin, byte dirPin);
+
+	// Loads segment of decoded plan record ('A', 'C', ARC_KIND or SPLINE_KIND) with the flags of the axis (see fromRecordAxisFlags) - segment is moved behind the axis data.
+	void loadFrom(byte kind, byte axisFlags, const byte*& segment);
+
+	// Loads ramps of the axis with the given steps from the planned move.
+	void loadMove(const MoveHeader& move, int16_t stepCount);
+
+	// Loads homing segment - constant steps with the given deltaT or acceleration ramp from the standstill up to the deltaT
+	// (steps of the ramp are given by the deltaT, the step count gives its direction).
+	void loadHoming(int16_t stepCount, uint16_t deltaT, bool isRamp);
+
+	// Creates next activation.
+	void createNextActivation();
+
+	// Determine whether the next steps can be repeated by a schedule run (the last step of the segment is left out),
+	// the period has to be longer than minDelay and the whole period has to fit into maxDelay.
+	bool canRepeat(uint16_t minDelay, uint16_t maxDelay);
+
+	// Determine whether the plan repeats exactly the same steps as the given plan.
+	bool repeatsLike(const SegmentPlan& plan);
+
+	// Initializes the run so it repeats the given count of the next steps (period is scaled by the time scale, see FEED_SCALE_SHIFT).
+	void initRun(ScheduleRun& run, uint16_t count, uint16_t timeScale);
+
+	// Creates activations of the given count of steps - returns their duration.
+	int32_t repeatSteps(uint16_t count);
+
+	// Steps which are left to the segment (including the phases which did not start yet).
+	inline uint16_t leftSteps() {
+		return this->remainingSteps + this->pendingPhaseSteps();
+	}
+
+	// Steps of the segment including the phases which did not start yet.
+	inline uint16_t totalSteps() {
+		return this->stepCount + this->pendingPhaseSteps();
+	}
+
+private:
+	// Loads constant segment from decoded values.
+	void loadConstant(int16_t stepCount, int32_t baseDeltaT, uint16_t periodNumerator, int32_t offset);
+
+	// Continues the move with cruise or deceleration ramp.
+	void startNextPhase();
+
+	// Creates next activation of constant jerk ramp (deltaT changes with 2 * deltaT / (3n + 1)).
+	void createNextJerkActivation();
+
+	// Loads arc segment of the axis.
+	void loadArc(int16_t stepCount, int32_t deltaT, int16_t coordinate, uint16_t radius);
+
+	// Creates next activation of arc segment (axis speed is proportional to the other coordinate of the circle).
+	void createNextArcActivation();
+
+	// Loads spline segment of the axis.
+	void loadSpline(int16_t stepCount, int32_t duration, uint16_t startSlope, uint16_t endSlope, byte intervalShift);
+
+	// Creates next activation of spline segment (steps of an interval are spread as the constant segment spreads them).
+	void createNextSplineActivation();
+
+	// Continues the spline with its next interval which has steps - returns time of the intervals without steps before it
+	// (no interval is started when the steps ended).
+	int32_t startNextInterval();
+
+	// Creates next activation of constant segment or phase.
+	void createNextConstantActivation();
+
+	// Steps of the move phases (or the spline intervals) which did not start yet.
+	inline uint16_t pendingPhaseSteps() {
+		if (this->_curveKind == ARC_KIND)
+			return 0;
+		return this->_curveKind == SPLINE_KIND ? this->_spline.pendingSteps : this->_move.cruiseSteps + this->_move.decelerationSteps;
+	}
+
+	// Move phases which did not start yet.
+	struct MovePhases {
+		// steps of the move cruise
+		uint16_t cruiseSteps;
+		// steps of the move deceleration
+		uint16_t decelerationSteps;
+		// n of the ramp formula where the move deceleration starts
+		uint16_t decelerationN;
+		// deltaT of the move cruise
+		int32_t cruiseDeltaT;
+		// cruise deltaT remainder distributed over the cruise steps
+		uint16_t cruiseNumerator;
+	};
+
+	// State of the arc segment - the other coordinate is doubled so the whole circle fits into 32 bits.
+	struct ArcState {
+		// coordinate of the axis (relative to the center)
+		int16_t coordinate;
+		// doubled other coordinate squared (doubled radius squared minus the doubled coordinate squared)
+		uint32_t otherCoordinate2;
+		// rounded doubled other coordinate
+		uint16_t otherCoordinate;
+		// 4 * deltaT * radius in the schedule ticks (time of a step is this divided by the sum of two other coordinates)
+		uint32_t stepTimeRadius;
+	};
+
+	// State of the spline segment - the curve is evaluated again at the end of each interval.
+	struct SplineState {
+		// steps of the whole segment
+		uint16_t steps;
+		// steps of the intervals which did not start yet
+		uint16_t pendingSteps;
+		// slopes of the curve (see SplineSegment)
+		uint16_t startSlope;
+		uint16_t endSlope;
+		// intervals which started already
+		byte interval;
+		// the segment has 1 << intervalShift intervals
+		byte intervalShift;
+		// the last intervals which are one tick longer (remainder of the segment time)
+		byte longIntervalCount;
+	};
+
+	// determine whether deltaT is constant for the whole segment
+	bool _isConstant;
+	// determine whether offset is defined for the first activation
+	bool _hasOffset;
+	// constant segments with offset are never splines
+	union {
+		// offset of the first activation
+		int32_t _offset;
+		// time of a spline interval in the schedule ticks
+		int32_t _intervalTime;
+	};
+	// determine whether ramps of the move have constant jerk
+	bool _isConstantJerk;
+	// ARC_KIND or SPLINE_KIND when the segment follows a curve (zero for constant, acceleration and move segments)
+	byte _curveKind;
+	// arcs, splines and moves never share a segment
+	union {
+		MovePhases _move;
+		ArcState _arc;
+		SplineState _spline;
+	};
+};
+
+// Timing counters of the step interrupt (see Steppers::takeTimingTelemetry).
+struct TimingTelemetry {
+	// lowest count of entries left for the step interrupt
+	ScheduleIndex minOccupancy;
+	// count of stops when armed instructions were not finished
+	uint16_t underrunStops;
+	// interrupts by timer ticks from the overflow (bucket width is 1 << ISR_LATENESS_BUCKET_SHIFT)
+	uint16_t latenessHistogram[ISR_LATENESS_BUCKET_COUNT];
+};
+
+class Steppers {
+public:
+	// Initialize registered steppers - no new steppers can be created afterewards.
+	static void initialize();
+
+	// Starts scheduler.
+	static bool startScheduler();
+
+	// Determine whether scheduler is started.
+	static bool isSchedulerRunning();
+
+	// Blocks given ports by mask (one blocks, zero unblocks)
+	static void setActivationMask(byte mask);
+
+	// Returns count of instructions finished from the last call.
+	static byte takeFinishedInstructionCount();
+
+	// Copies timing counters of the step interrupt and starts them again.
+	static void takeTimingTelemetry(TimingTelemetry& telemetry);
+
+	// Sends the scheduler reports which were raised by the refill interrupt.
+	static void sendDeferredReports();
+private:
+	// Determine whether steppers environment is initialized.
+	static bool _isInitialized;
+};
+
+
+// Wiring of a stepper axis known at compile time.
+template<byte ClkMask, byte DirMask> struct StepperAxis {
+	static const byte clkMask = ClkMask;
+	static const byte dirMask = DirMask;
+};
+
+typedef StepperAxis<SLOT0_CLK_MASK, SLOT0_DIR_MASK> Slot0Axis;
+typedef StepperAxis<SLOT1_CLK_MASK, SLOT1_DIR_MASK> Slot1Axis;
+typedef StepperAxis<SLOT2_CLK_MASK, SLOT2_DIR_MASK> Slot2Axis;
+typedef StepperAxis<SLOT3_CLK_MASK, SLOT3_DIR_MASK> Slot3Axis;
+
+// Selects axis on given index of the axis list.
+template<byte Index, typename Axis, typename... Rest> struct AxisAt {
+	typedef typename AxisAt<Index - 1, Rest...>::Type Type;
+};
+
+template<typename Axis, typename... Rest> struct AxisAt<0, Axis, Rest...> {
+	typedef Axis Type;
+};
+
+// Range of axes [First, First + Count) used for compile time unrolling.
+template<byte First, byte Count> struct AxisRange {};
+
+template<byte AxisCount> struct ActivationSlack
+{
+	int32_t d[AxisCount];
+
+	inline void reset() {
+		for (byte i = 0; i < AxisCount; ++i)
+			d[i] = 0;
+	}
+};
+
+typedef ActivationSlack<4> ActivationSlack4D;
+
+// Schedules plans of the given axes (in the order of plan data).
+// Earliest activation search and plan triggering are unrolled at compile time.
+template<typename PlanType, typename... Axes> class PlanScheduler {
+	static_assert(sizeof...(Axes) <= MAX_AXIS_COUNT, "schedule clocks have room for MAX_AXIS_COUNT axes");
+public:
+	static const byte axisCount = sizeof...(Axes);
+
+	ActivationSlack<axisCount> slack;
+
+	PlanScheduler()
+		:slack(), _plans{ PlanType(Axes::clkMask, Axes::dirMask)... }, _needInit(false), _hasEnd(false)
+	{
+		slack.reset();
+	}
+
+	void registerLastActivationSlack(ActivationSlack<axisCount> &slack) {
+		this->slack = slack;
+	}
+
+	void initForHoming() {
+		for (byte i = 0; i < axisCount; ++i) {
+			this->_plans[i].initForHoming();
+			this->_plans[i].createNextActivation();
+		}
+		this->_needInit = true;
+		this->_hasEnd = false;
+	}
+
+	// loads plan from given data
+	void initFrom(byte * data)
+	{
+		if (SCHEDULER_STOP_EVENT_FLAG) {
+			//scheduler reset means slack reset
+			this->slack.reset();
+			SCHEDULER_STOP_EVENT_FLAG = false;
+		}
+
+		bool isStepTimeMissed = false;
+		for (byte i = 0; i < axisCount; ++i) {
+			this->_plans[i].loadFrom(data + i * PlanType::dataSize);
+			this->_plans[i].createNextActivation();
+			isStepTimeMissed |= this->applySlack(this->slack.d[i], this->_plans[i]);
+		}
+
+		if (isStepTimeMissed)
+			sendSchedulerReport('M');
+
+		this->_needInit = true;
+		this->_hasEnd = true;
+	}
+
+	// fills schedule buffer with plan data
+	// returns true when buffer is full (temporarly), false when plan is over
+	bool fillSchedule(bool startScheduler = true) {
+		while (isAnyActive(AxisRange<0, axisCount>())) {
+			//find earliest plan
+			int32_t minActiveActivationTime = earliestActivationTime(AxisRange<0, axisCount>());
+
+			//limit activation to timer resolution (we can output empty activation intermediate step)
+			ScheduleTime earliestActivationTime = limitActivationTime(minActiveActivationTime);
+
+			if (_needInit) {
+				earliestActivationTime = PORT_CHANGE_DELAY;
+
+				CUMULATIVE_SCHEDULE_ACTIVATION = ACTIVATIONS_CLOCK_MASK;
+				for (byte i = 0; i < axisCount; ++i)
+					CUMULATIVE_SCHEDULE_ACTIVATION |= this->_plans[i].stepMask;
+				_needInit = false;
+			}
+
+			CUMULATIVE_SCHEDULE_ACTIVATION |= ACTIVATIONS_CLOCK_MASK;
+
+			//subtract earliest plan other plans
+			triggerPlans(AxisRange<0, axisCount>(), earliestActivationTime);
+
+			//schedule
+			while (isScheduleFull() && startScheduler) {
+				//wait until schedule buffer has empty space				
+				Steppers::startScheduler();
+			}
+
+			writeScheduleEntry(earliestActivationTime, CUMULATIVE_SCHEDULE_ACTIVATION, this->_hasEnd && !isAnyActive(AxisRange<0, axisCount>()));
+
+			if (isScheduleFull())
+				//we have free time
+				return true;
+		}
+		for (byte i = 0; i < axisCount; ++i)
+			this->slack.d[i] = this->_plans[i].nextActivationTime;
+		
+		flushScheduleEntries();
+		if (startScheduler)
+			Steppers::startScheduler();
+		return false;
+	}
+private:
+	template<byte First> inline bool isAnyActive(AxisRange<First, 1>) {
+		return this->_plans[First].isActive;
+	}
+
+	template<byte First, byte Count> inline bool isAnyActive(AxisRange<First, Count>) {
+		return isAnyActive(AxisRange<First, Count / 2>()) || isAnyActive(AxisRange<First + Count / 2, Count - Count / 2>());
+	}
+
+	template<byte First> inline int32_t earliestActivationTime(AxisRange<First, 1>) {
+		return this->_plans[First].isActive ? this->_plans[First].nextActivationTime : INT32_MAX;
+	}
+
+	// tournament tree - each half selects its earliest activation
+	template<byte First, byte Count> inline int32_t earliestActivationTime(AxisRange<First, Count>) {
+		int32_t first = earliestActivationTime(AxisRange<First, Count / 2>());
+		int32_t second = earliestActivationTime(AxisRange<First + Count / 2, Count - Count / 2>());
+		return first < second ? first : second;
+	}
+
+	template<byte First> inline void triggerPlans(AxisRange<First, 1>, ScheduleTime nextActivationTime) {
+		triggerPlan<typename AxisAt<First, Axes...>::Type>(this->_plans[First], nextActivationTime);
+	}
+
+	template<byte First, byte Count> inline void triggerPlans(AxisRange<First, Count>, ScheduleTime nextActivationTime) {
+		triggerPlans(AxisRange<First, Count / 2>(), nextActivationTime);
+		triggerPlans(AxisRange<First + Count / 2, Count - Count / 2>(), nextActivationTime);
+	}
+
+	inline bool applySlack(int32_t &slackTime, PlanType &plan) {
+		if (plan.isActivationBoundary) {
+			slackTime = 0;
+			return false;
+		}
+
+		plan.nextActivationTime += slackTime;
+		if (plan.nextActivationTime < PORT_CHANGE_DELAY) {
+			plan.nextActivationTime = PORT_CHANGE_DELAY;
+
+			//we cannot go backwards in time - step was missed
+			return true;
+		}
+
+		//step was not missed
+		return false;
+	}
+
+	template<typename Axis> inline void triggerPlan(PlanType& plan, ScheduleTime nextActivationTime) {
+		if (!plan.isActive) {
+			if (!plan.isActivationBoundary)
+				// this plan is not a boundary - continue to calculate slack
+				plan.nextActivationTime -= nextActivationTime;
+			//there is nothing to do
+			return;
+		}
+
+		plan.nextActivationTime -= nextActivationTime;
+
+		if (plan.nextActivationTime > MIN_ACTIVATION_DELAY)
+			//no steps for the plan now
+			return;
+
+		// make the appropriate pin LOW
+		CUMULATIVE_SCHEDULE_ACTIVATION &= ~(Axis::clkMask);
+
+		if (plan.nextActivationTime > 0) {
+			//activations would come too early one after another - we will group them
+			byte skippedTime = plan.nextActivationTime;
+			plan.createNextActivation();
+			plan.nextActivationTime += skippedTime;
+		}
+		else {
+			//compute next activation
+			plan.createNextActivation();
+		}
+	}
+
+	// data for the axes
+	PlanType _plans[axisCount];
+
+	//determine whether initialization is needed
+	bool _needInit;
+
+	///determine whether instruction end will be reported to scheduler
+	bool _hasEnd;
+};
+
+// Scheduler of the four slots in the order ControllerCNC sends them.
+template<typename PlanType> using PlanScheduler4D = PlanScheduler<PlanType, Slot1Axis, Slot0Axis, Slot3Axis, Slot2Axis>;
+
+// Schedules per-axis segment queues of the given axes (in the order of plan data).
+// Next instruction is armed while the current one is scheduled - each axis continues
+// with its next segment as soon as its current segment ends (unless any of them is an activation boundary).
+template<typename... Axes> class SegmentScheduler {
+	static_assert(sizeof...(Axes) <= MAX_AXIS_COUNT, "axis flags of plan records and schedule clocks have room for MAX_AXIS_COUNT axes");
+public:
+	static const byte axisCount = sizeof...(Axes);
+
+	SegmentScheduler()
+		:_plans{ SegmentPlan(Axes::clkMask, Axes::dirMask)..., SegmentPlan(Axes::clkMask, Axes::dirMask)... },
+		_armedMask(0), _aheadMask(0), _openInstructions(0), _instructionEnds(0), _directionMask(0), _directionDeadline(INT32_MAX), _forceDirections(true),
+		_instructionStepsStart(0), _instructionStepsEnd(0), _feedScale(FEED_SCALE_UNITY), _timeScale(FEED_SCALE_UNITY), _minActivationTime(MIN_ACTIVATION_DELAY),
+		_maxActivationTime(SCHEDULE_MAX_DELAY), _minEntryTime(MIN_ACTIVATION_DELAY), _feedState(FEED_RUNNING), _rampTime(0), _rampScaleFraction(0)
+	{
+		resetLookahead();
+		for (byte i = 0; i < axisCount; ++i) {
+			this->_current[i] = &this->_plans[i];
+			this->_next[i] = &this->_plans[axisCount + i];
+			this->_groupedSteps[i] = 0;
+			this->_missedSteps[i] = 0;
+			this->_rampSteps[i] = 0;
+		}
+	}
+
+	// Determine whether next instruction can be armed.
+	inline bool canArm() {
+		return this->_armedMask == 0 && (byte)(this->_instructionStepsStart - this->_instructionStepsEnd) < INSTRUCTION_STEPS_LEN;
+	}
+
+	// Determine whether there is nothing to schedule.
+	bool isIdle() {
+		bool isRefillEnabled = pauseScheduleRefill();
+		bool result = this->_openInstructions == 0 && !isAnyActive(AxisRange<0, axisCount>());
+		resumeScheduleRefill(isRefillEnabled);
+		return result;
+	}
+
+	// Determine whether the scheduled segments are close to their end (the next instruction is needed soon).
+	bool isNearEnd() {
+		bool isRefillEnabled = pauseScheduleRefill();
+		bool result = true;
+		for (byte i = 0; i < axisCount; ++i) {
+			if (this->_current[i]->isActive && this->_current[i]->leftSteps() > MOVE_ARM_STEPS) {
+				result = false;
+				break;
+			}
+		}
+		resumeScheduleRefill(isRefillEnabled);
+		return result;
+	}
+
+	// Loads decoded plan record (see PlanQueue) into the next segments.
+	void arm(const byte* record) {
+		bool isRefillEnabled = pauseScheduleRefill();
+		byte kind = record[0];
+		AxisFlags axisFlags = readRecordAxisFlags(record);
+		const byte* segment = record + PLAN_RECORD_HEADER_SIZE;
+		if (kind == MOVE_KIND) {
+			//ramps of the axes are derived from the planned speeds of the move
+			const MoveHeader* move = (const MoveHeader*)segment;
+			segment += sizeof(MoveHeader);
+			for (byte i = 0; i < axisCount; ++i) {
+				int16_t stepCount = 0;
+				if (fromRecordAxisFlags(axisFlags, i) & COMPACT_AXIS_PRESENT) {
+					memcpy(&stepCount, segment, sizeof(int16_t));
+					segment += sizeof(int16_t);
+				}
+				this->_next[i]->loadMove(*move, stepCount);
+			}
+		}
+		else {
+			for (byte i = 0; i < axisCount; ++i)
+				this->_next[i]->loadFrom(kind, fromRecordAxisFlags(axisFlags, i), segment);
+		}
+
+		armLoaded();
+		resumeScheduleRefill(isRefillEnabled);
+	}
+
+	// Commits steps of the instructions finished by the step interrupt to the positions - returns count of the instructions.
+	// Steps which were made by the held instructions are committed too (the rest is committed when they finish).
+	byte takeFinishedInstructions() {
+		bool isRefillEnabled = pauseScheduleRefill();
+		byte count = Steppers::takeFinishedInstructionCount();
+		for (byte i = 0; i < count; ++i) {
+			commitSteps(AxisRange<0, axisCount>(), this->_instructionSteps[this->_instructionStepsEnd & (INSTRUCTION_STEPS_LEN - 1)]);
+			++this->_instructionStepsEnd;
+		}
+
+		if (this->_feedState == FEED_HELD && this->_openInstructions > 0 && !Steppers::isSchedulerRunning())
+			commitHeldSteps();
+		resumeScheduleRefill(isRefillEnabled);
+		return count;
+	}
+
+	// Copies per-axis counters of grouped and missed steps and starts them again.
+	void takeStepCounters(uint16_t groupedSteps[axisCount], uint16_t missedSteps[axisCount]) {
+		bool isRefillEnabled = pauseScheduleRefill();
+		for (byte i = 0; i < axisCount; ++i) {
+			groupedSteps[i] = this->_groupedSteps[i];
+			missedSteps[i] = this->_missedSteps[i];
+			this->_groupedSteps[i] = 0;
+			this->_missedSteps[i] = 0;
+		}
+		resumeScheduleRefill(isRefillEnabled);
+	}
+
+	// Arms homing instruction (see SegmentPlan::loadHoming) - deltaTs of the axes are given in the order of plan data.
+	void armHoming(const int16_t* stepCounts, const uint16_t* deltaTs, bool isRamp) {
+		bool isRefillEnabled = pauseScheduleRefill();
+		for (byte i = 0; i < axisCount; ++i)
+			this->_next[i]->loadHoming(stepCounts[i], deltaTs[i], isRamp);
+
+		armLoaded();
+		resumeScheduleRefill(isRefillEnabled);
+	}
+
+	// Sets feed override in percents (it is limited to FEED_OVERRIDE_MIN and FEED_OVERRIDE_MAX).
+	// Activation times are scaled when they are written to the schedule - the override applies to everything which was not written yet.
+	// Moving axes ramp to the new speed with the hold ramp (a resume continues to the new override).
+	void setFeedOverride(byte percent) {
+		percent = min(max(percent, (byte)FEED_OVERRIDE_MIN), (byte)FEED_OVERRIDE_MAX);
+		bool isRefillEnabled = pauseScheduleRefill();
+		this->_feedScale = ((uint16_t)FEED_SCALE_UNITY * 100 + percent / 2) / percent;
+		if (this->_feedState == FEED_RUNNING && isIdle()) {
+			//there is nothing to ramp
+			setTimeScale(this->_feedScale);
+		}
+		else if (this->_feedState == FEED_RUNNING && this->_feedScale != this->_timeScale) {
+			startHoldRamp();
+			this->_feedState = FEED_OVERRIDING;
+		}
+		resumeScheduleRefill(isRefillEnabled);
+	}
+
+	// Decelerates all axes along their path until they stop - plans wait until resumeFeed is called.
+	// The ramp starts with the activations which are not written to the schedule yet.
+	void holdFeed() {
+		bool isRefillEnabled = pauseScheduleRefill();
+		if (this->_feedState == FEED_RUNNING)
+			startHoldRamp();
+		if (this->_feedState == FEED_RUNNING || this->_feedState == FEED_RESUMING || this->_feedState == FEED_OVERRIDING) {
+			//resuming ramp turns back from its speed
+			this->_feedState = FEED_STOPPING;
+			if (isIdle())
+				//there is nothing to decelerate
+				setFeedHeld();
+		}
+		//otherwise the hold is already on its way
+		resumeScheduleRefill(isRefillEnabled);
+	}
+
+	// Accelerates the held axes back to the feed override.
+	void resumeFeed() {
+		bool isRefillEnabled = pauseScheduleRefill();
+		if (this->_feedState == FEED_STOPPING || this->_feedState == FEED_HELD) {
+			if (this->_feedState == FEED_HELD)
+				startHoldRamp();
+			this->_feedState = FEED_RESUMING;
+			SCHEDULE_HOLD_FLAG = false;
+		}
+		resumeScheduleRefill(isRefillEnabled);
+	}
+
+	// Determine whether feed hold is active (including its ramps).
+	inline bool isFeedHeld() {
+		return this->_feedState != FEED_RUNNING && this->_feedState != FEED_OVERRIDING;
+	}
+
+	// Fills the schedule from the refill interrupt (see SCHEDULE_REFILL_ISR) - the schedule is topped up
+	// once it drains below SCHEDULE_REFILL_OCCUPANCY, so short refills do not steal time of the main loop.
+	void refillSchedule() {
+		beginScheduleRefill();
+		if (!Steppers::isSchedulerRunning() || scheduleOccupancy(SCHEDULE_START, readScheduleEnd()) < SCHEDULE_REFILL_OCCUPANCY)
+			fillSchedule();
+		endScheduleRefill();
+	}
+
+	// fills schedule buffer with segment data (up to SCHEDULE_LOOKAHEAD ahead of the step interrupt)
+	// returns true when buffer is full (temporarly), false when there is nothing to schedule
+	bool fillSchedule(bool startScheduler = true) {
+		while (this->_instructionEnds > 0 || isAnyActive(AxisRange<0, axisCount>())) {
+			if (this->_feedState == FEED_HELD) {
+				if (SCHEDULER_STOP_EVENT_FLAG)
+					takeHoldStop();
+				//plans wait where the hold stopped them
+				break;
+			}
+
+			if (this->_aheadTime >= SCHEDULE_LOOKAHEAD)
+				//the written time is not taken while it is short
+				takeFiredTime();
+			if (this->_aheadTime >= SCHEDULE_LOOKAHEAD) {
+				//feed changes would wait for the written entries
+				if (startScheduler)
+					Steppers::startScheduler();
+				return true;
+			}
+
+#if SCHEDULE_BUFFER_LEN > SCHEDULE_ARM_OCCUPANCY + 1
+			if (this->_armedMask == 0 && scheduleOccupancy(SCHEDULE_START, readScheduleEnd()) >= SCHEDULE_ARM_OCCUPANCY) {
+				//the next instruction has to be armed before the axes of the current one finish
+				if (startScheduler)
+					Steppers::startScheduler();
+				return true;
+			}
+#endif
+
+			if (scheduleRun()) {
+				if (isScheduleFull())
+					//we have free time
+					return true;
+				continue;
+			}
+
+			//find earliest plan
+			int32_t minActiveActivationTime = earliestActivationTime(AxisRange<0, axisCount>());
+			if (minActiveActivationTime == INT32_MAX)
+				//only instruction end is reported
+				minActiveActivationTime = MIN_ACTIVATION_DELAY;
+
+			//direction change has to come before the step
+			minActiveActivationTime = min(minActiveActivationTime, this->_directionDeadline);
+			this->_directionDeadline = INT32_MAX;
+
+			//limit activation to timer resolution (we can output empty activation intermediate step)
+			ScheduleTime earliestActivationTime = limitActivationTime(minActiveActivationTime, this->_maxActivationTime);
+
+			CUMULATIVE_SCHEDULE_ACTIVATION = ACTIVATIONS_CLOCK_MASK | this->_directionMask;
+
+			//subtract earliest plan other plans
+			triggerPlans(AxisRange<0, axisCount>(), earliestActivationTime);
+			while (checkInstructionEnd());
+
+			//schedule
+			while (isScheduleFull() && startScheduler) {
+				//wait until schedule buffer has empty space				
+				Steppers::startScheduler();
+			}
+
+			writeScaledEntry(earliestActivationTime, CUMULATIVE_SCHEDULE_ACTIVATION, this->_instructionEnds);
+			this->_instructionEnds = 0;
+
+			if (isScheduleFull())
+				//we have free time
+				return true;
+		}
+
+		flushScheduleEntries();
+		if (startScheduler)
+			Steppers::startScheduler();
+		return false;
+	}
+private:
+	template<byte First> inline bool isAnyActive(AxisRange<First, 1>) {
+		return this->_current[First]->isActive;
+	}
+
+	template<byte First, byte Count> inline bool isAnyActive(AxisRange<First, Count>) {
+		return isAnyActive(AxisRange<First, Count / 2>()) || isAnyActive(AxisRange<First + Count / 2, Count - Count / 2>());
+	}
+
+	template<byte First> inline int32_t earliestActivationTime(AxisRange<First, 1>) {
+		return this->_current[First]->isActive ? this->_current[First]->nextActivationTime : INT32_MAX;
+	}
+
+	// tournament tree - each half selects its earliest activation
+	template<byte First, byte Count> inline int32_t earliestActivationTime(AxisRange<First, Count>) {
+		int32_t first = earliestActivationTime(AxisRange<First, Count / 2>());
+		int32_t second = earliestActivationTime(AxisRange<First + Count / 2, Count - Count / 2>());
+		return first < second ? first : second;
+	}
+
+	template<byte First> inline void triggerPlans(AxisRange<First, 1>, ScheduleTime nextActivationTime) {
+		triggerPlan<First>(nextActivationTime);
+	}
+
+	template<byte First, byte Count> inline void triggerPlans(AxisRange<First, Count>, ScheduleTime nextActivationTime) {
+		triggerPlans(AxisRange<First, Count / 2>(), nextActivationTime);
+		triggerPlans(AxisRange<First + Count / 2, Count - Count / 2>(), nextActivationTime);
+	}
+
+	template<byte Index> inline void triggerPlan(ScheduleTime nextActivationTime) {
+		SegmentPlan& plan = *this->_current[Index];
+		if (!plan.isActive) {
+			if (!plan.isActivationBoundary)
+				// this plan is not a boundary - continue to calculate slack
+				plan.nextActivationTime -= nextActivationTime;
+			//there is nothing to do
+			return;
+		}
+
+		plan.nextActivationTime -= nextActivationTime;
+
+		if (plan.nextActivationTime > MIN_ACTIVATION_DELAY)
+			//no steps for the plan now
+			return;
+
+		// make the appropriate pin LOW
+		CUMULATIVE_SCHEDULE_ACTIVATION &= ~(AxisAt<Index, Axes...>::Type::clkMask);
+
+		if (plan.nextActivationTime > 0) {
+			//activations would come too early one after another - we will group them
+			countSaturated(this->_groupedSteps[Index]);
+			byte skippedTime = plan.nextActivationTime;
+			plan.createNextActivation();
+			if (plan.isActive)
+				//finished plan keeps the skipped time as its slack
+				plan.nextActivationTime += skippedTime;
+		}
+		else {
+			//compute next activation
+			plan.createNextActivation();
+		}
+
+		if (!plan.isActive && canAdvanceAhead(Index) && advanceAhead(Index))
+			sendSchedulerReport('M');
+	}
+
+	template<byte First> inline void commitSteps(AxisRange<First, 1>, const int16_t* steps) {
+		slotSteps(AxisAt<First, Axes...>::Type::clkMask) += steps[First];
+	}
+
+	template<byte First, byte Count> inline void commitSteps(AxisRange<First, Count>, const int16_t* steps) {
+		commitSteps(AxisRange<First, Count / 2>(), steps);
+		commitSteps(AxisRange<First + Count / 2, Count - Count / 2>(), steps);
+	}
+
+	// Writes two entries while all active axes step together with constant period - the step interrupt repeats the second one.
+	// Returns false when the steps cannot be repeated.
+	bool scheduleRun() {
+#ifdef STEP_ENGINE_DDA
+		//segments of the DDA engine repeat the steps already
+		return false;
+#else
+		if (this->_instructionEnds > 0 || this->_directionDeadline != INT32_MAX || this->_feedState != FEED_RUNNING)
+			//runs keep the time scale for many steps
+			return false;
+
+		if (freeScheduleEntries() < 2 || (byte)(SCHEDULE_RUN_START - this->_aheadRun) >= SCHEDULE_RUN_LEN)
+			//no space for the run (its duration is kept until the step interrupt passes it)
+			return false;
+
+		//the shortest run has to fit into the look-ahead
+		uint32_t lookaheadTime = ((uint32_t)SCHEDULE_LOOKAHEAD << FEED_SCALE_SHIFT) / this->_timeScale;
+		ScheduleTime maxDelay = min(this->_maxActivationTime, (ScheduleTime)min((uint32_t)SCHEDULE_RUN_MAX_DELAY, lookaheadTime / SCHEDULE_RUN_MIN_LENGTH));
+		SegmentPlan* leader = NULL;
+		byte activation = ACTIVATIONS_CLOCK_MASK | this->_directionMask;
+		for (byte i = 0; i < axisCount; ++i) {
+			SegmentPlan* plan = this->_current[i];
+			if (!plan->isActive)
+				continue;
+
+			if (leader == NULL) {
+				if (!plan->canRepeat(this->_minActivationTime, maxDelay))
+					return false;
+				leader = plan;
+			}
+			else if (!plan->repeatsLike(*leader)) {
+				return false;
+			}
+			activation &= ~plan->clkMask;
+		}
+
+		if (leader == NULL || (activation & ~ACTIVATIONS_CLOCK_MASK) != SCHEDULED_DIRECTIONS)
+			return false;
+
+		//the first step comes from the first entry, the run repeats the second one and the step after the run comes from the following entry
+		uint16_t firstActivationTime = leader->nextActivationTime;
+		uint16_t count = min((uint32_t)min(leader->remainingSteps - 1, SCHEDULE_RUN_MAX_LENGTH), lookaheadTime / firstActivationTime);
+		for (byte i = 0; i < axisCount; ++i) {
+			SegmentPlan* plan = this->_current[i];
+			if (plan->isActive)
+				plan->repeatSteps(1);
+		}
+
+		int32_t duration = 0;
+		uint16_t secondActivationTime = leader->nextActivationTime;
+		leader->initRun(SCHEDULE_RUNS[SCHEDULE_RUN_START & (SCHEDULE_RUN_LEN - 1)], count, this->_timeScale);
+		for (byte i = 0; i < axisCount; ++i) {
+			SegmentPlan* plan = this->_current[i];
+			if (plan->isActive)
+				duration = plan->repeatSteps(count) + firstActivationTime;
+		}
+
+		for (byte i = 0; i < axisCount; ++i) {
+			SegmentPlan* plan = this->_current[i];
+			if (!plan->isActive && !plan->isActivationBoundary)
+				// this plan is not a boundary - continue to calculate slack
+				plan->nextActivationTime -= duration;
+		}
+
+		//scaled duration of the repeated entry (it is not longer than the look-ahead)
+		byte runTime = (((uint32_t)(duration - firstActivationTime) * this->_timeScale) >> FEED_SCALE_SHIFT) >> SCHEDULE_RUN_TIME_SHIFT;
+		this->_runTimes[SCHEDULE_RUN_START & (SCHEDULE_RUN_LEN - 1)] = runTime;
+		++SCHEDULE_RUN_START;
+		writeScaledEntry(firstActivationTime, activation, 0, SCHEDULE_RUN_FLAG);
+		ScheduleTime secondTime = writeScaledEntry(secondActivationTime, activation, 0);
+		this->_aheadTime += ((uint32_t)runTime << SCHEDULE_RUN_TIME_SHIFT) - secondTime;
+		return true;
+#endif
+	}
+
+	// Writes schedule entry with the activation time scaled by the feed override (plans keep their own time so the slack stays unscaled).
+	// Returns the scaled time of the entry.
+	inline ScheduleTime writeScaledEntry(ScheduleTime activationTime, byte activation, byte instructionEnds, byte flags = 0) {
+		ScheduleTime scaledTime = activationTime;
+		if (this->_timeScale != FEED_SCALE_UNITY) {
+			//shortened time cannot come sooner than the previous activation allows
+			scaledTime = ((uint32_t)activationTime * this->_timeScale) >> FEED_SCALE_SHIFT;
+			scaledTime = max(scaledTime, (ScheduleTime)this->_minEntryTime);
+		}
+
+		//step after direction change has to wait for the port
+		this->_minEntryTime = (activation & ~ACTIVATIONS_CLOCK_MASK) != SCHEDULED_DIRECTIONS ? PORT_CHANGE_DELAY : MIN_ACTIVATION_DELAY;
+		if (scheduleOccupancy(SCHEDULE_START, this->_aheadEnd) + DDA_ENTRY_SEGMENTS >= SCHEDULE_BUFFER_LEN)
+			//the entry would overwrite entries which were not taken from the look-ahead
+			takeFiredTime();
+		writeScheduleEntry(scaledTime, activation, instructionEnds, flags);
+		this->_aheadTime += scaledTime;
+
+		if (isTimeScaleRamping()) {
+			this->_rampTime += activationTime;
+			while (this->_rampTime >= FEED_HOLD_QUANTUM && isTimeScaleRamping()) {
+				this->_rampTime -= FEED_HOLD_QUANTUM;
+				stepHoldRamp();
+			}
+
+			//steps of the activation count to the next quantum (its time comes before the steps)
+			for (byte i = 0; i < axisCount; ++i) {
+				if ((activation & this->_plans[i].clkMask) == 0)
+					++this->_rampSteps[i];
+			}
+		}
+		return scaledTime;
+	}
+
+	// Determine whether the time scale ramps (hold, resume or override change).
+	inline bool isTimeScaleRamping() {
+		return this->_feedState == FEED_STOPPING || this->_feedState == FEED_RESUMING || this->_feedState == FEED_OVERRIDING;
+	}
+
+	// Starts counting of the plan quanta for the hold ramp.
+	void startHoldRamp() {
+		this->_rampTime = 0;
+		this->_rampScaleFraction = 0;
+		for (byte i = 0; i < axisCount; ++i)
+			this->_rampSteps[i] = 0;
+	}
+
+	// Changes time scale of the hold ramp after a quantum of plan time - speed of the leading axis changes by MAX_ACCELERATION
+	// over the real time of the quantum (the planned ramps are bounded by it too).
+	void stepHoldRamp() {
+		//steps of the leading axis in the quantum (the next step is counted in, so the speed is not underestimated)
+		byte steps = 0;
+		for (byte i = 0; i < axisCount; ++i) {
+			steps = max(steps, this->_rampSteps[i]);
+			this->_rampSteps[i] = 0;
+		}
+		uint16_t stepCount = (uint16_t)steps + 1;
+
+		uint32_t scale = this->_timeScale;
+		if (this->_feedState == FEED_STOPPING && ((uint32_t)stepCount << 16) / scale <= FEED_HOLD_STOP_SPEED) {
+			//axes are slow enough to stop (as they would at a junction)
+			setFeedHeld();
+			return;
+		}
+
+		//relative change of the quantum time (in 1/65536)
+		uint32_t relativeChange = (scale * scale >> FEED_SCALE_SHIFT) / stepCount;
+		if (relativeChange > (UINT32_MAX >> 1) / FEED_HOLD_SPEED_CHANGE)
+			relativeChange = UINT32_MAX >> 1;
+		else
+			relativeChange = relativeChange * FEED_HOLD_SPEED_CHANGE >> 8;
+
+		if (this->_feedState == FEED_STOPPING) {
+			if (relativeChange >= 65536 || (scale << 16) / (65536 - relativeChange) > UINT16_MAX) {
+				//the time scale cannot slow down more
+				setFeedHeld();
+				return;
+			}
+			setTimeScale(rampTimeScale(65536 - relativeChange));
+			return;
+		}
+
+		if (scale > this->_feedScale) {
+			//axes accelerate to the feed override
+			scale = relativeChange < 65536 ? rampTimeScale(65536 + relativeChange) : (scale << 16) / (65536 + relativeChange);
+			if (scale <= this->_feedScale) {
+				//axes are back at the feed
+				scale = this->_feedScale;
+				this->_feedState = FEED_RUNNING;
+			}
+		}
+		else if (relativeChange >= 65536 || (scale << 16) / (65536 - relativeChange) >= this->_feedScale) {
+			//axes decelerated to the lowered feed override
+			scale = this->_feedScale;
+			this->_feedState = FEED_RUNNING;
+		}
+		else {
+			scale = rampTimeScale(65536 - relativeChange);
+		}
+		setTimeScale(scale);
+	}
+
+	// Time scale of the ramp divided by the given divisor (in 1/65536, below 131072) - the fraction below the scale unit is carried,
+	// so the small changes at the short time scales of a raised override do not round to a whole unit.
+	uint16_t rampTimeScale(uint32_t divisor) {
+		uint32_t scale = ((uint32_t)this->_timeScale << 16) | this->_rampScaleFraction;
+		uint32_t quotient = scale / divisor;
+		uint32_t remainder = scale - quotient * divisor;
+		this->_rampScaleFraction = (remainder << 15) / ((divisor + 1) >> 1);
+		return quotient;
+	}
+
+	// Feed hold stops the axes - the schedule drains and its stop is not counted as an underrun.
+	void setFeedHeld() {
+		this->_feedState = FEED_HELD;
+		SCHEDULE_HOLD_FLAG = true;
+	}
+
+	// Sets time scale which is applied to the written activation times.
+	void setTimeScale(uint16_t scale) {
+		this->_timeScale = scale;
+
+		//limits of the plan time which keep the scaled times in the timer range
+		this->_minActivationTime = max((uint16_t)MIN_ACTIVATION_DELAY, (uint16_t)((MIN_ACTIVATION_DELAY * FEED_SCALE_UNITY + scale - 1) / scale));
+		this->_maxActivationTime = (uint32_t)SCHEDULE_MAX_DELAY * FEED_SCALE_UNITY / scale;
+	}
+
+	// Determine whether the scheduler stopped because of the feed hold (some instructions wait for the resume).
+	inline bool isHoldStop() {
+		return this->_feedState == FEED_HELD && this->_openInstructions > 0;
+	}
+
+	// Scheduler was stopped by the feed hold - plan time did not pass while held, so the slack stays valid
+	// (the step interrupt did not count the stop as an underrun, see SCHEDULE_HOLD_FLAG).
+	void takeHoldStop() {
+		SCHEDULER_STOP_EVENT_FLAG = false;
+	}
+
+	// Commits steps which the held instructions made already - their instruction steps keep only the steps which were not written.
+	void commitHeldSteps() {
+		byte index = this->_instructionStepsEnd;
+		for (byte i = 0; i < axisCount; ++i) {
+			SegmentPlan* plan = this->_current[i];
+			int16_t* steps = &this->_instructionSteps[index & (INSTRUCTION_STEPS_LEN - 1)][i];
+			if (this->_aheadMask & (1 << i)) {
+				//axis finished the oldest instruction already
+				slotSteps(plan->clkMask) += *steps;
+				*steps = 0;
+				steps = &this->_instructionSteps[(byte)(index + 1) & (INSTRUCTION_STEPS_LEN - 1)][i];
+			}
+
+			//the pending step is not written yet
+			int16_t unwrittenSteps = plan->leftSteps() + (plan->isActive ? 1 : 0);
+			if (plan->stepMask)
+				unwrittenSteps = -unwrittenSteps;
+			slotSteps(plan->clkMask) += *steps - unwrittenSteps;
+			*steps = unwrittenSteps;
+		}
+	}
+
+	// Starts the look-ahead at the reading position of the step interrupt (the schedule is empty).
+	void resetLookahead() {
+		this->_aheadTime = 0;
+		this->_aheadEnd = SCHEDULE_END;
+		this->_isAheadRun = false;
+#ifndef STEP_ENGINE_DDA
+		this->_aheadRun = SCHEDULE_RUN_START;
+#endif
+	}
+
+	// Takes time of the entries which were passed by the step interrupt from the look-ahead.
+	void takeFiredTime() {
+		//the step interrupt is not blocked while nothing was fired
+		ScheduleIndex end = isScheduleEndAt(this->_aheadEnd) ? this->_aheadEnd : readScheduleEnd();
+		while (this->_aheadEnd != end) {
+			uint32_t firedTime;
+#ifdef STEP_ENGINE_DDA
+			firedTime = (uint32_t)SCHEDULE_SEGMENTS[this->_aheadEnd].ticks * DDA_PERIOD;
+#else
+			ScheduleTime timerWord = SCHEDULE_BUFFER[this->_aheadEnd];
+			if (this->_isAheadRun) {
+				//the repeated entry was fired for the whole run
+				firedTime = (uint32_t)this->_runTimes[this->_aheadRun & (SCHEDULE_RUN_LEN - 1)] << SCHEDULE_RUN_TIME_SHIFT;
+				++this->_aheadRun;
+			}
+			else {
+				firedTime = stepTimerTime(timerWord);
+			}
+			this->_isAheadRun = ((timerWord >> SCHEDULE_FLAGS_SHIFT) & SCHEDULE_RUN_FLAG) != 0;
+#endif
+			this->_aheadTime = this->_aheadTime > firedTime ? this->_aheadTime - firedTime : 0;
+			this->_aheadEnd = nextScheduleIndex(this->_aheadEnd);
+		}
+
+		if (this->_aheadEnd == SCHEDULE_START)
+			//there is nothing ahead of the step interrupt
+			this->_aheadTime = 0;
+	}
+
+	// Determine whether axis can continue with the next segment before the instruction ends.
+	inline bool canAdvanceAhead(byte axis) {
+		SegmentPlan* plan = this->_current[axis];
+		if (plan->isActive || (this->_armedMask & (1 << axis)) == 0)
+			return false;
+
+		return !plan->isActivationBoundary && !this->_next[axis]->isActivationBoundary;
+	}
+
+	inline bool advanceAhead(byte axis) {
+		this->_aheadMask |= 1 << axis;
+		return advance(axis);
+	}
+
+	// Replaces current segment of the axis by the armed one - returns true when step time was missed.
+	bool advance(byte axis) {
+		SegmentPlan* finishedPlan = this->_current[axis];
+		SegmentPlan* plan = this->_next[axis];
+		this->_current[axis] = plan;
+		this->_next[axis] = finishedPlan;
+		this->_armedMask &= ~(1 << axis);
+
+		if (!plan->isActivationBoundary)
+			//continue with the slack of the finished segment
+			plan->nextActivationTime += finishedPlan->nextActivationTime;
+
+		if (!plan->isActive)
+			//segment without steps keeps the direction
+			return false;
+
+		int32_t minimalActivationTime = MIN_ACTIVATION_DELAY;
+		bool isDirectionChange = this->_forceDirections || (this->_directionMask & plan->dirMask) != plan->stepMask;
+		if (isDirectionChange) {
+			//direction will be set by the next activation - the step has to wait for it
+			this->_directionMask = (this->_directionMask & ~plan->dirMask) | plan->stepMask;
+			minimalActivationTime += PORT_CHANGE_DELAY;
+		}
+
+		bool isStepTimeMissed = plan->nextActivationTime < minimalActivationTime;
+		if (isStepTimeMissed) {
+			//we cannot go backwards in time - step was missed
+			plan->nextActivationTime = minimalActivationTime;
+			countSaturated(this->_missedSteps[axis]);
+		}
+
+		if (isDirectionChange)
+			this->_directionDeadline = min(this->_directionDeadline, plan->nextActivationTime - PORT_CHANGE_DELAY);
+
+		return isStepTimeMissed;
+	}
+
+	// Starts scheduling of the loaded next segments.
+	void armLoaded() {
+		if (SCHEDULER_STOP_EVENT_FLAG) {
+			if (isHoldStop())
+				takeHoldStop();
+			else
+				resetAfterStop();
+		}
+
+		//steps are committed to the positions when the step interrupt passes the instruction end
+		int16_t* steps = this->_instructionSteps[this->_instructionStepsStart & (INSTRUCTION_STEPS_LEN - 1)];
+		++this->_instructionStepsStart;
+		++ARMED_INSTRUCTION_COUNT;
+		for (byte i = 0; i < axisCount; ++i) {
+			SegmentPlan* plan = this->_next[i];
+			steps[i] = plan->stepMask ? -plan->totalSteps() : plan->totalSteps();
+			plan->createNextActivation();
+		}
+		this->_armedMask = (1 << axisCount) - 1;
+		++this->_openInstructions;
+
+		bool isStepTimeMissed = false;
+		for (byte i = 0; i < axisCount; ++i) {
+			if (this->_openInstructions == 1)
+				//there is no running instruction - all axes start together
+				isStepTimeMissed |= advance(i);
+			else if (canAdvanceAhead(i))
+				//axis finished the running instruction already
+				isStepTimeMissed |= advanceAhead(i);
+		}
+
+		if (isStepTimeMissed)
+			sendSchedulerReport('M');
+
+		while (checkInstructionEnd());
+		this->_forceDirections = false;
+	}
+
+	// Counts end of the oldest instruction when all axes finished it - returns true when instruction ended.
+	bool checkInstructionEnd() {
+		if (this->_openInstructions == 0)
+			return false;
+
+		for (byte i = 0; i < axisCount; ++i) {
+			if ((this->_aheadMask & (1 << i)) == 0 && this->_current[i]->isActive)
+				//axis still runs the oldest instruction
+				return false;
+		}
+
+		++this->_instructionEnds;
+		--this->_openInstructions;
+
+		bool isStepTimeMissed = false;
+		if (this->_openInstructions > 0) {
+			//axes which waited for the instruction end continue now
+			for (byte i = 0; i < axisCount; ++i) {
+				if ((this->_aheadMask & (1 << i)) == 0)
+					isStepTimeMissed |= advance(i);
+			}
+		}
+		this->_aheadMask = 0;
+
+		if (isStepTimeMissed)
+			sendSchedulerReport('M');
+		return true;
+	}
+
+	// Scheduler was stopped - slack is not valid anymore and port directions has to be set again.
+	void resetAfterStop() {
+		for (byte i = 0; i < axisCount; ++i) {
+			if (!this->_current[i]->isActive)
+				this->_current[i]->nextActivationTime = 0;
+		}
+
+		this->_directionDeadline = INT32_MAX;
+		this->_forceDirections = true;
+		SCHEDULER_STOP_EVENT_FLAG = false;
+	}
+
+	// storage of current and next segments
+	SegmentPlan _plans[2 * axisCount];
+
+	// segments which are scheduled now
+	SegmentPlan* _current[axisCount];
+
+	// segments of the armed instruction
+	SegmentPlan* _next[axisCount];
+
+	// axes which has next segment armed
+	byte _armedMask;
+
+	// axes which already continue with the next instruction
+	byte _aheadMask;
+
+	// count of armed instructions which did not end yet
+	byte _openInstructions;
+
+	// count of instruction ends reported by the next activation
+	byte _instructionEnds;
+
+	// direction bits of the current segments
+	byte _directionMask;
+
+	// latest time when direction change has to be activated
+	int32_t _directionDeadline;
+
+	// determine whether directions has to be set regardless of the previous state
+	bool _forceDirections;
+
+	// signed step counts of the armed instructions (in the order of their ends)
+	int16_t _instructionSteps[INSTRUCTION_STEPS_LEN][axisCount];
+
+	// instruction steps which will be written next (index is masked by INSTRUCTION_STEPS_LEN)
+	byte _instructionStepsStart;
+
+	// instruction steps which will be committed next (index is masked by INSTRUCTION_STEPS_LEN)
+	byte _instructionStepsEnd;
+
+	// steps which were grouped with an earlier activation (counters saturate)
+	uint16_t _groupedSteps[axisCount];
+
+	// steps which came later than planned (counters saturate)
+	uint16_t _missedSteps[axisCount];
+
+	// time scale of the feed override (FEED_SCALE_UNITY keeps the planned times)
+	uint16_t _feedScale;
+
+	// time scale applied to the written activations (it differs from the feed override while the hold ramps)
+	uint16_t _timeScale;
+
+	// plan time which is scaled to the minimal activation delay
+	uint16_t _minActivationTime;
+
+	// plan time which is scaled to the longest schedule delay
+	ScheduleTime _maxActivationTime;
+
+	// shortest scaled time of the next entry
+	uint16_t _minEntryTime;
+
+	// state of the feed hold (FEED_RUNNING when there is no hold)
+	byte _feedState;
+
+	// plan time written since the last step of the hold ramp
+	ScheduleTime _rampTime;
+
+	// steps of the axes written since the last step of the hold ramp
+	byte _rampSteps[axisCount];
+
+	// time scale of the ramp below its unit (in 1/65536, see rampTimeScale)
+	uint16_t _rampScaleFraction;
+
+	// scaled time of the written entries which the step interrupt did not pass yet
+	uint32_t _aheadTime;
+
+	// entry where the step interrupt is expected next (entries up to readScheduleEnd are taken from the look-ahead)
+	ScheduleIndex _aheadEnd;
+
+	// determine whether the expected entry is repeated by a run
+	bool _isAheadRun;
+
+	// run which is expected next (index is masked by SCHEDULE_RUN_LEN)
+	byte _aheadRun;
+
+	// scaled durations of the repeated entries of the written runs (see SCHEDULE_RUN_TIME_SHIFT)
+	byte _runTimes[SCHEDULE_RUN_LEN];
+};
+
+#endif
@@ -1,6 +1,6 @@
 #include "StepperControl.h"
 
-PlanScheduler4D<ConstantPlan> CONSTANT_SCHEDULER(SLOT1_CLK_MASK, SLOT1_DIR_MASK, SLOT0_CLK_MASK, SLOT0_DIR_MASK, SLOT3_CLK_MASK, SLOT3_DIR_MASK, SLOT2_CLK_MASK, SLOT2_DIR_MASK);
+PlanScheduler4D<ConstantPlan> CONSTANT_SCHEDULER;
 
 // the setup function runs once when you press reset or power the board
 void setup() {
@@ -64,9 +64,47 @@ void testActivationClock() {
 	printTimeStep("Duration difference per step: ", abs(expectedMicroseconds - duration), stepCount);
 }
 
+template<typename PlanType> void measureAccelerationCost(String name, byte* data) {
+	PlanType plan(SLOT0_CLK_MASK, SLOT0_DIR_MASK);
+	plan.loadFrom(data);
+
+	unsigned long totalDuration = 0;
+	unsigned long worstDuration = 0;
+	int32_t stepCount = plan.stepCount;
+	for (int32_t i = 0; i < stepCount; ++i) {
+		unsigned long startTime = micros();
+		plan.createNextActivation();
+		unsigned long duration = micros() - startTime;
+
+		totalDuration += duration;
+		worstDuration = max(worstDuration, duration);
+	}
+
+	printTimeStep(name + " average per step: ", totalDuration, stepCount);
+	printTime(name + " worst step: ", worstDuration);
+}
+
+void testAccelerationCost() {
+	//the ramp used by homing (the worst case is at its start)
+	int16_t stepCount = 150;
+	int32_t initialDeltaT = 2000;
+	int32_t n = 6;
+
+	byte data[64] = { 0 };
+	byte plan1[] = { INT16_TO_BYTES(stepCount), INT32_TO_BYTES(initialDeltaT), INT32_TO_BYTES(n) };
+
+	for (int i = 0; i < sizeof(plan1); ++i) {
+		data[i] = plan1[i];
+	}
+
+	measureAccelerationCost<AccelerationPlan>("Current", data);
+	measureAccelerationCost<BoundedAccelerationPlan>("Bounded", data);
+}
+
 
 void loop() {
 	testActivationClock();
+	testAccelerationCost();
 
 	Serial.println();
 	Serial.println();